@@ -0,0 +1,5193 @@
+// Benchmarks for the platform-neutral parts of the encoder.
+//
+// Builds without any Windows SDK:
+//     g++ -O2 -std=c++17 -pthread bench.cpp -o bench    (Linux)
+//     cl /O2 /EHsc bench.cpp                            (Windows)
+// Run ./bench to run every section, or ./bench <section> for one of them.
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Project
+#include "benchmark_suite.h"
+#include "bitstream_writer.h"
+#include "color_convert.h"
+#include "congestion_controller.h"
+#include "encoder.h"
+#include "encoder_caps.h"
+#include "encoder_config.h"
+#include "encoder_manager.h"
+#include "event_pump.h"
+#include "frame_pool.h"
+#include "frame_scaler.h"
+#include "frame_preprocessor.h"
+#include "frame_source.h"
+#include "frame_tracer.h"
+#include "ladder_encoder.h"
+#include "live_segmenter.h"
+#include "lookahead.h"
+#include "metrics_exporter.h"
+#include "metrics_registry.h"
+#include "mp4_muxer.h"
+#include "mpsc_queue.h"
+#include "nal_parser.h"
+#include "recording_journal.h"
+#include "seek_index.h"
+#include "software_backend.h"
+#include "tile_scheduler.h"
+#include "upload_pipeline.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::vector<uint8_t> randomBytes(size_t size, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> bytes(size);
+    for (auto& b : bytes)
+        b = (uint8_t)rng();
+    return bytes;
+}
+
+static std::vector<uint8_t> readBytes(const std::string& path)
+{
+    std::ifstream fin(path, std::ios::binary);
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+}
+
+// ----------------------------------------------------------------------------
+// Software encodes
+//
+// Most sections run the stand-in encoder the same way: a file, a recorder on
+// the packets, a schedule, start and wait for the drain. The section sets up
+// what it is about in `configure` and checks what comes back.
+// ----------------------------------------------------------------------------
+
+struct RecordedPacket
+{
+    int64_t time;
+    int64_t duration;
+    size_t size;
+    bool keyframe;
+};
+
+class PacketRecorder : public IPacketConsumer
+{
+public:
+    void onPacket(const EncodedPacket& packet) override
+    {
+        packets.push_back({ packet.time(), packet.duration(), packet.size(), packet.keyframe() });
+    }
+
+    std::vector<RecordedPacket> packets;
+};
+
+// Passes everything through and keeps a checksum of every input frame as it goes in
+class ChecksumBackend : public IEncoderBackend
+{
+public:
+    explicit ChecksumBackend(std::unique_ptr<IEncoderBackend> inner) : inner(std::move(inner)) {}
+
+    void start(IEncoderEventSink* sink) override { inner->start(sink); }
+    bool acquireInput(InputFrame& frame) override { return inner->acquireInput(frame); }
+    void releaseInput(const InputFrame& frame) override { inner->releaseInput(frame); }
+
+    void submitInput(const InputFrame& frame, int64_t time, int64_t duration) override
+    {
+        const EncoderConfig& config = inner->config();
+        size_t bytes = frame.pitch * config.height * (config.format == FrameFormat::NV12 ? 3 : 2) / 2;
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < bytes; i++)
+            hash = (hash ^ frame.data[i]) * 1099511628211ull;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            hashes[time] = hash;
+        }
+        inner->submitInput(frame, time, duration);
+    }
+
+    void setInputReleaseCallback(std::function<void()> callback) override { inner->setInputReleaseCallback(std::move(callback)); }
+    OutputStatus processOutput(EncodedPacket& packet) override { return inner->processOutput(packet); }
+    void renegotiateOutput() override { inner->renegotiateOutput(); }
+    void drain() override { inner->drain(); }
+    void shutdown() override { inner->shutdown(); }
+    bool applyControl(const EncoderControl& control) override { return inner->applyControl(control); }
+    const EncoderConfig& config() const override { return inner->config(); }
+    EncoderStatus status() const override { return inner->status(); }
+    IStagingDevice* enableStaging(uint32_t buffers) override { return inner->enableStaging(buffers); }
+
+    std::map<int64_t, uint64_t> checksums() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hashes;
+    }
+
+private:
+    std::unique_ptr<IEncoderBackend> inner;
+    mutable std::mutex mutex;
+    std::map<int64_t, uint64_t> hashes;
+};
+
+struct SoftwareEncodeOptions
+{
+    const char* path = "bench_encode.h264";
+    SoftwareBackendOptions backend;
+    WorkerPool* backendWorkers = nullptr;
+    BitstreamWriterOptions writer;
+    FrameSchedulerOptions schedule;
+    WorkerPool* scheduleWorkers = nullptr;
+    bool checksums = false;             // hash every input frame on its way in
+    bool keepFile = false;
+    std::chrono::seconds drainTimeout{30};
+    std::function<void(Encoder&)> running;  // after start, before the drain
+};
+
+struct SoftwareEncode
+{
+    bool drained = false;
+    double seconds = 0;                 // from start to drained
+    uint64_t inputFrames = 0;
+    uint64_t outputFrames = 0;
+    uint64_t outputBytes = 0;
+    std::vector<RecordedPacket> packets;
+    std::map<int64_t, uint64_t> checksums;
+    FrameSchedulerStats schedule;
+    LookaheadStats lookahead;
+    FramePreprocessorStats preprocess;
+    UploadPipelineStats upload;
+    CpuStagingStats staging;
+    BitstreamWriterStats writer;
+};
+
+static SoftwareEncode runSoftwareEncode(const SoftwareEncodeOptions& options, const std::function<void(Encoder&)>& configure = nullptr)
+{
+    SoftwareEncode run;
+    {
+        SoftwareEncoderBackend* software = new SoftwareEncoderBackend(options.backend, options.backendWorkers);
+        std::unique_ptr<IEncoderBackend> owned(software);
+        ChecksumBackend* probe = nullptr;
+        if (options.checksums)
+        {
+            probe = new ChecksumBackend(std::move(owned));
+            owned.reset(probe);
+        }
+
+        PacketRecorder recorder;
+        Encoder encoder(*owned, options.path, options.writer);
+        encoder.addConsumer(&recorder);
+        encoder.setSchedule(options.schedule, options.scheduleWorkers);
+        if (configure)
+            configure(encoder);
+
+        Clock::time_point start = Clock::now();
+        encoder.start();
+        if (options.running)
+            options.running(encoder);
+        run.drained = encoder.waitForDrain(options.drainTimeout);
+        run.seconds = secondsSince(start);
+        encoder.closeWriter();
+
+        run.inputFrames = encoder.inputFrames();
+        run.outputFrames = encoder.outputFrames();
+        run.outputBytes = encoder.outputBytes();
+        run.packets = recorder.packets;
+        if (probe)
+            run.checksums = probe->checksums();
+        run.schedule = encoder.schedulerStats();
+        run.lookahead = encoder.lookaheadStats();
+        run.preprocess = encoder.preprocessStats();
+        run.upload = encoder.uploadStats();
+        run.staging = software->stagingStats();
+        run.writer = encoder.writerStats();
+    }
+    if (!options.keepFile)
+        std::remove(options.path);
+    return run;
+}
+
+// ----------------------------------------------------------------------------
+// Color conversion
+// ----------------------------------------------------------------------------
+
+static const ColorKernel colorKernels[] = { ColorKernel::Scalar, ColorKernel::Sse41, ColorKernel::Avx2, ColorKernel::Neon };
+
+struct Nv12Buffer
+{
+    Nv12Buffer(uint32_t width, uint32_t height)
+        : y((size_t)width * height), uv((size_t)width * height / 2)
+    {
+        frame = { y.data(), width, uv.data(), width };
+    }
+
+    std::vector<uint8_t> y;
+    std::vector<uint8_t> uv;
+    Nv12Frame frame;
+};
+
+// Every SIMD kernel has to match the scalar one byte for byte, including the
+// scalar tails left over when the width is not a multiple of the vector size.
+static bool verifyColorKernels()
+{
+    const uint32_t widths[] = { 2, 6, 14, 16, 30, 34, 1280, 1922 };
+    const uint32_t height = 6;
+    bool ok = true;
+
+    for (ColorMatrix matrix : { ColorMatrix::BT601, ColorMatrix::BT709 })
+    for (ColorRange range : { ColorRange::Limited, ColorRange::Full })
+    for (PixelOrder order : { PixelOrder::BGRA, PixelOrder::RGBA })
+    for (uint32_t width : widths)
+    {
+        size_t pitch = (size_t)width * 4 + 12;
+        std::vector<uint8_t> src = randomBytes(pitch * height, width);
+
+        ColorConverter reference(matrix, range, order, ColorKernel::Scalar);
+        Nv12Buffer expected(width, height);
+        reference.convert(src.data(), pitch, width, height, expected.frame);
+
+        for (ColorKernel kernel : colorKernels)
+        {
+            if (kernel == ColorKernel::Scalar || !colorKernelSupported(kernel))
+                continue;
+
+            ColorConverter converter(matrix, range, order, kernel);
+            Nv12Buffer actual(width, height);
+            converter.convert(src.data(), pitch, width, height, actual.frame);
+
+            if (actual.y != expected.y || actual.uv != expected.uv)
+            {
+                printf("color: %s differs from scalar (matrix=%d range=%d order=%d width=%u)\n",
+                    colorKernelName(kernel), (int)matrix, (int)range, (int)order, width);
+                ok = false;
+            }
+        }
+    }
+
+    // The fixed point scalar path against the floating point definition,
+    // chroma from the mean of each 2x2 block
+    const uint32_t refWidth = 64, refHeight = 64;
+    std::vector<uint8_t> src = randomBytes((size_t)refWidth * refHeight * 4, 7);
+    int maxError = 0, maxChromaError = 0;
+    for (ColorMatrix matrix : { ColorMatrix::BT601, ColorMatrix::BT709 })
+    for (ColorRange range : { ColorRange::Limited, ColorRange::Full })
+    {
+        ColorConverter converter(matrix, range, PixelOrder::BGRA, ColorKernel::Scalar);
+        Nv12Buffer out(refWidth, refHeight);
+        converter.convert(src.data(), (size_t)refWidth * 4, refWidth, refHeight, out.frame);
+
+        double kr = matrix == ColorMatrix::BT709 ? 0.2126 : 0.299;
+        double kb = matrix == ColorMatrix::BT709 ? 0.0722 : 0.114;
+        double yScale = range == ColorRange::Full ? 1.0 : 219.0 / 255.0;
+        double yOffset = range == ColorRange::Full ? 0.0 : 16.0;
+        double cScale = range == ColorRange::Full ? 1.0 : 224.0 / 255.0;
+        for (size_t i = 0; i < (size_t)refWidth * refHeight; i++)
+        {
+            const uint8_t* px = &src[i * 4];
+            double y = (kr * px[2] + (1.0 - kr - kb) * px[1] + kb * px[0]) * yScale + yOffset;
+            int error = std::abs((int)std::lround(y) - (int)out.y[i]);
+            maxError = error > maxError ? error : maxError;
+        }
+        for (uint32_t cy = 0; cy < refHeight / 2; cy++)
+        for (uint32_t cx = 0; cx < refWidth / 2; cx++)
+        {
+            double b = 0, g = 0, r = 0;
+            for (uint32_t dy = 0; dy < 2; dy++)
+            for (uint32_t dx = 0; dx < 2; dx++)
+            {
+                const uint8_t* px = &src[((size_t)(cy * 2 + dy) * refWidth + cx * 2 + dx) * 4];
+                b += px[0] / 4.0;
+                g += px[1] / 4.0;
+                r += px[2] / 4.0;
+            }
+            double luma = kr * r + (1.0 - kr - kb) * g + kb * b;
+            double u = std::min(255.0, std::max(0.0, (b - luma) / (2.0 * (1.0 - kb)) * cScale + 128));
+            double v = std::min(255.0, std::max(0.0, (r - luma) / (2.0 * (1.0 - kr)) * cScale + 128));
+            const uint8_t* uv = &out.uv[(size_t)cy * refWidth + cx * 2];
+            int error = std::max(std::abs((int)std::lround(u) - (int)uv[0]), std::abs((int)std::lround(v) - (int)uv[1]));
+            maxChromaError = error > maxChromaError ? error : maxChromaError;
+        }
+    }
+    if (maxError > 1)
+    {
+        printf("color: scalar luma is off by %d from the reference\n", maxError);
+        ok = false;
+    }
+    if (maxChromaError > 1)
+    {
+        printf("color: scalar chroma is off by %d from the reference\n", maxChromaError);
+        ok = false;
+    }
+
+    return ok;
+}
+
+static bool benchColor()
+{
+    bool ok = verifyColorKernels();
+    printf("color: kernels bit exact with scalar: %s\n", ok ? "yes" : "NO");
+
+    const uint32_t width = 1920, height = 1080;
+    std::vector<uint8_t> src = randomBytes((size_t)width * height * 4, 1);
+    Nv12Buffer dst(width, height);
+
+    for (ColorKernel kernel : colorKernels)
+    {
+        if (!colorKernelSupported(kernel))
+            continue;
+
+        ColorConverter converter(ColorMatrix::BT709, ColorRange::Limited, PixelOrder::BGRA, kernel);
+        converter.convert(src.data(), (size_t)width * 4, width, height, dst.frame);
+
+        int frames = 0;
+        Clock::time_point start = Clock::now();
+        while (secondsSince(start) < 1.0)
+        {
+            converter.convert(src.data(), (size_t)width * 4, width, height, dst.frame);
+            frames++;
+        }
+        double seconds = secondsSince(start);
+
+        printf("color: %-7s 1920x1080 BGRA->NV12 %8.1f fps %7.2f GB/s in\n",
+            colorKernelName(kernel), frames / seconds, frames * src.size() / seconds / 1e9);
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Pipeline against the software backend
+// ----------------------------------------------------------------------------
+
+static bool runPipeline(const char* label, const SoftwareBackendOptions& options, uint64_t frames)
+{
+    const char* path = "bench_pipeline.h264";
+    bool ok = true;
+    {
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+
+        Clock::time_point start = Clock::now();
+        encoder.start();
+        while (encoder.outputFrames() < frames)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(encoder.stop());
+        double seconds = secondsSince(start);
+
+        // Output buffers are recycled once the writer is done with them
+        PacketPoolStats packets = backend.outputPoolStats();
+        printf("pipeline: %-22s %8.0f fps %7.1f MB/s out, %llu stream changes, %llu output buffers\n", label,
+            encoder.outputFrames() / seconds, encoder.outputBytes() / seconds / 1e6,
+            (unsigned long long)encoder.streamChangeCount(), (unsigned long long)packets.allocations);
+
+        if (encoder.outputFrames() != encoder.inputFrames())
+        {
+            printf("pipeline: %llu frames in but %llu out\n", (unsigned long long)encoder.inputFrames(), (unsigned long long)encoder.outputFrames());
+            ok = false;
+        }
+    }
+    std::remove(path);
+    return ok;
+}
+
+static bool benchPipeline()
+{
+    bool ok = true;
+
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    ok = runPipeline("720p NV12", options, 2000) && ok;
+
+    options.config.format = FrameFormat::BGRA;
+    ok = runPipeline("720p BGRA", options, 2000) && ok;
+
+    options.config.format = FrameFormat::NV12;
+    options.streamChangeInterval = 100;
+    ok = runPipeline("720p stream changes", options, 2000) && ok;
+
+    options.streamChangeInterval = 0;
+    options.config.width = 1920;
+    options.config.height = 1080;
+    options.latency = std::chrono::microseconds(5000);
+    options.depth = 4;
+    ok = runPipeline("1080p 5ms latency", options, 1000) && ok;
+
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Input frame pool
+//
+// acquire() fails instead of blocking once every slot is in flight, freed
+// slots come back oldest first, and recycling never allocates again.
+// ----------------------------------------------------------------------------
+
+static bool benchPool()
+{
+    const uint32_t capacity = 8;
+    const size_t frameBytes = 1280 * 720 * 3 / 2 + 5;
+
+    CpuFramePool pool(capacity, frameBytes);
+    std::vector<uint32_t> released;
+    pool.setReleaseCallback([&](uint32_t slot) { released.push_back(slot); });
+
+    // Until exhausted: every slot once, aligned and apart from the others
+    std::vector<uint32_t> slots;
+    uint32_t slot;
+    while (pool.acquire(slot))
+    {
+        slots.push_back(slot);
+        if (slots.size() > capacity)
+            break;
+    }
+    bool distinct = true;
+    for (uint32_t i = 0; i < slots.size(); i++)
+    {
+        uintptr_t address = reinterpret_cast<uintptr_t>(pool.data(slots[i]));
+        distinct = distinct && address % CpuFramePool::ALIGNMENT == 0;
+        for (uint32_t j = 0; j < i; j++)
+        {
+            uintptr_t other = reinterpret_cast<uintptr_t>(pool.data(slots[j]));
+            distinct = distinct && (address >= other + frameBytes || other >= address + frameBytes);
+        }
+    }
+    FramePoolStats full = pool.stats();
+    bool exhausted = slots.size() == capacity && distinct && pool.inFlight() == capacity && full.exhausted == 1 &&
+        full.acquired == capacity && full.highWater == capacity;
+
+    // The next acquire fails at once and leaves the pool as it was
+    Clock::time_point start = Clock::now();
+    bool refused = !pool.acquire(slot);
+    double refuseUs = secondsSince(start) * 1e6;
+    refused = refused && pool.inFlight() == capacity && pool.stats().exhausted == 2;
+
+    // Released out of order, reused in the order they were released
+    const uint32_t order[] = { 5, 2, 7, 0, 3, 6, 1, 4 };
+    for (uint32_t index : order)
+        pool.release(slots[index]);
+    bool reuse = pool.inFlight() == 0 && released.size() == capacity;
+    for (uint32_t i = 0; i < capacity && reuse; i++)
+        reuse = released[i] == slots[order[i]] && pool.acquire(slot) && slot == slots[order[i]];
+    for (uint32_t index : order)
+        pool.release(slots[index]);
+
+    // Warm: a steady acquire and release loop, from several threads at once
+    const uint32_t threads = 4;
+    const uint32_t perThread = 200000;
+    pool.setReleaseCallback(nullptr);
+    std::atomic<uint32_t> collisions{0};
+    std::atomic<uint32_t> overbooked{0};
+    std::atomic<bool> running{true};
+    start = Clock::now();
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&]()
+        {
+            const size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for (uint32_t i = 0; i < perThread; i++)
+            {
+                uint32_t own;
+                if (!pool.acquire(own))
+                    continue;
+                // Tagged with the holder and the round; nobody else writes
+                // the slot before it comes back
+                uint8_t* frame = pool.data(own);
+                memcpy(frame, &thread, sizeof(thread));
+                memcpy(frame + frameBytes - sizeof(i), &i, sizeof(i));
+                if (i % 64 == 0)
+                    std::this_thread::yield();
+                size_t holder;
+                uint32_t round;
+                memcpy(&holder, frame, sizeof(holder));
+                memcpy(&round, frame + frameBytes - sizeof(round), sizeof(round));
+                if (holder != thread || round != i)
+                    collisions++;
+                pool.release(own);
+            }
+        });
+    }
+    // Never more out than there are slots, watched while the workers run
+    std::thread watcher([&]()
+    {
+        while (running.load(std::memory_order_relaxed))
+        {
+            if (pool.inFlight() > capacity)
+                overbooked++;
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+    for (std::thread& worker : workers)
+        worker.join();
+    double seconds = secondsSince(start);
+    running = false;
+    watcher.join();
+    FramePoolStats warm = pool.stats();
+
+    printf("pool: %u x %zu bytes, %u threads          %8.2f M acquire+release/s, refused in %.2f us, %llu allocations\n",
+        capacity, frameBytes, threads, warm.released / seconds / 1e6, refuseUs, (unsigned long long)warm.allocations);
+    printf("pool: exhausted after %zu %s, next acquire %s, reuse order %s\n", slots.size(), exhausted ? "ok" : "FAILED",
+        refused ? "refused" : "FAILED", reuse ? "ok" : "FAILED");
+
+    bool steady = warm.allocations == 1 && warm.acquired == warm.released && pool.inFlight() == 0 && collisions == 0 &&
+        overbooked == 0 && warm.highWater == capacity;
+    if (!steady)
+        printf("pool: %llu allocations, %llu acquired, %llu released, %u collisions, %u times more than %u in flight\n",
+            (unsigned long long)warm.allocations, (unsigned long long)warm.acquired, (unsigned long long)warm.released,
+            collisions.load(), overbooked.load(), capacity);
+    return exhausted && refused && reuse && steady;
+}
+
+// ----------------------------------------------------------------------------
+// Rendition ladder
+//
+// A 1080p source goes through the standard ladder on stand-in encoders.
+// Each frame is converted once. Every rung gets every frame with the same
+// times, keyframes fall on the same frames in all rungs, and a probe on each
+// rung's input finds the moving bar where scaling puts it.
+// ----------------------------------------------------------------------------
+
+// Passes everything through to a stand-in, and on the way in finds the
+// darkest run of the first luma row of every frame (the synthetic bar) and
+// keeps its first byte
+class ProbeBackend : public IEncoderBackend
+{
+public:
+    explicit ProbeBackend(std::unique_ptr<IEncoderBackend> inner) : inner(std::move(inner)) {}
+
+    void start(IEncoderEventSink* sink) override { inner->start(sink); }
+    bool acquireInput(InputFrame& frame) override { return inner->acquireInput(frame); }
+    void releaseInput(const InputFrame& frame) override { inner->releaseInput(frame); }
+
+    void submitInput(const InputFrame& frame, int64_t time, int64_t duration) override
+    {
+        const uint32_t width = inner->config().width;
+        double sum = 0;
+        uint32_t count = 0;
+        for (uint32_t x = 0; x < width; x++)
+        {
+            if (frame.data[x] < 110)
+            {
+                sum += x;
+                count++;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            barCenters[time] = count != 0 ? sum / count : -1;
+            firstPixels[time] = frame.data[0];
+        }
+        inner->submitInput(frame, time, duration);
+    }
+
+    void setInputReleaseCallback(std::function<void()> callback) override { inner->setInputReleaseCallback(std::move(callback)); }
+    OutputStatus processOutput(EncodedPacket& packet) override { return inner->processOutput(packet); }
+    void renegotiateOutput() override { inner->renegotiateOutput(); }
+    void drain() override { inner->drain(); }
+    void shutdown() override { inner->shutdown(); }
+    bool applyControl(const EncoderControl& control) override { return inner->applyControl(control); }
+    const EncoderConfig& config() const override { return inner->config(); }
+    EncoderStatus status() const override { return inner->status(); }
+
+    std::map<int64_t, double> bars() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return barCenters;
+    }
+
+    std::map<int64_t, uint8_t> firsts() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return firstPixels;
+    }
+
+private:
+    std::unique_ptr<IEncoderBackend> inner;
+    mutable std::mutex mutex;
+    std::map<int64_t, double> barCenters;
+    std::map<int64_t, uint8_t> firstPixels;
+};
+
+class ProbeFactory : public IEncoderBackendFactory
+{
+public:
+    explicit ProbeFactory(const SoftwareBackendOptions& options) : inner(options) {}
+
+    uint32_t adapterCount() const override { return inner.adapterCount(); }
+    uint32_t sessionLimit(uint32_t adapter) const override { return inner.sessionLimit(adapter); }
+    bool supports(uint32_t adapter, const EncoderConfig& config) const override { return inner.supports(adapter, config); }
+
+    std::unique_ptr<IEncoderBackend> createBackend(uint32_t adapter, const EncoderConfig& config, WorkerPool& workers) override
+    {
+        probes.push_back(new ProbeBackend(inner.createBackend(adapter, config, workers)));
+        return std::unique_ptr<IEncoderBackend>(probes.back());
+    }
+
+    // In rung order, owned by the ladder and gone with it
+    std::vector<ProbeBackend*> probes;
+
+private:
+    SoftwareBackendFactory inner;
+};
+
+// Times and keyframe flags of one rung's access units
+class TimeRecorder : public IPacketConsumer
+{
+public:
+    void onPacket(const EncodedPacket& packet) override
+    {
+        times.push_back(packet.time());
+        if (packet.keyframe())
+            keyframeTimes.push_back(packet.time());
+        if (onCount && times.size() == triggerAt)
+            onCount();
+    }
+
+    std::vector<int64_t> times;
+    std::vector<int64_t> keyframeTimes;
+    size_t triggerAt = 0;
+    std::function<void()> onCount;
+};
+
+static bool runLadder(const char* label, const EncoderConfig& source, const FrameSchedulerOptions& schedule, uint64_t failAtFrame = 0)
+{
+    SoftwareBackendOptions backendOptions;
+    backendOptions.latency = std::chrono::microseconds(0);
+    backendOptions.failAtFrame = failAtFrame;
+    ProbeFactory factory(backendOptions);
+
+    LadderOptions options;
+    options.source = source;
+    options.rungs = standardLadder(source);
+    for (LadderRung& rung : options.rungs)
+        rung.path = "bench_ladder_" + std::to_string(rung.height) + "p.h264";
+
+    bool ok = true;
+    WorkerPool workers(2);
+    std::vector<TimeRecorder> recorders(options.rungs.size());
+    std::vector<std::map<int64_t, double>> bars;
+    LadderStats stats;
+    double seconds;
+    bool drained;
+    {
+        LadderEncoder ladder(factory, 0, options, workers);
+        ladder.setSchedule(schedule);
+        for (size_t i = 0; i < recorders.size(); i++)
+            ladder.addConsumer(i, &recorders[i]);
+
+        // A keyframe asked for mid-stream lands on the same frame everywhere
+        recorders[0].triggerAt = (size_t)schedule.frames / 3;
+        recorders[0].onCount = [&ladder]() { ladder.forceKeyframe(); };
+
+        Clock::time_point start = Clock::now();
+        ladder.start();
+        drained = ladder.waitForDrain(std::chrono::seconds(30));
+        seconds = secondsSince(start);
+        ladder.closeWriters();
+        stats = ladder.stats();
+        for (ProbeBackend* probe : factory.probes)
+            bars.push_back(probe->bars());
+
+        if (failAtFrame != 0)
+        {
+            ok = !drained && ladder.status().code == SOFTWARE_E_FAIL;
+            printf("ladder: %-20s stopped at frame %llu: %s\n", label, (unsigned long long)failAtFrame, ok ? "yes" : "NO");
+        }
+    }
+    for (const LadderRung& rung : options.rungs)
+        std::remove(rung.path.c_str());
+    if (failAtFrame != 0)
+        return ok;
+
+    uint64_t frames = stats.rungs[0].framesIn;
+    printf("ladder: %-20s %llu frames to %zu rungs in %.2f s (%.0f fps), %llu conversions, %llu shared buffers, %u shared at most\n", label,
+        (unsigned long long)frames, stats.rungs.size(), seconds, frames / seconds, (unsigned long long)stats.conversions,
+        (unsigned long long)stats.sharedFrames.allocations, stats.sharedFrames.highWater);
+    for (const LadderRungStats& rung : stats.rungs)
+    {
+        printf("ladder:   %4ux%-4u %4llu frames out, %llu keyframes, %.2f ms scaling per frame\n", rung.width, rung.height,
+            (unsigned long long)rung.framesOut, (unsigned long long)rung.keyframes, rung.framesIn ? rung.scaleUs / 1000.0 / rung.framesIn : 0.0);
+    }
+
+    // One conversion per frame, whatever the number of rungs
+    uint64_t newPictures = stats.schedule.captured;
+    if (!drained || frames == 0 || stats.conversions > newPictures || stats.sharedFrames.allocations != 1 ||
+        stats.sharedFrames.acquired != stats.sharedFrames.released)
+    {
+        printf("ladder: %s did not drain or converted more than once per frame\n", label);
+        ok = false;
+    }
+
+    const uint32_t barWidth = 16;
+    for (size_t i = 0; i < stats.rungs.size(); i++)
+    {
+        bool same = stats.rungs[i].framesIn == frames && stats.rungs[i].framesOut == frames && recorders[i].times == recorders[0].times &&
+            recorders[i].keyframeTimes == recorders[0].keyframeTimes;
+        if (!same)
+        {
+            printf("ladder: the %up rung did not get the same frames and keyframes as the first\n", stats.rungs[i].height);
+            ok = false;
+        }
+
+        // The bar of frame n starts at n + 1 in the fast schedule's pictures
+        if (schedule.mode != FrameSchedule::AsFastAsPossible)
+            continue;
+        double scale = (double)stats.rungs[i].width / source.width;
+        uint32_t span = source.width - barWidth + 1;
+        double worst = 0;
+        for (const auto& bar : bars[i])
+        {
+            uint64_t slot = (uint64_t)llround((double)bar.first * source.frameRate.num / source.frameRate.den / 1e7);
+            double expected = ((slot + 1) % span + (barWidth - 1) / 2.0 + 0.5) * scale - 0.5;
+            worst = std::max(worst, std::fabs(bar.second - expected));
+        }
+        if (worst > 1.5)
+        {
+            printf("ladder: the bar in the %up rung is %.1f pixels from where scaling puts it\n", stats.rungs[i].height, worst);
+            ok = false;
+        }
+    }
+    if (recorders[0].keyframeTimes.size() < 2)
+    {
+        printf("ladder: %s has no keyframes past the first\n", label);
+        ok = false;
+    }
+    return ok;
+}
+
+static bool benchLadder()
+{
+    bool ok = true;
+
+    EncoderConfig config;
+    config.width = 1920;
+    config.height = 1080;
+    config.gopLength = 30;
+
+    FrameSchedulerOptions fast;
+    fast.frames = 150;
+    ok = runLadder("1080p fast", config, fast) && ok;
+
+    FrameSchedulerOptions realTime;
+    realTime.mode = FrameSchedule::RealTime;
+    realTime.frames = 45;
+    config.width = 1280;
+    config.height = 720;
+    ok = runLadder("720p real time", config, realTime) && ok;
+
+    ok = runLadder("720p failing", config, fast, 20) && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Scaling
+//
+// Every SIMD kernel matches the scalar one byte for byte, for every filter,
+// NV12 and BGRA, and flat pictures stay flat. The fixed point result is
+// within one of the same weights in double precision, tables are shared
+// through the cache, and sliced scaling gives the same bytes as one thread.
+// Quality is a round trip's PSNR and how much of a stripe pattern too fine
+// for the target survives as aliasing. Last, an encoder captures at one
+// size and encodes at another, and a probe finds the bar where it belongs.
+// ----------------------------------------------------------------------------
+
+static const ScaleKernel scaleKernels[] = { ScaleKernel::Scalar, ScaleKernel::Sse2, ScaleKernel::Avx2, ScaleKernel::Neon };
+static const ScaleFilter scaleFilters[] = { ScaleFilter::Bilinear, ScaleFilter::Bicubic, ScaleFilter::Area };
+
+static bool verifyScaleKernels()
+{
+    const uint32_t sizes[][4] =
+    {
+        { 1920, 1080, 1280, 720 }, { 1920, 1080, 854, 480 }, { 1920, 1080, 640, 360 }, { 640, 360, 1280, 720 },
+        { 34, 18, 20, 10 }, { 30, 6, 46, 14 }, { 2, 2, 6, 4 }, { 1282, 722, 1280, 720 }, { 1920, 1080, 160, 90 },
+    };
+    bool ok = true;
+
+    for (ScaleFilter filter : scaleFilters)
+    {
+        for (const auto& size : sizes)
+        {
+            uint32_t sourcePitch = size[0] * 4 + 12;
+            std::vector<uint8_t> source = randomBytes((size_t)sourcePitch * size[1] * 3 / 2, size[0] + size[2]);
+            Nv12Frame from = { source.data(), sourcePitch, source.data() + (size_t)sourcePitch * size[1], sourcePitch };
+            size_t bgraBytes = (size_t)size[2] * size[3] * 4;
+
+            Nv12Buffer expected(size[2], size[3]);
+            std::vector<uint8_t> expectedBgra(bgraBytes);
+            FrameScaler reference(size[0], size[1], size[2], size[3], filter, ScaleKernel::Scalar);
+            reference.scaleNv12(from, expected.frame);
+            reference.scaleBgra(source.data(), sourcePitch, expectedBgra.data(), (size_t)size[2] * 4);
+            for (ScaleKernel kernel : scaleKernels)
+            {
+                if (kernel == ScaleKernel::Scalar || !scaleKernelSupported(kernel))
+                    continue;
+                Nv12Buffer actual(size[2], size[3]);
+                std::vector<uint8_t> actualBgra(bgraBytes);
+                FrameScaler scaler(size[0], size[1], size[2], size[3], filter, kernel);
+                scaler.scaleNv12(from, actual.frame);
+                scaler.scaleBgra(source.data(), sourcePitch, actualBgra.data(), (size_t)size[2] * 4);
+                if (actual.y != expected.y || actual.uv != expected.uv || actualBgra != expectedBgra)
+                {
+                    printf("scale: %s %s differs from scalar (%ux%u to %ux%u)\n", scaleKernelName(kernel), scaleFilterName(filter),
+                        size[0], size[1], size[2], size[3]);
+                    ok = false;
+                }
+            }
+
+            // Weights sum to one, so a flat picture stays exactly flat
+            std::vector<uint8_t> flat((size_t)size[0] * size[1] * 3 / 2, 0);
+            std::fill(flat.begin(), flat.begin() + (size_t)size[0] * size[1], 77);
+            for (size_t i = (size_t)size[0] * size[1]; i < flat.size(); i += 2)
+            {
+                flat[i] = 90;
+                flat[i + 1] = 160;
+            }
+            Nv12Frame flatFrame = { flat.data(), size[0], flat.data() + (size_t)size[0] * size[1], size[0] };
+            Nv12Buffer scaled(size[2], size[3]);
+            FrameScaler(size[0], size[1], size[2], size[3], filter).scaleNv12(flatFrame, scaled.frame);
+            bool stayedFlat = std::all_of(scaled.y.begin(), scaled.y.end(), [](uint8_t v) { return v == 77; });
+            for (size_t i = 0; i < scaled.uv.size(); i += 2)
+                stayedFlat = stayedFlat && scaled.uv[i] == 90 && scaled.uv[i + 1] == 160;
+            if (!stayedFlat)
+            {
+                printf("scale: a flat %ux%u picture is not flat at %ux%u %s\n", size[0], size[1], size[2], size[3], scaleFilterName(filter));
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// Luma of a picture with detail at several scales but none too fine to keep
+static std::vector<uint8_t> smoothPicture(uint32_t width, uint32_t height)
+{
+    std::vector<uint8_t> picture((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            double value = 128 + 60 * std::sin(x * 0.011 + y * 0.007) + 40 * std::cos(x * 0.043) * std::sin(y * 0.051) +
+                20 * std::sin((x + 2.0 * y) * 0.13);
+            picture[(size_t)y * width + x] = clampToByte((int)std::lround(value));
+        }
+    }
+    return picture;
+}
+
+static double psnr(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b)
+{
+    double error = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        error += ((double)a[i] - b[i]) * ((double)a[i] - b[i]);
+    error /= a.size();
+    return error == 0 ? 99 : 10 * std::log10(255.0 * 255.0 / error);
+}
+
+// One luma plane through a scaler: an NV12 frame with a chroma plane to spare
+static std::vector<uint8_t> scaleLuma(const std::vector<uint8_t>& luma, uint32_t width, uint32_t height, uint32_t toWidth, uint32_t toHeight,
+                                      ScaleFilter filter)
+{
+    std::vector<uint8_t> chroma((size_t)width * height / 2, 128);
+    Nv12Frame from = { const_cast<uint8_t*>(luma.data()), width, chroma.data(), width };
+    Nv12Buffer to(toWidth, toHeight);
+    FrameScaler(width, height, toWidth, toHeight, filter).scaleNv12(from, to.frame);
+    return to.y;
+}
+
+static bool checkScaleQuality()
+{
+    bool ok = true;
+
+    // The integer passes against the same weights in double precision
+    const uint32_t width = 1920, height = 1080, toWidth = 1280, toHeight = 720;
+    std::vector<uint8_t> noise = randomBytes((size_t)width * height, 11);
+    for (ScaleFilter filter : scaleFilters)
+    {
+        std::vector<uint8_t> scaled = scaleLuma(noise, width, height, toWidth, toHeight, filter);
+        const ScaleTable& columns = *cachedScaleTable(width, toWidth, filter);
+        const ScaleTable& rows = *cachedScaleTable(height, toHeight, filter);
+        std::vector<double> between(width);
+        int worst = 0;
+        for (uint32_t y = 0; y < toHeight; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                between[x] = 0;
+                for (uint32_t k = 0; k < rows.taps; k++)
+                    between[x] += rows.weights[(size_t)y * rows.taps + k] / 16384.0 * noise[(size_t)(rows.offsets[y] + k) * width + x];
+            }
+            for (uint32_t x = 0; x < toWidth; x++)
+            {
+                double sum = 0;
+                for (uint32_t k = 0; k < columns.taps; k++)
+                    sum += columns.weights[(size_t)x * columns.taps + k] / 16384.0 * between[columns.offsets[x] + k];
+                int exact = clampToByte((int)std::lround(sum));
+                worst = std::max(worst, std::abs(exact - scaled[(size_t)y * toWidth + x]));
+            }
+        }
+        if (worst > 1)
+        {
+            printf("scale: %s is %d off its weights in double precision\n", scaleFilterName(filter), worst);
+            ok = false;
+        }
+    }
+
+    // Down to a third and back, and one pixel stripes down to a third: the
+    // filters that look at every covered pixel must average them out
+    const uint32_t smallWidth = 640, smallHeight = 360;
+    std::vector<uint8_t> picture = smoothPicture(width, height);
+    std::vector<uint8_t> stripes((size_t)width * height);
+    for (size_t i = 0; i < stripes.size(); i++)
+        stripes[i] = (i % width) % 2 ? 255 : 0;
+    double bilinearAliasing = 0;
+    for (ScaleFilter filter : scaleFilters)
+    {
+        std::vector<uint8_t> small = scaleLuma(picture, width, height, smallWidth, smallHeight, filter);
+        double roundTrip = psnr(picture, scaleLuma(small, smallWidth, smallHeight, width, height, filter));
+
+        std::vector<uint8_t> aliased = scaleLuma(stripes, width, height, smallWidth, smallHeight, filter);
+        double mean = 0, variance = 0;
+        for (uint8_t v : aliased)
+            mean += v;
+        mean /= aliased.size();
+        for (uint8_t v : aliased)
+            variance += (v - mean) * (v - mean);
+        double deviation = std::sqrt(variance / aliased.size());
+        if (filter == ScaleFilter::Bilinear)
+            bilinearAliasing = deviation;
+
+        printf("scale: %-8s 1080p->360p->1080p %5.1f dB, stripes alias to a %5.1f deviation\n", scaleFilterName(filter), roundTrip, deviation);
+        if (roundTrip < 30 || (filter != ScaleFilter::Bilinear && deviation > bilinearAliasing / 2))
+        {
+            printf("scale: %s loses too much or aliases\n", scaleFilterName(filter));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// The same tables for the same sizes, and the same bytes from any number of slices
+static bool checkScaleSharing()
+{
+    bool ok = true;
+    std::shared_ptr<const ScaleTable> table = cachedScaleTable(1920, 1280, ScaleFilter::Bicubic);
+    FrameScaler first(1920, 1080, 1280, 720, ScaleFilter::Bicubic);
+    FrameScaler second(1920, 1080, 1280, 720, ScaleFilter::Bicubic);
+    if (cachedScaleTable(1920, 1280, ScaleFilter::Bicubic) != table || &first.columnTable() != table.get() ||
+        &second.columnTable() != &first.columnTable() || &first.rowTable() == &first.columnTable())
+    {
+        printf("scale: tables for the same sizes are not shared\n");
+        ok = false;
+    }
+
+    WorkerPool workers(3);
+    const uint32_t sizes[][4] = { { 1920, 1080, 1280, 720 }, { 640, 360, 1920, 1080 }, { 64, 36, 30, 4 } };
+    for (const auto& size : sizes)
+    {
+        std::vector<uint8_t> source = randomBytes((size_t)size[0] * size[1] * 4, 5);
+        Nv12Frame from = { source.data(), size[0], source.data() + (size_t)size[0] * size[1], size[0] };
+        FrameScaler single(size[0], size[1], size[2], size[3], ScaleFilter::Area);
+        Nv12Buffer expected(size[2], size[3]);
+        std::vector<uint8_t> expectedBgra((size_t)size[2] * size[3] * 4);
+        single.scaleNv12(from, expected.frame);
+        single.scaleBgra(source.data(), (size_t)size[0] * 4, expectedBgra.data(), (size_t)size[2] * 4);
+
+        for (uint32_t slices : { 2u, 4u, 7u })
+        {
+            FrameScaler sliced(size[0], size[1], size[2], size[3], ScaleFilter::Area);
+            sliced.setSlices(&workers, slices);
+            Nv12Buffer actual(size[2], size[3]);
+            std::vector<uint8_t> actualBgra(expectedBgra.size());
+            for (int repeat = 0; repeat < 3; repeat++)
+            {
+                sliced.scaleNv12(from, actual.frame);
+                sliced.scaleBgra(source.data(), (size_t)size[0] * 4, actualBgra.data(), (size_t)size[2] * 4);
+            }
+            if (actual.y != expected.y || actual.uv != expected.uv || actualBgra != expectedBgra)
+            {
+                printf("scale: %u slices differ from one (%ux%u to %ux%u)\n", sliced.sliceCount(), size[0], size[1], size[2], size[3]);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// An encoder capturing at one size and encoding at another
+static bool runCaptureScaling(uint32_t captureWidth, uint32_t captureHeight, uint32_t width, uint32_t height, ScaleFilter filter)
+{
+    const char* path = "bench_scale.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = width;
+    options.config.height = height;
+
+    FrameSchedulerOptions schedule;
+    schedule.frames = 60;
+    WorkerPool workers(2);
+    std::map<int64_t, double> bars;
+    bool drained;
+    uint64_t framesOut;
+    {
+        ProbeBackend probe(std::unique_ptr<IEncoderBackend>(new SoftwareEncoderBackend(options)));
+        Encoder encoder(probe, path);
+        encoder.setSchedule(schedule);
+        encoder.setCaptureSize(captureWidth, captureHeight, filter, &workers);
+        encoder.start();
+        drained = encoder.waitForDrain(std::chrono::seconds(30));
+        framesOut = encoder.outputFrames();
+        bars = probe.bars();
+    }
+    std::remove(path);
+
+    // The bar of frame n starts at n + 1, see runLadder()
+    const uint32_t barWidth = 16;
+    double scale = (double)width / captureWidth;
+    uint32_t span = captureWidth - barWidth + 1;
+    double worst = 0;
+    for (const auto& bar : bars)
+    {
+        uint64_t slot = (uint64_t)llround((double)bar.first * options.config.frameRate.num / options.config.frameRate.den / 1e7);
+        double expected = ((slot + 1) % span + (barWidth - 1) / 2.0 + 0.5) * scale - 0.5;
+        worst = std::max(worst, std::fabs(bar.second - expected));
+    }
+    bool ok = drained && framesOut == schedule.frames && bars.size() == schedule.frames && worst <= 1.5;
+    printf("scale: capture %ux%u, encode %ux%u %-8s %llu frames, bar %.2f pixels off: %s\n", captureWidth, captureHeight, width, height,
+        scaleFilterName(filter), (unsigned long long)framesOut, worst, ok ? "ok" : "WRONG");
+    return ok;
+}
+
+static bool benchScale()
+{
+    bool ok = verifyScaleKernels();
+    printf("scale: kernels bit exact with scalar: %s\n", ok ? "yes" : "NO");
+    ok = checkScaleQuality() && ok;
+    ok = checkScaleSharing() && ok;
+
+    const uint32_t width = 1920, height = 1080;
+    std::vector<uint8_t> source = randomBytes((size_t)width * height * 3 / 2, 3);
+    Nv12Frame from = { source.data(), width, source.data() + (size_t)width * height, width };
+    auto timeScaler = [&](FrameScaler& scaler)
+    {
+        Nv12Buffer out(1280, 720);
+        int frames = 0;
+        Clock::time_point start = Clock::now();
+        while (secondsSince(start) < 0.3)
+        {
+            scaler.scaleNv12(from, out.frame);
+            frames++;
+        }
+        return frames / secondsSince(start);
+    };
+    for (ScaleFilter filter : scaleFilters)
+    {
+        for (ScaleKernel kernel : scaleKernels)
+        {
+            if (!scaleKernelSupported(kernel))
+                continue;
+            FrameScaler scaler(width, height, 1280, 720, filter, kernel);
+            printf("scale: %-8s %-7s 1080p->720p NV12 %7.1f fps (%u taps)\n", scaleFilterName(filter), scaleKernelName(kernel),
+                timeScaler(scaler), scaler.columnTable().taps);
+        }
+    }
+    WorkerPool workers(4);
+    for (uint32_t slices : { 1u, 2u, 4u })
+    {
+        FrameScaler scaler(width, height, 1280, 720, ScaleFilter::Bicubic);
+        scaler.setSlices(&workers, slices);
+        printf("scale: bicubic  %-7s 1080p->720p NV12 %7.1f fps in %u slices\n", scaleKernelName(scaler.activeKernel()), timeScaler(scaler), slices);
+    }
+
+    ok = runCaptureScaling(1920, 1080, 1280, 720, ScaleFilter::Bicubic) && ok;
+    ok = runCaptureScaling(640, 360, 1280, 720, ScaleFilter::Bilinear) && ok;
+    ok = runCaptureScaling(1280, 720, 854, 480, ScaleFilter::Area) && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Frame sources
+//
+// The pattern kernels against the scalar one, and the motion pattern
+// actually panning. Raw, Y4M and BGRA files come back frame for frame from
+// the mapping, loop, and go through an encoder in order, at their own size
+// and scaled. A producer thread hammers a three slot ring while the reader
+// checks that no picture it took was written under it.
+// ----------------------------------------------------------------------------
+
+static const PatternKernel patternKernels[] = { PatternKernel::Scalar, PatternKernel::Sse2, PatternKernel::Avx2, PatternKernel::Neon };
+
+static bool verifyPatternKernels()
+{
+    std::vector<uint8_t> row = randomBytes(1000, 11);
+    bool ok = true;
+    for (PatternKernel kernel : patternKernels)
+    {
+        if (!patternKernelSupported(kernel))
+            continue;
+        PatternRowFn addRow = patternRowFunction(kernel);
+        for (int delta : { -255, -40, -1, 0, 1, 17, 255 })
+        {
+            for (size_t count : { (size_t)0, (size_t)1, (size_t)15, (size_t)31, (size_t)33, (size_t)70, (size_t)999 })
+            {
+                std::vector<uint8_t> expected(count + 1, 7), actual(count + 1, 7);
+                patternRowScalar(row.data() + 1, count, delta, expected.data());
+                addRow(row.data() + 1, count, delta, actual.data());
+                if (actual != expected)
+                {
+                    printf("source: %s pattern row of %zu, delta %d differs\n", patternKernelName(kernel), count, delta);
+                    ok = false;
+                }
+            }
+        }
+
+        for (PictureFormat format : { PictureFormat::NV12, PictureFormat::BGRA })
+        {
+            PatternSource reference(TestPattern::Motion, format, 322, 180, 0, PatternKernel::Scalar);
+            PatternSource source(TestPattern::Motion, format, 322, 180, 0, kernel);
+            const size_t bytes = pictureBytes(format, 322, 180);
+            for (int i = 0; i < 40; i++)
+            {
+                reference.next();
+                source.next();
+                if (memcmp(reference.picture().planes[0], source.picture().planes[0], bytes) != 0)
+                {
+                    printf("source: %s %s motion picture %d differs\n", patternKernelName(kernel), pictureFormatName(format), i);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+// Mean difference of b against a moved by (dx, dy), over the part of the
+// picture both cover
+static double shiftedDifference(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height, int dx, int dy)
+{
+    uint64_t sum = 0, count = 0;
+    for (uint32_t y = 8; y + 8 < height; y++)
+    {
+        for (uint32_t x = 8; x + 8 < width; x++)
+        {
+            sum += std::abs((int)a[(size_t)(y + dy) * width + x + dx] - (int)b[(size_t)y * width + x]);
+            count++;
+        }
+    }
+    return (double)sum / count;
+}
+
+// Background moves 4 pixels left and 2 up a frame: most of the next picture
+// is this one moved, not this one again
+static bool checkPatternMotion()
+{
+    const uint32_t width = 1280, height = 720;
+    PatternSource source(TestPattern::Motion, PictureFormat::NV12, width, height);
+    for (int i = 0; i < 10; i++)
+        source.next();
+    std::vector<uint8_t> previous(source.picture().planes[0], source.picture().planes[0] + (size_t)width * height);
+    source.next();
+    const uint8_t* current = source.picture().planes[0];
+
+    double mean = 0, square = 0;
+    for (size_t i = 0; i < previous.size(); i++)
+    {
+        mean += previous[i];
+        square += (double)previous[i] * previous[i];
+    }
+    mean /= previous.size();
+    double deviation = std::sqrt(square / previous.size() - mean * mean);
+    double still = shiftedDifference(previous.data(), current, width, height, 0, 0);
+    double panned = shiftedDifference(previous.data(), current, width, height, 4, 2);
+    bool ok = deviation > 20 && still > 10 && panned < still / 3;
+    printf("source: motion 720p luma deviation %.1f, frame to frame %.1f, along the pan %.1f: %s\n", deviation, still, panned,
+        ok ? "ok" : "WRONG");
+    return ok;
+}
+
+static void writeBytes(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*)bytes.data(), bytes.size());
+}
+
+// I420 frame i: flat planes of Y 16 + 2i, U 60 + i, V 200 - i
+static void appendTestFrame(std::vector<uint8_t>& file, uint32_t width, uint32_t height, uint32_t i)
+{
+    const size_t luma = (size_t)width * height;
+    file.insert(file.end(), luma, (uint8_t)(16 + 2 * i));
+    file.insert(file.end(), luma / 4, (uint8_t)(60 + i));
+    file.insert(file.end(), luma / 4, (uint8_t)(200 - i));
+}
+
+static bool isTestFrame(const SourcePicture& picture, uint32_t i)
+{
+    for (uint32_t y = 0; y < picture.height; y++)
+    {
+        for (uint32_t x = 0; x < picture.width; x++)
+        {
+            if (picture.planes[0][picture.pitches[0] * y + x] != 16 + 2 * i)
+                return false;
+        }
+    }
+    for (uint32_t y = 0; y < picture.height / 2; y++)
+    {
+        for (uint32_t x = 0; x < picture.width / 2; x++)
+        {
+            if (picture.planes[1][picture.pitches[1] * y + x] != 60 + i || picture.planes[2][picture.pitches[2] * y + x] != 200 - i)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Every frame once and in order, straight from the mapping, then End, or
+// from the top again when looping
+static bool readTestFrames(const char* label, const std::string& path, const FileSourceOptions& options, uint32_t frames)
+{
+    FileFrameSource source;
+    std::string error;
+    if (!source.open(path, options, error))
+    {
+        printf("source: %s does not open: %s\n", label, error.c_str());
+        return false;
+    }
+
+    bool ok = source.info().format == PictureFormat::I420;
+    uint32_t reads = options.loop ? frames * 2 + 3 : frames;
+    for (uint32_t i = 0; i < reads && ok; i++)
+    {
+        const SourcePicture& picture = source.picture();
+        ok = source.next() == SourceRead::Fresh && isTestFrame(picture, i % frames) &&
+            picture.planes[0] >= source.mappedData() && picture.planes[2] < source.mappedData() + source.mappedSize();
+    }
+    ok = ok && (options.loop ? source.getStats().loops == 2 : source.next() == SourceRead::End);
+    printf("source: %-28s %u frames%s, %llu madvise calls: %s\n", label, frames, options.loop ? " looped twice" : "",
+        (unsigned long long)source.getStats().adviseCalls, ok ? "ok" : "WRONG");
+    return ok;
+}
+
+static bool checkFileSource()
+{
+    const uint32_t width = 64, height = 48, frames = 12;
+    std::vector<uint8_t> raw, y4m;
+    const std::string header = "YUV4MPEG2 W64 H48 F30000:1001 Ip A1:1 C420jpeg XYSCSS=420JPEG\n";
+    y4m.insert(y4m.end(), header.begin(), header.end());
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        appendTestFrame(raw, width, height, i);
+        const std::string line = i == 3 ? "FRAME Ip\n" : "FRAME\n";
+        y4m.insert(y4m.end(), line.begin(), line.end());
+        appendTestFrame(y4m, width, height, i);
+    }
+    // A part frame at the end is not a frame
+    raw.insert(raw.end(), 100, 0);
+    writeBytes("bench_source.yuv", raw);
+    writeBytes("bench_source.y4m", y4m);
+
+    FileSourceOptions options;
+    options.width = width;
+    options.height = height;
+    bool ok = readTestFrames("raw i420", "bench_source.yuv", options, frames);
+    ok = readTestFrames("y4m", "bench_source.y4m", FileSourceOptions(), frames) && ok;
+    options.loop = true;
+    ok = readTestFrames("raw i420", "bench_source.yuv", options, frames) && ok;
+
+    FileFrameSource y4mSource;
+    std::string error;
+    y4mSource.open("bench_source.y4m", FileSourceOptions(), error);
+    if (y4mSource.frameRate().num != 30000 || y4mSource.frameRate().den != 1001)
+    {
+        printf("source: y4m frame rate %u/%u\n", y4mSource.frameRate().num, y4mSource.frameRate().den);
+        ok = false;
+    }
+
+    // I420 chroma interleaved into NV12
+    y4mSource.next();
+    y4mSource.next();
+    std::vector<uint8_t> nv12(pictureBytes(PictureFormat::NV12, width, height));
+    PictureUploader uploader(y4mSource.info(), FrameFormat::NV12, width, height);
+    uploader.upload(y4mSource.picture(), nv12.data(), width);
+    for (size_t i = 0; i < nv12.size(); i++)
+    {
+        bool chroma = i >= (size_t)width * height;
+        uint8_t expected = !chroma ? 18 : i % 2 == 0 ? 61 : 199;
+        if (nv12[i] != expected)
+        {
+            printf("source: i420 upload byte %zu is %u, not %u\n", i, nv12[i], expected);
+            ok = false;
+            break;
+        }
+    }
+
+    // What does not open
+    std::string text = "YUV4MPEG2 W64 H48 C444\nFRAME\n";
+    writeBytes("bench_source_444.y4m", std::vector<uint8_t>(text.begin(), text.end()));
+    writeBytes("bench_source_short.yuv", std::vector<uint8_t>(1000, 0));
+    FileSourceOptions noSize;
+    FileSourceOptions oddSize = options;
+    oddSize.width = 63;
+    struct Rejected { const char* path; const FileSourceOptions* options; } rejected[] = {
+        { "bench_source_444.y4m", &noSize },
+        { "bench_source_short.yuv", &options },
+        { "bench_source.yuv", &noSize },
+        { "bench_source.yuv", &oddSize },
+        { "bench_source_missing.yuv", &options },
+    };
+    for (const Rejected& bad : rejected)
+    {
+        FileFrameSource source;
+        std::string reason;
+        if (source.open(bad.path, *bad.options, reason) || reason.empty())
+        {
+            printf("source: %s opened\n", bad.path);
+            ok = false;
+        }
+    }
+    printf("source: bad files and sizes rejected: %s\n", ok ? "yes" : "NO");
+
+    for (const char* path : { "bench_source.yuv", "bench_source.y4m", "bench_source_444.y4m", "bench_source_short.yuv" })
+        std::remove(path);
+    return ok;
+}
+
+// A raw file through the encoder, fast: every frame once, in order, and the
+// stream ends with the file
+static bool runFileEncode(uint32_t width, uint32_t height, uint32_t fileWidth, uint32_t fileHeight)
+{
+    const char* path = "bench_source.h264";
+    const uint32_t frames = 90;
+    std::vector<uint8_t> raw;
+    for (uint32_t i = 0; i < frames; i++)
+        appendTestFrame(raw, fileWidth, fileHeight, i);
+    writeBytes("bench_source.yuv", raw);
+
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = width;
+    options.config.height = height;
+    FileSourceOptions fileOptions;
+    fileOptions.width = fileWidth;
+    fileOptions.height = fileHeight;
+
+    bool drained;
+    uint64_t framesOut;
+    std::map<int64_t, uint8_t> firsts;
+    {
+        FileFrameSource source;
+        std::string error;
+        CHECK(source.open("bench_source.yuv", fileOptions, error));
+        ProbeBackend probe(std::unique_ptr<IEncoderBackend>(new SoftwareEncoderBackend(options)));
+        Encoder encoder(probe, path);
+        encoder.setSchedule(FrameSchedulerOptions());
+        encoder.setFrameSource(&source, ScaleFilter::Bilinear);
+        encoder.start();
+        drained = encoder.waitForDrain(std::chrono::seconds(30));
+        framesOut = encoder.outputFrames();
+        firsts = probe.firsts();
+    }
+    std::remove(path);
+    std::remove("bench_source.yuv");
+
+    bool ok = drained && framesOut == frames && firsts.size() == frames;
+    uint32_t i = 0;
+    for (const auto& first : firsts)
+        ok = ok && first.second == 16 + 2 * i++;
+    printf("source: raw %ux%u file encoded at %ux%u    %llu frames, in order: %s\n", fileWidth, fileHeight, width, height,
+        (unsigned long long)framesOut, ok ? "ok" : "WRONG");
+    return ok;
+}
+
+// Read and upload only, no encoder: the mapping against a read() of every
+// frame into a buffer
+static void timeFileRead()
+{
+    const uint32_t width = 1280, height = 720, frames = 60;
+    const size_t frameBytes = pictureBytes(PictureFormat::I420, width, height);
+    std::vector<uint8_t> raw;
+    for (uint32_t i = 0; i < frames; i++)
+        appendTestFrame(raw, width, height, i);
+    writeBytes("bench_source.yuv", raw);
+    raw.clear();
+    raw.shrink_to_fit();
+
+    std::vector<uint8_t> nv12(pictureBytes(PictureFormat::NV12, width, height));
+    FileSourceOptions options;
+    options.width = width;
+    options.height = height;
+    FileFrameSource source;
+    std::string error;
+    CHECK(source.open("bench_source.yuv", options, error));
+    PictureUploader uploader(source.info(), FrameFormat::NV12, width, height);
+    Clock::time_point start = Clock::now();
+    while (source.next() == SourceRead::Fresh)
+        uploader.upload(source.picture(), nv12.data(), width);
+    double mapped = frames / secondsSince(start);
+
+    std::vector<uint8_t> buffer(frameBytes);
+    FILE* file = fopen("bench_source.yuv", "rb");
+    start = Clock::now();
+    while (file && fread(buffer.data(), 1, frameBytes, file) == frameBytes)
+        uploader.upload(pictureAt(PictureFormat::I420, width, height, buffer.data()), nv12.data(), width);
+    double copied = frames / secondsSince(start);
+    if (file)
+        fclose(file);
+    std::remove("bench_source.yuv");
+    printf("source: 720p i420 file to NV12 %7.1f fps mapped, %7.1f fps read into a buffer\n", mapped, copied);
+}
+
+// The producer fills each picture with one byte and puts its sequence in
+// front. The reader takes whatever is newest; a picture that is not all one
+// byte behind its sequence was written while it was being read.
+static bool checkFrameRing()
+{
+    const uint32_t width = 320, height = 180, frames = 3000;
+    const size_t bytes = pictureBytes(PictureFormat::NV12, width, height);
+    FrameRingProducer producer;
+    FrameRingSource consumer;
+    std::string error;
+    bool ok = producer.create("bench_ring", PictureFormat::NV12, width, height, 3, error) && consumer.open("bench_ring", error);
+    if (!ok)
+    {
+        printf("source: ring: %s\n", error.c_str());
+        return false;
+    }
+
+    bool blank = consumer.picture().planes[0][0] == 16 && consumer.next() == SourceRead::Same;
+    std::thread thread([&]()
+    {
+        for (uint64_t sequence = 0; sequence < frames; sequence++)
+        {
+            producer.beginFrame();
+            uint8_t* data = producer.frameData();
+            memset(data, (int)(sequence % 251), bytes);
+            memcpy(data, &sequence, sizeof(sequence));
+            producer.publish();
+            std::this_thread::yield();
+        }
+        producer.close();
+    });
+
+    uint64_t taken = 0, torn = 0, backwards = 0, same = 0;
+    uint64_t last = 0;
+    bool any = false;
+    SourceRead read;
+    while ((read = consumer.next()) != SourceRead::End)
+    {
+        if (read == SourceRead::Same)
+        {
+            same++;
+            std::this_thread::yield();
+            continue;
+        }
+        const uint8_t* data = consumer.picture().planes[0];
+        uint64_t sequence;
+        memcpy(&sequence, data, sizeof(sequence));
+        for (size_t i = sizeof(sequence); i < bytes; i++)
+        {
+            if (data[i] != sequence % 251)
+            {
+                torn++;
+                break;
+            }
+        }
+        if (any && sequence <= last)
+            backwards++;
+        last = sequence;
+        any = true;
+        taken++;
+    }
+    thread.join();
+
+    FrameRingStats stats = consumer.getStats();
+    ok = blank && torn == 0 && backwards == 0 && last == frames - 1 && stats.frames == taken && stats.frames + stats.skipped == frames;
+    printf("source: ring of 3 slots, %u published, %llu taken, %llu skipped, %llu retries, %llu torn: %s\n", frames,
+        (unsigned long long)taken, (unsigned long long)stats.skipped, (unsigned long long)stats.retries, (unsigned long long)torn,
+        ok ? "ok" : "WRONG");
+    return ok;
+}
+
+// A ring as a live source at the encoder's clock. The producer runs faster
+// than the encoder, whose pictures only ever move forward.
+static bool runRingEncode()
+{
+    const char* path = "bench_source.h264";
+    const uint32_t width = 320, height = 180;
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = width;
+    options.config.height = height;
+    options.config.frameRate = { 60, 1 };
+    FrameSchedulerOptions schedule;
+    schedule.mode = FrameSchedule::RealTime;
+    schedule.frames = 30;
+
+    FrameRingProducer producer;
+    FrameRingSource source;
+    std::string error;
+    CHECK(producer.create("bench_ring_encode", PictureFormat::I420, width, height, 4, error));
+    CHECK(source.open("bench_ring_encode", error));
+    std::atomic<bool> done{false};
+    std::thread thread([&]()
+    {
+        const size_t bytes = pictureBytes(PictureFormat::I420, width, height);
+        for (uint32_t i = 0; !done; i++)
+        {
+            producer.beginFrame();
+            memset(producer.frameData(), 16 + (int)(i % 200), bytes);
+            producer.publish();
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+
+    bool drained;
+    uint64_t framesOut;
+    FrameSchedulerStats stats;
+    std::map<int64_t, uint8_t> firsts;
+    {
+        ProbeBackend probe(std::unique_ptr<IEncoderBackend>(new SoftwareEncoderBackend(options)));
+        Encoder encoder(probe, path);
+        encoder.setSchedule(schedule);
+        encoder.setFrameSource(&source);
+        encoder.start();
+        drained = encoder.waitForDrain(std::chrono::seconds(30));
+        framesOut = encoder.outputFrames();
+        stats = encoder.schedulerStats();
+        firsts = probe.firsts();
+    }
+    done = true;
+    thread.join();
+    std::remove(path);
+
+    bool ok = drained && framesOut == firsts.size() && framesOut > 0 && stats.captured > 0;
+    int previous = 0;
+    for (const auto& first : firsts)
+    {
+        // Wraps after 200 pictures, a second at 5 ms
+        ok = ok && (first.second >= previous || first.second < 40);
+        previous = first.second;
+    }
+    printf("source: ring into a 60 fps encoder      %llu frames, %llu new, %llu repeated, %llu skipped by the reader: %s\n",
+        (unsigned long long)framesOut, (unsigned long long)stats.captured, (unsigned long long)stats.duplicated,
+        (unsigned long long)source.getStats().skipped, ok ? "ok" : "WRONG");
+    return ok;
+}
+
+static bool benchSource()
+{
+    bool ok = verifyPatternKernels();
+    printf("source: kernels bit exact with scalar: %s\n", ok ? "yes" : "NO");
+    ok = checkPatternMotion() && ok;
+
+    for (PictureFormat format : { PictureFormat::NV12, PictureFormat::BGRA })
+    {
+        for (PatternKernel kernel : patternKernels)
+        {
+            if (!patternKernelSupported(kernel))
+                continue;
+            PatternSource source(TestPattern::Motion, format, 1920, 1080, 0, kernel);
+            int frames = 0;
+            Clock::time_point start = Clock::now();
+            while (secondsSince(start) < 0.3)
+            {
+                source.next();
+                frames++;
+            }
+            printf("source: motion %-6s %-4s 1080p %7.1f fps\n", patternKernelName(kernel), pictureFormatName(format), frames / secondsSince(start));
+        }
+    }
+
+    ok = checkFileSource() && ok;
+    ok = runFileEncode(320, 180, 320, 180) && ok;
+    ok = runFileEncode(640, 360, 320, 180) && ok;
+    timeFileRead();
+    ok = checkFrameRing() && ok;
+    ok = runRingEncode() && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Event pump
+//
+// The queue and the pump are hammered from several threads at once, which is
+// what ThreadSanitizer should see (build with -fsanitize=thread and run
+// ./bench pump). Every item arrives once and in its producer's order, every
+// event is counted into exactly one batch, neither side of the pump ever runs
+// beside itself, and DrainComplete comes after every output posted before
+// it. Last, a stand-in that fails mid-stream ends the run with its status
+// instead of an exception.
+// ----------------------------------------------------------------------------
+
+static bool benchMpscQueue()
+{
+    const uint32_t producers = 4;
+    const uint64_t perProducer = 200000;
+    MpscQueue<uint64_t> queue(64);
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&queue, p, perProducer]()
+        {
+            for (uint64_t i = 0; i < perProducer; i++)
+            {
+                while (!queue.push((uint64_t)p << 32 | i))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    bool ok = true;
+    std::vector<uint64_t> next(producers, 0);
+    for (uint64_t received = 0; received < producers * perProducer;)
+    {
+        uint64_t item;
+        if (!queue.pop(item))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        uint32_t producer = (uint32_t)(item >> 32);
+        if (producer >= producers || (item & 0xFFFFFFFF) != next[producer]++)
+            ok = false;
+        received++;
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    double seconds = secondsSince(start);
+
+    uint64_t item;
+    ok = ok && !queue.pop(item);
+    printf("pump: mpsc queue, %u producers     %8.2f M items/s\n", producers, producers * perProducer / seconds / 1e6);
+    if (!ok)
+        printf("pump: the queue lost, repeated or reordered items\n");
+    return ok;
+}
+
+// Records what arrives and checks the threading contract as it goes
+class CheckingSink : public IEncoderEventSink
+{
+public:
+    void onEncoderEvent(EncoderEvent event, uint32_t count) override
+    {
+        std::atomic<bool>& busy = event == EncoderEvent::NeedInput ? inputBusy : outputBusy;
+        if (busy.exchange(true))
+            overlapped = true;
+
+        switch (event)
+        {
+        case EncoderEvent::NeedInput:
+            needInput += count;
+            break;
+        case EncoderEvent::HaveOutput:
+            haveOutput += count;
+            break;
+        case EncoderEvent::DrainComplete:
+            outputsAtDrain = haveOutput.load();
+            drained = true;
+            break;
+        case EncoderEvent::Error:
+            errors++;
+            break;
+        }
+
+        // A little work per batch, so events pile up behind it
+        for (volatile int i = 0; i < 200; i = i + 1)
+        {
+        }
+        busy = false;
+    }
+
+    std::atomic<bool> inputBusy{false};
+    std::atomic<bool> outputBusy{false};
+    std::atomic<bool> overlapped{false};
+    std::atomic<uint64_t> needInput{0};
+    std::atomic<uint64_t> haveOutput{0};
+    std::atomic<uint64_t> outputsAtDrain{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<bool> drained{false};
+};
+
+static bool benchEventPumpStress()
+{
+    const uint32_t producers = 4;
+    const uint32_t perProducer = 100000;
+
+    WorkerPool workers(2);
+    CheckingSink sink;
+    EventPump pump(workers);
+    pump.start(&sink);
+
+    std::atomic<uint64_t> expectedInput{0};
+    std::atomic<uint64_t> expectedOutput{0};
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < producers; p++)
+    {
+        threads.emplace_back([&, p]()
+        {
+            std::mt19937 rng(p + 1);
+            uint64_t input = 0, output = 0;
+            for (uint32_t i = 0; i < perProducer; i++)
+            {
+                if (rng() & 1)
+                {
+                    pump.post(EncoderEvent::NeedInput);
+                    input++;
+                }
+                else
+                {
+                    pump.post(EncoderEvent::HaveOutput);
+                    output++;
+                }
+            }
+            expectedInput += input;
+            expectedOutput += output;
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    // Two failures, only the first is kept and reported
+    pump.post(EncoderEvent::DrainComplete);
+    pump.fail({ SOFTWARE_E_FAIL, "first" });
+    pump.fail({ SOFTWARE_E_NOTACCEPTING, "second" });
+    while (!sink.drained || sink.errors == 0 || sink.needInput != expectedInput)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    double seconds = secondsSince(start);
+    pump.close();
+
+    EventPumpStats stats = pump.stats();
+    EncoderStatus status = pump.status();
+    printf("pump: event pump, %u producers     %8.2f M events/s, %.1f events per input batch, %.1f per output batch, largest %u / %u\n",
+        producers, producers * perProducer / seconds / 1e6, (double)stats.needInput / stats.inputBatches,
+        (double)stats.haveOutput / stats.outputBatches, stats.largestInputBatch, stats.largestOutputBatch);
+
+    bool ok = !sink.overlapped && sink.needInput == expectedInput && sink.haveOutput == expectedOutput &&
+        sink.outputsAtDrain == expectedOutput && sink.errors == 1 && status.code == SOFTWARE_E_FAIL &&
+        stats.needInput == expectedInput && stats.haveOutput == expectedOutput && stats.lost == 0;
+    if (!ok)
+        printf("pump: %llu of %llu NeedInput, %llu of %llu HaveOutput (%llu before the drain), %llu errors, overlapped %d\n",
+            (unsigned long long)sink.needInput, (unsigned long long)expectedInput.load(), (unsigned long long)sink.haveOutput,
+            (unsigned long long)expectedOutput.load(), (unsigned long long)sink.outputsAtDrain, (unsigned long long)sink.errors,
+            (int)sink.overlapped);
+
+    // Piled up events are what batching is for
+    if (stats.largestInputBatch < 2 || stats.largestOutputBatch < 2)
+    {
+        printf("pump: events never arrived in batches\n");
+        ok = false;
+    }
+    return ok;
+}
+
+static bool benchEventPumpFailure()
+{
+    const char* path = "bench_pump.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.failAtFrame = 50;
+
+    bool ok;
+    {
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+
+        Clock::time_point start = Clock::now();
+        encoder.start();
+        bool drained = encoder.waitForDrain(std::chrono::seconds(5));
+        double seconds = secondsSince(start);
+        bool stopped = encoder.stop();
+        EncoderStatus status = encoder.status();
+        printf("pump: failure at frame %llu         %s after %.1f ms, %llu frames in, %llu out\n", (unsigned long long)options.failAtFrame,
+            status.operation, seconds * 1000, (unsigned long long)encoder.inputFrames(), (unsigned long long)encoder.outputFrames());
+
+        ok = !drained && !stopped && seconds < 1 && status.code == SOFTWARE_E_FAIL && strcmp(status.operation, "submitInput") == 0 &&
+            encoder.inputFrames() == options.failAtFrame && encoder.outputFrames() < encoder.inputFrames();
+        if (!ok)
+            printf("pump: the failure did not end the stream with its status\n");
+    }
+    std::remove(path);
+    return ok;
+}
+
+// Timers posted from many threads while the workers wait on the earliest
+// one, so the timer heap grows under a pending wait_until()
+static bool benchTimerStress()
+{
+    const uint32_t posters = 4;
+    const uint32_t perPoster = 20000;
+
+    std::atomic<uint64_t> fired{0};
+    std::atomic<uint64_t> early{0};
+    Clock::time_point start = Clock::now();
+    {
+        WorkerPool workers(2);
+
+        // Far off, so every worker sleeps on it until the pool is destroyed
+        workers.postAt(Clock::now() + std::chrono::hours(1), []() {});
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        std::vector<std::thread> threads;
+        for (uint32_t p = 0; p < posters; p++)
+        {
+            threads.emplace_back([&, p]()
+            {
+                std::mt19937 rng(p + 1);
+                for (uint32_t i = 0; i < perPoster; i++)
+                {
+                    Clock::time_point due = Clock::now() + std::chrono::microseconds(rng() % 2000);
+                    workers.postAt(due, [&fired, &early, due]()
+                    {
+                        if (Clock::now() < due)
+                            early++;
+                        fired++;
+                    });
+                }
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+        while (fired < posters * perPoster && Clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double seconds = secondsSince(start);
+    printf("pump: timers, %u posters            %8.2f M timers/s, %llu of %u run, %llu early\n", posters,
+        posters * perPoster / seconds / 1e6, (unsigned long long)fired.load(), posters * perPoster, (unsigned long long)early.load());
+
+    bool ok = fired == posters * perPoster && early == 0;
+    if (!ok)
+        printf("pump: timers were lost or ran before they were due\n");
+    return ok;
+}
+
+static bool benchPump()
+{
+    bool ok = benchMpscQueue();
+    ok = benchTimerStress() && ok;
+    ok = benchEventPumpStress() && ok;
+    ok = benchEventPumpFailure() && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Bitstream writer
+//
+// What matters is how long the encoder's event thread is held up per access
+// unit, so the producer side of each write is timed on its own.
+// ----------------------------------------------------------------------------
+
+struct WriteTimes
+{
+    std::vector<double> us;
+
+    double percentile(double p)
+    {
+        std::sort(us.begin(), us.end());
+        return us[(size_t)(p * (us.size() - 1))];
+    }
+};
+
+static void reportWriter(const char* label, WriteTimes& times, double seconds, size_t bytes)
+{
+    printf("writer: %-24s p50 %6.2f us  p99 %7.2f us  max %8.1f us  %7.1f MB/s\n", label,
+        times.percentile(0.5), times.percentile(0.99), times.percentile(1.0), bytes / seconds / 1e6);
+}
+
+static bool sameContents(const char* path, const std::vector<EncodedPacket>& packets)
+{
+    std::ifstream fin(path, std::ios::binary);
+    std::vector<uint8_t> bytes;
+    for (const EncodedPacket& packet : packets)
+    {
+        bytes.resize(packet.size());
+        if (!fin.read((char*)bytes.data(), bytes.size()) || memcmp(bytes.data(), packet.data(), bytes.size()) != 0)
+            return false;
+    }
+    return fin.peek() == EOF;
+}
+
+static bool benchWriter()
+{
+    const char* path = "bench_writer.h264";
+    const size_t packets = 20000;
+    const uint32_t gop = 60;
+
+    // 60 fps at roughly 8 Mbps with 5x larger IDRs
+    std::vector<uint8_t> payload = randomBytes(200000, 3);
+    std::vector<size_t> sizes(packets);
+    std::mt19937 rng(5);
+    size_t total = 0;
+    for (size_t i = 0; i < packets; i++)
+    {
+        sizes[i] = (i % gop == 0 ? 80000 : 16000) + rng() % 4000;
+        total += sizes[i];
+    }
+
+    // Baseline: what the MF callback used to do
+    {
+        WriteTimes times;
+        times.us.reserve(packets);
+        Clock::time_point start = Clock::now();
+        {
+            std::ofstream fout(path, std::ios::binary | std::ios::out | std::ios::trunc);
+            for (size_t i = 0; i < packets; i++)
+            {
+                Clock::time_point t = Clock::now();
+                fout.write((const char*)payload.data(), sizes[i]);
+                times.us.push_back(secondsSince(t) * 1e6);
+            }
+        }
+        reportWriter("ofstream per frame", times, secondsSince(start), total);
+    }
+
+    // The encoder hands out packets, the writer only takes references to them
+    PacketPool pool;
+    std::vector<EncodedPacket> encoded(packets);
+    for (size_t i = 0; i < packets; i++)
+    {
+        PacketPool::Buffer* buffer;
+        encoded[i] = pool.acquire(buffer);
+        buffer->storage.assign(payload.begin() + i % 1000, payload.begin() + i % 1000 + sizes[i]);
+        buffer->commit();
+        buffer->keyframe = i % gop == 0;
+    }
+
+    for (bool directIo : { false, true })
+    {
+        BitstreamWriterOptions options;
+        options.directIo = directIo;
+
+        WriteTimes times;
+        times.us.reserve(packets);
+        BitstreamWriterStats stats;
+        Clock::time_point start = Clock::now();
+        {
+            BitstreamWriter writer(path, options);
+            for (size_t i = 0; i < packets; i++)
+            {
+                Clock::time_point t = Clock::now();
+                writer.write(encoded[i]);
+                times.us.push_back(secondsSince(t) * 1e6);
+            }
+            writer.close();
+            stats = writer.stats();
+        }
+        reportWriter(directIo ? "async writer O_DIRECT" : "async writer", times, secondsSince(start), total);
+        printf("writer:   %llu writes of %.0f KB avg, %.0f us avg, queue high water %.1f MB, %llu producer stalls\n",
+            (unsigned long long)stats.writeCalls, stats.bytesWritten / 1024.0 / stats.writeCalls, stats.writeCallAvgUs,
+            stats.queueHighWaterBytes / 1e6, (unsigned long long)stats.producerStalls);
+
+        if (stats.bytesWritten != total || stats.packets != packets || !sameContents(path, encoded))
+        {
+            printf("writer: wrote %llu of %zu bytes, or not the packets queued\n", (unsigned long long)stats.bytesWritten, total);
+            std::remove(path);
+            return false;
+        }
+    }
+    std::remove(path);
+
+    // Low latency: every packet goes out at once, and an idle writer sleeps
+    // instead of polling. The process does nothing else meanwhile.
+    bool ok = true;
+    {
+        BitstreamWriter writer(path, lowLatencyWriterOptions());
+        for (size_t i = 0; i < 100; i++)
+            writer.write(encoded[i]);
+        while (writer.stats().packets != 100)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        std::clock_t cpuStart = std::clock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        double idleCpu = (double)(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+        // Woken by the first packet after the idle time
+        Clock::time_point start = Clock::now();
+        writer.write(encoded[100]);
+        while (writer.stats().packets != 101 && secondsSince(start) < 1)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        double wakeMs = secondsSince(start) * 1000;
+        bool closed = writer.close();
+
+        bool idleOk = idleCpu < 0.05 && wakeMs < 100 && closed;
+        printf("writer: low latency, idle 0.5 s       %.3f s CPU, next packet written after %.2f ms: %s\n", idleCpu, wakeMs,
+            idleOk ? "ok" : "WRONG");
+        ok = idleOk && ok;
+    }
+    std::remove(path);
+
+#ifdef __linux__
+    // A full disk fails the writer thread, which the producer hears about
+    // instead of the process terminating
+    {
+        BitstreamWriter writer("/dev/full");
+        for (size_t i = 0; i < packets; i++)
+            writer.write(encoded[i]);
+        bool closed = writer.close();
+        printf("writer: writing to a full disk         %s\n", !closed && writer.failed() ? "reported by close()" : "WRONG");
+        ok = !closed && writer.failed() && ok;
+    }
+#endif
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// MP4 muxer
+//
+// Muxes the software backend's output and walks the file it wrote: box
+// layout, fragment timeline, and that every sample in an mdat is exactly
+// the AVCC form of one access unit.
+// ----------------------------------------------------------------------------
+
+static uint32_t readU32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t readU64(const uint8_t* p)
+{
+    return ((uint64_t)readU32(p) << 32) | readU32(p + 4);
+}
+
+// First box of the given type inside [begin, end), depth first
+static const uint8_t* findBox(const uint8_t* begin, const uint8_t* end, const char* type)
+{
+    static const char* containers[] = { "moov", "trak", "mdia", "minf", "stbl", "moof", "traf" };
+    while (end - begin >= 8)
+    {
+        uint32_t size = readU32(begin);
+        if (size < 8 || size > (size_t)(end - begin))
+            return nullptr;
+        if (memcmp(begin + 4, type, 4) == 0)
+            return begin;
+        for (const char* container : containers)
+        {
+            if (memcmp(begin + 4, container, 4) == 0)
+            {
+                if (const uint8_t* found = findBox(begin + 8, begin + size, type))
+                    return found;
+            }
+        }
+        // Sample descriptions have fields in front of their child boxes
+        size_t skip = memcmp(begin + 4, "stsd", 4) == 0 ? 16 : memcmp(begin + 4, "avc3", 4) == 0 ? 86 : 0;
+        if (skip != 0 && skip < size)
+        {
+            if (const uint8_t* found = findBox(begin + skip, begin + size, type))
+                return found;
+        }
+        begin += size;
+    }
+    return nullptr;
+}
+
+static bool checkFragmentedMp4(const char* path, uint64_t expectedSamples, const EncoderConfig& config)
+{
+    std::ifstream fin(path, std::ios::binary);
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    const uint8_t* p = file.data();
+    const uint8_t* end = p + file.size();
+
+    if (file.size() < 16 || memcmp(p + 4, "ftyp", 4) != 0)
+        return false;
+    p += readU32(p);
+    if (end - p < 8 || memcmp(p + 4, "moov", 4) != 0)
+        return false;
+    // avc3, since parameter sets can change in-band
+    const uint8_t* avcC = findBox(p, p + readU32(p), "avcC");
+    if (!findBox(p, p + readU32(p), "avc3") || !avcC || avcC[8] != 1 || (avcC[12] & 3) != 3)
+        return false;
+    p += readU32(p);
+
+    uint64_t samples = 0;
+    uint32_t sequence = 0;
+    uint64_t nextTime = 0;
+    while (p < end)
+    {
+        const uint8_t* moof = p;
+        if (end - moof < 8 || memcmp(moof + 4, "moof", 4) != 0)
+            return false;
+        uint32_t moofSize = readU32(moof);
+        const uint8_t* mdat = moof + moofSize;
+        if (end - mdat < 8 || memcmp(mdat + 4, "mdat", 4) != 0)
+            return false;
+        uint32_t mdatSize = readU32(mdat);
+        if (mdatSize > (size_t)(end - mdat))
+            return false;
+
+        const uint8_t* mfhd = findBox(moof + 8, mdat, "mfhd");
+        const uint8_t* tfdt = findBox(moof + 8, mdat, "tfdt");
+        const uint8_t* trun = findBox(moof + 8, mdat, "trun");
+        if (!mfhd || !tfdt || !trun || readU32(mfhd + 12) != ++sequence)
+            return false;
+
+        // The timeline has no gaps between fragments
+        if (readU64(tfdt + 12) != nextTime)
+            return false;
+
+        uint32_t count = readU32(trun + 12);
+        if (readU32(trun + 16) != moofSize + 8)
+            return false;
+
+        const uint8_t* entry = trun + 20;
+        const uint8_t* sample = mdat + 8;
+        for (uint32_t i = 0; i < count; i++, entry += 12)
+        {
+            uint32_t duration = readU32(entry);
+            uint32_t size = readU32(entry + 4);
+            bool sync = readU32(entry + 8) == 0x02000000;
+            // Durations follow the exact frame rate, so the timeline never drifts
+            if (duration != (uint32_t)config.frameDuration(samples + i) || sync != (i == 0))
+                return false;
+            nextTime += duration;
+            if (nextTime != (uint64_t)config.frameTime(samples + i + 1))
+                return false;
+
+            // Length-prefixed NAL units filling the sample exactly, IDR slices
+            // only in sync samples, and those start with their SPS and PPS
+            const uint8_t* nal = sample;
+            sample += size;
+            if (sample > mdat + mdatSize)
+                return false;
+            while (nal < sample)
+            {
+                uint32_t length = readU32(nal);
+                if (length == 0 || length > (size_t)(sample - nal - 4))
+                    return false;
+                uint8_t type = nal[4] & 0x1F;
+                bool parameterSet = type == 7 || type == 8;
+                if ((parameterSet && !sync) || (!parameterSet && (type == 5) != sync))
+                    return false;
+                if (sync && nal == sample - size && type != 7)
+                    return false;
+                nal += 4 + length;
+            }
+        }
+        if (sample != mdat + mdatSize)
+            return false;
+
+        samples += count;
+        p = mdat + mdatSize;
+    }
+    return samples == expectedSamples;
+}
+
+static bool benchMp4()
+{
+    const char* rawPath = "bench_mp4.h264";
+    const char* path = "bench_mp4.mp4";
+    bool ok = true;
+
+    // NTSC rate, where summed 100ns durations would drift
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.streamChangeInterval = 250;
+    options.config.frameRate = { 30000, 1001 };
+
+    uint64_t frames;
+    {
+        SoftwareEncoderBackend backend(options);
+
+        Mp4MuxerOptions muxerOptions;
+        muxerOptions.width = options.config.width;
+        muxerOptions.height = options.config.height;
+        Mp4Muxer muxer(path, muxerOptions);
+
+        Encoder encoder(backend, rawPath);
+        encoder.addConsumer(&muxer);
+
+        Clock::time_point start = Clock::now();
+        encoder.start();
+        while (encoder.outputFrames() < 3000)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(encoder.stop());
+        muxer.finish();
+        double seconds = secondsSince(start);
+
+        frames = encoder.outputFrames();
+        Mp4MuxerStats stats = muxer.muxerStats();
+        printf("mp4: %llu samples in %llu fragments, %8.0f fps, largest fragment %.0f KB, %llu parameter set changes\n",
+            (unsigned long long)stats.samples, (unsigned long long)stats.fragments, frames / seconds,
+            stats.fragmentHighWaterBytes / 1024.0, (unsigned long long)stats.parameterSetChanges);
+
+        if (stats.samples != frames || stats.droppedBeforeKeyframe != 0 || stats.parameterSetChanges != 0)
+            ok = false;
+    }
+
+    if (!checkFragmentedMp4(path, frames, options.config))
+    {
+        printf("mp4: %s is not the fragmented MP4 expected\n", path);
+        ok = false;
+    }
+
+    // SPS/PPS that change mid-stream, and back, stay in the samples of the
+    // keyframes that bring them
+    {
+        PacketPool pool;
+        auto accessUnit = [&pool](std::initializer_list<std::vector<uint8_t>> nals)
+        {
+            PacketPool::Buffer* buffer;
+            EncodedPacket packet = pool.acquire(buffer);
+            for (const std::vector<uint8_t>& nal : nals)
+            {
+                buffer->storage.insert(buffer->storage.end(), { 0, 0, 0, 1 });
+                buffer->storage.insert(buffer->storage.end(), nal.begin(), nal.end());
+            }
+            buffer->commit();
+            return packet;
+        };
+        const std::vector<uint8_t> sps = { 0x67, 0x64, 0x00, 0x1F, 0xAC }, pps = { 0x68, 0xEE, 0x3C };
+        const std::vector<uint8_t> changedSps = { 0x67, 0x64, 0x00, 0x28, 0xAC }, idr = { 0x65, 0x88 }, slice = { 0x41, 0x9A };
+
+        Mp4FragmentBuilder builder(1280, 720, 90000);
+        bool parsed = builder.readParameterSets(accessUnit({ sps, pps, idr }));
+        std::vector<uint8_t> samples;
+        uint32_t first = builder.appendSample(samples, accessUnit({ sps, pps, idr }));
+        uint32_t second = builder.appendSample(samples, accessUnit({ slice }));
+        uint32_t changed = builder.appendSample(samples, accessUnit({ changedSps, pps, idr }));
+        uint32_t back = builder.appendSample(samples, accessUnit({ sps, pps, idr }));
+        bool inBand = parsed && builder.codecString() == "avc3.64001f" && first == 12 + sps.size() + pps.size() + idr.size() &&
+            second == 4 + slice.size() && changed == first && back == first && builder.parameterSetChanges() == 1 &&
+            std::equal(sps.begin(), sps.end(), samples.begin() + 4) &&
+            std::equal(pps.begin(), pps.end(), samples.begin() + 8 + sps.size()) &&
+            std::equal(changedSps.begin(), changedSps.end(), samples.begin() + first + second + 4) &&
+            std::equal(sps.begin(), sps.end(), samples.begin() + first + second + changed + 4);
+        printf("mp4: parameter sets changing mid-stream %s\n", inBand ? "stay in-band" : "WRONG");
+        ok = inBand && ok;
+    }
+
+    std::remove(rawPath);
+    std::remove(path);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Durable recording
+//
+// A journaled recording that was closed normally commits everything, and
+// recovering it changes nothing. Crashes are simulated two ways. The first
+// cuts a finished recording back to mid-GOP and its journal back to a commit
+// plus a torn record. The second copies both while the encoder is still
+// writing, the way a kill would leave them. Recovery must keep whole GOPs
+// only, exactly what the journal committed, and must write a seek index and
+// an MP4 that match. With a GOP longer than syncBytes, syncs happen inside
+// it and commits do not. The cost is reported as syncs per GOP, the slowest
+// sync, and bytes written per byte of payload (from /proc/self/io on Linux).
+// ----------------------------------------------------------------------------
+
+struct DurableRun
+{
+    SoftwareEncode encode;
+    RecordingJournalStats journal;
+    ProcessIo io;                        // written during the run
+    bool measuredIo = false;
+};
+
+// Copies the journal, then the recording, as they are at the nth access unit.
+// In that order, because the journal never gets ahead of the recording.
+class CrashSnapshot : public IPacketConsumer
+{
+public:
+    CrashSnapshot(const RecoveryOptions& from, const RecoveryOptions& to, uint64_t at) : from(from), to(to), at(at) {}
+
+    void onPacket(const EncodedPacket&) override
+    {
+        if (++packets != at)
+            return;
+        std::vector<uint8_t> journal = readBytes(from.journalPath);
+        std::vector<uint8_t> recording = readBytes(from.path);
+        std::ofstream(to.journalPath, std::ios::binary).write((const char*)journal.data(), journal.size());
+        std::ofstream(to.path, std::ios::binary).write((const char*)recording.data(), recording.size());
+        taken = true;
+    }
+
+    bool taken = false;
+
+private:
+    RecoveryOptions from;
+    RecoveryOptions to;
+    uint64_t at;
+    uint64_t packets = 0;
+};
+
+static DurableRun runDurable(const RecoveryOptions& files, const EncoderConfig& config, uint64_t frames, bool durable,
+                             const BitstreamWriterOptions& writerOptions = BitstreamWriterOptions(), IPacketConsumer* consumer = nullptr)
+{
+    SoftwareEncodeOptions encode;
+    encode.path = files.path.c_str();
+    encode.backend.latency = std::chrono::microseconds(0);
+    encode.backend.config = config;
+    encode.writer = writerOptions;
+    encode.schedule.frames = frames;
+    encode.keepFile = true;
+
+    DurableRun run;
+    ProcessIo before, after;
+    bool measured = readProcessIo(before);
+    {
+        std::unique_ptr<RecordingJournal> journal;
+        if (durable)
+            journal.reset(new RecordingJournal(files.journalPath.c_str(), config.width, config.height));
+        run.encode = runSoftwareEncode(encode, [&](Encoder& encoder)
+        {
+            encoder.setJournal(journal.get());
+            if (consumer)
+                encoder.addConsumer(consumer);
+        });
+        CHECK(run.encode.drained);
+        if (journal)
+            run.journal = journal->stats();
+    }
+    run.measuredIo = measured && readProcessIo(after);
+    run.io.writeCallBytes = after.writeCallBytes - before.writeCallBytes;
+    run.io.storageBytes = after.storageBytes - before.storageBytes;
+    return run;
+}
+
+// The recording is the first keptBytes of the original, and its seek index
+// and MP4 have exactly the committed access units
+static bool checkRecovered(const char* label, const RecoveryOptions& files, const RecoveryResult& result, const std::vector<uint8_t>& original,
+                           uint32_t gop, const EncoderConfig& config)
+{
+    std::vector<uint8_t> recording = readBytes(files.path);
+    SeekIndex index;
+    bool ok = recording.size() == result.keptBytes && result.keptBytes <= original.size() &&
+        std::equal(recording.begin(), recording.end(), original.begin()) && result.keptUnits % gop == 0 && result.keptUnits != 0 &&
+        index.load(files.indexPath.c_str()) && index.all().size() == result.keptUnits && checkFragmentedMp4(files.mp4Path.c_str(), result.keptUnits, config);
+    for (size_t i = 0; ok && i < index.all().size(); i++)
+    {
+        const SeekIndexEntry& entry = index.all()[i];
+        ok = (entry.flags & SEEK_KEYFRAME) == (i % gop == 0 ? SEEK_KEYFRAME : 0u) && entry.time == config.frameTime(i) &&
+            (i + 1 == index.all().size() ? entry.offset + entry.size == result.keptBytes : entry.offset + entry.size == index.all()[i + 1].offset);
+    }
+    printf("durable: %-26s kept %4llu of %4llu KB, %3llu frames, %llu logged past the last commit: %s\n", label,
+        (unsigned long long)result.keptBytes / 1024, (unsigned long long)result.fileBytes / 1024, (unsigned long long)result.keptUnits,
+        (unsigned long long)(result.loggedUnits - result.keptUnits), ok ? "ok" : "WRONG");
+    return ok;
+}
+
+static void removeRecording(const RecoveryOptions& files)
+{
+    std::remove(files.path.c_str());
+    std::remove(files.journalPath.c_str());
+    std::remove(files.indexPath.c_str());
+    std::remove(files.mp4Path.c_str());
+}
+
+static bool benchDurable()
+{
+    bool ok = true;
+    const uint32_t gop = 30;
+    const uint64_t frames = 300;
+    EncoderConfig config;
+    config.gopLength = gop;
+
+    // A normal run, then the same recording cut as a crash would leave it
+    RecoveryOptions files = recoveryOptionsFor("bench_durable.h264");
+    RecoveryOptions crash = recoveryOptionsFor("bench_crash.h264");
+    RecoveryOptions cut = recoveryOptionsFor("bench_cut.h264");
+    CrashSnapshot snapshot(files, crash, frames * 2 / 3);
+    DurableRun run = runDurable(files, config, frames, true, BitstreamWriterOptions(), &snapshot);
+    std::vector<uint8_t> original = readBytes(files.path);
+    std::vector<uint8_t> journal = readBytes(files.journalPath);
+
+    RecordingJournalContents contents;
+    CHECK(loadRecordingJournal(files.journalPath.c_str(), contents));
+    bool committedAll = contents.commits.size() >= 2 && contents.commits.back().final && contents.commits.back().units == frames &&
+        contents.commits.back().end == original.size() && contents.units.size() == frames && contents.tornBytes == 0;
+    for (size_t i = 0; committedAll && i + 1 < contents.commits.size(); i++)
+        committedAll = contents.commits[i].units % gop == 0;
+    printf("durable: %llu frames, %llu GOP commits and the final one, %llu syncs: %s\n", (unsigned long long)run.encode.outputFrames,
+        (unsigned long long)contents.commits.size() - 1, (unsigned long long)run.encode.writer.syncCalls, committedAll ? "ok" : "WRONG");
+    ok = committedAll && ok;
+
+    RecoveryResult result;
+    std::string error;
+    bool recovered = recoverRecording(files, result, error) && result.clean && result.keptUnits == frames && readBytes(files.path) == original;
+    printf("durable: %-26s %s\n", "recovering a clean close", recovered ? "changes nothing" : error.c_str());
+    ok = recovered && ok;
+
+    // Half a GOP past a commit in the middle, with the records after it and a torn one in the journal
+    const JournalCommit& middle = contents.commits[contents.commits.size() / 2];
+    const JournalCommit& next = contents.commits[contents.commits.size() / 2 + 1];
+    size_t journalCut = RECORDING_JOURNAL_HEADER_SIZE;
+    for (size_t commits = 0; commits <= contents.commits.size() / 2; journalCut += RECORDING_JOURNAL_RECORD_SIZE)
+        commits += journal[journalCut] == JOURNAL_COMMIT ? 1 : 0;
+    journalCut = std::min(journal.size(), journalCut + 3 * RECORDING_JOURNAL_RECORD_SIZE + 17);
+    uint64_t recordingCut = (middle.end + next.end) / 2;
+    std::ofstream(cut.journalPath, std::ios::binary).write((const char*)journal.data(), journalCut);
+    std::ofstream(cut.path, std::ios::binary).write((const char*)original.data(), recordingCut);
+    bool cutOk = recoverRecording(cut, result, error);
+    if (!cutOk)
+        printf("durable: cut recording: %s\n", error.c_str());
+    cutOk = cutOk && result.keptUnits == middle.units && result.keptBytes == middle.end && !result.clean;
+    ok = checkRecovered("cut in the middle of a GOP", cut, result, original, gop, config) && cutOk && ok;
+
+    // As the process left them at two thirds of the run
+    bool crashOk = snapshot.taken && recoverRecording(crash, result, error);
+    if (!crashOk)
+        printf("durable: snapshot: %s\n", snapshot.taken ? error.c_str() : "not taken");
+    ok = crashOk && checkRecovered("copied while writing", crash, result, original, gop, config) && ok;
+
+    // A journal that checks out until its second unit goes back in time: nothing is touched
+    RecoveryOptions refused = recoveryOptionsFor("bench_refused.h264");
+    std::vector<uint8_t> backwards = journal;
+    size_t record = RECORDING_JOURNAL_HEADER_SIZE;
+    for (int units = 0; record + RECORDING_JOURNAL_RECORD_SIZE <= backwards.size(); record += RECORDING_JOURNAL_RECORD_SIZE)
+    {
+        if (backwards[record] == JOURNAL_UNIT && ++units == 2)
+            break;
+    }
+    std::fill(backwards.begin() + record + 16, backwards.begin() + record + 24, 0);
+    uint32_t checksum = journalChecksum(backwards.data() + record, RECORDING_JOURNAL_RECORD_SIZE - 4);
+    for (int i = 0; i < 4; i++)
+        backwards[record + 36 + i] = (uint8_t)(checksum >> (8 * i));
+    const std::string stale = "stale";
+    std::ofstream(refused.journalPath, std::ios::binary).write((const char*)backwards.data(), backwards.size());
+    std::ofstream(refused.path, std::ios::binary).write((const char*)original.data(), recordingCut);
+    std::ofstream(refused.indexPath, std::ios::binary) << stale;
+    std::ofstream(refused.mp4Path, std::ios::binary) << stale;
+    bool refusedOk = !recoverRecording(refused, result, error);
+    std::vector<uint8_t> refusedRecording = readBytes(refused.path);
+    refusedOk = refusedOk && refusedRecording.size() == recordingCut && std::equal(refusedRecording.begin(), refusedRecording.end(), original.begin()) &&
+        readBytes(refused.indexPath) == std::vector<uint8_t>(stale.begin(), stale.end()) &&
+        readBytes(refused.mp4Path) == std::vector<uint8_t>(stale.begin(), stale.end()) &&
+        !std::ifstream(refused.indexPath + ".tmp") && !std::ifstream(refused.mp4Path + ".tmp");
+    printf("durable: %-26s %s\n", "a journal out of order", refusedOk ? ("refused, files left alone: " + error).c_str() : "WRONG");
+    ok = refusedOk && ok;
+    removeRecording(refused);
+
+    // No GOP boundary in sight: syncs keep the unsynced bytes bounded, commits wait for GOPs
+    RecoveryOptions longGop = recoveryOptionsFor("bench_long_gop.h264");
+    // Writes of at most syncBytes, so no sync has more than twice that to do
+    BitstreamWriterOptions bounded;
+    bounded.syncBytes = 64 << 10;
+    bounded.maxWriteBytes = bounded.syncBytes;
+    config.gopLength = 150;
+    DurableRun longRun = runDurable(longGop, config, frames, true, bounded);
+    bool boundedOk = longRun.journal.commits <= 2 && longRun.encode.writer.syncCalls >= longRun.encode.outputBytes / (2 * bounded.syncBytes) &&
+        longRun.encode.writer.syncCalls <= longRun.encode.outputBytes / bounded.syncBytes + longRun.journal.commits;
+    printf("durable: 150 frame GOPs, syncs every 64 KB: %llu syncs, %llu commits: %s\n", (unsigned long long)longRun.encode.writer.syncCalls,
+        (unsigned long long)longRun.journal.commits, boundedOk ? "ok" : "WRONG");
+    ok = boundedOk && ok;
+    config.gopLength = gop;
+
+    // What durability costs
+    RecoveryOptions plainFiles = recoveryOptionsFor("bench_plain.h264");
+    DurableRun plain = runDurable(plainFiles, config, frames, false);
+    DurableRun timed = runDurable(files, config, frames, true);
+    uint64_t gops = (frames + gop - 1) / gop;
+    printf("durable: %llu syncs for %llu GOPs, sync avg %.0f us max %.0f us, commit avg %.0f us max %.0f us\n",
+        (unsigned long long)timed.encode.writer.syncCalls, (unsigned long long)gops, timed.encode.writer.syncAvgUs, timed.encode.writer.syncMaxUs,
+        timed.journal.commitAvgUs, timed.journal.commitMaxUs);
+    printf("durable: %.0f fps journaled, %.0f fps plain, journal %.2f%% of the payload\n", timed.encode.outputFrames / timed.encode.seconds,
+        plain.encode.outputFrames / plain.encode.seconds, 100.0 * timed.journal.bytes / timed.encode.outputBytes);
+    if (timed.measuredIo && plain.measuredIo)
+    {
+        printf("durable: written per payload byte: %.3f journaled, %.3f plain; to storage %.3f journaled, %.3f plain\n",
+            (double)timed.io.writeCallBytes / timed.encode.outputBytes, (double)plain.io.writeCallBytes / plain.encode.outputBytes,
+            (double)timed.io.storageBytes / timed.encode.outputBytes, (double)plain.io.storageBytes / plain.encode.outputBytes);
+    }
+    if (timed.encode.writer.syncCalls > gops + 1 || plain.encode.writer.syncCalls != 0)
+    {
+        printf("durable: more than one sync per GOP\n");
+        ok = false;
+    }
+
+    for (const RecoveryOptions* recording : { &files, &crash, &cut, &longGop, &plainFiles })
+        removeRecording(*recording);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Live segments
+//
+// Ten seconds at 30 fps, cut into 1 s segments straight from the encoder:
+// fMP4 on disk with a window of four, MPEG-TS in memory with a window of
+// three. Every segment starts on an IDR at its place on the timeline, the
+// ones that left the window are gone, and a reader polling the playlist
+// while it is rewritten never sees half of one. With a GOP longer than the
+// segments, cuts wait for the next IDR.
+// ----------------------------------------------------------------------------
+
+struct LiveRun
+{
+    LiveSegmenterStats stats;
+    std::deque<LiveSegment> window;
+    std::string hls;
+    std::string dash;
+    uint64_t reads = 0;
+    uint64_t tornReads = 0;
+    bool drained = false;
+};
+
+// A whole playlist ends with a segment or the end tag
+static bool wholePlaylist(const std::string& text)
+{
+    if (text.compare(0, 7, "#EXTM3U") != 0 || text.empty() || text.back() != '\n')
+        return false;
+    size_t last = text.rfind('\n', text.size() - 2);
+    std::string line = text.substr(last + 1, text.size() - last - 2);
+    return line == "#EXT-X-ENDLIST" || line.find(".m4s") != std::string::npos || line.find(".ts") != std::string::npos ||
+        line.compare(0, 7, "#EXT-X-") == 0;
+}
+
+static LiveRun runLive(SegmentFormat format, SegmentStorage storage, const char* name, uint32_t windowSegments, uint32_t gopLength, LiveSegmenter*& live)
+{
+    SoftwareBackendOptions backendOptions;
+    backendOptions.latency = std::chrono::microseconds(0);
+    backendOptions.config.gopLength = gopLength;
+
+    LiveSegmenterOptions options;
+    options.format = format;
+    options.storage = storage;
+    options.name = name;
+    options.segmentDuration = std::chrono::milliseconds(1000);
+    options.windowSegments = windowSegments;
+    options.keepSegments = 1;
+    options.width = backendOptions.config.width;
+    options.height = backendOptions.config.height;
+
+    LiveRun run;
+    live = new LiveSegmenter(options);
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_live.h264";
+    encode.backend = backendOptions;
+    encode.schedule.frames = 300;
+
+    // Polls the playlist on disk while it is being replaced
+    std::atomic<bool> done{false};
+    std::thread reader([&]()
+    {
+        std::string path = std::string(name) + ".m3u8";
+        while (!done)
+        {
+            std::vector<uint8_t> bytes = readBytes(path);
+            if (!bytes.empty())
+            {
+                run.reads++;
+                run.tornReads += wholePlaylist(std::string(bytes.begin(), bytes.end())) ? 0 : 1;
+            }
+        }
+    });
+
+    run.drained = runSoftwareEncode(encode, [&](Encoder& encoder) { encoder.addConsumer(live); }).drained;
+    live->finish();
+    done = true;
+    reader.join();
+
+    run.stats = live->stats();
+    run.window = live->window();
+    run.hls = live->hlsPlaylist();
+    run.dash = live->dashManifest();
+    printf("live: %-4s %-6s %3llu samples in %llu segments of %.2f-%.2f s, %llu removed, %llu playlist updates, %llu reads, %llu torn\n",
+        segmentFormatName(format), storage == SegmentStorage::Disk ? "disk" : "memory", (unsigned long long)run.stats.samples,
+        (unsigned long long)run.stats.segments, run.stats.shortestSegment / 1e7, run.stats.longestSegment / 1e7,
+        (unsigned long long)run.stats.removed, (unsigned long long)run.stats.playlistUpdates, (unsigned long long)run.reads,
+        (unsigned long long)run.tornReads);
+    return run;
+}
+
+static bool contains(const std::string& text, const std::string& part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+// styp, then a moof numbered like the segment at its time, then its mdat
+static bool checkFmp4Segment(const std::vector<uint8_t>& file, const LiveSegment& segment)
+{
+    const uint8_t* p = file.data();
+    const uint8_t* end = p + file.size();
+    if (file.size() < 16 || memcmp(p + 4, "styp", 4) != 0)
+        return false;
+    p += readU32(p);
+    if (end - p < 8 || memcmp(p + 4, "moof", 4) != 0)
+        return false;
+    const uint8_t* moofEnd = p + readU32(p);
+    const uint8_t* mfhd = findBox(p, moofEnd, "mfhd");
+    const uint8_t* tfdt = findBox(p, moofEnd, "tfdt");
+    const uint8_t* trun = findBox(p, moofEnd, "trun");
+    if (!mfhd || !tfdt || !trun || readU32(mfhd + 12) != segment.number || (int64_t)readU64(tfdt + 12) != segment.time)
+        return false;
+
+    uint32_t count = readU32(trun + 12);
+    uint64_t bytes = 0;
+    int64_t duration = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        duration += readU32(trun + 20 + 12 * i);
+        bytes += readU32(trun + 24 + 12 * i);
+    }
+    bool keyframeFirst = count != 0 && readU32(trun + 28) == 0x02000000;
+    return keyframeFirst && duration == segment.duration && end - moofEnd == (ptrdiff_t)(bytes + 8) && memcmp(moofEnd + 4, "mdat", 4) == 0;
+}
+
+// Whole packets, valid tables, unbroken continuity counters, one PES per
+// frame stamped with its time, and an IDR at the start
+static bool checkTsSegment(const std::vector<uint8_t>& file, const LiveSegment& segment, uint64_t expectedFrames)
+{
+    if (file.empty() || file.size() % MpegTsWriter::PACKET_SIZE != 0)
+        return false;
+
+    std::map<uint32_t, uint32_t> counters;
+    uint64_t pes = 0;
+    bool ok = true;
+    for (size_t offset = 0; offset < file.size(); offset += MpegTsWriter::PACKET_SIZE)
+    {
+        const uint8_t* p = &file[offset];
+        uint32_t pid = ((p[1] & 0x1F) << 8) | p[2];
+        bool start = (p[1] & 0x40) != 0;
+        ok = ok && p[0] == 0x47;
+        if (counters.count(pid) && counters[pid] != (p[3] & 0x0Fu))
+            ok = false;
+        counters[pid] = (p[3] + 1) & 0x0F;
+
+        if (pid == 0 || pid == MpegTsWriter::PMT_PID)
+        {
+            // The CRC over a section and its CRC comes out 0
+            uint32_t length = ((p[6] & 0x0F) << 8) | p[7];
+            ok = ok && offset == (pid == 0 ? 0 : MpegTsWriter::PACKET_SIZE) && MpegTsWriter::crc32(p + 5, length + 3) == 0;
+            continue;
+        }
+
+        if (pid != MpegTsWriter::VIDEO_PID || !start)
+            continue;
+        size_t payload = (p[3] & 0x20) ? 5 + p[4] : 4;
+        const uint8_t* header = p + payload;
+        uint64_t pts = ((uint64_t)(header[9] & 0x0E) << 29) | ((uint64_t)header[10] << 22) | ((uint64_t)(header[11] & 0xFE) << 14) |
+            ((uint64_t)header[12] << 7) | (header[13] >> 1);
+        uint64_t expected = (uint64_t)(segment.time + rationalFrameTime(EncoderConfig().frameRate, pes)) * 9 / 1000 + 90000;
+        if (header[0] != 0 || header[1] != 0 || header[2] != 1 || pts != expected)
+            ok = false;
+        if (pes == 0 && !(p[3] & 0x20 && (p[5] & 0x50) == 0x50))
+            ok = false;
+        pes++;
+    }
+    return ok && pes == expectedFrames;
+}
+
+static bool benchLive()
+{
+    bool ok = true;
+    const uint32_t gop = segmentGopLength(EncoderConfig().frameRate, std::chrono::milliseconds(1000));
+
+    // fMP4 on disk
+    {
+        LiveSegmenter* live;
+        LiveRun run = runLive(SegmentFormat::Fmp4, SegmentStorage::Disk, "bench_live", 4, gop, live);
+        bool filesOk = run.window.size() == 4 && run.window.front().number == 7;
+        for (uint64_t number = 1; number <= 10; number++)
+        {
+            std::vector<uint8_t> file = readBytes(live->segmentName(number));
+            if (number < 6)
+                filesOk = filesOk && file.empty();
+            for (const LiveSegment& segment : run.window)
+            {
+                if (segment.number == number)
+                    filesOk = filesOk && segment.time == (int64_t)(number - 1) * 10000000 && checkFmp4Segment(file, segment);
+            }
+            std::remove(live->segmentName(number).c_str());
+        }
+        std::vector<uint8_t> init = readBytes(live->initName());
+        std::vector<uint8_t> playlist = readBytes(live->hlsName());
+        filesOk = filesOk && init.size() > 16 && findBox(init.data(), init.data() + init.size(), "avcC") != nullptr &&
+            std::string(playlist.begin(), playlist.end()) == run.hls && readBytes(live->hlsName() + ".tmp").empty();
+        std::remove(live->initName().c_str());
+        std::remove(live->hlsName().c_str());
+        std::remove(live->dashName().c_str());
+        delete live;
+
+        bool playlistsOk = contains(run.hls, "#EXT-X-VERSION:7\n") && contains(run.hls, "#EXT-X-TARGETDURATION:1\n") &&
+            contains(run.hls, "#EXT-X-MEDIA-SEQUENCE:7\n") && contains(run.hls, "#EXT-X-MAP:URI=\"bench_live_init.mp4\"\n") &&
+            contains(run.hls, "#EXTINF:1.000,\nbench_live_00010.m4s\n#EXT-X-ENDLIST\n") &&
+            contains(run.dash, "type=\"static\"") && contains(run.dash, "startNumber=\"7\"") &&
+            contains(run.dash, "<S t=\"60000000\" d=\"10000000\" r=\"3\"/>") && contains(run.dash, "codecs=\"avc3.");
+        if (!run.drained || run.stats.segments != 10 || run.stats.removed != 5 || run.stats.samples != 300 || run.stats.writeFailures != 0 ||
+            run.stats.shortestSegment != 10000000 || run.stats.longestSegment != 10000000 || !filesOk || !playlistsOk ||
+            run.reads == 0 || run.tornReads != 0)
+        {
+            printf("live: fMP4 segments, files or playlists are not what was expected\n");
+            ok = false;
+        }
+    }
+
+    // MPEG-TS in memory, nothing on disk
+    {
+        LiveSegmenter* live;
+        LiveRun run = runLive(SegmentFormat::MpegTs, SegmentStorage::Memory, "bench_live_ts", 3, gop, live);
+        bool filesOk = run.window.size() == 3 && run.window.front().number == 8 && readBytes(live->hlsName()).empty();
+        PacketGather gather;
+        filesOk = filesOk && live->file(live->segmentName(7), gather) && !live->file(live->segmentName(6), gather);
+        for (const LiveSegment& segment : run.window)
+        {
+            std::vector<uint8_t> file;
+            if (!live->file(segment.uri, gather))
+                filesOk = false;
+            for (const ByteSpan& span : gather.spans())
+                file.insert(file.end(), span.data, span.data + span.size);
+            filesOk = filesOk && file.size() == segment.bytes && checkTsSegment(file, segment, 30);
+        }
+        delete live;
+
+        bool playlistsOk = contains(run.hls, "#EXT-X-VERSION:3\n") && contains(run.hls, "#EXT-X-MEDIA-SEQUENCE:8\n") &&
+            !contains(run.hls, "#EXT-X-MAP") && contains(run.hls, "bench_live_ts_00010.ts\n#EXT-X-ENDLIST\n") && run.dash.empty();
+        if (!run.drained || run.stats.segments != 10 || run.stats.removed != 6 || !filesOk || !playlistsOk)
+        {
+            printf("live: TS segments or playlists are not what was expected\n");
+            ok = false;
+        }
+    }
+
+    // A GOP of 1.5 s: every IDR cuts, every segment starts on one
+    {
+        LiveSegmenter* live;
+        LiveRun run = runLive(SegmentFormat::Fmp4, SegmentStorage::Memory, "bench_live_gop", 10, gop * 3 / 2, live);
+        bool aligned = run.window.size() == 7;
+        for (const LiveSegment& segment : run.window)
+            aligned = aligned && segment.time % 15000000 == 0;
+        delete live;
+        if (!aligned || run.stats.longestSegment != 15000000 || run.stats.shortestSegment != 10000000)
+        {
+            printf("live: segments with a 1.5 s GOP did not start on its IDRs\n");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// NAL parser and seek index
+// ----------------------------------------------------------------------------
+
+static const ScanKernel scanKernels[] = { ScanKernel::Scalar, ScanKernel::Sse2, ScanKernel::Avx2, ScanKernel::Neon };
+
+struct SyntheticStream
+{
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> startCodes; // positions of 00 00 01
+};
+
+// NAL units of random size behind 3 or 4 byte start codes. zeroPercent sets
+// how much of the payload is zero, which is what makes scanning expensive;
+// runs of zeros get an emulation prevention byte like a real encoder adds.
+static SyntheticStream syntheticStream(size_t size, uint32_t zeroPercent, uint32_t seed)
+{
+    SyntheticStream stream;
+    stream.bytes.reserve(size + 70000);
+    std::mt19937 rng(seed);
+    while (stream.bytes.size() < size)
+    {
+        if (rng() % 4 != 0)
+            stream.bytes.push_back(0);
+        stream.startCodes.push_back(stream.bytes.size());
+        stream.bytes.push_back(0);
+        stream.bytes.push_back(0);
+        stream.bytes.push_back(1);
+        stream.bytes.push_back((uint8_t)(0x60 | (1 + rng() % 8)));
+
+        size_t length = 64 + rng() % 65536;
+        int zeros = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t b = rng() % 100 < zeroPercent ? 0 : (uint8_t)(1 + rng() % 255);
+            if (zeros == 2 && b <= 3)
+            {
+                stream.bytes.push_back(3);
+                zeros = 0;
+            }
+            stream.bytes.push_back(b);
+            zeros = b == 0 ? zeros + 1 : 0;
+        }
+
+        // rbsp_stop_one_bit, a NAL never ends in zero
+        stream.bytes.push_back(0x80);
+    }
+    return stream;
+}
+
+static std::vector<size_t> scanAll(const NalParser& parser, const uint8_t* data, size_t size)
+{
+    std::vector<size_t> found;
+    for (size_t at = parser.findStartCode(data, size, 0); at < size; at = parser.findStartCode(data, size, at + 3))
+        found.push_back(at);
+    return found;
+}
+
+static bool verifyScanKernels(const SyntheticStream& stream)
+{
+    bool ok = true;
+
+    // Start codes at every position of short buffers, for the scalar tails
+    std::vector<uint8_t> small(96, 0xAA);
+    for (size_t length = 0; length <= small.size(); length++)
+    for (size_t at = 0; at + 3 <= length; at++)
+    {
+        std::vector<uint8_t> buffer(small.begin(), small.begin() + length);
+        buffer[at] = 0;
+        buffer[at + 1] = 0;
+        buffer[at + 2] = 1;
+        std::vector<size_t> expected = { at };
+
+        for (ScanKernel kernel : scanKernels)
+        {
+            if (!scanKernelSupported(kernel))
+                continue;
+            if (scanAll(NalParser(kernel), buffer.data(), buffer.size()) != expected)
+            {
+                printf("nal: %s misses the start code at %zu of %zu\n", scanKernelName(kernel), at, length);
+                ok = false;
+            }
+        }
+    }
+
+    for (ScanKernel kernel : scanKernels)
+    {
+        if (!scanKernelSupported(kernel))
+            continue;
+        if (scanAll(NalParser(kernel), stream.bytes.data(), stream.bytes.size()) != stream.startCodes)
+        {
+            printf("nal: %s does not find the start codes of the synthetic stream\n", scanKernelName(kernel));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// The index written during a pipeline run has to describe the .h264 file exactly
+static bool verifySeekIndex()
+{
+    const char* rawPath = "bench_index.h264";
+    const char* indexPath = "bench_index.h264.idx";
+
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    uint64_t frames;
+    SeekIndexStats stats;
+    {
+        SoftwareEncoderBackend backend(options);
+        SeekIndexWriter index(indexPath, 100);
+        {
+            Encoder encoder(backend, rawPath);
+            encoder.addConsumer(&index);
+            encoder.start();
+            while (encoder.outputFrames() < 1000)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            CHECK(encoder.stop());
+            frames = encoder.outputFrames();
+        }
+        index.finish();
+        stats = index.indexStats();
+    }
+
+    std::ifstream fin(rawPath, std::ios::binary);
+    std::vector<uint8_t> raw((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    fin.close();
+
+    SeekIndex index;
+    bool ok = index.load(indexPath) && index.all().size() == frames;
+    uint64_t offset = 0;
+    for (size_t i = 0; ok && i < index.all().size(); i++)
+    {
+        const SeekIndexEntry& entry = index.all()[i];
+        bool keyframe = i % options.config.gopLength == 0;
+        ok = entry.offset == offset && entry.frame == i && entry.offset + 4 <= raw.size() &&
+            memcmp(&raw[entry.offset], "\0\0\0\1", 4) == 0 &&
+            ((entry.flags & SEEK_KEYFRAME) != 0) == keyframe && ((entry.flags & SEEK_IDR) != 0) == keyframe &&
+            ((entry.flags & SEEK_SPS) != 0) == keyframe;
+        offset += entry.size;
+
+        const SeekIndexEntry* start = index.keyframeBefore((uint32_t)i);
+        ok = ok && start && start->frame == i - i % options.config.gopLength;
+        start = index.keyframeBeforeTime(entry.time);
+        ok = ok && start && start->frame == i - i % options.config.gopLength;
+    }
+    ok = ok && offset == raw.size();
+
+    printf("nal: seek index %llu entries, %llu keyframes, %llu NAL units, matches the .h264 file: %s\n",
+        (unsigned long long)stats.entries, (unsigned long long)stats.keyframes, (unsigned long long)stats.nalUnits, ok ? "yes" : "NO");
+
+    std::remove(rawPath);
+    std::remove(indexPath);
+    return ok;
+}
+
+static bool benchNal()
+{
+    SyntheticStream typical = syntheticStream(64 << 20, 1, 1);
+    bool ok = verifyScanKernels(typical);
+    printf("nal: kernels find every start code: %s\n", ok ? "yes" : "NO");
+
+    SyntheticStream zeroHeavy = syntheticStream(64 << 20, 25, 2);
+    for (const SyntheticStream* stream : { &typical, &zeroHeavy })
+    {
+        for (ScanKernel kernel : scanKernels)
+        {
+            if (!scanKernelSupported(kernel))
+                continue;
+
+            NalParser parser(kernel);
+            size_t nals = 0;
+            int passes = 0;
+            Clock::time_point start = Clock::now();
+            while (secondsSince(start) < 0.5)
+            {
+                parser.forEachNalUnit(stream->bytes.data(), stream->bytes.size(), [&nals](size_t, size_t) { nals++; });
+                passes++;
+            }
+            double seconds = secondsSince(start);
+
+            printf("nal: %-7s %-11s %7.2f GB/s, %zu NAL units\n", scanKernelName(kernel),
+                stream == &typical ? "1% zeros" : "25% zeros", passes * stream->bytes.size() / seconds / 1e9, nals / passes);
+        }
+    }
+
+    return verifySeekIndex() && ok;
+}
+
+// ----------------------------------------------------------------------------
+// Encoder manager
+//
+// Many software sessions on a few shared worker threads, with more sessions
+// asked for than the fake adapters allow.
+// ----------------------------------------------------------------------------
+
+static bool benchManager()
+{
+    const std::vector<uint32_t> limits = { 32, 32, 32, 32 };
+    const uint32_t requested = 130;
+
+    SoftwareBackendOptions backendOptions;
+    backendOptions.latency = std::chrono::microseconds(2000);
+    SoftwareBackendFactory factory(backendOptions, limits);
+
+    EncoderManagerOptions options;
+    options.workerThreads = std::thread::hardware_concurrency();
+    EncoderManager manager(factory, options);
+
+    SessionOptions sessionOptions;
+    sessionOptions.config.width = 640;
+    sessionOptions.config.height = 360;
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::shared_ptr<EncoderSession>> sessions;
+    std::vector<std::string> paths;
+    for (uint32_t i = 0; i < requested; i++)
+    {
+        sessionOptions.path = "bench_session_" + std::to_string(i) + ".h264";
+        std::shared_ptr<EncoderSession> session = manager.open(sessionOptions);
+        if (session)
+        {
+            sessions.push_back(session);
+            paths.push_back(sessionOptions.path);
+        }
+    }
+
+    // Run for a while and until every session had its turn, which takes
+    // longer on slow machines and sanitizer builds
+    bool started = false;
+    while ((!started || secondsSince(start) < 3) && secondsSince(start) < 120)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        started = true;
+        for (const std::shared_ptr<EncoderSession>& session : sessions)
+            started = started && session->encoder().outputFrames() != 0;
+    }
+
+    EncoderManagerStats running = manager.stats();
+    manager.closeAll();
+    double seconds = secondsSince(start);
+    EncoderManagerStats stats = manager.stats();
+
+    uint64_t frames = 0, minFrames = UINT64_MAX;
+    bool consistent = true;
+    for (const std::shared_ptr<EncoderSession>& session : sessions)
+    {
+        Encoder& encoder = session->encoder();
+        frames += encoder.outputFrames();
+        minFrames = std::min(minFrames, encoder.outputFrames());
+        consistent = consistent && encoder.drainComplete() && encoder.inputFrames() == encoder.outputFrames();
+    }
+    sessions.clear();
+    for (const std::string& path : paths)
+        std::remove(path.c_str());
+
+    uint32_t capacity = 0;
+    for (uint32_t limit : limits)
+        capacity += limit;
+
+    printf("manager: %llu sessions on %u worker threads, %llu rejected, %.0f frames/s total, slowest session %llu frames\n",
+        (unsigned long long)stats.opened, running.workers.threads, (unsigned long long)stats.rejected, frames / seconds,
+        (unsigned long long)minFrames);
+    printf("manager: per adapter");
+    for (uint32_t count : running.sessionsPerAdapter)
+        printf(" %u", count);
+    printf(", %llu worker tasks, %llu timers\n", (unsigned long long)stats.workers.tasks, (unsigned long long)stats.workers.timers);
+
+    // None starved by the others: the slowest gets at least a quarter of the average
+    bool fair = minFrames != 0 && minFrames * 4 * stats.opened >= frames;
+
+    bool ok = fair && consistent && stats.opened == capacity && stats.rejected == requested - capacity &&
+        stats.closed == capacity && stats.drainTimeouts == 0 && manager.sessionCount() == 0;
+    if (!ok)
+        printf("manager: sessions did not all run and drain as expected\n");
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Encoder capabilities
+//
+// Probing through the fake probe, the on-disk cache and placement of sessions
+// with different requirements on the probed adapters.
+// ----------------------------------------------------------------------------
+
+static bool sameCaps(const std::vector<AdapterCaps>& a, const std::vector<AdapterCaps>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (!a[i].identity.sameHardware(b[i].identity) || a[i].encoders.size() != b[i].encoders.size())
+            return false;
+        for (size_t j = 0; j < a[i].encoders.size(); j++)
+        {
+            const EncoderCaps& x = a[i].encoders[j];
+            const EncoderCaps& y = b[i].encoders[j];
+            if (x.name != y.name || x.clsid != y.clsid || x.hardware != y.hardware || x.maxWidth != y.maxWidth ||
+                x.maxHeight != y.maxHeight || x.profiles != y.profiles ||
+                x.maxSessions != y.maxSessions || x.inputFormats != y.inputFormats)
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool benchCaps()
+{
+    const char* path = "bench_caps.cache";
+    std::remove(path);
+    bool ok = true;
+
+    FakeCapabilityProbe probe(FakeCapabilityProbe::workstation(), std::chrono::milliseconds(50));
+
+    // Cold start probes everything, warm start nothing
+    CapabilityRegistry cold;
+    Clock::time_point start = Clock::now();
+    cold.refresh(probe, path);
+    double coldMs = secondsSince(start) * 1000;
+    CapabilityRegistryStats coldStats = cold.refreshStats();
+
+    CapabilityRegistry warm;
+    start = Clock::now();
+    warm.refresh(probe, path);
+    double warmMs = secondsSince(start) * 1000;
+    CapabilityRegistryStats warmStats = warm.refreshStats();
+
+    printf("caps: cold start %7.2f ms, %u probes; from cache %5.2f ms, %u hits\n", coldMs, coldStats.probes, warmMs, warmStats.cacheHits);
+    if (coldStats.probes != 3 || !coldStats.cacheWritten || warmStats.probes != 0 || warmStats.cacheHits != 3 ||
+        !sameCaps(cold.adapters(), warm.adapters()) || !sameCaps(cold.adapters(), probe.hardware()))
+    {
+        printf("caps: cached capabilities differ from the probed ones\n");
+        ok = false;
+    }
+
+    // A driver update probes that adapter again, a damaged file all of them
+    probe.hardware()[0].identity.driverVersion++;
+    CapabilityRegistry updated;
+    updated.refresh(probe, path);
+    {
+        std::ofstream damaged(path, std::ios::app);
+        damaged << "encoder ???\n";
+    }
+    CapabilityRegistry damaged;
+    damaged.refresh(probe, path);
+    printf("caps: after a driver update %u probes, after damage %u probes\n", updated.refreshStats().probes, damaged.refreshStats().probes);
+    ok = ok && updated.refreshStats().probes == 1 && updated.refreshStats().cacheHits == 2 && damaged.refreshStats().probes == 3;
+    std::remove(path);
+
+    // Placement on the GeForce (8 sessions, NV12 and BGRA) and the iGPU (no
+    // session limit, NV12 only, up to 4096x2304); the Basic Render Driver
+    // has no encoder and is left out
+    SoftwareBackendOptions backendOptions;
+    SoftwareBackendFactory factory(backendOptions, warm.adapters());
+    EncoderManagerOptions options;
+    options.workerThreads = 2;
+    EncoderManager manager(factory, options);
+
+    SessionOptions plain;
+    plain.config.width = 320;
+    plain.config.height = 180;
+    SessionOptions bgra = plain;
+    bgra.config.format = FrameFormat::BGRA;
+    SessionOptions huge = plain;
+    huge.config.width = 8192;
+    huge.config.height = 4320;
+    SessionOptions square = plain;
+    square.config.width = 4096;
+    square.config.height = 4096;
+
+    // 3 + 3 spread evenly, then BGRA fills the GeForce and one is refused,
+    // then the rest has to go to the iGPU
+    std::vector<SessionOptions> requests;
+    requests.insert(requests.end(), 6, plain);
+    requests.insert(requests.end(), 6, bgra);
+    requests.insert(requests.end(), 4, plain);
+    requests.push_back(huge);
+    requests.push_back(square);
+
+    std::vector<std::string> paths;
+    uint32_t admitted = 0;
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        requests[i].path = "bench_caps_" + std::to_string(i) + ".h264";
+        paths.push_back(requests[i].path);
+        admitted += manager.open(requests[i]) ? 1 : 0;
+    }
+
+    EncoderManagerStats placed = manager.stats();
+    manager.closeAll();
+    for (const std::string& session : paths)
+        std::remove(session.c_str());
+
+    printf("caps: %u of %zu sessions placed, per adapter %u %u, %llu refused\n", admitted, requests.size(),
+        placed.sessionsPerAdapter[0], placed.sessionsPerAdapter[1], (unsigned long long)placed.rejected);
+
+    // The square one only fits the GeForce, which is full by then
+    bool placement = factory.adapterCount() == 2 && placed.sessionsPerAdapter[0] == 8 && placed.sessionsPerAdapter[1] == 7 &&
+        placed.rejected == 3 && admitted == 15;
+    if (!placement)
+        printf("caps: sessions were not placed on the least loaded matching adapter\n");
+    return ok && placement;
+}
+
+// ----------------------------------------------------------------------------
+// Encoder configuration
+//
+// The same stream described on the command line, in an INI file and in a
+// JSON file has to come out identical, bad combinations have to be refused
+// up front, and timestamps at fractional rates must not drift.
+// ----------------------------------------------------------------------------
+
+static bool sameConfig(const EncoderConfig& a, const EncoderConfig& b)
+{
+    return a.width == b.width && a.height == b.height && a.frameRate.num == b.frameRate.num && a.frameRate.den == b.frameRate.den &&
+        a.rateControl == b.rateControl && a.bitrate == b.bitrate && a.maxBitrate == b.maxBitrate && a.qp == b.qp &&
+        a.gopLength == b.gopLength && a.profile == b.profile && a.level == b.level &&
+        a.lowLatency == b.lowLatency && a.format == b.format;
+}
+
+static bool parseArguments(std::vector<std::string> args, EncoderConfig& config, std::vector<std::string>& unused, std::string& error)
+{
+    std::vector<char*> argv = { (char*)"encode" };
+    for (std::string& arg : args)
+        argv.push_back(&arg[0]);
+    return parseConfigArguments((int)argv.size(), argv.data(), config, unused, error);
+}
+
+static bool benchConfig()
+{
+    const char* iniPath = "bench_config.ini";
+    const char* jsonPath = "bench_config.json";
+    bool ok = true;
+
+    EncoderConfig expected;
+    expected.width = 1920;
+    expected.height = 1080;
+    expected.frameRate = { 30000, 1001 };
+    expected.rateControl = RateControl::Vbr;
+    expected.bitrate = 6000000;
+    expected.maxBitrate = 9000000;
+    expected.gopLength = 120;
+    expected.profile = H264Profile::Main;
+    expected.level = 41;
+    expected.format = FrameFormat::BGRA;
+
+    // Command line, with arguments that are not settings left over
+    EncoderConfig cli;
+    std::vector<std::string> unused;
+    std::string error;
+    bool parsed = parseArguments({ "--size", "1920x1080", "--fps=29.97", "--rate-control", "vbr", "--bitrate", "6M",
+        "--max-bitrate=9000k", "--gop", "120", "--profile", "main", "--level", "4.1", "--format", "bgra",
+        "--software", "--seconds", "3" }, cli, unused, error);
+    bool cliOk = parsed && validateConfig(cli, error) && sameConfig(cli, expected) &&
+        unused == std::vector<std::string>({ "--software", "--seconds", "3" });
+
+    // INI and JSON, each spelling keys its own way
+    {
+        std::ofstream ini(iniPath);
+        ini << "; encoder settings\n[video]\nwidth = 1920\nheight = 1080\nframe_rate = 30000/1001\nrate_control = vbr\n"
+            << "bitrate = 6000k\nmax_bitrate = 9M\ngop_length = 120\nprofile = main\nlevel = 41\nformat = bgra\n";
+        std::ofstream json(jsonPath);
+        json << "{\n  \"size\": \"1920x1080\", \"frameRate\": \"30000/1001\", \"rateControl\": \"vbr\",\n"
+            << "  \"bitrate\": 6000000, \"maxBitrate\": \"9M\", \"gopLength\": 120,\n"
+            << "  \"profile\": \"main\", \"level\": \"4.1\", \"lowLatency\": false, \"format\": \"bgra\"\n}\n";
+    }
+    EncoderConfig ini, json;
+    bool iniOk = loadConfigFile(iniPath, ini, error) && sameConfig(ini, expected);
+    bool jsonOk = loadConfigFile(jsonPath, json, error) && sameConfig(json, expected);
+
+    // Settings after --config override the file
+    EncoderConfig layered;
+    unused.clear();
+    bool layeredOk = parseArguments({ "--config", jsonPath, "--bitrate", "8M" }, layered, unused, error) &&
+        layered.bitrate == 8000000 && layered.gopLength == 120 && unused.empty();
+    std::remove(iniPath);
+    std::remove(jsonPath);
+
+    printf("config: %s\n", describeConfig(cli).c_str());
+    printf("config: command line %s, ini %s, json %s, overrides %s\n", cliOk ? "ok" : "FAILED", iniOk ? "ok" : "FAILED",
+        jsonOk ? "ok" : "FAILED", layeredOk ? "ok" : "FAILED");
+    ok = cliOk && iniOk && jsonOk && layeredOk;
+
+    // Each of these has to be refused by parsing or validation
+    const std::vector<std::vector<std::string>> bad = {
+        { "--width", "1281" },
+        { "--size", "9000x1080" },
+        { "--fps", "0" },
+        { "--fps", "30/0" },
+        { "--bitrate", "fast" },
+        { "--bitrate", "2k" },
+        { "--rate-control", "cbr", "--max-bitrate", "8M" },
+        { "--rate-control", "vbr", "--bitrate", "8M", "--max-bitrate", "6M" },
+        { "--rate-control", "cqp", "--qp", "60" },
+        { "--level", "4.7" },
+        { "--format", "yuy2" },
+        { "--lookahead", "3" },
+        { "--low-latency", "--lookahead", "10" },
+        { "--format", "bgra", "--lookahead", "10" },
+        { "--low-latency", "maybe" },
+        { "--config", "bench_config_missing.ini" },
+        { "--bitrate" },
+    };
+    uint32_t refused = 0;
+    for (const std::vector<std::string>& args : bad)
+    {
+        EncoderConfig config;
+        unused.clear();
+        if (!parseArguments(args, config, unused, error) || !validateConfig(config, error))
+            refused++;
+        else
+            printf("config: accepted %s\n", args[0].c_str());
+    }
+    printf("config: %u of %zu bad configurations refused\n", refused, bad.size());
+    ok = ok && refused == bad.size();
+
+    // 108000 frames, an hour of 30 fps timecode, end at exactly 3603.6 s at
+    // 30000/1001; summing rounded durations is off by then
+    EncoderConfig ntsc;
+    ntsc.frameRate = { 30000, 1001 };
+    int64_t summed = 0;
+    int64_t rounded = 10000000ll * 1001 / 30000;
+    bool contiguous = true;
+    const uint64_t timecodeHour = 108000;
+    for (uint64_t i = 0; i < timecodeHour; i++)
+    {
+        contiguous = contiguous && ntsc.frameTime(i) + ntsc.frameDuration(i) == ntsc.frameTime(i + 1);
+        summed += rounded;
+    }
+    bool exact = ntsc.frameTime(timecodeHour) == 36036000000ll && contiguous;
+    printf("config: frame %llu at 29.97 fps is at %.7f s, summing %lld ticks per frame gives %.7f s\n",
+        (unsigned long long)timecodeHour, ntsc.frameTime(timecodeHour) / 1e7, (long long)rounded, summed / 1e7);
+    if (!exact)
+        printf("config: timestamps drift\n");
+    return ok && exact;
+}
+
+// ----------------------------------------------------------------------------
+// Runtime control
+//
+// Changes requested while the stand-in encodes have to land on exactly the
+// frame the encoder reports: frame sizes follow the bitrate per second, a
+// forced keyframe starts a new GOP and times follow the new frame rate. The
+// congestion controller then runs against a simulated bottleneck link.
+// ----------------------------------------------------------------------------
+
+static void waitForOutput(Encoder& encoder, uint64_t frames)
+{
+    while (encoder.outputFrames() < frames)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+static bool benchControlSequencing()
+{
+    const char* path = "bench_control.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.sizeJitterPercent = 20;
+
+    std::vector<RecordedPacket> packets;
+    std::vector<AppliedControl> applied;
+    uint32_t refused = 0;
+    {
+        SoftwareEncoderBackend backend(options);
+        PacketRecorder recorder;
+        Encoder encoder(backend, path);
+        encoder.addConsumer(&recorder);
+        encoder.start();
+
+        std::string error;
+        EncoderControl halve;
+        halve.bitrate = options.config.bitrate / 2;
+        halve.forceKeyframe = true;
+        waitForOutput(encoder, 100);
+        encoder.control(halve, error);
+
+        // Twice the frames per second at the same bitrate halves every frame again
+        EncoderControl faster;
+        faster.frameRate = { 60, 1 };
+        waitForOutput(encoder, 250);
+        encoder.control(faster, error);
+
+        EncoderControl bounds;
+        bounds.bitrate = options.config.bitrate * 2;
+        bounds.qpBounds = true;
+        bounds.minQp = 20;
+        bounds.maxQp = 40;
+        waitForOutput(encoder, 400);
+        encoder.control(bounds, error);
+
+        // Each of these is refused up front and never reaches the encoder
+        EncoderControl bad[4];
+        bad[0].bitrate = 1000;
+        bad[1].qpBounds = true;
+        bad[1].minQp = 40;
+        bad[1].maxQp = 20;
+        bad[2].frameRate = { 5000, 1 };
+        bad[3].maxBitrate = 12000000;
+        for (const EncoderControl& change : bad)
+            refused += encoder.control(change, error) ? 0 : 1;
+
+        waitForOutput(encoder, 600);
+        CHECK(encoder.stop());
+        packets = recorder.packets;
+        applied = encoder.appliedControls();
+    }
+    std::remove(path);
+
+    bool ok = applied.size() == 3 && refused == 4;
+    for (size_t i = 0; ok && i < applied.size(); i++)
+        ok = applied[i].accepted && (i == 0 || applied[i].frame > applied[i - 1].frame);
+    if (!ok)
+    {
+        printf("control: expected 3 changes applied and 4 refused, got %zu and %u\n", applied.size(), refused);
+        return false;
+    }
+
+    // Replay what every frame should look like from the frames the changes landed on
+    const double scales[] = { 1.0, 0.5, 0.25, 1.0 };
+    Rational rate = options.config.frameRate;
+    int64_t rateTime = 0;
+    uint64_t rateFrame = 0, sinceKeyframe = 0;
+    size_t change = 0;
+    uint64_t mismatches = 0;
+    for (uint64_t i = 0; i < packets.size(); i++)
+    {
+        bool forced = false;
+        if (change < applied.size() && applied[change].frame == i)
+        {
+            const EncoderControl& control = applied[change].control;
+            forced = control.forceKeyframe;
+            if (control.frameRate.num != 0)
+            {
+                rateTime += rationalFrameTime(rate, i - rateFrame);
+                rateFrame = i;
+                rate = control.frameRate;
+            }
+            change++;
+        }
+
+        bool keyframe = i == 0 || forced || sinceKeyframe == options.config.gopLength;
+        sinceKeyframe = keyframe ? 1 : sinceKeyframe + 1;
+        int64_t time = rateTime + rationalFrameTime(rate, i - rateFrame);
+        int64_t duration = rateTime + rationalFrameTime(rate, i + 1 - rateFrame) - time;
+
+        // Sizes land in bands that do not overlap from one change to the next
+        double base = (keyframe ? options.idrBytes : options.frameBytes) * scales[change];
+        double low = base * (100 - options.sizeJitterPercent) / 100;
+        double high = base * (100 + options.sizeJitterPercent) / 100 + 64;
+
+        const RecordedPacket& packet = packets[i];
+        if (packet.keyframe != keyframe || packet.time != time || packet.duration != duration || packet.size < low || packet.size > high)
+            mismatches++;
+    }
+
+    double latencyUs = 0;
+    for (const AppliedControl& control : applied)
+        latencyUs = std::max(latencyUs, std::chrono::duration<double, std::micro>(control.applied - control.requested).count());
+
+    printf("control: %zu frames, changes landed on frames %llu %llu %llu, slowest %.0f us after the request, %u bad changes refused\n",
+        packets.size(), (unsigned long long)applied[0].frame, (unsigned long long)applied[1].frame,
+        (unsigned long long)applied[2].frame, latencyUs, refused);
+    if (mismatches != 0)
+        printf("control: %llu frames do not match the changes applied before them\n", (unsigned long long)mismatches);
+    return mismatches == 0;
+}
+
+// A bottleneck link with a drop-tail queue, fed at exactly the target rate
+struct SimulatedLink
+{
+    double capacity;                // bits/s
+    double randomLoss = 0;
+    double queueBits = 0;
+    double bufferSeconds = 0.25;
+
+    // Bits that arrive out of the bits sent over dt, counting drops into lost
+    double step(double sentBits, double dt, double& lostBits)
+    {
+        queueBits += sentBits;
+        double overflow = std::max(queueBits - capacity * bufferSeconds, 0.0);
+        queueBits -= overflow;
+        double served = std::min(queueBits, capacity * dt);
+        queueBits -= served;
+        lostBits += overflow + served * randomLoss;
+        return served * (1 - randomLoss);
+    }
+
+    int64_t queueDelayUs() const { return (int64_t)(queueBits / capacity * 1e6); }
+};
+
+static bool benchCongestion()
+{
+    CongestionControllerOptions options;
+    options.startBitrate = 2000000;
+    options.maxBitrate = 10000000;
+    CongestionController controller(options);
+    SimulatedLink link{6000000};
+
+    // 6 Mbps, a drop to 2 Mbps, then 8 Mbps with a stretch of heavy loss
+    const double dt = 0.01, report = 0.1, duration = 90;
+    double sent = 0, received = 0, lost = 0;
+    double delivered[3] = {}, maxDelay[3] = {};
+    double dropReaction = -1, recovery = -1, targetBeforeLoss = 0, targetAfterLoss = 0;
+    uint32_t target = options.startBitrate;
+    for (int tick = 1; tick * dt <= duration + 1e-9; tick++)
+    {
+        double now = tick * dt;
+        link.capacity = now <= 30 ? 6000000 : now <= 50 ? 2000000 : 8000000;
+        link.randomLoss = now > 75 && now <= 77 ? 0.15 : 0;
+
+        double bits = target * dt;
+        double arrived = link.step(bits, dt, lost);
+        sent += bits;
+        received += arrived;
+
+        // Steady-state windows: the last 10 s at each capacity
+        int phase = now <= 30 ? 0 : now <= 50 ? 1 : 2;
+        bool steady = (now > 20 && now <= 30) || (now > 40 && now <= 50) || (now > 65 && now <= 75);
+        if (steady)
+        {
+            delivered[phase] += arrived / (link.capacity * 10);
+            maxDelay[phase] = std::max(maxDelay[phase], (double)link.queueDelayUs());
+        }
+
+        if (tick % (int)(report / dt + 0.5) != 0)
+            continue;
+
+        TransportFeedback feedback;
+        feedback.timeUs = (int64_t)(now * 1e6 + 0.5);
+        feedback.receivedBitrate = (uint32_t)(received / report);
+        feedback.lossFraction = sent > 0 ? lost / sent : 0;
+        feedback.queueDelayUs = link.queueDelayUs();
+        sent = received = lost = 0;
+
+        controller.onFeedback(feedback, target);
+
+        if (dropReaction < 0 && now > 30 && target <= 2000000)
+            dropReaction = now - 30;
+        if (recovery < 0 && now > 50 && target >= 0.75 * 8000000)
+            recovery = now - 50;
+        if (now <= 75)
+            targetBeforeLoss = target;
+        if (now <= 77)
+            targetAfterLoss = target;
+    }
+
+    CongestionControllerStats stats = controller.stats();
+    printf("congestion: link used %3.0f%% at 6 Mbps, %3.0f%% at 2 Mbps, %3.0f%% at 8 Mbps, queue at most %.0f, %.0f, %.0f ms\n",
+        delivered[0] * 100, delivered[1] * 100, delivered[2] * 100, maxDelay[0] / 1000, maxDelay[1] / 1000, maxDelay[2] / 1000);
+    printf("congestion: under 2 Mbps %.1f s after the drop, 75%% of 8 Mbps %.1f s after the rise\n", dropReaction, recovery);
+    printf("congestion: loss burst took the target from %.2f to %.2f Mbps, %llu encoder changes in %llu reports (%llu delay, %llu loss decreases)\n",
+        targetBeforeLoss / 1e6, targetAfterLoss / 1e6, (unsigned long long)stats.targetChanges, (unsigned long long)stats.reports,
+        (unsigned long long)stats.delayDecreases, (unsigned long long)stats.lossDecreases);
+
+    bool ok = delivered[0] > 0.75 && delivered[1] > 0.75 && delivered[2] > 0.75 &&
+        maxDelay[0] < 150000 && maxDelay[1] < 150000 && maxDelay[2] < 150000 &&
+        dropReaction >= 0 && dropReaction < 2 && recovery >= 0 && recovery < 15 &&
+        targetAfterLoss < 0.8 * targetBeforeLoss && stats.targetChanges * 4 < stats.reports;
+    if (!ok)
+        printf("congestion: the controller did not track the link\n");
+    return ok;
+}
+
+static bool benchControl()
+{
+    bool ok = benchControlSequencing();
+    return benchCongestion() && ok;
+}
+
+// ----------------------------------------------------------------------------
+// Latency tracing
+//
+// Every frame has to be traced from fill to file. The low-latency profile has
+// to get frames into the file sooner than the default one, which batches file
+// writes, and stay under a fixed bound so a pipeline regression shows. The
+// source is not paced, so the default profile's lookahead costs little here.
+// ----------------------------------------------------------------------------
+
+struct LatencyRun
+{
+    FrameTracerStats trace;
+    uint64_t frames;
+    size_t chromeEvents;
+};
+
+static LatencyRun runLatency(const char* label, const EncoderConfig& config, const BitstreamWriterOptions& writerOptions, uint64_t frames)
+{
+    const char* tracePath = "bench_latency.json";
+
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_latency.h264";
+    encode.backend.config = config;
+    encode.writer = writerOptions;
+    encode.schedule.frames = frames;
+
+    FrameTracerOptions traceOptions;
+    traceOptions.chromeTraceFrames = 100;
+    FrameTracer tracer(traceOptions);
+
+    LatencyRun run;
+    SoftwareEncode encoded = runSoftwareEncode(encode, [&](Encoder& encoder) { encoder.setTracer(&tracer); });
+    CHECK(encoded.drained);
+    run.frames = encoded.outputFrames;
+    run.trace = tracer.stats();
+
+    // One complete event per stage and frame kept
+    run.chromeEvents = 0;
+    if (tracer.writeChromeTrace(tracePath))
+    {
+        std::ifstream fin(tracePath);
+        std::string json((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+        for (size_t at = json.find("\"ph\":\"X\""); at != std::string::npos; at = json.find("\"ph\":\"X\"", at + 1))
+            run.chromeEvents++;
+        if (json.compare(0, 15, "{\"displayTimeUn") != 0 || json.find("]}") == std::string::npos)
+            run.chromeEvents = 0;
+    }
+    std::remove(tracePath);
+
+    const FrameTracerStats& trace = run.trace;
+    printf("latency: %-12s fill to bitstream p50 %6.2f p95 %6.2f p99 %6.2f ms, fill to file p50 %6.2f p99 %6.2f ms\n", label,
+        trace.captureToBitstream.percentile(0.5) / 1000, trace.captureToBitstream.percentile(0.95) / 1000,
+        trace.captureToBitstream.percentile(0.99) / 1000, trace.endToEnd.percentile(0.5) / 1000, trace.endToEnd.percentile(0.99) / 1000);
+    printf("latency: %-12s stages p50 fill %.2f, encode %.2f, write %.2f ms, %llu of %llu frames traced\n", label,
+        trace.fill.percentile(0.5) / 1000, trace.encode.percentile(0.5) / 1000, trace.write.percentile(0.5) / 1000,
+        (unsigned long long)trace.frames, (unsigned long long)run.frames);
+    return run;
+}
+
+static bool benchLatency()
+{
+    // The histogram against a known distribution first
+    LatencyHistogram histogram;
+    for (uint64_t us = 1; us <= 10000; us++)
+        histogram.record(us);
+    bool ok = std::fabs(histogram.percentile(0.5) / 5000 - 1) < 0.07 && std::fabs(histogram.percentile(0.99) / 9900 - 1) < 0.07 &&
+        histogram.max() == 10000 && histogram.count() == 10000;
+    if (!ok)
+        printf("latency: histogram p50 %.0f p99 %.0f, expected 5000 and 9900\n", histogram.percentile(0.5), histogram.percentile(0.99));
+
+    EncoderConfig standard;
+    LatencyRun normal = runLatency("default", standard, BitstreamWriterOptions(), 600);
+
+    EncoderConfig interactive;
+    applyLowLatencyProfile(interactive);
+    LatencyRun low = runLatency("low-latency", interactive, lowLatencyWriterOptions(), 600);
+
+    for (const LatencyRun* run : { &normal, &low })
+    {
+        if (run->trace.frames != run->frames || run->trace.lost != 0 || run->trace.abandoned != 0 || run->chromeEvents != 300)
+        {
+            printf("latency: %llu of %llu frames traced, %llu stamps lost, %llu abandoned, %zu trace events\n",
+                (unsigned long long)run->trace.frames, (unsigned long long)run->frames, (unsigned long long)run->trace.lost,
+                (unsigned long long)run->trace.abandoned, run->chromeEvents);
+            ok = false;
+        }
+    }
+
+    // Every third frame is dropped by the encoder and never written; their
+    // slots come back, so a small table keeps tracing the rest
+    FrameTracerOptions smallTable;
+    smallTable.slots = 64;
+    FrameTracer dropping(smallTable);
+    for (int64_t frame = 0; frame < 3000; frame++)
+    {
+        int64_t sampleTime = frame * 333333;
+        dropping.stamp(TraceStage::Fill, sampleTime);
+        dropping.stamp(TraceStage::Submit, sampleTime);
+        if (frame % 3 == 0)
+            continue;
+        dropping.stamp(TraceStage::Output, sampleTime);
+        dropping.stamp(TraceStage::Written, sampleTime);
+    }
+    FrameTracerStats dropped = dropping.stats();
+    if (dropped.frames != 2000 || dropped.lost != 0 || dropped.abandoned + smallTable.reorder < 1000 || dropped.abandoned > 1000)
+    {
+        printf("latency: with drops %llu frames traced, %llu stamps lost, %llu abandoned, expected 2000, 0 and about 1000\n",
+            (unsigned long long)dropped.frames, (unsigned long long)dropped.lost, (unsigned long long)dropped.abandoned);
+        ok = false;
+    }
+
+    // The stand-in takes 2 ms per frame; everything above that is the pipeline
+    if (low.trace.endToEnd.percentile(0.5) >= normal.trace.endToEnd.percentile(0.5) || low.trace.captureToBitstream.percentile(0.99) > 12000)
+    {
+        printf("latency: low-latency profile is not faster into the file than the default one, or above 12 ms at p99\n");
+        ok = false;
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Frame scheduling
+//
+// Offline encodes take every frame the encoder asks for. Paced runs capture
+// two seconds at 30 fps against the wall clock, once undisturbed, once with
+// the encoder's thread stalled for 120 ms and once with the pacer's thread
+// stalled for 150 ms. A stalled encoder costs real-time capture frames and the bounded
+// queue none; a stalled pacer repeats and skips slots. Sample times stay on
+// the 30 fps grid throughout, and every run drains by itself.
+// ----------------------------------------------------------------------------
+
+enum class ScheduleStall { None, Encoder, Pacer };
+
+static SoftwareEncode runSchedule(const char* label, FrameSchedule mode, ScheduleStall stall, uint64_t frames)
+{
+    WorkerPool encoderWorkers(1);
+    WorkerPool pacerWorkers(1);
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_schedule.h264";
+    encode.backendWorkers = &encoderWorkers;
+    encode.schedule.mode = mode;
+    encode.schedule.frames = frames;
+    encode.schedule.queueFrames = 5;
+    encode.scheduleWorkers = &pacerWorkers;
+    if (stall != ScheduleStall::None)
+    {
+        encode.running = [&](Encoder& encoder)
+        {
+            waitForOutput(encoder, 20);
+            WorkerPool& stalled = stall == ScheduleStall::Encoder ? encoderWorkers : pacerWorkers;
+            std::chrono::milliseconds length(stall == ScheduleStall::Encoder ? 120 : 150);
+            stalled.post([length]() { std::this_thread::sleep_for(length); });
+        };
+    }
+    SoftwareEncode run = runSoftwareEncode(encode);
+
+    const FrameSchedulerStats& stats = run.schedule;
+    printf("schedule: %-16s %4llu slots in %6.3f s, %llu captured, %llu repeated, %llu skipped, %llu dropped, queue %llu, late %.1f ms\n", label,
+        (unsigned long long)stats.slots, run.seconds, (unsigned long long)stats.captured, (unsigned long long)stats.duplicated,
+        (unsigned long long)stats.skipped, (unsigned long long)stats.dropped, (unsigned long long)stats.maxQueued, stats.maxLateUs / 1000.0);
+    return run;
+}
+
+// Every slot accounted for, every frame encoded on its slot of the grid, in
+// order. Returns the slots that have no frame.
+static bool checkSchedule(const char* label, const SoftwareEncode& run, uint64_t frames, uint64_t& missing)
+{
+    const FrameSchedulerStats& stats = run.schedule;
+    const Rational rate = EncoderConfig().frameRate;
+    bool ok = run.drained && stats.slots == frames && stats.captured + stats.duplicated + stats.skipped == stats.slots &&
+        run.inputFrames == stats.captured + stats.duplicated - stats.dropped && run.packets.size() == run.inputFrames;
+
+    uint64_t next = 0;
+    missing = 0;
+    for (const RecordedPacket& packet : run.packets)
+    {
+        uint64_t slot = (uint64_t)((packet.time * rate.num + rate.den * 5000000) / (rate.den * 10000000));
+        if (slot < next || rationalFrameTime(rate, slot) != packet.time || rationalFrameTime(rate, slot + 1) - packet.time != packet.duration)
+            ok = false;
+        missing += slot - next;
+        next = slot + 1;
+    }
+    missing += frames - next;
+
+    if (!ok)
+        printf("schedule: %s lost track of its slots, %llu frames in, %zu out\n", label, (unsigned long long)run.inputFrames, run.packets.size());
+    return ok;
+}
+
+static bool benchSchedule()
+{
+    const uint64_t offline = 600;
+    const uint64_t paced = 60;
+    uint64_t missing = 0;
+
+    SoftwareEncode fast = runSchedule("fast", FrameSchedule::AsFastAsPossible, ScheduleStall::None, offline);
+    bool ok = checkSchedule("fast", fast, offline, missing) && missing == 0 && fast.schedule.dropped == 0;
+
+    // Two seconds of frames take two seconds, less the last slot's interval
+    SoftwareEncode realtime = runSchedule("realtime", FrameSchedule::RealTime, ScheduleStall::None, paced);
+    ok = checkSchedule("realtime", realtime, paced, missing) && ok;
+    if (missing != 0 || realtime.seconds < 1.96 || realtime.seconds > 2.3)
+    {
+        printf("schedule: realtime missed %llu slots over %.3f s, expected none over 1.97 s\n", (unsigned long long)missing, realtime.seconds);
+        ok = false;
+    }
+
+    // 120 ms is more than the encoder's requests cover, and less than the queue
+    SoftwareEncode realtimeStall = runSchedule("realtime, stall", FrameSchedule::RealTime, ScheduleStall::Encoder, paced);
+    ok = checkSchedule("realtime, stall", realtimeStall, paced, missing) && ok;
+    if (realtimeStall.schedule.dropped == 0 || missing != realtimeStall.schedule.dropped)
+    {
+        printf("schedule: a stalled encoder dropped %llu frames in real time\n", (unsigned long long)realtimeStall.schedule.dropped);
+        ok = false;
+    }
+
+    SoftwareEncode queued = runSchedule("queue, stall", FrameSchedule::BoundedQueue, ScheduleStall::Encoder, paced);
+    ok = checkSchedule("queue, stall", queued, paced, missing) && ok;
+    if (missing != 0 || queued.schedule.maxQueued == 0)
+    {
+        printf("schedule: the queue lost %llu frames to a stalled encoder, held %llu at most\n", (unsigned long long)missing,
+            (unsigned long long)queued.schedule.maxQueued);
+        ok = false;
+    }
+
+    // A tick over 117 ms late has three or four slots behind it: two repeated,
+    // the rest skipped. Repeats the encoder has not asked for are dropped.
+    SoftwareEncode late = runSchedule("realtime, late", FrameSchedule::RealTime, ScheduleStall::Pacer, paced);
+    ok = checkSchedule("realtime, late", late, paced, missing) && ok;
+    if (late.schedule.duplicated != 2 || late.schedule.skipped == 0 || late.schedule.maxLateUs < 100000 || missing != late.schedule.skipped + late.schedule.dropped)
+    {
+        printf("schedule: a late pacer repeated %llu and skipped %llu slots\n", (unsigned long long)late.schedule.duplicated,
+            (unsigned long long)late.schedule.skipped);
+        ok = false;
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark suite
+//
+// A small sweep on the stand-in, checked for what the suite reports rather
+// than how fast it is: every point and kernel has a result, the files read
+// back, and the baseline comparison flags what got worse and nothing else.
+// ----------------------------------------------------------------------------
+
+static bool benchSuite()
+{
+    const char* jsonPath = "bench_suite.json";
+    const char* csvPath = "bench_suite.csv";
+
+    BenchmarkSuiteOptions options;
+    options.sizes = { { 320, 180 } };
+    options.frameRates = { { 30, 1 } };
+    options.sessionCounts = { 1, 2 };
+    options.framesPerSession = 60;
+    options.kernelSeconds = 0.05;
+
+    SoftwareBackendFactory factory((SoftwareBackendOptions()));
+    std::vector<BenchmarkResult> results = runBenchmarkSuite(factory, options);
+
+    // Two formats, two session counts and two writers, then color, scan and mux
+    bool ok = results.size() == 8 + 3;
+    for (size_t i = 0; ok && i < 8; i++)
+    {
+        const BenchmarkMetric* frames = results[i].metric("frames");
+        const BenchmarkMetric* fps = results[i].metric("fps");
+        uint32_t sessions = results[i].name.find("/x2/") != std::string::npos ? 2 : 1;
+        ok = frames && frames->value == sessions * 60.0 && fps && fps->value > 0 && results[i].metric("latency_p50_ms");
+    }
+    if (!ok)
+        printf("suite: %zu results, expected 11 with every session's frames\n", results.size());
+
+    std::vector<BenchmarkResult> readBack;
+    std::string error;
+    size_t metrics = 0, matching = 0;
+    if (writeResultsJson(jsonPath, results) && writeResultsCsv(csvPath, results) && readResultsCsv(csvPath, readBack, error) && readBack.size() == results.size())
+    {
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            for (const BenchmarkMetric& metric : results[i].metrics)
+            {
+                const BenchmarkMetric* back = readBack[i].metric(metric.name);
+                metrics++;
+                matching += back && readBack[i].name == results[i].name && std::fabs(back->value - metric.value) <= 1e-5 * std::fabs(metric.value);
+            }
+        }
+    }
+    std::ifstream fin(jsonPath);
+    std::string json((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    size_t names = 0;
+    for (size_t at = json.find("\"name\":"); at != std::string::npos; at = json.find("\"name\":", at + 1))
+        names++;
+    std::remove(jsonPath);
+    std::remove(csvPath);
+    printf("suite: %zu of %zu metrics read back from CSV, %zu results in JSON\n", matching, metrics, names);
+    ok = ok && metrics != 0 && matching == metrics && names == results.size();
+
+    // Twice the throughput in the baseline is a regression everywhere; a
+    // change inside a metric's noise is none
+    std::vector<BenchmarkResult> faster = results, noisy = results;
+    for (BenchmarkResult& result : faster)
+    {
+        for (BenchmarkMetric& metric : result.metrics)
+            metric.value *= metric.name == "fps" ? 2 : 1;
+    }
+    for (BenchmarkResult& result : noisy)
+    {
+        for (BenchmarkMetric& metric : result.metrics)
+            metric.value -= metric.trend == MetricTrend::LowerIsBetter ? metric.noise * 0.9 : 0;
+    }
+    size_t same = compareResults(results, results, 0.2).size();
+    size_t slower = compareResults(faster, results, 0.2).size();
+    size_t withinNoise = compareResults(noisy, results, 0).size();
+    printf("suite: %zu regressions against itself, %zu against twice the fps, %zu within noise\n", same, slower, withinNoise);
+    return ok && same == 0 && slower == 9 && withinNoise == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Resources
+//
+// The tracker's counts, peaks and leak report first. Then every way an
+// encode can end (drained, stopped mid-stream, a source that runs out, a
+// ladder) leaves nothing alive, a frame takes one sample and nothing else
+// once the pools are warm, and a long soak on the stand-in does not grow.
+// ./bench resources N soaks for N frames, 1000000 for the long run.
+// ----------------------------------------------------------------------------
+
+// Extra argument after the section name, nullptr without one
+static const char* sectionArgument = nullptr;
+
+// Resident set in KB, 0 where /proc is not there
+static uint64_t residentKb()
+{
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file)
+        return 0;
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            kb = strtoull(line + 6, nullptr, 10);
+    }
+    fclose(file);
+    return kb;
+}
+
+static bool sameLive(const ResourceSnapshot& a, const ResourceSnapshot& b)
+{
+    for (size_t i = 0; i < RESOURCE_KINDS; i++)
+    {
+        if (a.kinds[i].live != b.kinds[i].live || a.kinds[i].liveBytes != b.kinds[i].liveBytes)
+            return false;
+    }
+    return true;
+}
+
+static void printLeft(const char* label, const ResourceSnapshot& before, const ResourceSnapshot& after)
+{
+    printf("resources: %s left", label);
+    for (size_t i = 0; i < RESOURCE_KINDS; i++)
+        printf(" %lld %s", (long long)(after.kinds[i].live - before.kinds[i].live), resourceKindName((ResourceKind)i));
+    printf("\n");
+}
+
+static bool checkResourceTracker()
+{
+    ResourceTracker tracker;
+    int objects[3];
+    tracker.created(ResourceKind::Buffer, &objects[0], 100, "a.h", 1);
+    tracker.created(ResourceKind::Buffer, &objects[1], 50, "a.h", 1);
+    tracker.destroyed(ResourceKind::Buffer, &objects[0], 100);
+    tracker.resized(ResourceKind::Buffer, &objects[1], 50, 80);
+    ResourceSnapshot counted = tracker.snapshot();
+    const ResourceCounts& buffers = counted[ResourceKind::Buffer];
+    bool ok = buffers.live == 1 && buffers.liveBytes == 80 && buffers.created == 2 && buffers.destroyed == 1 && buffers.peakLive == 2 &&
+        buffers.peakBytes == 150 && counted.live() == 1;
+    tracker.resetPeaks();
+    ok = ok && tracker.snapshot()[ResourceKind::Buffer].peakLive == 1 && tracker.snapshot()[ResourceKind::Buffer].peakBytes == 80;
+
+    // Only what was created with the leak mode on is listed, by creation site
+    tracker.setLeakTracking(true);
+    tracker.created(ResourceKind::Packet, &objects[2], 10, "b.h", 7);
+    tracker.created(ResourceKind::Texture, &objects[0], 20, "c.h", 9);
+    tracker.destroyed(ResourceKind::Buffer, &objects[1], 80);
+    tracker.destroyed(ResourceKind::Texture, &objects[0], 20);
+    std::vector<LeakedResource> live = tracker.live();
+    ok = ok && live.size() == 1 && live[0].kind == ResourceKind::Packet && strcmp(live[0].file, "b.h") == 0 && live[0].line == 7;
+
+    // A packet held past its pool shows up with the line that made it
+    std::string report;
+    resourceTracker().setLeakTracking(true);
+    {
+        PacketPool pool;
+        EncodedPacket held = pool.copy(reinterpret_cast<const uint8_t*>("leak"), 4);
+        std::vector<LeakedResource> leaks = resourceTracker().live();
+        ok = ok && leaks.size() == 1 && leaks[0].kind == ResourceKind::Packet && strstr(leaks[0].file, "encoded_packet.h") != nullptr;
+
+        const char* path = "bench_resources.txt";
+        FILE* file = fopen(path, "w");
+        CHECK(file);
+        size_t count = resourceTracker().reportLeaks(file);
+        fclose(file);
+        std::vector<uint8_t> bytes = readBytes(path);
+        report.assign(bytes.begin(), bytes.end());
+        std::remove(path);
+        ok = ok && count == 1;
+    }
+    ok = ok && resourceTracker().live().empty();
+    resourceTracker().setLeakTracking(false);
+    if (!report.empty() && report.back() == '\n')
+        report.pop_back();
+
+    printf("resources: counts, peaks and leak report: %s (%s)\n", ok ? "ok" : "WRONG", report.c_str());
+    return ok;
+}
+
+// A drained encode, one stopped mid-stream and one whose source runs out
+static bool checkEncoderResources()
+{
+    const char* path = "bench_resources.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = 320;
+    options.config.height = 180;
+    bool ok = true;
+
+    ResourceSnapshot before = resourceTracker().snapshot();
+    ResourceSnapshot warm, end;
+    uint64_t warmFrames = 0, frames = 0;
+    {
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+        FrameSchedulerOptions schedule;
+        schedule.frames = 600;
+        encoder.setSchedule(schedule);
+        encoder.start();
+        while (encoder.outputFrames() < 200)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        warm = resourceTracker().snapshot();
+        warmFrames = encoder.inputFrames();
+        ok = encoder.waitForDrain(std::chrono::seconds(30)) && ok;
+        end = resourceTracker().snapshot();
+        frames = encoder.inputFrames();
+    }
+    ResourceSnapshot after = resourceTracker().snapshot();
+    double samples = createdPerFrame(before, after, ResourceKind::Sample, frames);
+    double packets = createdPerFrame(warm, end, ResourceKind::Packet, frames - warmFrames);
+    double buffers = createdPerFrame(warm, end, ResourceKind::Buffer, frames - warmFrames);
+    printf("resources: drained encode, %llu frames: %.2f samples per frame, %.3f packets and %.3f buffers per frame once warm, peak %lld packets (%.1f KB)\n",
+        (unsigned long long)frames, samples, packets, buffers, (long long)end[ResourceKind::Packet].peakLive,
+        end[ResourceKind::Packet].peakBytes / 1024.0);
+    printLeft("drained encode", before, after);
+    // Packets only until the pool has seen the writer's worst lag, see the soak
+    ok = ok && frames == 600 && std::fabs(samples - 1) < 1e-9 && buffers == 0 && sameLive(before, after);
+
+    // Stopped with frames still in the encoder and the writer
+    before = resourceTracker().snapshot();
+    {
+        options.latency = std::chrono::microseconds(2000);
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+        encoder.start();
+        while (encoder.outputFrames() < 20)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(encoder.stop());
+    }
+    after = resourceTracker().snapshot();
+    printLeft("stopped encode", before, after);
+    ok = ok && sameLive(before, after);
+
+    // The frame taken for the picture that never came goes back
+    before = resourceTracker().snapshot();
+    {
+        options.latency = std::chrono::microseconds(0);
+        SoftwareEncoderBackend backend(options);
+        PatternSource source(TestPattern::Bar, PictureFormat::BGRA, 320, 180, 30);
+        Encoder encoder(backend, path);
+        FrameSchedulerOptions schedule;
+        schedule.frames = 60;
+        encoder.setSchedule(schedule);
+        encoder.setFrameSource(&source);
+        encoder.start();
+        ok = encoder.waitForDrain(std::chrono::seconds(30)) && encoder.outputFrames() == 30 && ok;
+    }
+    after = resourceTracker().snapshot();
+    printLeft("source that ends", before, after);
+    ok = ok && sameLive(before, after);
+    std::remove(path);
+    return ok;
+}
+
+// Drained, then stopped with every rung's next frame taken
+static bool checkLadderResources()
+{
+    SoftwareBackendOptions backendOptions;
+    backendOptions.latency = std::chrono::microseconds(0);
+    SoftwareBackendFactory factory(backendOptions);
+    LadderOptions options;
+    options.source.width = 640;
+    options.source.height = 360;
+    options.rungs = standardLadder(options.source);
+    options.rungs.push_back(options.rungs[0]);
+    options.rungs.back().width = 320;
+    options.rungs.back().height = 180;
+    for (LadderRung& rung : options.rungs)
+        rung.path = "bench_resources_" + std::to_string(rung.height) + "p.h264";
+
+    bool ok = true;
+    WorkerPool workers(2);
+    for (bool drain : { true, false })
+    {
+        ResourceSnapshot before = resourceTracker().snapshot();
+        {
+            LadderEncoder ladder(factory, 0, options, workers);
+            FrameSchedulerOptions schedule;
+            schedule.frames = drain ? 60 : 100000;
+            ladder.setSchedule(schedule);
+            ladder.start();
+            if (drain)
+            {
+                ok = ladder.waitForDrain(std::chrono::seconds(30)) && ok;
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                ladder.stop();
+            }
+        }
+        ResourceSnapshot after = resourceTracker().snapshot();
+        printLeft(drain ? "drained ladder" : "stopped ladder", before, after);
+        ok = ok && sameLive(before, after);
+    }
+    for (const LadderRung& rung : options.rungs)
+        std::remove(rung.path.c_str());
+    return ok;
+}
+
+// Counts what is alive every interval frames, as the writer sees them
+class ResourceSampler : public IPacketConsumer
+{
+public:
+    explicit ResourceSampler(uint64_t interval) : interval(interval) {}
+
+    void onPacket(const EncodedPacket&) override
+    {
+        if (++packets % interval == 0)
+        {
+            snapshots.push_back(resourceTracker().snapshot());
+            warm.store(true, std::memory_order_release);
+        }
+    }
+
+    uint64_t interval;
+    uint64_t packets = 0;
+    std::vector<ResourceSnapshot> snapshots;     // read once the encoder is gone
+    std::atomic<bool> warm{false};
+};
+
+// No frame memory is created past the first tenth of the run and nothing is
+// left after it. The packet pool keeps its high-water mark, so it still grows
+// when the writer falls further behind than before, up to the writer's queue;
+// a leak grows with the frames, so the second half may add only a handful.
+// Frames are small so a million of them take a few minutes.
+static bool runResourceSoak(uint64_t frames)
+{
+    const char* path = "bench_resources.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = 64;
+    options.config.height = 64;
+    options.config.gopLength = 30;
+
+    resourceTracker().resetPeaks();
+    ResourceSnapshot before = resourceTracker().snapshot();
+    ResourceSampler sampler(std::max<uint64_t>(1, frames / 10));
+    uint64_t rssWarm = 0, framesOut = 0;
+    bool drained;
+    Clock::time_point start = Clock::now();
+    {
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+        encoder.addConsumer(&sampler);
+        FrameSchedulerOptions schedule;
+        schedule.frames = frames;
+        encoder.setSchedule(schedule);
+        encoder.start();
+        while (!sampler.warm.load(std::memory_order_acquire) && !encoder.waitForDrain(std::chrono::milliseconds(10)))
+        {
+        }
+        rssWarm = residentKb();
+        drained = encoder.waitForDrain(std::chrono::seconds(3600));
+        framesOut = encoder.outputFrames();
+    }
+    double seconds = secondsSince(start);
+    uint64_t rssEnd = residentKb();
+    ResourceSnapshot after = resourceTracker().snapshot();
+
+    // Created after the first checkpoint, and the most alive at any later one
+    bool ok = drained && framesOut == frames && sampler.snapshots.size() >= 2 && sameLive(before, after);
+    uint64_t memoryLate = 0, packetsLate = 0;
+    int64_t peakWarm = 0, peakEnd = after[ResourceKind::Packet].peakLive;
+    double bytesWarm = 0, bytesEnd = after[ResourceKind::Packet].peakBytes + after[ResourceKind::Buffer].peakBytes;
+    if (sampler.snapshots.size() >= 2)
+    {
+        const ResourceSnapshot& warm = sampler.snapshots.front();
+        const ResourceSnapshot& half = sampler.snapshots[sampler.snapshots.size() / 2];
+        memoryLate = after[ResourceKind::Buffer].created - warm[ResourceKind::Buffer].created +
+            after[ResourceKind::Texture].created - warm[ResourceKind::Texture].created;
+        packetsLate = after[ResourceKind::Packet].created - half[ResourceKind::Packet].created;
+        peakWarm = warm[ResourceKind::Packet].peakLive;
+        bytesWarm = warm[ResourceKind::Packet].peakBytes + warm[ResourceKind::Buffer].peakBytes;
+    }
+    ok = ok && memoryLate == 0 && packetsLate <= 16;
+    std::remove(path);
+
+    printf("resources: soak %llu frames in %.1f s, %llu buffers created after the first tenth, %llu packets in the second half, peak %lld packets (%.1f KB) "
+        "then %lld (%.1f KB): %s\n", (unsigned long long)framesOut, seconds, (unsigned long long)memoryLate, (unsigned long long)packetsLate,
+        (long long)peakWarm, bytesWarm / 1024, (long long)peakEnd, bytesEnd / 1024, ok ? "ok" : "GROWING");
+    if (rssWarm != 0)
+        printf("resources: resident %.1f MB warm, %.1f MB at the end\n", rssWarm / 1024.0, rssEnd / 1024.0);
+    printLeft("soak", before, after);
+    return ok;
+}
+
+static bool benchResources()
+{
+    bool ok = true;
+    ok = checkResourceTracker() && ok;
+    ok = checkEncoderResources() && ok;
+    ok = checkLadderResources() && ok;
+
+    uint64_t frames = sectionArgument ? strtoull(sectionArgument, nullptr, 10) : 20000;
+    ok = runResourceSoak(std::max<uint64_t>(frames, 100)) && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Metrics
+//
+// Updates from many threads against one shared atomic, the totals after
+// them, an encode's series against its own counters, and both exporters
+// over loopback.
+// ----------------------------------------------------------------------------
+
+static const MetricValue* findMetric(const std::vector<MetricValue>& values, const std::string& name)
+{
+    for (const MetricValue& value : values)
+    {
+        if (value.name == name)
+            return &value;
+    }
+    return nullptr;
+}
+
+static bool checkMetricsRegistry()
+{
+    const uint32_t threadCount = 4;
+    const uint32_t perThread = 2000000;
+
+    MetricsRegistry registry;
+    MetricId frames = registry.counter("frames_total", "Frames");
+    MetricId latency = registry.histogram("latency_seconds", "Latency", MetricLabels(), latencyBuckets());
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (uint32_t t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            for (uint32_t i = 0; i < perThread; i++)
+                registry.add(frames);
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    double sharded = secondsSince(start);
+
+    std::atomic<uint64_t> shared{0};
+    threads.clear();
+    start = Clock::now();
+    for (uint32_t t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            for (uint32_t i = 0; i < perThread; i++)
+                shared.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    double atomic = secondsSince(start);
+
+    // 1 ms to every thread's first bucket, the rest spread up to 2 s
+    threads.clear();
+    for (uint32_t t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            for (uint32_t i = 0; i < 1000; i++)
+                registry.observe(latency, i % 2 == 0 ? 0.001 : (t * 1000 + i) / 2000.0);
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::vector<MetricValue> values = registry.collect();
+    const MetricValue* counted = findMetric(values, "frames_total");
+    const MetricValue* observed = findMetric(values, "latency_seconds");
+    printf("metrics: counter, %u threads         %6.2f ns per update, shared atomic %6.2f ns, %zu shards\n", threadCount,
+        sharded * 1e9 / perThread, atomic * 1e9 / perThread,
+        registry.shardCount());
+    bool ok = counted && counted->value == (double)threadCount * perThread && shared == (uint64_t)threadCount * perThread;
+    ok = ok && observed && observed->count == threadCount * 1000 && observed->buckets.size() == latencyBuckets().size() + 1 &&
+        observed->buckets[1] >= threadCount * 500;
+    if (!ok)
+        printf("metrics: counts from several threads do not add up\n");
+
+    // A removed series' cells go to the next one, which starts from zero
+    registry.remove(frames);
+    MetricId next = registry.counter("next_total", "Next");
+    registry.add(next, 3);
+    values = registry.collect();
+    const MetricValue* reused = findMetric(values, "next_total");
+    if (findMetric(values, "frames_total") || !reused || reused->value != 3)
+    {
+        printf("metrics: a removed series' counts leaked into the next one\n");
+        ok = false;
+    }
+
+    // Buckets are cumulative in the text format
+    std::string text = prometheusText(values);
+    std::string inf = "latency_seconds_bucket{le=\"+Inf\"} " + std::to_string(threadCount * 1000) + "\n";
+    if (!contains(text, "# TYPE latency_seconds histogram\n") || !contains(text, inf) || !contains(text, "next_total 3\n"))
+    {
+        printf("metrics: unexpected exposition text\n%s", text.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+// One encode's series against the encoder's own counters
+static bool checkEncoderMetrics()
+{
+    const char* path = "bench_metrics.h264";
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(200);
+    options.config.width = 320;
+    options.config.height = 180;
+
+    MetricsRegistry registry;
+    bool ok = true;
+    {
+        EncoderMetrics metrics(registry, { { "session", "1" } });
+        SoftwareEncoderBackend backend(options);
+        Encoder encoder(backend, path);
+        encoder.setMetrics(&metrics);
+        FrameSchedulerOptions schedule;
+        schedule.frames = 300;
+        encoder.setSchedule(schedule);
+        encoder.start();
+        ok = encoder.waitForDrain(std::chrono::seconds(30));
+
+        std::vector<MetricValue> values = registry.collect();
+        const MetricValue* in = findMetric(values, "encoder_frames_in_total");
+        const MetricValue* out = findMetric(values, "encoder_frames_out_total");
+        const MetricValue* bytes = findMetric(values, "encoder_bytes_out_total");
+        const MetricValue* latency = findMetric(values, "encoder_latency_seconds");
+        const MetricValue* bitrate = findMetric(values, "encoder_output_bitrate_bps");
+        const MetricValue* target = findMetric(values, "encoder_target_bitrate_bps");
+        ok = ok && in && out && bytes && latency && bitrate && target && in->value == encoder.inputFrames() &&
+            out->value == encoder.outputFrames() && bytes->value == encoder.outputBytes() && latency->count == encoder.outputFrames() &&
+            bitrate->value > 0 && target->value == options.config.bitrate;
+        printf("metrics: encode, %llu frames            latency mean %.3f ms, output %.2f Mbps for a target of %.2f\n",
+            (unsigned long long)encoder.outputFrames(), latency && latency->count ? latency->sum * 1000 / latency->count : 0.0,
+            bitrate ? bitrate->value / 1e6 : 0.0, target ? target->value / 1e6 : 0.0);
+        if (!ok)
+            printf("metrics: the series do not match the encoder's counters\n");
+    }
+    if (!registry.collect().empty())
+    {
+        printf("metrics: the session's series outlived it\n");
+        ok = false;
+    }
+    std::remove(path);
+    return ok;
+}
+
+static bool checkMetricsExport()
+{
+    MetricsRegistry registry;
+    MetricId frames = registry.counter("encoder_frames_out_total", "Frames", { { "session", "7" } });
+    MetricId queue = registry.gauge("encoder_capture_queue_frames", "Queue", { { "session", "7" } });
+    registry.add(frames, 42);
+    registry.set(queue, 3);
+
+    LoopbackSocket statsd;
+    if (!statsd.bindUdp(0))
+    {
+        printf("metrics: no loopback UDP socket, export skipped\n");
+        return true;
+    }
+    MetricsExporterOptions options;
+    options.prometheus = true;
+    options.statsdPort = statsd.port();
+    options.statsdInterval = std::chrono::milliseconds(50);
+    MetricsExporter exporter(registry, options);
+    std::string error;
+    if (!exporter.start(error))
+    {
+        printf("metrics: %s, export skipped\n", error.c_str());
+        return true;
+    }
+
+    // A scrape as Prometheus does it
+    std::string response;
+    LoopbackSocket client;
+    bool ok = client.connectTcp(exporter.prometheusPort()) && client.sendAll("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    char buffer[4096];
+    while (ok && client.readable(std::chrono::milliseconds(2000)))
+    {
+        size_t received = client.receive(buffer, sizeof(buffer));
+        if (received == 0)
+            break;
+        response.append(buffer, received);
+    }
+    ok = ok && contains(response, "HTTP/1.0 200 OK") && contains(response, "encoder_frames_out_total{session=\"7\"} 42\n") &&
+        contains(response, "encoder_capture_queue_frames{session=\"7\"} 3\n");
+    if (!ok)
+        printf("metrics: unexpected scrape\n%s\n", response.c_str());
+
+    // The first push has the whole count, the next one only what came since
+    std::string datagrams;
+    Clock::time_point start = Clock::now();
+    while (!contains(datagrams, "encoder_frames_out_total:5|c") && secondsSince(start) < 5)
+    {
+        if (!statsd.readable(std::chrono::milliseconds(100)))
+            continue;
+        size_t received = statsd.receive(buffer, sizeof(buffer));
+        datagrams.append(buffer, received).append("\n");
+        if (contains(datagrams, "encoder_frames_out_total:42|c"))
+            registry.add(frames, 5);
+    }
+    exporter.stop();
+    MetricsExporterStats stats = exporter.stats();
+    bool pushed = contains(datagrams, "encoder_frames_out_total:42|c|#session:7") && contains(datagrams, "encoder_frames_out_total:5|c") &&
+        contains(datagrams, "encoder_capture_queue_frames:3|g");
+    if (!pushed)
+        printf("metrics: unexpected StatsD datagrams\n%s", datagrams.c_str());
+    printf("metrics: export                        %llu scrapes, %llu StatsD datagrams, %llu send failures\n", (unsigned long long)stats.scrapes,
+        (unsigned long long)stats.datagrams, (unsigned long long)stats.sendFailures);
+    return ok && pushed && stats.scrapes == 1;
+}
+
+static bool benchMetrics()
+{
+    bool ok = checkMetricsRegistry();
+    ok = checkEncoderMetrics() && ok;
+    ok = checkMetricsExport() && ok;
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Lookahead
+// ----------------------------------------------------------------------------
+
+static const AnalysisKernel analysisKernelList[] = { AnalysisKernel::Scalar, AnalysisKernel::Sse2, AnalysisKernel::Avx2, AnalysisKernel::Neon };
+
+static bool verifyAnalysisKernels()
+{
+    const uint32_t pitch = 2000;
+    std::vector<uint8_t> picture = randomBytes((size_t)pitch * LOOKAHEAD_BLOCK, 21);
+    std::vector<uint8_t> a = randomBytes(70000, 22), b = randomBytes(70000, 23);
+    AnalysisKernels reference = analysisKernels(AnalysisKernel::Scalar);
+    bool ok = true;
+    for (AnalysisKernel kernel : analysisKernelList)
+    {
+        if (!analysisKernelSupported(kernel))
+            continue;
+        AnalysisKernels kernels = analysisKernels(kernel);
+        for (uint32_t blocks : { 0u, 1u, 3u, 4u, 7u, 8u, 9u, 17u, 33u, 481u })
+        {
+            std::vector<uint8_t> expected(blocks + 1, 7), actual(blocks + 1, 7);
+            reference.decimateRow(picture.data() + 1, pitch, blocks, expected.data());
+            kernels.decimateRow(picture.data() + 1, pitch, blocks, actual.data());
+            if (actual != expected)
+            {
+                printf("lookahead: %s decimation of %u blocks differs\n", analysisKernelName(kernel), blocks);
+                ok = false;
+            }
+        }
+
+        // Saturated values check the widest sums the kernels keep
+        std::vector<uint8_t> white(70000, 255), black(70000, 0);
+        for (size_t count : { (size_t)0, (size_t)1, (size_t)15, (size_t)16, (size_t)31, (size_t)33, (size_t)100, (size_t)1001, (size_t)LOOKAHEAD_CHUNK })
+        {
+            uint64_t expectedSum, expectedSquares, sum, squares;
+            reference.sums(a.data() + 1, count, expectedSum, expectedSquares);
+            kernels.sums(a.data() + 1, count, sum, squares);
+            bool same = sum == expectedSum && squares == expectedSquares &&
+                kernels.sad(a.data() + 1, b.data() + 3, count) == reference.sad(a.data() + 1, b.data() + 3, count) &&
+                kernels.sad(white.data(), black.data(), count) == 255 * count;
+            kernels.sums(white.data(), count, sum, squares);
+            same = same && sum == 255 * count && squares == 255 * 255 * count;
+            if (!same)
+            {
+                printf("lookahead: %s sums or SAD of %zu differ\n", analysisKernelName(kernel), count);
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// A made up edit, 130 frames of it. Shots of smooth texture with their own
+// brightness and contrast, cut at 30, 60 and 110. The second has a one frame
+// flash at 45, the third pans fast and fades to black from 90.
+struct SceneShot
+{
+    uint32_t first;
+    int base;
+    int contrast;
+    int pan;            // pixels a frame
+    double frequency;
+};
+
+static const SceneShot sceneShots[] = {
+    { 0, 70, 30, 2, 0.020 },
+    { 30, 170, 40, 2, 0.035 },
+    { 60, 120, 70, 16, 0.040 },
+    { 110, 45, 20, 0, 0.050 },
+};
+static const uint32_t SCENE_FRAMES = 130;
+static const uint64_t sceneCuts[] = { 30, 60, 110 };
+
+static void sceneLuma(uint32_t frame, uint32_t width, uint32_t height, uint8_t* luma, size_t pitch)
+{
+    const SceneShot* shot = sceneShots;
+    for (const SceneShot& next : sceneShots)
+        shot = next.first <= frame ? &next : shot;
+    const double f = shot->frequency;
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            double moved = x + (double)shot->pan * (frame - shot->first);
+            double value = shot->base + shot->contrast * (0.6 * std::sin(moved * f + y * f * 0.7) + 0.4 * std::sin(moved * f * 2.3 - y * f * 1.1));
+            if (frame >= 90 && frame < 110)
+                value = 16 + (value - 16) * (110 - frame) / 21;
+            if (frame == 45)
+                value += 90;
+            luma[y * pitch + x] = clampToByte((int)std::lround(value));
+        }
+    }
+}
+
+static std::vector<LookaheadDecision> analyzeScenes(const LookaheadOptions& options, AnalysisKernel kernel, uint32_t width, uint32_t height,
+                                                    LookaheadStats* stats = nullptr)
+{
+    Lookahead lookahead(options, width, height, kernel);
+    std::vector<uint8_t> luma((size_t)width * height);
+    std::vector<LookaheadDecision> decisions;
+    LookaheadDecision decision;
+    for (uint32_t i = 0; i < SCENE_FRAMES; i++)
+    {
+        sceneLuma(i, width, height, luma.data(), width);
+        lookahead.push(luma.data(), width);
+        while (lookahead.pop(decision))
+            decisions.push_back(decision);
+    }
+    lookahead.flush();
+    while (lookahead.pop(decision))
+        decisions.push_back(decision);
+    if (stats)
+        *stats = lookahead.stats();
+    return decisions;
+}
+
+static std::vector<uint64_t> cutsOf(const std::vector<LookaheadDecision>& decisions)
+{
+    std::vector<uint64_t> cuts;
+    for (const LookaheadDecision& decision : decisions)
+        if (decision.sceneCut)
+            cuts.push_back(decision.frame);
+    return cuts;
+}
+
+static bool sameDecisions(const std::vector<LookaheadDecision>& a, const std::vector<LookaheadDecision>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].frame != b[i].frame || a[i].sceneCut != b[i].sceneCut || a[i].qpOffset != b[i].qpOffset ||
+            a[i].complexity != b[i].complexity || a[i].analysis.sad != b[i].analysis.sad ||
+            a[i].analysis.histogramDistance != b[i].analysis.histogramDistance)
+            return false;
+    }
+    return true;
+}
+
+// Cuts found exactly, and not the flash, the pan or the fade; the same
+// decisions from every kernel and the same cuts at every depth
+static bool checkSceneCuts()
+{
+    const uint32_t width = 320, height = 180;
+    const std::vector<uint64_t> expected(std::begin(sceneCuts), std::end(sceneCuts));
+    LookaheadStats stats;
+    std::vector<LookaheadDecision> reference = analyzeScenes(LookaheadOptions(), AnalysisKernel::Scalar, width, height, &stats);
+    bool ok = reference.size() == SCENE_FRAMES && cutsOf(reference) == expected && stats.flashes == 1;
+
+    int32_t minOffset = 0, maxOffset = 0;
+    for (const LookaheadDecision& decision : reference)
+    {
+        minOffset = std::min(minOffset, decision.qpOffset);
+        maxOffset = std::max(maxOffset, decision.qpOffset);
+    }
+    std::string cuts;
+    for (uint64_t cut : cutsOf(reference))
+        cuts += " " + std::to_string(cut);
+    printf("lookahead: %u frames, cuts at%s, %llu flash, QP offsets %d to %+d\n", SCENE_FRAMES, cuts.c_str(),
+        (unsigned long long)stats.flashes, minOffset, maxOffset);
+
+    for (AnalysisKernel kernel : analysisKernelList)
+    {
+        if (kernel == AnalysisKernel::Scalar || !analysisKernelSupported(kernel))
+            continue;
+        if (!sameDecisions(analyzeScenes(LookaheadOptions(), kernel, width, height), reference))
+        {
+            printf("lookahead: %s decisions differ from scalar\n", analysisKernelName(kernel));
+            ok = false;
+        }
+    }
+    for (uint32_t depth : { MIN_LOOKAHEAD, MAX_LOOKAHEAD })
+    {
+        LookaheadOptions options;
+        options.depth = depth;
+        if (cutsOf(analyzeScenes(options, AnalysisKernel::Auto, width, height)) != expected)
+        {
+            printf("lookahead: a depth of %u finds other cuts\n", depth);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+class SceneSource : public IFrameSource
+{
+public:
+    SceneSource(uint32_t width, uint32_t height)
+        : width(width), height(height), data((size_t)width * height * 3 / 2, 128)
+    {
+        current = pictureAt(PictureFormat::NV12, width, height, data.data());
+    }
+
+    FrameSourceInfo info() const override
+    {
+        FrameSourceInfo result;
+        result.format = PictureFormat::NV12;
+        result.width = width;
+        result.height = height;
+        return result;
+    }
+
+    SourceRead next() override
+    {
+        if (frame == SCENE_FRAMES)
+            return SourceRead::End;
+        sceneLuma(frame++, width, height, data.data(), width);
+        return SourceRead::Fresh;
+    }
+
+    const SourcePicture& picture() const override { return current; }
+
+private:
+    uint32_t width;
+    uint32_t height;
+    std::vector<uint8_t> data;
+    SourcePicture current;
+    uint32_t frame = 0;
+};
+
+static SoftwareEncode runLookaheadEncode(const SoftwareBackendOptions& options, FrameSchedule mode)
+{
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_lookahead.h264";
+    encode.backend = options;
+    encode.schedule.mode = mode;
+    SceneSource source(options.config.width, options.config.height);
+    return runSoftwareEncode(encode, [&](Encoder& encoder) { encoder.setFrameSource(&source, ScaleFilter::Bilinear); });
+}
+
+// The scenes through the encoder in quality mode: IDRs on the cuts and
+// nowhere else, and every frame the size its QP makes it
+static bool checkLookaheadEncode()
+{
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.sizeJitterPercent = 0;
+    options.config.width = 320;
+    options.config.height = 180;
+    options.config.rateControl = RateControl::Quality;
+    options.config.qp = 26;
+    options.config.gopLength = 120;
+    options.config.lookahead = 10;
+
+    LookaheadOptions lookaheadOptions;
+    lookaheadOptions.depth = options.config.lookahead;
+    std::vector<LookaheadDecision> decisions = analyzeScenes(lookaheadOptions, AnalysisKernel::Auto, options.config.width, options.config.height);
+    SoftwareEncode run = runLookaheadEncode(options, FrameSchedule::AsFastAsPossible);
+
+    bool ok = run.drained && run.packets.size() == SCENE_FRAMES && run.lookahead.decided == SCENE_FRAMES;
+    uint64_t mismatches = 0;
+    std::vector<uint64_t> keyframes;
+    for (size_t i = 0; ok && i < run.packets.size(); i++)
+    {
+        const RecordedPacket& packet = run.packets[i];
+        if (packet.keyframe)
+            keyframes.push_back(i);
+        int32_t qp = std::max(1, std::min(51, (int32_t)options.config.qp + decisions[i].qpOffset));
+        double base = (packet.keyframe ? options.idrBytes : options.frameBytes) * std::pow(2.0, ((double)options.config.qp - qp) / 6);
+        if (packet.size < base || packet.size > base + 64 || packet.time != options.config.frameTime(i))
+            mismatches++;
+    }
+    std::vector<uint64_t> expected(1, 0);
+    expected.insert(expected.end(), std::begin(sceneCuts), std::end(sceneCuts));
+    ok = ok && keyframes == expected && mismatches == 0;
+    printf("lookahead: encoded %zu frames through a %u frame lookahead, IDRs at the cuts and sizes by QP: %s\n", run.packets.size(),
+        options.config.lookahead, ok ? "ok" : "WRONG");
+
+    // Paced, the queue holds the decided frames and the lookahead the rest
+    options.config.frameRate = { 120, 1 };
+    run = runLookaheadEncode(options, FrameSchedule::BoundedQueue);
+    size_t idrs = 0;
+    for (const RecordedPacket& packet : run.packets)
+        idrs += packet.keyframe ? 1 : 0;
+    bool paced = run.drained && run.packets.size() == run.schedule.captured + run.schedule.duplicated - run.schedule.dropped &&
+        idrs == expected.size();
+    printf("lookahead: queue schedule at 120 fps, %zu frames, %llu dropped, %zu IDRs: %s\n", run.packets.size(),
+        (unsigned long long)run.schedule.dropped, idrs, paced ? "ok" : "WRONG");
+    return ok && paced;
+}
+
+static void timeLookahead(uint32_t width, uint32_t height)
+{
+    std::vector<uint8_t> pictures[2];
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        pictures[i].resize((size_t)width * height);
+        sceneLuma(29 + i, width, height, pictures[i].data(), width);
+    }
+
+    for (AnalysisKernel kernel : analysisKernelList)
+    {
+        if (!analysisKernelSupported(kernel))
+            continue;
+        Lookahead lookahead(LookaheadOptions(), width, height, kernel);
+        LookaheadDecision decision;
+        uint64_t frames = 0;
+        Clock::time_point start = Clock::now();
+        while (secondsSince(start) < 0.5)
+        {
+            lookahead.push(pictures[frames % 2].data(), width);
+            lookahead.pop(decision);
+            frames++;
+        }
+        double seconds = secondsSince(start);
+        printf("lookahead: %-6s %ux%u %8.1f fps %6.3f ms a frame\n", analysisKernelName(kernel), width, height, frames / seconds,
+            seconds * 1000 / frames);
+    }
+}
+
+static bool benchLookahead()
+{
+    bool ok = verifyAnalysisKernels();
+    printf("lookahead: kernels bit exact with scalar: %s\n", ok ? "yes" : "NO");
+    ok = checkSceneCuts() && ok;
+    ok = checkLookaheadEncode() && ok;
+    timeLookahead(1920, 1080);
+    timeLookahead(3840, 2160);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Pipelined upload
+// ----------------------------------------------------------------------------
+
+// The ring on its own: a fill that numbers its frames, a consumer that takes
+// them as soon as they are filled, and copies whose fences pass late
+static bool checkUploadRing(uint32_t depth, std::chrono::microseconds copyLatency)
+{
+    const uint32_t frames = 200;
+    const size_t bytes = 4096;
+    CpuStagingDevice device(depth, bytes, 64, copyLatency);
+    std::mutex mutex;
+    std::condition_variable filledOne;
+    uint32_t numbered = 0;
+    WorkerPool workers(2);
+    UploadPipelineOptions options;
+    options.depth = depth;
+    UploadPipeline pipeline(options, device, workers, [&](uint8_t* data, size_t)
+    {
+        if (numbered == frames)
+            return SourceRead::End;
+        memset(data, (int)(numbered % 251), bytes);
+        numbered++;
+        return SourceRead::Fresh;
+    }, [&]()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        filledOne.notify_all();
+    });
+
+    std::vector<uint8_t> input(bytes);
+    InputFrame frame = { 0, input.data(), 64 };
+    uint32_t taken = 0, wrong = 0;
+    bool ended = false;
+    pipeline.start();
+    while (!ended)
+    {
+        SourceRead read;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            filledOne.wait_for(lock, std::chrono::milliseconds(1), [&]() { return pipeline.peek(read); });
+        }
+        if (!pipeline.peek(read))
+            continue;
+        if (read == SourceRead::End)
+        {
+            ended = true;
+            break;
+        }
+        pipeline.copyInto(frame);
+        wrong += input[0] == taken % 251 && input[bytes - 1] == taken % 251 ? 0 : 1;
+        taken++;
+    }
+    pipeline.close();
+
+    UploadPipelineStats stats = pipeline.stats();
+    CpuStagingStats staging = device.stats();
+    bool ok = taken == frames && wrong == 0 && stats.copied == frames && stats.maxAhead <= depth && staging.earlyWrites == 0 &&
+        staging.mappedCopies == 0;
+    printf("upload: ring of %-2u, fences %4lld us  %u frames in order: %s, at most %u ahead, %llu fills waited on a fence, %llu early writes\n",
+        depth, (long long)copyLatency.count(), taken, wrong == 0 ? "yes" : "NO", stats.maxAhead, (unsigned long long)stats.fenceWaits,
+        (unsigned long long)staging.earlyWrites);
+    return ok;
+}
+
+// Motion pictures captured at one size and scaled to the encoder's, in place
+// or staged depth frames ahead (0 for in place)
+static SoftwareEncode runUpload(const SoftwareBackendOptions& options, uint32_t captureWidth, uint32_t captureHeight, uint64_t frames,
+                                uint32_t depth, bool checksum)
+{
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_upload.h264";
+    encode.backend = options;
+    encode.checksums = checksum;
+    encode.drainTimeout = std::chrono::seconds(60);
+    PatternSource source(TestPattern::Motion, PictureFormat::BGRA, captureWidth, captureHeight, frames);
+    return runSoftwareEncode(encode, [&](Encoder& encoder)
+    {
+        encoder.setFrameSource(&source, ScaleFilter::Bicubic);
+        UploadPipelineOptions uploadOptions;
+        uploadOptions.depth = depth;
+        CHECK(depth == 0 || encoder.setUploadPipeline(uploadOptions));
+    });
+}
+
+static bool benchUpload()
+{
+    bool ok = checkUploadRing(MIN_UPLOAD_DEPTH, std::chrono::microseconds(0));
+    ok = checkUploadRing(3, std::chrono::microseconds(2000)) && ok;
+    ok = checkUploadRing(MAX_UPLOAD_DEPTH, std::chrono::microseconds(500)) && ok;
+
+    // Staged frames are the same frames, in the same order
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.config.width = 640;
+    options.config.height = 360;
+    const uint64_t frames = 120;
+    SoftwareEncode inPlace = runUpload(options, 960, 540, frames, 0, true);
+    SoftwareEncode staged = runUpload(options, 960, 540, frames, 3, true);
+    bool same = inPlace.drained && staged.drained && inPlace.checksums.size() == frames && staged.checksums == inPlace.checksums &&
+        staged.staging.copies == frames && staged.staging.earlyWrites == 0 && staged.staging.mappedCopies == 0;
+    printf("upload: %llu staged frames through the encoder, the same as filled in place: %s\n", (unsigned long long)staged.outputFrames,
+        same ? "yes" : "NO");
+    ok = same && ok;
+
+    // One frame in the encoder at a time, so filling in place and encoding
+    // take turns while the staged fill runs alongside
+    options.config.width = 1920;
+    options.config.height = 1080;
+    options.depth = 1;
+    options.lookahead = 0;
+    options.latency = std::chrono::microseconds(4000);
+    for (uint32_t depth : { 0u, 2u, 3u, 4u })
+    {
+        SoftwareEncode run = runUpload(options, 2560, 1440, 120, depth, false);
+        ok = run.drained && run.outputFrames == 120 && run.staging.earlyWrites == 0 && ok;
+        if (depth == 0)
+            printf("upload: in place       1440p->1080p, 4 ms encode %7.1f fps\n", run.outputFrames / run.seconds);
+        else
+            printf("upload: %u staging bufs 1440p->1080p, 4 ms encode %7.1f fps, fill %.2f ms, %llu requests waited for a fill\n", depth,
+                run.outputFrames / run.seconds, run.upload.fillUs / 1000, (unsigned long long)run.upload.starved);
+    }
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Tiles
+//
+// The scheduler runs every tile of a job exactly once, however the threads
+// steal from each other and whoever else runs jobs on it. The tiled pass
+// makes the bytes converting the whole frame and then scaling it makes, its
+// block means are the ones the lookahead makes from the frame, and an
+// encoder with a lookahead decides the same with tiles as without. Then the
+// pass is timed at 1080p and 4K on 1 to 64 threads, against the whole frame
+// passes one after the other on one thread.
+// ----------------------------------------------------------------------------
+
+static bool checkTileScheduler()
+{
+    bool ok = true;
+    for (uint32_t threads : { 1u, 2u, 3u, 8u, 17u })
+    {
+        TileSchedulerOptions options;
+        options.threads = threads;
+        TileScheduler scheduler(options);
+        uint64_t expectedTiles = 0;
+        for (uint32_t count : { 1u, 2u, 7u, 64u, 1000u })
+        {
+            for (bool skewed : { false, true })
+            {
+                // The first eighth of the tiles is slow, so whoever holds them gets stolen from
+                std::vector<std::atomic<uint32_t>> runs(count);
+                std::atomic<bool> wrongThread{false};
+                scheduler.run(count, [&](uint32_t tile, uint32_t thread)
+                {
+                    if (thread >= threads)
+                        wrongThread = true;
+                    if (skewed && tile < count / 8)
+                    {
+                        Clock::time_point start = Clock::now();
+                        while (secondsSince(start) < 50e-6)
+                            ;
+                    }
+                    runs[tile]++;
+                });
+                expectedTiles += count;
+                bool once = !wrongThread;
+                for (const std::atomic<uint32_t>& run : runs)
+                    once = once && run == 1;
+                if (!once)
+                {
+                    printf("tiles: %u threads, %u %s tiles not run exactly once each\n", threads, count, skewed ? "skewed" : "even");
+                    ok = false;
+                }
+            }
+        }
+
+        // Three callers at once take turns
+        std::vector<std::atomic<uint32_t>> shared(300);
+        std::vector<std::thread> callers;
+        for (uint32_t caller = 0; caller < 3; caller++)
+        {
+            callers.emplace_back([&scheduler, &shared, caller]()
+            {
+                for (int job = 0; job < 50; job++)
+                    scheduler.run(100, [&](uint32_t tile, uint32_t) { shared[caller * 100 + tile]++; });
+            });
+        }
+        for (std::thread& caller : callers)
+            caller.join();
+        expectedTiles += 3 * 50 * 100;
+        bool turns = true;
+        for (const std::atomic<uint32_t>& run : shared)
+            turns = turns && run == 50;
+
+        TileSchedulerStats stats = scheduler.stats();
+        bool counted = stats.threads == threads && stats.tiles == expectedTiles && stats.jobs == 10 + 150 &&
+            (threads == 1 || stats.stolenTiles != 0);
+        printf("tiles: %2u threads, %llu tiles in %llu jobs from 1 and 3 callers, %llu steals took %llu tiles: %s\n", threads,
+            (unsigned long long)stats.tiles, (unsigned long long)stats.jobs, (unsigned long long)stats.steals,
+            (unsigned long long)stats.stolenTiles, turns && counted ? "ok" : "WRONG");
+        ok = turns && counted && ok;
+    }
+    return ok;
+}
+
+// Converting the whole frame and then scaling it, on this thread
+static void convertThenScale(const ColorConverter& converter, FrameScaler* scaler, const uint8_t* source, uint32_t sourceWidth,
+                             uint32_t sourceHeight, Nv12Buffer& staging, Nv12Buffer& out)
+{
+    if (!scaler)
+    {
+        converter.convert(source, (size_t)sourceWidth * 4, sourceWidth, sourceHeight, out.frame);
+        return;
+    }
+    converter.convert(source, (size_t)sourceWidth * 4, sourceWidth, sourceHeight, staging.frame);
+    scaler->scaleNv12(staging.frame, out.frame);
+}
+
+static std::vector<uint8_t> blockMeans(const Nv12Buffer& frame, uint32_t width, uint32_t height)
+{
+    const uint32_t blocksX = width / LOOKAHEAD_BLOCK, blocksY = height / LOOKAHEAD_BLOCK;
+    std::vector<uint8_t> blocks((size_t)blocksX * blocksY);
+    for (uint32_t y = 0; y < blocksY; y++)
+        decimateRowScalar(frame.y.data() + (size_t)width * y * LOOKAHEAD_BLOCK, width, blocksX, blocks.data() + (size_t)blocksX * y);
+    return blocks;
+}
+
+static bool checkTiledPass()
+{
+    struct Case
+    {
+        uint32_t sourceWidth, sourceHeight, width, height;
+        ScaleFilter filter;
+    };
+    const Case cases[] = {
+        { 1920, 1080, 1920, 1080, ScaleFilter::Bicubic },
+        { 3840, 2160, 1920, 1080, ScaleFilter::Bicubic },
+        { 1920, 1080, 1280, 720, ScaleFilter::Area },
+        { 1280, 720, 1920, 1080, ScaleFilter::Bilinear },
+        { 646, 366, 322, 182, ScaleFilter::Bicubic },
+        { 322, 182, 642, 362, ScaleFilter::Area },
+    };
+
+    bool ok = true;
+    ColorConverter converter(ColorMatrix::BT709, ColorRange::Limited, PixelOrder::BGRA);
+    for (const Case& test : cases)
+    {
+        std::vector<uint8_t> source = randomBytes((size_t)test.sourceWidth * test.sourceHeight * 4, 21);
+        bool scales = test.sourceWidth != test.width || test.sourceHeight != test.height;
+        std::unique_ptr<FrameScaler> scaler(scales ? new FrameScaler(test.sourceWidth, test.sourceHeight, test.width, test.height, test.filter) : nullptr);
+        Nv12Buffer staging(test.sourceWidth, test.sourceHeight), expected(test.width, test.height);
+        convertThenScale(converter, scaler.get(), source.data(), test.sourceWidth, test.sourceHeight, staging, expected);
+        std::vector<uint8_t> expectedBlocks = blockMeans(expected, test.width, test.height);
+
+        for (uint32_t threads : { 1u, 3u, 8u })
+        {
+            TileSchedulerOptions options;
+            options.threads = threads;
+            TileScheduler scheduler(options);
+
+            // The L2 size of this machine, and one small enough for tiles of a few rows
+            for (size_t cache : { (size_t)0, (size_t)48 << 10 })
+            {
+                FramePreprocessor tiled(scheduler, converter, test.sourceWidth, test.sourceHeight, test.width, test.height, test.filter, true, cache);
+                Nv12Buffer actual(test.width, test.height);
+                bool same = true;
+                for (int repeat = 0; repeat < 2; repeat++)
+                {
+                    tiled.process(source.data(), (size_t)test.sourceWidth * 4, actual.frame);
+                    same = same && actual.y == expected.y && actual.uv == expected.uv &&
+                        memcmp(tiled.blocks(), expectedBlocks.data(), expectedBlocks.size()) == 0;
+                }
+                if (!same)
+                {
+                    FramePreprocessorStats stats = tiled.stats();
+                    printf("tiles: %ux%u -> %ux%u %s on %u threads in %u tiles of %u rows differs from whole frame passes\n", test.sourceWidth,
+                        test.sourceHeight, test.width, test.height, scaleFilterName(test.filter), threads, stats.tiles, stats.tileRows);
+                    ok = false;
+                }
+            }
+        }
+    }
+    printf("tiles: tiled convert, scale and block means the same as whole frame passes: %s\n", ok ? "yes" : "NO");
+    return ok;
+}
+
+static SoftwareEncode runTiledEncode(const SoftwareBackendOptions& options, TileScheduler* scheduler)
+{
+    SoftwareEncodeOptions encode;
+    encode.path = "bench_tiles.h264";
+    encode.backend = options;
+    encode.checksums = true;
+    PatternSource source(TestPattern::Motion, PictureFormat::BGRA, 640, 360, 90);
+    return runSoftwareEncode(encode, [&](Encoder& encoder)
+    {
+        encoder.setFrameSource(&source, ScaleFilter::Bicubic);
+        encoder.setPreprocessing(scheduler);
+    });
+}
+
+// In quality mode frame sizes follow the lookahead's QP, so the same packets
+// mean the same decisions
+static bool checkTiledEncode()
+{
+    SoftwareBackendOptions options;
+    options.latency = std::chrono::microseconds(0);
+    options.sizeJitterPercent = 0;
+    options.config.width = 320;
+    options.config.height = 180;
+    options.config.rateControl = RateControl::Quality;
+    options.config.qp = 26;
+    options.config.lookahead = 10;
+
+    TileSchedulerOptions tileOptions;
+    tileOptions.threads = 3;
+    TileScheduler scheduler(tileOptions);
+    SoftwareEncode whole = runTiledEncode(options, nullptr);
+    SoftwareEncode tiled = runTiledEncode(options, &scheduler);
+
+    bool same = whole.drained && tiled.drained && whole.packets.size() == 90 && tiled.packets.size() == whole.packets.size() &&
+        tiled.checksums == whole.checksums && tiled.lookahead.decided == whole.lookahead.decided && tiled.preprocess.frames == 90;
+    for (size_t i = 0; same && i < whole.packets.size(); i++)
+        same = tiled.packets[i].size == whole.packets[i].size && tiled.packets[i].keyframe == whole.packets[i].keyframe;
+    printf("tiles: %zu frames 360p->180p through a %u frame lookahead, tiled the same as whole frame: %s\n", tiled.packets.size(),
+        options.config.lookahead, same ? "yes" : "NO");
+    return same;
+}
+
+// Frames a second of fn, for about 0.3 s after one frame of warm up
+template <typename Fn>
+static double framesPerSecond(Fn fn)
+{
+    fn();
+    uint64_t frames = 0;
+    Clock::time_point start = Clock::now();
+    while (secondsSince(start) < 0.3)
+    {
+        fn();
+        frames++;
+    }
+    return frames / secondsSince(start);
+}
+
+static void timeTiles(const char* label, uint32_t sourceWidth, uint32_t sourceHeight, uint32_t width, uint32_t height, uint32_t maxThreads)
+{
+    ColorConverter converter(ColorMatrix::BT709, ColorRange::Limited, PixelOrder::BGRA);
+    PatternSource pattern(TestPattern::Motion, PictureFormat::BGRA, sourceWidth, sourceHeight);
+    pattern.next();
+    const uint8_t* source = pattern.picture().planes[0];
+    const size_t sourcePitch = pattern.picture().pitches[0];
+    Nv12Buffer staging(sourceWidth, sourceHeight), out(width, height);
+
+    // What a frame took without tiles: convert, scale and the lookahead's reduction, each over the whole frame
+    std::unique_ptr<FrameScaler> scaler(sourceWidth != width || sourceHeight != height ? new FrameScaler(sourceWidth, sourceHeight, width, height, ScaleFilter::Bicubic) : nullptr);
+    AnalysisKernels kernels = analysisKernels(bestAnalysisKernel());
+    std::vector<uint8_t> blocks((size_t)(width / LOOKAHEAD_BLOCK) * (height / LOOKAHEAD_BLOCK));
+    double passes = framesPerSecond([&]()
+    {
+        convertThenScale(converter, scaler.get(), source, sourceWidth, sourceHeight, staging, out);
+        for (uint32_t y = 0; y < height / LOOKAHEAD_BLOCK; y++)
+            kernels.decimateRow(out.y.data() + (size_t)width * y * LOOKAHEAD_BLOCK, width, width / LOOKAHEAD_BLOCK, blocks.data() + (size_t)(width / LOOKAHEAD_BLOCK) * y);
+    });
+    printf("tiles: %-11s whole frame passes     %8.1f fps\n", label, passes);
+
+    double single = 0;
+    const uint32_t cpus = (uint32_t)cpuTopology().cpus.size();
+    // Powers of two, and the top count whether it is one or not
+    std::vector<uint32_t> counts;
+    for (uint32_t threads = 1; threads < maxThreads; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(maxThreads);
+    for (uint32_t threads : counts)
+    {
+        TileSchedulerOptions options;
+        options.threads = threads;
+        options.pin = threads <= cpus;
+        TileScheduler scheduler(options);
+        FramePreprocessor tiled(scheduler, converter, sourceWidth, sourceHeight, width, height, ScaleFilter::Bicubic, true);
+        double fps = framesPerSecond([&]() { tiled.process(source, sourcePitch, out.frame); });
+        if (threads == 1)
+            single = fps;
+        FramePreprocessorStats layout = tiled.stats();
+        TileSchedulerStats stats = scheduler.stats();
+        printf("tiles: %-11s %2u thread%s tiled %8.1f fps  x%5.2f (%3.0f%% of linear), %u tiles of %u rows, %.1f stolen a frame\n", label,
+            threads, threads == 1 ? " " : "s", fps, fps / single, fps / single / threads * 100, layout.tiles, layout.tileRows,
+            (double)stats.stolenTiles / stats.jobs);
+    }
+}
+
+// ./bench tiles N times up to N threads, else up to the CPU count
+static bool benchTiles()
+{
+    bool ok = checkTileScheduler();
+    ok = checkTiledPass() && ok;
+    ok = checkTiledEncode() && ok;
+
+    const CpuTopology& topology = cpuTopology();
+    printf("tiles: %zu CPUs on %u NUMA nodes, %zu KB of L2\n", topology.cpus.size(), topology.nodeCount, topology.l2Bytes >> 10);
+    uint32_t maxThreads = sectionArgument ? (uint32_t)strtoul(sectionArgument, nullptr, 10) : (uint32_t)topology.cpus.size();
+    maxThreads = std::max(1u, std::min(maxThreads, 64u));
+    timeTiles("1080p", 1920, 1080, 1920, 1080, maxThreads);
+    timeTiles("4K", 3840, 2160, 3840, 2160, maxThreads);
+    timeTiles("4K->1080p", 3840, 2160, 1920, 1080, maxThreads);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Main
+// ----------------------------------------------------------------------------
+
+struct BenchSection
+{
+    const char* name;
+    bool (*run)();
+};
+
+static const BenchSection sections[] = {
+    { "color", benchColor },
+    { "pipeline", benchPipeline },
+    { "pool", benchPool },
+    { "upload", benchUpload },
+    { "ladder", benchLadder },
+    { "scale", benchScale },
+    { "tiles", benchTiles },
+    { "lookahead", benchLookahead },
+    { "source", benchSource },
+    { "resources", benchResources },
+    { "metrics", benchMetrics },
+    { "pump", benchPump },
+    { "writer", benchWriter },
+    { "mp4", benchMp4 },
+    { "durable", benchDurable },
+    { "live", benchLive },
+    { "nal", benchNal },
+    { "manager", benchManager },
+    { "caps", benchCaps },
+    { "config", benchConfig },
+    { "control", benchControl },
+    { "latency", benchLatency },
+    { "schedule", benchSchedule },
+    { "suite", benchSuite },
+};
+
+int main(int argc, char** argv)
+{
+    bool ok = true;
+    bool ran = false;
+    if (argc > 2)
+        sectionArgument = argv[2];
+    for (const BenchSection& section : sections)
+    {
+        if (argc > 1 && strcmp(argv[1], section.name) != 0)
+            continue;
+        ran = true;
+        ok = section.run() && ok;
+    }
+
+    if (!ran)
+    {
+        printf("unknown section %s\n", argv[1]);
+        return 2;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,677 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Project
+#include "bitstream_writer.h"
+#include "color_convert.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder.h"
+#include "encoder_backend.h"
+#include "encoder_config.h"
+#include "encoder_manager.h"
+#include "frame_tracer.h"
+#include "mp4_muxer.h"
+#include "nal_parser.h"
+#include "resource_tracker.h"
+#include "software_backend.h"
+
+// ----------------------------------------------------------------------------
+// Benchmark suite
+//
+// Sweeps the encode pipeline over resolution, frame rate, input format,
+// session count and writer mode on whatever backend factory it is given (the
+// stand-in anywhere, the MFT on Windows) and times the CPU kernels on their
+// own. A result is a named set of metrics and goes out as JSON or CSV. The
+// CSV of an earlier run is the baseline for the next one: a metric that got
+// worse by more than the tolerance, and by more than its noise, fails the run.
+// ----------------------------------------------------------------------------
+
+enum class MetricTrend { HigherIsBetter, LowerIsBetter, Informational };
+
+struct BenchmarkMetric
+{
+    std::string name;
+    double value;
+    MetricTrend trend;
+    double noise;                       // changes this small never count as regressions
+};
+
+struct BenchmarkResult
+{
+    std::string name;
+    std::vector<BenchmarkMetric> metrics;
+
+    void add(const char* metric, double value, MetricTrend trend, double noise = 0)
+    {
+        metrics.push_back({ metric, value, trend, noise });
+    }
+
+    const BenchmarkMetric* metric(const std::string& metricName) const
+    {
+        for (const BenchmarkMetric& metric : metrics)
+        {
+            if (metric.name == metricName)
+                return &metric;
+        }
+        return nullptr;
+    }
+};
+
+enum class WriterMode { Buffered, LowLatency };
+
+inline const char* writerModeName(WriterMode mode)
+{
+    return mode == WriterMode::Buffered ? "buffered" : "low-latency";
+}
+
+struct FrameSize
+{
+    uint32_t width;
+    uint32_t height;
+};
+
+struct BenchmarkSuiteOptions
+{
+    EncoderConfig base;                 // everything the sweep does not set
+    std::vector<FrameSize> sizes = { { 640, 360 }, { 1280, 720 }, { 1920, 1080 } };
+    std::vector<Rational> frameRates = { { 30, 1 }, { 60, 1 } };
+    std::vector<FrameFormat> formats = { FrameFormat::NV12, FrameFormat::BGRA };
+    std::vector<uint32_t> sessionCounts = { 1, 4 };
+    std::vector<WriterMode> writers = { WriterMode::Buffered, WriterMode::LowLatency };
+    uint64_t framesPerSession = 240;
+    bool kernels = true;
+    std::string filter;                 // only results whose name contains it
+    double kernelSeconds = 0.3;         // per kernel measurement
+
+    // Running count of heap allocations, when the program counts them
+    std::function<uint64_t()> heapAllocations;
+};
+
+// A short sweep that still covers every axis
+inline void quickSweep(BenchmarkSuiteOptions& options)
+{
+    options.sizes = { { 1280, 720 } };
+    options.frameRates = { { 30, 1 } };
+    options.sessionCounts = { 1, 2 };
+    options.framesPerSession = 90;
+    options.kernelSeconds = 0.1;
+}
+
+// User and kernel time of the whole process
+inline double processCpuSeconds()
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    CHECK(GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user));
+    auto seconds = [](const FILETIME& time) { return (((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7; };
+    return seconds(kernel) + seconds(user);
+#else
+    rusage usage;
+    CHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+inline std::string rateName(const Rational& rate)
+{
+    return rate.den == 1 ? std::to_string(rate.num) : std::to_string(rate.num) + ":" + std::to_string(rate.den);
+}
+
+// ----------------------------------------------------------------------------
+// Encode sweep
+//
+// Every session encodes the same number of frames as fast as the encoder
+// takes them. Throughput, CPU time and allocations count from the point
+// every session has warmed up, so session setup does not weigh in unless
+// the run is too short to tell.
+// ----------------------------------------------------------------------------
+
+struct SweepPoint
+{
+    FrameSize size;
+    Rational frameRate;
+    FrameFormat format;
+    uint32_t sessions;
+    WriterMode writer;
+};
+
+inline std::string sweepPointName(const SweepPoint& point)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "encode/%ux%u@%s/%s/x%u/%s", point.size.width, point.size.height, rateName(point.frameRate).c_str(),
+        frameFormatName(point.format), point.sessions, writerModeName(point.writer));
+    return name;
+}
+
+// False when the backend cannot take the point, or not that many sessions of it
+inline bool runEncodeBenchmark(IEncoderBackendFactory& factory, const SweepPoint& point, const BenchmarkSuiteOptions& options, BenchmarkResult& result)
+{
+    SessionOptions sessionOptions;
+    sessionOptions.config = options.base;
+    sessionOptions.config.width = point.size.width;
+    sessionOptions.config.height = point.size.height;
+    sessionOptions.config.frameRate = point.frameRate;
+    sessionOptions.config.format = point.format;
+    if (point.writer == WriterMode::LowLatency)
+        sessionOptions.writer = lowLatencyWriterOptions();
+    sessionOptions.schedule.frames = options.framesPerSession;
+
+    std::string error;
+    if (!validateConfig(sessionOptions.config, error))
+        return false;
+
+    result.name = sweepPointName(point);
+    std::vector<std::unique_ptr<FrameTracer>> tracers;
+    std::vector<std::shared_ptr<EncoderSession>> sessions;
+    std::vector<std::string> paths;
+
+    // Setup counts as well when a run is over before it could warm up
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point startAt = Clock::now();
+    double startCpu = processCpuSeconds();
+    uint64_t startAllocations = options.heapAllocations ? options.heapAllocations() : 0;
+    ResourceSnapshot startResources = resourceTracker().snapshot();
+
+    EncoderManager manager(factory);
+    for (uint32_t i = 0; i < point.sessions; i++)
+    {
+        tracers.emplace_back(new FrameTracer());
+        sessionOptions.tracer = tracers.back().get();
+        sessionOptions.path = "benchmark_" + std::to_string(i) + ".h264";
+        std::shared_ptr<EncoderSession> session = manager.open(sessionOptions);
+        if (!session)
+            break;
+        sessions.push_back(session);
+        paths.push_back(sessionOptions.path);
+    }
+
+    // Frames in the encoder, and where the warm part of the run starts
+    const uint64_t warmFrames = std::max<uint64_t>(1, std::min<uint64_t>(16, options.framesPerSession / 4));
+    bool warm = false;
+    uint64_t warmOutput = 0;
+    uint64_t warmAllocations = startAllocations;
+    ResourceSnapshot warmResources = startResources;
+    double warmCpu = startCpu;
+    Clock::time_point warmAt = startAt;
+    uint64_t maxInEncoder = 0;
+
+    bool opened = sessions.size() == point.sessions;
+    bool drained = false;
+    while (opened && !drained && Clock::now() - startAt < std::chrono::minutes(10))
+    {
+        drained = true;
+        uint64_t output = 0;
+        uint64_t slowest = UINT64_MAX;
+        for (const std::shared_ptr<EncoderSession>& session : sessions)
+        {
+            Encoder& encoder = session->encoder();
+            uint64_t in = encoder.inputFrames(), out = encoder.outputFrames();
+            maxInEncoder = std::max(maxInEncoder, in > out ? in - out : 0);
+            output += out;
+            slowest = std::min(slowest, out);
+            drained = drained && encoder.drainComplete();
+        }
+
+        if (!warm && slowest >= warmFrames && output < point.sessions * options.framesPerSession / 2)
+        {
+            warm = true;
+            warmOutput = output;
+            warmAllocations = options.heapAllocations ? options.heapAllocations() : 0;
+            warmResources = resourceTracker().snapshot();
+            warmCpu = processCpuSeconds();
+            warmAt = Clock::now();
+        }
+        if (!drained)
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+
+    double seconds = std::chrono::duration<double>(Clock::now() - warmAt).count();
+    double cpu = processCpuSeconds() - warmCpu;
+    uint64_t allocations = options.heapAllocations ? options.heapAllocations() - warmAllocations : 0;
+    ResourceSnapshot endResources = resourceTracker().snapshot();
+
+    // Written stamps and writer counters are final once the writers are closed
+    uint64_t frames = 0;
+    size_t writerQueueBytes = 0;
+    uint64_t writerStalls = 0;
+    for (const std::shared_ptr<EncoderSession>& session : sessions)
+    {
+        session->encoder().closeWriter();
+        frames += session->encoder().outputFrames();
+        BitstreamWriterStats writer = session->encoder().writerStats();
+        writerQueueBytes = std::max(writerQueueBytes, writer.queueHighWaterBytes);
+        writerStalls += writer.producerStalls;
+    }
+    manager.closeAll();
+    sessions.clear();
+    int64_t leftAlive = resourceTracker().snapshot().live() - startResources.live();
+    for (const std::string& path : paths)
+        std::remove(path.c_str());
+
+    if (!opened || !drained)
+        return false;
+
+    LatencyHistogram bitstream, file;
+    for (const std::unique_ptr<FrameTracer>& tracer : tracers)
+    {
+        FrameTracerStats trace = tracer->stats();
+        bitstream.merge(trace.captureToBitstream);
+        file.merge(trace.endToEnd);
+    }
+
+    uint64_t measured = std::max<uint64_t>(1, frames - warmOutput);
+    result.add("frames", (double)frames, MetricTrend::Informational);
+    result.add("fps", measured / seconds, MetricTrend::HigherIsBetter);
+    result.add("cpu_us_per_frame", cpu * 1e6 / measured, MetricTrend::LowerIsBetter, 2);
+    if (options.heapAllocations)
+        result.add("heap_allocs_per_frame", (double)allocations / measured, MetricTrend::LowerIsBetter, 0.5);
+    // Pooled buffers, textures and packets are made while warming up, none
+    // after; whatever the sessions made is gone once they are closed
+    double created = 0;
+    for (ResourceKind kind : { ResourceKind::Buffer, ResourceKind::Texture, ResourceKind::Packet })
+        created += createdPerFrame(warmResources, endResources, kind, measured);
+    result.add("resources_per_frame", created, MetricTrend::LowerIsBetter, 0.05);
+    result.add("resources_left", (double)leftAlive, MetricTrend::LowerIsBetter);
+    result.add("max_frames_in_encoder", (double)maxInEncoder, MetricTrend::Informational);
+    result.add("writer_queue_kb", writerQueueBytes / 1024.0, MetricTrend::Informational);
+    result.add("writer_stalls", (double)writerStalls, MetricTrend::Informational);
+
+    // Tails over a few hundred frames move too much between runs to fail one
+    result.add("latency_p50_ms", bitstream.percentile(0.5) / 1000, MetricTrend::LowerIsBetter, 0.5);
+    result.add("latency_p95_ms", bitstream.percentile(0.95) / 1000, MetricTrend::Informational);
+    result.add("latency_p99_ms", bitstream.percentile(0.99) / 1000, MetricTrend::Informational);
+    result.add("file_latency_p50_ms", file.percentile(0.5) / 1000, MetricTrend::LowerIsBetter, 0.5);
+    result.add("file_latency_p99_ms", file.percentile(0.99) / 1000, MetricTrend::Informational);
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// CPU kernels
+//
+// Color conversion per sweep size, and start code scanning and muxing over a
+// stand-in bitstream, so they run the same on every platform.
+// ----------------------------------------------------------------------------
+
+// Calls work until minSeconds have passed, returns the passes and the seconds
+template <typename Work>
+inline double timeRepeated(double minSeconds, uint64_t& passes, Work&& work)
+{
+    passes = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    do
+    {
+        work();
+        passes++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < minSeconds);
+    return seconds;
+}
+
+inline BenchmarkResult colorKernelBenchmark(const FrameSize& size, double minSeconds)
+{
+    const size_t sourcePitch = (size_t)size.width * 4;
+    std::vector<uint8_t> source(sourcePitch * size.height);
+    for (size_t i = 0; i < source.size(); i++)
+        source[i] = (uint8_t)(i * 7 + i / sourcePitch);
+    std::vector<uint8_t> nv12((size_t)size.width * size.height * 3 / 2);
+    Nv12Frame frame = { nv12.data(), size.width, nv12.data() + (size_t)size.width * size.height, size.width };
+
+    ColorConverter converter(ColorMatrix::BT709, ColorRange::Limited, PixelOrder::BGRA);
+    uint64_t passes;
+    double seconds = timeRepeated(minSeconds, passes, [&]() { converter.convert(source.data(), sourcePitch, size.width, size.height, frame); });
+
+    BenchmarkResult result;
+    result.name = "kernel/color/" + std::to_string(size.width) + "x" + std::to_string(size.height) + "/" + colorKernelName(converter.activeKernel());
+    result.add("mpix_per_s", passes * (double)size.width * size.height / seconds / 1e6, MetricTrend::HigherIsBetter);
+    return result;
+}
+
+class PacketCollector : public IPacketConsumer
+{
+public:
+    void onPacket(const EncodedPacket& packet) override { packets.push_back(packet); }
+
+    std::vector<EncodedPacket> packets;
+};
+
+inline void streamKernelBenchmarks(const BenchmarkSuiteOptions& options, std::vector<BenchmarkResult>& results)
+{
+    const char* rawPath = "benchmark_kernel.h264";
+    const char* path = "benchmark_kernel.mp4";
+
+    // Ten seconds of stand-in bitstream, kept in memory
+    SoftwareBackendOptions backendOptions;
+    backendOptions.config = options.base;
+    backendOptions.latency = std::chrono::microseconds(0);
+    FrameSchedulerOptions schedule;
+    schedule.frames = 300;
+
+    PacketCollector collector;
+    {
+        SoftwareEncoderBackend backend(backendOptions);
+        Encoder encoder(backend, rawPath);
+        encoder.addConsumer(&collector);
+        encoder.setSchedule(schedule);
+        encoder.start();
+        CHECK(encoder.waitForDrain(std::chrono::seconds(60)));
+    }
+    std::remove(rawPath);
+
+    std::vector<uint8_t> stream;
+    for (const EncodedPacket& packet : collector.packets)
+        stream.insert(stream.end(), packet.data(), packet.data() + packet.size());
+
+    NalParser parser;
+    size_t nals = 0;
+    uint64_t passes;
+    double seconds = timeRepeated(options.kernelSeconds, passes, [&]() { parser.forEachNalUnit(stream.data(), stream.size(), [&nals](size_t, size_t) { nals++; }); });
+
+    BenchmarkResult scan;
+    scan.name = std::string("kernel/nal-scan/") + scanKernelName(parser.activeKernel());
+    scan.add("gb_per_s", passes * stream.size() / seconds / 1e9, MetricTrend::HigherIsBetter);
+    scan.add("nal_units", (double)(nals / passes), MetricTrend::Informational);
+    results.push_back(scan);
+
+    Mp4MuxerOptions muxerOptions;
+    muxerOptions.width = backendOptions.config.width;
+    muxerOptions.height = backendOptions.config.height;
+    seconds = timeRepeated(options.kernelSeconds, passes, [&]()
+    {
+        Mp4Muxer muxer(path, muxerOptions);
+        for (const EncodedPacket& packet : collector.packets)
+            muxer.onPacket(packet);
+        muxer.finish();
+    });
+    std::remove(path);
+
+    BenchmarkResult mux;
+    mux.name = "kernel/mp4-mux";
+    mux.add("fps", passes * collector.packets.size() / seconds, MetricTrend::HigherIsBetter);
+    mux.add("mb_per_s", passes * stream.size() / seconds / 1e6, MetricTrend::HigherIsBetter);
+    results.push_back(mux);
+}
+
+// ----------------------------------------------------------------------------
+// Results
+// ----------------------------------------------------------------------------
+
+inline bool writeResultsJson(const char* path, const std::vector<BenchmarkResult>& results)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\"results\":[");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        fprintf(file, "%s\n{\"name\":\"%s\",\"metrics\":{", i ? "," : "", results[i].name.c_str());
+        for (size_t j = 0; j < results[i].metrics.size(); j++)
+            fprintf(file, "%s\"%s\":%.6g", j ? "," : "", results[i].metrics[j].name.c_str(), results[i].metrics[j].value);
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+// One metric per line, which is also the baseline format
+inline bool writeResultsCsv(const char* path, const std::vector<BenchmarkResult>& results)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "name,metric,value\n");
+    for (const BenchmarkResult& result : results)
+    {
+        for (const BenchmarkMetric& metric : result.metrics)
+            fprintf(file, "%s,%s,%.6g\n", result.name.c_str(), metric.name.c_str(), metric.value);
+    }
+    return fclose(file) == 0;
+}
+
+// Values only, what a metric means comes from the current run
+inline bool readResultsCsv(const char* path, std::vector<BenchmarkResult>& results, std::string& error)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+
+    results.clear();
+    std::string line;
+    for (uint32_t number = 1; std::getline(file, line); number++)
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (number == 1 || line.empty())
+            continue;
+
+        size_t first = line.find(','), second = line.rfind(',');
+        char* end = nullptr;
+        double value = first != second ? strtod(line.c_str() + second + 1, &end) : 0;
+        if (first == second || end == line.c_str() + second + 1 || *end != 0)
+        {
+            error = std::string(path) + ":" + std::to_string(number) + ": expected name,metric,value";
+            return false;
+        }
+
+        std::string name = line.substr(0, first);
+        if (results.empty() || results.back().name != name)
+            results.push_back({ name, {} });
+        results.back().add(line.substr(first + 1, second - first - 1).c_str(), value, MetricTrend::Informational);
+    }
+    return true;
+}
+
+struct Regression
+{
+    std::string result;
+    std::string metric;
+    double baseline;
+    double current;
+};
+
+// Metrics that got worse than the baseline by more than tolerance (0.2 =
+// 20%) and their noise. Results or metrics only one side has are left out.
+inline std::vector<Regression> compareResults(const std::vector<BenchmarkResult>& baseline, const std::vector<BenchmarkResult>& current, double tolerance)
+{
+    std::vector<Regression> regressions;
+    for (const BenchmarkResult& result : current)
+    {
+        auto before = std::find_if(baseline.begin(), baseline.end(), [&result](const BenchmarkResult& other) { return other.name == result.name; });
+        if (before == baseline.end())
+            continue;
+
+        for (const BenchmarkMetric& metric : result.metrics)
+        {
+            const BenchmarkMetric* old = before->metric(metric.name);
+            if (!old || metric.trend == MetricTrend::Informational)
+                continue;
+
+            double worse = metric.trend == MetricTrend::HigherIsBetter ? old->value - metric.value : metric.value - old->value;
+            if (worse > tolerance * std::fabs(old->value) && worse > metric.noise)
+                regressions.push_back({ result.name, metric.name, old->value, metric.value });
+        }
+    }
+    return regressions;
+}
+
+// ----------------------------------------------------------------------------
+// Running it
+// ----------------------------------------------------------------------------
+
+inline void printResult(const BenchmarkResult& result)
+{
+    printf("%-44s", result.name.c_str());
+    for (const BenchmarkMetric& metric : result.metrics)
+        printf(" %s=%.4g", metric.name.c_str(), metric.value);
+    printf("\n");
+}
+
+inline std::vector<BenchmarkResult> runBenchmarkSuite(IEncoderBackendFactory& factory, const BenchmarkSuiteOptions& options)
+{
+    std::vector<BenchmarkResult> results;
+    auto wanted = [&options](const std::string& name) { return options.filter.empty() || name.find(options.filter) != std::string::npos; };
+
+    for (const FrameSize& size : options.sizes)
+    for (const Rational& rate : options.frameRates)
+    for (FrameFormat format : options.formats)
+    for (uint32_t sessions : options.sessionCounts)
+    for (WriterMode writer : options.writers)
+    {
+        SweepPoint point = { size, rate, format, sessions, writer };
+        if (!wanted(sweepPointName(point)))
+            continue;
+
+        BenchmarkResult result;
+        if (runEncodeBenchmark(factory, point, options, result))
+        {
+            printResult(result);
+            results.push_back(result);
+        }
+        else
+        {
+            printf("%-44s not supported by this backend\n", sweepPointName(point).c_str());
+        }
+    }
+
+    if (!options.kernels)
+        return results;
+
+    for (const FrameSize& size : options.sizes)
+    {
+        BenchmarkResult result = colorKernelBenchmark(size, options.kernelSeconds);
+        if (wanted(result.name))
+        {
+            printResult(result);
+            results.push_back(result);
+        }
+    }
+
+    std::vector<BenchmarkResult> stream;
+    if (wanted("kernel/nal-scan") || wanted("kernel/mp4-mux"))
+        streamKernelBenchmarks(options, stream);
+    for (const BenchmarkResult& result : stream)
+    {
+        if (wanted(result.name))
+        {
+            printResult(result);
+            results.push_back(result);
+        }
+    }
+    return results;
+}
+
+struct BenchmarkCommand
+{
+    BenchmarkSuiteOptions suite;
+    std::string jsonPath;
+    std::string csvPath;
+    std::string baselinePath;
+    double tolerance = 0.2;
+};
+
+// --quick, --frames N, --filter text, --no-kernels, --json path, --csv path,
+// --baseline path, --tolerance fraction
+inline bool parseBenchmarkArguments(const std::vector<std::string>& args, BenchmarkCommand& command, std::string& error)
+{
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string& arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        if (arg == "--quick")
+            quickSweep(command.suite);
+        else if (arg == "--no-kernels")
+            command.suite.kernels = false;
+        else if (arg == "--frames" && hasValue && parseUnsigned(args[i + 1], command.suite.framesPerSession) && command.suite.framesPerSession != 0)
+            i++;
+        else if (arg == "--filter" && hasValue)
+            command.suite.filter = args[++i];
+        else if (arg == "--json" && hasValue)
+            command.jsonPath = args[++i];
+        else if (arg == "--csv" && hasValue)
+            command.csvPath = args[++i];
+        else if (arg == "--baseline" && hasValue)
+            command.baselinePath = args[++i];
+        else if (arg == "--tolerance" && hasValue)
+        {
+            char* end = nullptr;
+            command.tolerance = strtod(args[++i].c_str(), &end);
+            if (*end != 0 || command.tolerance < 0)
+            {
+                error = "--tolerance takes a fraction, e.g. 0.2";
+                return false;
+            }
+        }
+        else
+        {
+            error = "unknown benchmark argument " + arg;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the suite, writes the results and compares them with the baseline.
+// Returns the process exit code: 1 on a regression, 2 on bad files.
+inline int runBenchmarkCommand(IEncoderBackendFactory& factory, const BenchmarkCommand& command)
+{
+    std::vector<BenchmarkResult> baseline;
+    std::string error;
+    if (!command.baselinePath.empty() && !readResultsCsv(command.baselinePath.c_str(), baseline, error))
+    {
+        fprintf(stderr, "benchmark: %s\n", error.c_str());
+        return 2;
+    }
+
+    std::vector<BenchmarkResult> results = runBenchmarkSuite(factory, command.suite);
+    if (!command.jsonPath.empty() && !writeResultsJson(command.jsonPath.c_str(), results))
+    {
+        fprintf(stderr, "benchmark: cannot write %s\n", command.jsonPath.c_str());
+        return 2;
+    }
+    if (!command.csvPath.empty() && !writeResultsCsv(command.csvPath.c_str(), results))
+    {
+        fprintf(stderr, "benchmark: cannot write %s\n", command.csvPath.c_str());
+        return 2;
+    }
+    if (command.baselinePath.empty())
+        return 0;
+
+    std::vector<Regression> regressions = compareResults(baseline, results, command.tolerance);
+    for (const Regression& regression : regressions)
+    {
+        double change = regression.baseline != 0 ? (regression.current / regression.baseline - 1) * 100 : 0;
+        fprintf(stderr, "REGRESSION %s %s: %.4g -> %.4g (%+.1f%%)\n", regression.result.c_str(), regression.metric.c_str(),
+            regression.baseline, regression.current, change);
+    }
+    printf("benchmark: %zu results, %zu regressions against %s at %.0f%% tolerance\n", results.size(), regressions.size(),
+        command.baselinePath.c_str(), command.tolerance * 100);
+    return regressions.empty() ? 0 : 1;
+}
@@ -0,0 +1,702 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Project
+#include "common.h"
+#include "encoded_packet.h"
+#include "spsc_queue.h"
+
+// ----------------------------------------------------------------------------
+// Output file
+//
+// Gather writes straight from the packets. Direct I/O is only used on Linux,
+// where O_DIRECT can be switched off again for the unaligned tail of the file.
+// sync() gets what was written onto the disk, data only where the platform
+// can tell the difference.
+// ----------------------------------------------------------------------------
+
+class OutputFile
+{
+public:
+    static constexpr size_t MAX_SPANS = 1024;  // IOV_MAX on Linux
+    static constexpr size_t ALIGNMENT = 4096;  // O_DIRECT offsets, sizes and buffers
+
+    ~OutputFile()
+    {
+        close();
+    }
+
+    bool open(const char* path, bool directIo)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return file != INVALID_HANDLE_VALUE;
+#else
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+        if (directIo)
+        {
+            fd = ::open(path, flags | O_DIRECT, 0644);
+            if (fd >= 0)
+            {
+                direct = true;
+                return true;
+            }
+            // Not every file system supports it (tmpfs for one)
+        }
+#endif
+        fd = ::open(path, flags, 0644);
+        return fd >= 0;
+#endif
+    }
+
+    // Gather write of every span, retried until complete
+    bool write(const ByteSpan* spans, size_t count)
+    {
+#ifdef _WIN32
+        for (size_t i = 0; i < count; i++)
+        {
+            DWORD written;
+            if (spans[i].size != 0 && !WriteFile(file, spans[i].data, (DWORD)spans[i].size, &written, nullptr))
+                return false;
+        }
+        return true;
+#else
+        iovec regions[MAX_SPANS];
+        while (count != 0)
+        {
+            int batch = (int)(count < MAX_SPANS ? count : MAX_SPANS);
+            size_t remaining = 0;
+            for (int i = 0; i < batch; i++)
+            {
+                regions[i].iov_base = (void*)spans[i].data;
+                regions[i].iov_len = spans[i].size;
+                remaining += spans[i].size;
+            }
+
+            iovec* next = regions;
+            int left = batch;
+            while (remaining != 0)
+            {
+                ssize_t written = ::writev(fd, next, left);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written < 0)
+                    return false;
+                remaining -= (size_t)written;
+
+                // Short write, skip what made it out
+                while (left > 0 && (size_t)written >= next->iov_len)
+                {
+                    written -= (ssize_t)next->iov_len;
+                    next++;
+                    left--;
+                }
+                if (left > 0)
+                {
+                    next->iov_base = (uint8_t*)next->iov_base + written;
+                    next->iov_len -= (size_t)written;
+                }
+            }
+
+            spans += batch;
+            count -= (size_t)batch;
+        }
+        return true;
+#endif
+    }
+
+    bool sync()
+    {
+#ifdef _WIN32
+        return FlushFileBuffers(file) != 0;
+#elif defined(__linux__)
+        return ::fdatasync(fd) == 0;
+#else
+        return ::fsync(fd) == 0;
+#endif
+    }
+
+    // Buffered writes for the unaligned end of the stream
+    void disableDirectIo()
+    {
+#if !defined(_WIN32) && defined(O_DIRECT)
+        if (direct)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+        direct = false;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+    }
+
+    bool directIo() const { return direct; }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+    bool direct = false;
+};
+
+
+// ----------------------------------------------------------------------------
+// Write journal
+//
+// For durable recordings, see recording_journal.h. The writer thread tells it
+// about every access unit once it is completely in the file, and about every
+// point the file is on disk up to: the start of a GOP, or the end of the
+// stream when the writer closes.
+// ----------------------------------------------------------------------------
+
+struct WrittenUnit
+{
+    uint64_t offset;
+    uint32_t size;
+    int64_t time;
+    int64_t duration;
+    bool keyframe;
+};
+
+class IWriteJournal
+{
+public:
+    virtual ~IWriteJournal() {}
+    virtual void unitWritten(const WrittenUnit& unit) = 0;
+    virtual void synced(uint64_t end, uint64_t units, bool final) = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Asynchronous bitstream writer
+//
+// write() queues a reference to the packet on a lock-free queue and returns; a
+// writer thread gathers everything queued into as few large writes as the
+// flush policy allows, straight out of the encoder's buffers. The producer
+// only blocks when the queue is full. An idle writer sleeps until the next
+// write() wakes it. A failed write or sync stops the writer thread; later
+// packets are dropped and close() returns false.
+// ----------------------------------------------------------------------------
+
+struct BitstreamWriterOptions
+{
+    size_t maxQueuedBytes = 32 << 20;  // packets not in the file yet
+    size_t maxPackets = 4096;
+
+    // Flush policy, whichever comes first
+    size_t flushBytes = 1 << 20;
+    std::chrono::milliseconds flushInterval{100};
+    bool flushOnKeyframe = true;
+
+    // Upper bound for one write, so packets are released while a large backlog drains
+    size_t maxWriteBytes = 4 << 20;
+
+    // Writes multiples of 4096 bytes from an aligned staging buffer with O_DIRECT
+    bool directIo = false;
+
+    // With a journal the file is synced at every GOP boundary, and also once
+    // this much was written since the last sync, so no single sync has a long
+    // GOP to get onto the disk
+    size_t syncBytes = 16 << 20;
+};
+
+// Every access unit goes to the file as soon as it is queued, for
+// interactive streams where the writer must not add latency
+inline BitstreamWriterOptions lowLatencyWriterOptions()
+{
+    BitstreamWriterOptions options;
+    options.flushBytes = 1;
+    options.flushInterval = std::chrono::milliseconds(1);
+    return options;
+}
+
+struct BitstreamWriterStats
+{
+    uint64_t packets = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t writeCalls = 0;
+    uint64_t producerStalls = 0;  // write() found the queue full
+    size_t queueBytes = 0;
+    size_t queuePackets = 0;
+    size_t queueHighWaterBytes = 0;
+    double writeLatencyAvgUs = 0; // write() to the data reaching the file
+    double writeLatencyMaxUs = 0;
+    double writeCallAvgUs = 0;    // one gather write
+    double writeCallMaxUs = 0;
+    uint64_t syncCalls = 0;       // journaled writers only
+    double syncAvgUs = 0;
+    double syncMaxUs = 0;
+};
+
+class BitstreamWriter : public IPacketConsumer
+{
+public:
+    BitstreamWriter(const char* path, const BitstreamWriterOptions& options = BitstreamWriterOptions())
+        : options(options), records(options.maxPackets)
+    {
+        CHECK(options.maxWriteBytes >= OutputFile::ALIGNMENT);
+        CHECK(file.open(path, options.directIo));
+        if (file.directIo())
+        {
+            stagingCapacity = options.maxWriteBytes & ~(OutputFile::ALIGNMENT - 1);
+            staging.resize(stagingCapacity + OutputFile::ALIGNMENT);
+            uintptr_t base = reinterpret_cast<uintptr_t>(staging.data());
+            stagingBytes = reinterpret_cast<uint8_t*>((base + OutputFile::ALIGNMENT - 1) & ~(uintptr_t)(OutputFile::ALIGNMENT - 1));
+        }
+        spans.reserve(OutputFile::MAX_SPANS);
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~BitstreamWriter()
+    {
+        close();
+    }
+
+    void onPacket(const EncodedPacket& packet) override
+    {
+        write(packet);
+    }
+
+    // Producer side, one thread only. Queues a reference, the bytes are not copied.
+    void write(const EncodedPacket& packet)
+    {
+        if (writeFailed.load(std::memory_order_relaxed))
+            return;
+        size_t size = packet.size();
+        bool keyframe = packet.keyframe();
+
+        Record record;
+        record.packet = packet;
+        record.queued = Clock::now();
+
+        // An oversized packet still goes through once the queue is empty
+        bool stalled = false;
+        while (queuedBytes.load(std::memory_order_acquire) != 0 && queuedBytes.load(std::memory_order_acquire) + size > options.maxQueuedBytes &&
+               !writeFailed.load(std::memory_order_relaxed))
+            stalled = waitForSpace();
+        size_t before = queuedBytes.fetch_add(size);
+        size_t queued = before + size;
+        while (!records.push(std::move(record)) && !writeFailed.load(std::memory_order_relaxed))
+            stalled = waitForSpace();
+        if (stalled)
+            producerStalls++;
+
+        if (queued > highWater.load(std::memory_order_relaxed))
+            highWater.store(queued, std::memory_order_relaxed);
+
+        // The first packet after the queue ran empty wakes the idle writer
+        if (before == 0 || queued >= options.flushBytes || (keyframe && options.flushOnKeyframe))
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                flushRequested = true;
+            }
+            wake.notify_one();
+        }
+    }
+
+    // Gets the sample time of every packet once it is completely in the
+    // file, on the writer thread. Set before the first write.
+    void setWrittenCallback(std::function<void(int64_t)> callback)
+    {
+        onWritten = std::move(callback);
+    }
+
+    // Makes the recording durable: the file is synced at GOP boundaries and
+    // the journal hears about it. Set before the first write.
+    void setJournal(IWriteJournal* writeJournal)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        journal = writeJournal;
+    }
+
+    // Flushes everything and stops the writer thread. false when a write or
+    // sync failed, and the file is missing whatever came after it.
+    bool close()
+    {
+        if (worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+            file.close();
+        }
+        return !failed();
+    }
+
+    bool failed() const { return writeFailed.load(); }
+
+    // Bytes written to the queue and not to the file yet, cheap enough per packet
+    size_t queueBytes() const { return queuedBytes.load(std::memory_order_relaxed); }
+
+    BitstreamWriterStats stats() const
+    {
+        BitstreamWriterStats stats;
+        stats.packets = packetsWritten.load();
+        stats.bytesWritten = bytesWritten.load();
+        stats.writeCalls = writeCalls.load();
+        stats.producerStalls = producerStalls.load();
+        stats.queueBytes = queuedBytes.load();
+        stats.queuePackets = records.size() + pendingCount.load();
+        stats.queueHighWaterBytes = highWater.load();
+        if (stats.packets != 0)
+            stats.writeLatencyAvgUs = latencyTotalNs.load() / 1000.0 / stats.packets;
+        stats.writeLatencyMaxUs = latencyMaxNs.load() / 1000.0;
+        if (stats.writeCalls != 0)
+            stats.writeCallAvgUs = writeTotalNs.load() / 1000.0 / stats.writeCalls;
+        stats.writeCallMaxUs = writeMaxNs.load() / 1000.0;
+        stats.syncCalls = syncCalls.load();
+        if (stats.syncCalls != 0)
+            stats.syncAvgUs = syncTotalNs.load() / 1000.0 / stats.syncCalls;
+        stats.syncMaxUs = syncMaxNs.load() / 1000.0;
+        return stats;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Record
+    {
+        EncodedPacket packet;
+        Clock::time_point queued;
+    };
+
+    // Collected but not completely in the file yet
+    struct Pending
+    {
+        EncodedPacket packet; // dropped early once copied to the staging buffer
+        uint64_t end;         // stream position right after the packet
+        uint32_t size;
+        int64_t time;
+        int64_t duration;
+        bool keyframe;
+        Clock::time_point queued;
+    };
+
+    bool waitForSpace()
+    {
+        wake.notify_one();
+        std::this_thread::yield();
+        return true;
+    }
+
+    // A CHECK failing on this thread must not reach std::terminate, the
+    // producer learns about it from write() and close()
+    void run()
+    {
+        try
+        {
+            writeLoop();
+        }
+        catch (...)
+        {
+            writeFailed = true;
+        }
+    }
+
+    void writeLoop()
+    {
+        // Often enough to flush on time, never a zero timeout
+        const std::chrono::microseconds poll =
+            std::max(std::chrono::duration_cast<std::chrono::microseconds>(options.flushInterval) / 4, std::chrono::microseconds(1000));
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            bool stop = stopping;
+            bool durable = journal != nullptr;
+            flushRequested = false;
+            lock.unlock();
+
+            bool keyframe = collect();
+            if (stop || shouldFlush(keyframe))
+                flush(stop);
+            if (durable)
+                sync(stop);
+
+            lock.lock();
+            if (stop)
+                break;
+
+            // With nothing queued or pending, write() wakes this thread
+            auto woken = [this]() { return stopping || flushRequested; };
+            if (queuedBytes.load() == 0)
+                wake.wait(lock, woken);
+            else
+                wake.wait_for(lock, poll, woken);
+        }
+    }
+
+    // Moves newly queued packets into the pending list
+    bool collect()
+    {
+        bool keyframe = false;
+        Record record;
+        while (records.pop(record))
+        {
+            keyframe |= record.packet.keyframe();
+            collected += record.packet.size();
+
+            Pending entry;
+            entry.size = (uint32_t)record.packet.size();
+            entry.time = record.packet.time();
+            entry.duration = record.packet.duration();
+            entry.keyframe = record.packet.keyframe();
+            entry.packet = std::move(record.packet);
+            entry.end = collected;
+            entry.queued = record.queued;
+            pending.push_back(std::move(entry));
+        }
+        pendingCount.store(pending.size());
+        return keyframe;
+    }
+
+    bool shouldFlush(bool keyframe) const
+    {
+        if (pending.empty())
+            return false;
+        if (keyframe && options.flushOnKeyframe)
+            return true;
+        if (collected - written >= options.flushBytes)
+            return true;
+        return Clock::now() - pending.front().queued >= options.flushInterval;
+    }
+
+    void flush(bool final)
+    {
+        if (file.directIo())
+            flushDirect(final);
+        else
+            flushBuffered();
+    }
+
+    // One gather write per chunk, straight from the packets
+    void flushBuffered()
+    {
+        while (written < collected)
+        {
+            spans.clear();
+            size_t size = 0;
+            uint64_t position = written;
+            for (const Pending& entry : pending)
+            {
+                if (size == options.maxWriteBytes || spans.size() == OutputFile::MAX_SPANS)
+                    break;
+
+                size_t packetSize = entry.packet.size();
+                size_t offset = (size_t)(position - (entry.end - packetSize));
+                size_t count = packetSize - offset;
+                if (count > options.maxWriteBytes - size)
+                    count = options.maxWriteBytes - size;
+
+                spans.push_back(entry.packet.span(offset, count));
+                size += count;
+                position += count;
+            }
+            writeSpans(size);
+        }
+    }
+
+    // Direct I/O writes whole blocks from the staging buffer, the remainder
+    // waits there for more data
+    void flushDirect(bool final)
+    {
+        while (true)
+        {
+            for (Pending& entry : pending)
+            {
+                uint64_t staged = written + stagingFill;
+                if (entry.end <= staged)
+                    continue;
+                if (stagingFill == stagingCapacity)
+                    break;
+
+                size_t packetSize = entry.packet.size();
+                size_t offset = (size_t)(staged - (entry.end - packetSize));
+                size_t count = packetSize - offset;
+                if (count > stagingCapacity - stagingFill)
+                    count = stagingCapacity - stagingFill;
+
+                memcpy(stagingBytes + stagingFill, entry.packet.data() + offset, count);
+                stagingFill += count;
+                if (offset + count == packetSize)
+                    entry.packet.reset();
+            }
+
+            size_t size = stagingFill & ~(OutputFile::ALIGNMENT - 1);
+            if (size == 0)
+            {
+                if (!final || stagingFill == 0)
+                    return;
+                file.disableDirectIo();
+                size = stagingFill;
+            }
+
+            spans.clear();
+            spans.push_back({ stagingBytes, size });
+            writeSpans(size);
+
+            memmove(stagingBytes, stagingBytes + size, stagingFill - size);
+            stagingFill -= size;
+        }
+    }
+
+    void writeSpans(size_t size)
+    {
+        Clock::time_point writeStart = Clock::now();
+        CHECK(file.write(spans.data(), spans.size()));
+        Clock::time_point done = Clock::now();
+
+        accumulate(writeTotalNs, writeMaxNs, done - writeStart);
+        writeCalls++;
+        bytesWritten += size;
+        written += size;
+        queuedBytes -= size;
+
+        // Retire the packets that are now completely in the file
+        size_t retired = 0;
+        while (!pending.empty() && pending.front().end <= written)
+        {
+            const Pending& entry = pending.front();
+            accumulate(latencyTotalNs, latencyMaxNs, done - entry.queued);
+            if (onWritten)
+                onWritten(entry.time);
+            if (journal)
+            {
+                // A keyframe ends the GOP before it
+                uint64_t offset = entry.end - entry.size;
+                if (entry.keyframe && unitsWritten != 0)
+                {
+                    gopEnd = offset;
+                    gopUnits = unitsWritten;
+                }
+                journal->unitWritten({ offset, entry.size, entry.time, entry.duration, entry.keyframe });
+            }
+            unitsWritten++;
+            pending.pop_front();
+            retired++;
+        }
+        pendingCount.store(pending.size());
+        packetsWritten += retired;
+
+        if (journal && written - synced >= options.syncBytes)
+            syncFile();
+    }
+
+    // Syncs once the file got past a GOP boundary and tells the journal. The
+    // last sync covers everything: a stream ends on a complete access unit.
+    // Inside a GOP, writeSpans() syncs every syncBytes, so no sync has more
+    // than that and one write to get onto the disk.
+    void sync(bool final)
+    {
+        bool boundary = final || gopEnd > committed;
+        if (!boundary)
+            return;
+
+        if (written != synced)
+            syncFile();
+        if (final)
+            journal->synced(written, unitsWritten, true);
+        else if (boundary)
+            journal->synced(gopEnd, gopUnits, false);
+        committed = final ? written : gopEnd;
+    }
+
+    void syncFile()
+    {
+        Clock::time_point start = Clock::now();
+        CHECK(file.sync());
+        accumulate(syncTotalNs, syncMaxNs, Clock::now() - start);
+        syncCalls++;
+        synced = written;
+    }
+
+    static void accumulate(std::atomic<uint64_t>& total, std::atomic<uint64_t>& max, Clock::duration elapsed)
+    {
+        uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        total += ns;
+        if (ns > max.load(std::memory_order_relaxed))
+            max.store(ns, std::memory_order_relaxed);
+    }
+
+    BitstreamWriterOptions options;
+    OutputFile file;
+    SpscQueue<Record> records;
+
+    // Writer thread only
+    std::deque<Pending> pending;
+    std::vector<ByteSpan> spans;
+    uint64_t collected = 0;
+    uint64_t written = 0;
+    std::vector<uint8_t> staging;
+    uint8_t* stagingBytes = nullptr;
+    size_t stagingCapacity = 0;
+    size_t stagingFill = 0;
+
+    std::function<void(int64_t)> onWritten;
+
+    // Durable recordings, writer thread only
+    IWriteJournal* journal = nullptr;
+    uint64_t unitsWritten = 0;
+    uint64_t gopEnd = 0;      // where the last GOP boundary in the file is
+    uint64_t gopUnits = 0;    // and the access units before it
+    uint64_t synced = 0;
+    uint64_t committed = 0;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    bool flushRequested = false;
+    std::atomic<bool> writeFailed{false};
+
+    std::atomic<size_t> queuedBytes{0};
+    std::atomic<size_t> highWater{0};
+    std::atomic<size_t> pendingCount{0};
+    std::atomic<uint64_t> packetsWritten{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> writeCalls{0};
+    std::atomic<uint64_t> producerStalls{0};
+    std::atomic<uint64_t> latencyTotalNs{0};
+    std::atomic<uint64_t> latencyMaxNs{0};
+    std::atomic<uint64_t> writeTotalNs{0};
+    std::atomic<uint64_t> writeMaxNs{0};
+    std::atomic<uint64_t> syncCalls{0};
+    std::atomic<uint64_t> syncTotalNs{0};
+    std::atomic<uint64_t> syncMaxNs{0};
+};
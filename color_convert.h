@@ -0,0 +1,426 @@
+#pragma once
+
+// std
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+#include "cpu_features.h"
+
+// ----------------------------------------------------------------------------
+// BGRA/RGBA -> NV12 color conversion
+//
+// Every kernel does the same Q14 fixed point math in 32 bit lanes, so the SIMD
+// paths are bit exact with the scalar one. Chroma is taken from the sum of each
+// 2x2 block and scaled down together with the coefficients.
+// ----------------------------------------------------------------------------
+
+enum class ColorMatrix { BT601, BT709 };
+enum class ColorRange { Limited, Full };
+enum class PixelOrder { BGRA, RGBA };
+enum class ColorKernel { Auto, Scalar, Sse41, Avx2, Neon };
+
+inline const char* colorKernelName(ColorKernel kernel)
+{
+    switch (kernel)
+    {
+    case ColorKernel::Scalar: return "scalar";
+    case ColorKernel::Sse41: return "sse4.1";
+    case ColorKernel::Avx2: return "avx2";
+    case ColorKernel::Neon: return "neon";
+    default: return "auto";
+    }
+}
+
+inline bool colorKernelSupported(ColorKernel kernel)
+{
+    switch (kernel)
+    {
+    case ColorKernel::Scalar: return true;
+    case ColorKernel::Sse41: return cpuFeatures().sse41;
+    case ColorKernel::Avx2: return cpuFeatures().avx2;
+    case ColorKernel::Neon: return cpuFeatures().neon;
+    default: return false;
+    }
+}
+
+inline ColorKernel bestColorKernel()
+{
+    if (colorKernelSupported(ColorKernel::Avx2))
+        return ColorKernel::Avx2;
+    if (colorKernelSupported(ColorKernel::Neon))
+        return ColorKernel::Neon;
+    if (colorKernelSupported(ColorKernel::Sse41))
+        return ColorKernel::Sse41;
+    return ColorKernel::Scalar;
+}
+
+// Coefficients are in source byte order, so BGRA and RGBA share the kernels
+struct ColorConvertParams
+{
+    static constexpr int SHIFT = 14;
+
+    int32_t y[3];
+    int32_t u[3];
+    int32_t v[3];
+    int32_t yOffset;
+};
+
+inline ColorConvertParams makeColorConvertParams(ColorMatrix matrix, ColorRange range, PixelOrder order)
+{
+    const double one = 1 << ColorConvertParams::SHIFT;
+    double kr = matrix == ColorMatrix::BT709 ? 0.2126 : 0.299;
+    double kb = matrix == ColorMatrix::BT709 ? 0.0722 : 0.114;
+    double yScale = range == ColorRange::Full ? 1.0 : 219.0 / 255.0;
+    double cScale = range == ColorRange::Full ? 1.0 : 224.0 / 255.0;
+
+    // Green absorbs the rounding so white and gray map exactly
+    int32_t yr = (int32_t)std::lround(kr * yScale * one);
+    int32_t yb = (int32_t)std::lround(kb * yScale * one);
+    int32_t yg = (int32_t)std::lround(yScale * one) - yr - yb;
+
+    int32_t cMax = (int32_t)std::lround(0.5 * cScale * one);
+    int32_t ur = (int32_t)std::lround(-kr / (2.0 * (1.0 - kb)) * cScale * one);
+    int32_t ug = -cMax - ur;
+    int32_t vb = (int32_t)std::lround(-kb / (2.0 * (1.0 - kr)) * cScale * one);
+    int32_t vg = -cMax - vb;
+
+    ColorConvertParams params;
+    int r = order == PixelOrder::BGRA ? 2 : 0;
+    int b = 2 - r;
+    params.y[r] = yr; params.y[1] = yg; params.y[b] = yb;
+    params.u[r] = ur; params.u[1] = ug; params.u[b] = cMax;
+    params.v[r] = cMax; params.v[1] = vg; params.v[b] = vb;
+    params.yOffset = range == ColorRange::Full ? 0 : 16;
+    return params;
+}
+
+struct Nv12Frame
+{
+    uint8_t* y;
+    size_t yPitch;
+    uint8_t* uv;
+    size_t uvPitch;
+};
+
+// Converts two source rows into two luma rows and one interleaved chroma row
+typedef void (*Nv12RowPairFn)(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, uint32_t width, const ColorConvertParams& p);
+
+// ----------------------------------------------------------------------------
+// Scalar
+// ----------------------------------------------------------------------------
+
+inline uint8_t clampToByte(int32_t value)
+{
+    return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+inline uint8_t lumaScalar(const uint8_t* px, const ColorConvertParams& p)
+{
+    int32_t sum = p.y[0] * px[0] + p.y[1] * px[1] + p.y[2] * px[2];
+    return clampToByte(((sum + (1 << (ColorConvertParams::SHIFT - 1))) >> ColorConvertParams::SHIFT) + p.yOffset);
+}
+
+inline uint8_t chromaScalar(const int32_t* sums, const int32_t* coef)
+{
+    // sums cover a 2x2 block, hence the two extra bits of shift
+    int32_t sum = coef[0] * sums[0] + coef[1] * sums[1] + coef[2] * sums[2];
+    return clampToByte(((sum + (1 << (ColorConvertParams::SHIFT + 1))) >> (ColorConvertParams::SHIFT + 2)) + 128);
+}
+
+inline void nv12RowPairScalar(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, uint32_t width, const ColorConvertParams& p)
+{
+    for (uint32_t x = 0; x < width; x += 2)
+    {
+        const uint8_t* a = src0 + x * 4;
+        const uint8_t* b = src1 + x * 4;
+
+        y0[x] = lumaScalar(a, p);
+        y0[x + 1] = lumaScalar(a + 4, p);
+        y1[x] = lumaScalar(b, p);
+        y1[x + 1] = lumaScalar(b + 4, p);
+
+        int32_t sums[3];
+        for (int c = 0; c < 3; c++)
+            sums[c] = a[c] + a[c + 4] + b[c] + b[c + 4];
+
+        uv[x] = chromaScalar(sums, p.u);
+        uv[x + 1] = chromaScalar(sums, p.v);
+    }
+}
+
+#if defined(ARCH_X86)
+
+// ----------------------------------------------------------------------------
+// SSE4.1, 8 pixels per iteration
+// ----------------------------------------------------------------------------
+
+// lo and hi hold two 16 bit pixels each, returns four 32 bit weighted sums
+TARGET_SSE41 inline __m128i weightedSumSse41(__m128i lo, __m128i hi, __m128i coef)
+{
+    return _mm_hadd_epi32(_mm_madd_epi16(lo, coef), _mm_madd_epi16(hi, coef));
+}
+
+TARGET_SSE41 inline __m128i scaleSse41(__m128i sum, int shift, int32_t offset)
+{
+    __m128i rounded = _mm_add_epi32(sum, _mm_set1_epi32(1 << (shift - 1)));
+    return _mm_add_epi32(_mm_sra_epi32(rounded, _mm_cvtsi32_si128(shift)), _mm_set1_epi32(offset));
+}
+
+TARGET_SSE41 inline void nv12RowPairSse41(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, uint32_t width, const ColorConvertParams& p)
+{
+    const int yShift = ColorConvertParams::SHIFT;
+    const int cShift = ColorConvertParams::SHIFT + 2;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i yCoef = _mm_setr_epi16((short)p.y[0], (short)p.y[1], (short)p.y[2], 0, (short)p.y[0], (short)p.y[1], (short)p.y[2], 0);
+    const __m128i uCoef = _mm_setr_epi16((short)p.u[0], (short)p.u[1], (short)p.u[2], 0, (short)p.u[0], (short)p.u[1], (short)p.u[2], 0);
+    const __m128i vCoef = _mm_setr_epi16((short)p.v[0], (short)p.v[1], (short)p.v[2], 0, (short)p.v[0], (short)p.v[1], (short)p.v[2], 0);
+
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + x * 4));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + x * 4 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + x * 4));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + x * 4 + 16));
+
+        // Widen to 16 bit, two pixels per register
+        __m128i a00 = _mm_unpacklo_epi8(a0, zero);
+        __m128i a01 = _mm_unpackhi_epi8(a0, zero);
+        __m128i a10 = _mm_unpacklo_epi8(a1, zero);
+        __m128i a11 = _mm_unpackhi_epi8(a1, zero);
+        __m128i b00 = _mm_unpacklo_epi8(b0, zero);
+        __m128i b01 = _mm_unpackhi_epi8(b0, zero);
+        __m128i b10 = _mm_unpacklo_epi8(b1, zero);
+        __m128i b11 = _mm_unpackhi_epi8(b1, zero);
+
+        // Luma
+        __m128i ya = _mm_packs_epi32(scaleSse41(weightedSumSse41(a00, a01, yCoef), yShift, p.yOffset), scaleSse41(weightedSumSse41(a10, a11, yCoef), yShift, p.yOffset));
+        __m128i yb = _mm_packs_epi32(scaleSse41(weightedSumSse41(b00, b01, yCoef), yShift, p.yOffset), scaleSse41(weightedSumSse41(b10, b11, yCoef), yShift, p.yOffset));
+        _mm_storel_epi64((__m128i*)(y0 + x), _mm_packus_epi16(ya, zero));
+        _mm_storel_epi64((__m128i*)(y1 + x), _mm_packus_epi16(yb, zero));
+
+        // Chroma from the vertical pair sums, horizontal pairs folded by hadd
+        __m128i s00 = _mm_add_epi16(a00, b00);
+        __m128i s01 = _mm_add_epi16(a01, b01);
+        __m128i s10 = _mm_add_epi16(a10, b10);
+        __m128i s11 = _mm_add_epi16(a11, b11);
+
+        __m128i u = _mm_hadd_epi32(weightedSumSse41(s00, s01, uCoef), weightedSumSse41(s10, s11, uCoef));
+        __m128i v = _mm_hadd_epi32(weightedSumSse41(s00, s01, vCoef), weightedSumSse41(s10, s11, vCoef));
+        u = scaleSse41(u, cShift, 128);
+        v = scaleSse41(v, cShift, 128);
+
+        __m128i uv16 = _mm_packs_epi32(_mm_unpacklo_epi32(u, v), _mm_unpackhi_epi32(u, v));
+        _mm_storel_epi64((__m128i*)(uv + x), _mm_packus_epi16(uv16, zero));
+    }
+
+    if (x < width)
+        nv12RowPairScalar(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, uv + x, width - x, p);
+}
+
+// ----------------------------------------------------------------------------
+// AVX2, 16 pixels per iteration
+//
+// hadd and pack work within 128 bit lanes, so results come out as
+// px0-3, px8-11 | px4-7, px12-15 and get one permute before the store.
+// ----------------------------------------------------------------------------
+
+TARGET_AVX2 inline __m256i weightedSumAvx2(__m256i lo, __m256i hi, __m256i coef)
+{
+    return _mm256_hadd_epi32(_mm256_madd_epi16(lo, coef), _mm256_madd_epi16(hi, coef));
+}
+
+TARGET_AVX2 inline __m256i scaleAvx2(__m256i sum, int shift, int32_t offset)
+{
+    __m256i rounded = _mm256_add_epi32(sum, _mm256_set1_epi32(1 << (shift - 1)));
+    return _mm256_add_epi32(_mm256_sra_epi32(rounded, _mm_cvtsi32_si128(shift)), _mm256_set1_epi32(offset));
+}
+
+TARGET_AVX2 inline __m128i packOrderedAvx2(__m256i lo, __m256i hi)
+{
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+}
+
+TARGET_AVX2 inline void nv12RowPairAvx2(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, uint32_t width, const ColorConvertParams& p)
+{
+    const int yShift = ColorConvertParams::SHIFT;
+    const int cShift = ColorConvertParams::SHIFT + 2;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i yCoef = _mm256_setr_epi16((short)p.y[0], (short)p.y[1], (short)p.y[2], 0, (short)p.y[0], (short)p.y[1], (short)p.y[2], 0,
+                                            (short)p.y[0], (short)p.y[1], (short)p.y[2], 0, (short)p.y[0], (short)p.y[1], (short)p.y[2], 0);
+    const __m256i uCoef = _mm256_setr_epi16((short)p.u[0], (short)p.u[1], (short)p.u[2], 0, (short)p.u[0], (short)p.u[1], (short)p.u[2], 0,
+                                            (short)p.u[0], (short)p.u[1], (short)p.u[2], 0, (short)p.u[0], (short)p.u[1], (short)p.u[2], 0);
+    const __m256i vCoef = _mm256_setr_epi16((short)p.v[0], (short)p.v[1], (short)p.v[2], 0, (short)p.v[0], (short)p.v[1], (short)p.v[2], 0,
+                                            (short)p.v[0], (short)p.v[1], (short)p.v[2], 0, (short)p.v[0], (short)p.v[1], (short)p.v[2], 0);
+
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + x * 4));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + x * 4 + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + x * 4));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + x * 4 + 32));
+
+        __m256i a0l = _mm256_unpacklo_epi8(a0, zero);
+        __m256i a0h = _mm256_unpackhi_epi8(a0, zero);
+        __m256i a1l = _mm256_unpacklo_epi8(a1, zero);
+        __m256i a1h = _mm256_unpackhi_epi8(a1, zero);
+        __m256i b0l = _mm256_unpacklo_epi8(b0, zero);
+        __m256i b0h = _mm256_unpackhi_epi8(b0, zero);
+        __m256i b1l = _mm256_unpacklo_epi8(b1, zero);
+        __m256i b1h = _mm256_unpackhi_epi8(b1, zero);
+
+        // Luma
+        __m128i ya = packOrderedAvx2(scaleAvx2(weightedSumAvx2(a0l, a0h, yCoef), yShift, p.yOffset), scaleAvx2(weightedSumAvx2(a1l, a1h, yCoef), yShift, p.yOffset));
+        __m128i yb = packOrderedAvx2(scaleAvx2(weightedSumAvx2(b0l, b0h, yCoef), yShift, p.yOffset), scaleAvx2(weightedSumAvx2(b1l, b1h, yCoef), yShift, p.yOffset));
+        _mm_storeu_si128((__m128i*)(y0 + x), ya);
+        _mm_storeu_si128((__m128i*)(y1 + x), yb);
+
+        // Chroma
+        __m256i s0l = _mm256_add_epi16(a0l, b0l);
+        __m256i s0h = _mm256_add_epi16(a0h, b0h);
+        __m256i s1l = _mm256_add_epi16(a1l, b1l);
+        __m256i s1h = _mm256_add_epi16(a1h, b1h);
+
+        __m256i u = _mm256_hadd_epi32(weightedSumAvx2(s0l, s0h, uCoef), weightedSumAvx2(s1l, s1h, uCoef));
+        __m256i v = _mm256_hadd_epi32(weightedSumAvx2(s0l, s0h, vCoef), weightedSumAvx2(s1l, s1h, vCoef));
+        u = scaleAvx2(u, cShift, 128);
+        v = scaleAvx2(v, cShift, 128);
+
+        _mm_storeu_si128((__m128i*)(uv + x), packOrderedAvx2(_mm256_unpacklo_epi32(u, v), _mm256_unpackhi_epi32(u, v)));
+    }
+
+    if (x < width)
+        nv12RowPairSse41(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, uv + x, width - x, p);
+}
+
+#endif
+
+#if defined(ARCH_ARM64)
+
+// ----------------------------------------------------------------------------
+// NEON, 16 pixels per iteration
+// ----------------------------------------------------------------------------
+
+inline uint16x4_t lumaNeon(uint16x4_t c0, uint16x4_t c1, uint16x4_t c2, const ColorConvertParams& p)
+{
+    uint32x4_t sum = vmull_n_u16(c0, (uint16_t)p.y[0]);
+    sum = vmlal_n_u16(sum, c1, (uint16_t)p.y[1]);
+    sum = vmlal_n_u16(sum, c2, (uint16_t)p.y[2]);
+    sum = vshrq_n_u32(vaddq_u32(sum, vdupq_n_u32(1 << (ColorConvertParams::SHIFT - 1))), ColorConvertParams::SHIFT);
+    return vqmovn_u32(vaddq_u32(sum, vdupq_n_u32((uint32_t)p.yOffset)));
+}
+
+inline uint8x16_t lumaRowNeon(const uint8x16x4_t& px, const ColorConvertParams& p)
+{
+    uint16x8_t c0l = vmovl_u8(vget_low_u8(px.val[0]));
+    uint16x8_t c1l = vmovl_u8(vget_low_u8(px.val[1]));
+    uint16x8_t c2l = vmovl_u8(vget_low_u8(px.val[2]));
+    uint16x8_t c0h = vmovl_u8(vget_high_u8(px.val[0]));
+    uint16x8_t c1h = vmovl_u8(vget_high_u8(px.val[1]));
+    uint16x8_t c2h = vmovl_u8(vget_high_u8(px.val[2]));
+
+    uint16x8_t lo = vcombine_u16(lumaNeon(vget_low_u16(c0l), vget_low_u16(c1l), vget_low_u16(c2l), p), lumaNeon(vget_high_u16(c0l), vget_high_u16(c1l), vget_high_u16(c2l), p));
+    uint16x8_t hi = vcombine_u16(lumaNeon(vget_low_u16(c0h), vget_low_u16(c1h), vget_low_u16(c2h), p), lumaNeon(vget_high_u16(c0h), vget_high_u16(c1h), vget_high_u16(c2h), p));
+    return vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi));
+}
+
+inline int16x4_t chromaNeon(int32x4_t s0, int32x4_t s1, int32x4_t s2, const int32_t* coef)
+{
+    int32x4_t sum = vmulq_n_s32(s0, coef[0]);
+    sum = vmlaq_n_s32(sum, s1, coef[1]);
+    sum = vmlaq_n_s32(sum, s2, coef[2]);
+    sum = vshrq_n_s32(vaddq_s32(sum, vdupq_n_s32(1 << (ColorConvertParams::SHIFT + 1))), ColorConvertParams::SHIFT + 2);
+    return vqmovn_s32(vaddq_s32(sum, vdupq_n_s32(128)));
+}
+
+inline void nv12RowPairNeon(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* uv, uint32_t width, const ColorConvertParams& p)
+{
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x4_t a = vld4q_u8(src0 + x * 4);
+        uint8x16x4_t b = vld4q_u8(src1 + x * 4);
+
+        vst1q_u8(y0 + x, lumaRowNeon(a, p));
+        vst1q_u8(y1 + x, lumaRowNeon(b, p));
+
+        // 2x2 sums per channel, at most 1020 so they fit signed 16 bit
+        int16x8_t s[3];
+        for (int c = 0; c < 3; c++)
+            s[c] = vreinterpretq_s16_u16(vpadalq_u8(vpaddlq_u8(a.val[c]), b.val[c]));
+
+        int16x8_t u = vcombine_s16(chromaNeon(vmovl_s16(vget_low_s16(s[0])), vmovl_s16(vget_low_s16(s[1])), vmovl_s16(vget_low_s16(s[2])), p.u),
+                                   chromaNeon(vmovl_s16(vget_high_s16(s[0])), vmovl_s16(vget_high_s16(s[1])), vmovl_s16(vget_high_s16(s[2])), p.u));
+        int16x8_t v = vcombine_s16(chromaNeon(vmovl_s16(vget_low_s16(s[0])), vmovl_s16(vget_low_s16(s[1])), vmovl_s16(vget_low_s16(s[2])), p.v),
+                                   chromaNeon(vmovl_s16(vget_high_s16(s[0])), vmovl_s16(vget_high_s16(s[1])), vmovl_s16(vget_high_s16(s[2])), p.v));
+
+        uint8x8x2_t interleaved;
+        interleaved.val[0] = vqmovun_s16(u);
+        interleaved.val[1] = vqmovun_s16(v);
+        vst2_u8(uv + x, interleaved);
+    }
+
+    if (x < width)
+        nv12RowPairScalar(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, uv + x, width - x, p);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Converter
+// ----------------------------------------------------------------------------
+
+class ColorConverter
+{
+public:
+    ColorConverter(ColorMatrix matrix, ColorRange range, PixelOrder order, ColorKernel kernel = ColorKernel::Auto)
+        : params(makeColorConvertParams(matrix, range, order))
+    {
+        if (kernel == ColorKernel::Auto)
+            kernel = bestColorKernel();
+        CHECK(colorKernelSupported(kernel));
+        this->kernel = kernel;
+
+        switch (kernel)
+        {
+#if defined(ARCH_X86)
+        case ColorKernel::Sse41: rowPair = nv12RowPairSse41; break;
+        case ColorKernel::Avx2: rowPair = nv12RowPairAvx2; break;
+#endif
+#if defined(ARCH_ARM64)
+        case ColorKernel::Neon: rowPair = nv12RowPairNeon; break;
+#endif
+        default: rowPair = nv12RowPairScalar; break;
+        }
+    }
+
+    // NV12 needs even dimensions
+    void convert(const uint8_t* src, size_t srcPitch, uint32_t width, uint32_t height, const Nv12Frame& dst) const
+    {
+        convertRows(src, srcPitch, width, 0, height, dst);
+    }
+
+    // Converts rows [rowBegin, rowEnd), both even, so frames can be split into bands
+    void convertRows(const uint8_t* src, size_t srcPitch, uint32_t width, uint32_t rowBegin, uint32_t rowEnd, const Nv12Frame& dst) const
+    {
+        CHECK(width % 2 == 0 && rowBegin % 2 == 0 && rowEnd % 2 == 0);
+
+        for (uint32_t row = rowBegin; row < rowEnd; row += 2)
+        {
+            const uint8_t* src0 = src + srcPitch * row;
+            rowPair(src0, src0 + srcPitch, dst.y + dst.yPitch * row, dst.y + dst.yPitch * (row + 1), dst.uv + dst.uvPitch * (row / 2), width, params);
+        }
+    }
+
+    ColorKernel activeKernel() const { return kernel; }
+    const ColorConvertParams& parameters() const { return params; }
+
+private:
+    ColorConvertParams params;
+    ColorKernel kernel;
+    Nv12RowPairFn rowPair;
+};
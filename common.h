@@ -0,0 +1,11 @@
+#pragma once
+
+// std
+#include <cstdio>
+#include <exception>
+
+// Error handling
+#define CHECK(x) if (!(x)) { printf("%s(%d) %s was false\n", __FILE__, __LINE__, #x); throw std::exception(); }
+#ifdef _WIN32
+#define CHECK_HR(x) { HRESULT hr_ = (x); if (FAILED(hr_)) { printf("%s(%d) %s failed with 0x%x\n", __FILE__, __LINE__, #x, hr_); throw std::exception(); } }
+#endif
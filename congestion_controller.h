@@ -0,0 +1,163 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// ----------------------------------------------------------------------------
+// Congestion controller
+//
+// Turns transport feedback into encoder bitrate targets, along the lines of
+// the delay and loss based controllers real-time video uses. Rising queueing
+// delay means the link is full: the estimate drops below what actually got
+// through. A clear path is probed multiplicatively, and additively close to
+// the rate that last overused. Heavy loss cuts the estimate, moderate loss
+// holds it.
+//
+// Time only comes in with the feedback, so the controller is deterministic
+// and runs the same against a simulated link as against a real one. The
+// encoder is only retargeted on changes worth a reconfiguration: decreases
+// right away, increases at most every increaseIntervalUs.
+// ----------------------------------------------------------------------------
+
+struct TransportFeedback
+{
+    int64_t timeUs;                             // when the receiver sent the report, monotonic
+    uint32_t receivedBitrate;                   // what arrived over the report interval, bits/s
+    double lossFraction;                        // of what was sent over the interval
+    int64_t queueDelayUs;                       // one-way delay above the lowest seen
+};
+
+struct CongestionControllerOptions
+{
+    uint32_t startBitrate = 2000000;
+    uint32_t minBitrate = 250000;
+    uint32_t maxBitrate = 8000000;
+
+    int64_t overuseDelayUs = 30000;             // queueing delay that means the link is full
+    double decreaseFactor = 0.85;               // of the received rate on overuse
+    int64_t decreaseIntervalUs = 300000;        // one decrease per overuse, not one per report
+    double increasePerSecond = 0.10;            // multiplicative probing on a clear path
+    uint32_t additiveBitsPerSecond = 150000;    // near the rate that last overused
+    double lossHigh = 0.10;                     // above this the estimate is cut
+    double lossLow = 0.02;                      // between the two it holds
+
+    int64_t increaseIntervalUs = 500000;        // fewest time between two raises of the target
+    double hysteresis = 0.05;                   // smaller changes are not worth a reconfiguration
+};
+
+enum class CongestionState { Increase, Hold, Decrease };
+
+struct CongestionControllerStats
+{
+    uint64_t reports = 0;
+    uint64_t delayDecreases = 0;
+    uint64_t lossDecreases = 0;
+    uint64_t targetChanges = 0;
+};
+
+class CongestionController
+{
+public:
+    explicit CongestionController(const CongestionControllerOptions& options = CongestionControllerOptions())
+        : options(options), estimated(clamp(options.startBitrate)), current((uint32_t)estimated)
+    {
+    }
+
+    // Updates the estimate. Returns true with the new target when the
+    // encoder should be retargeted.
+    bool onFeedback(const TransportFeedback& feedback, uint32_t& target)
+    {
+        bool first = controllerStats.reports++ == 0;
+        double elapsed = first ? 0.0 : std::min(std::max((feedback.timeUs - lastReportUs) / 1e6, 0.0), 1.0);
+        lastReportUs = feedback.timeUs;
+
+        // Smoothed delay and its trend, so single late packets do not count
+        double previous = smoothedDelayUs;
+        smoothedDelayUs = first ? (double)feedback.queueDelayUs : 0.7 * smoothedDelayUs + 0.3 * feedback.queueDelayUs;
+        bool rising = smoothedDelayUs >= previous;
+
+        bool overuse = smoothedDelayUs > options.overuseDelayUs && (rising || smoothedDelayUs > 2.0 * options.overuseDelayUs);
+        bool heavyLoss = feedback.lossFraction > options.lossHigh;
+        bool canDecrease = feedback.timeUs - lastDecreaseUs >= options.decreaseIntervalUs;
+
+        if (overuse)
+        {
+            controllerState = CongestionState::Decrease;
+            double next = options.decreaseFactor * feedback.receivedBitrate;
+            if (canDecrease && next < estimated)
+            {
+                estimated = next;
+                overuseBitrate = feedback.receivedBitrate;
+                lastDecreaseUs = feedback.timeUs;
+                controllerStats.delayDecreases++;
+            }
+        }
+        else if (heavyLoss)
+        {
+            controllerState = CongestionState::Decrease;
+            if (canDecrease)
+            {
+                estimated *= 1.0 - 0.5 * feedback.lossFraction;
+                lastDecreaseUs = feedback.timeUs;
+                controllerStats.lossDecreases++;
+            }
+        }
+        else if (smoothedDelayUs > options.overuseDelayUs / 2 || feedback.lossFraction > options.lossLow)
+        {
+            // The queue is still draining, or the path loses some packets
+            controllerState = CongestionState::Hold;
+        }
+        else
+        {
+            controllerState = CongestionState::Increase;
+            bool nearOveruse = overuseBitrate != 0 && estimated > 0.8 * overuseBitrate && estimated < 1.2 * overuseBitrate;
+            if (nearOveruse)
+                estimated += options.additiveBitsPerSecond * elapsed;
+            else
+                estimated *= std::pow(1.0 + options.increasePerSecond, elapsed);
+
+            // Never far above what actually gets through
+            if (feedback.receivedBitrate != 0)
+                estimated = std::min(estimated, 1.5 * feedback.receivedBitrate + 10000.0);
+        }
+        estimated = clamp(estimated);
+
+        double change = std::fabs(estimated - current) / current;
+        if (change < options.hysteresis)
+            return false;
+        if (estimated > current && feedback.timeUs - lastTargetUs < options.increaseIntervalUs)
+            return false;
+
+        current = (uint32_t)estimated;
+        lastTargetUs = feedback.timeUs;
+        controllerStats.targetChanges++;
+        target = current;
+        return true;
+    }
+
+    // What the controller thinks the path carries, and what the encoder was last told
+    uint32_t estimate() const { return (uint32_t)estimated; }
+    uint32_t target() const { return current; }
+    CongestionState state() const { return controllerState; }
+    CongestionControllerStats stats() const { return controllerStats; }
+
+private:
+    double clamp(double bitrate) const
+    {
+        return std::min(std::max(bitrate, (double)options.minBitrate), (double)options.maxBitrate);
+    }
+
+    CongestionControllerOptions options;
+    double estimated;
+    uint32_t current;
+    uint32_t overuseBitrate = 0;
+    CongestionState controllerState = CongestionState::Increase;
+
+    int64_t lastReportUs = 0;
+    int64_t lastDecreaseUs = INT64_MIN / 2;
+    int64_t lastTargetUs = INT64_MIN / 2;
+    double smoothedDelayUs = 0;
+    CongestionControllerStats controllerStats;
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+// ----------------------------------------------------------------------------
+// Runtime CPU feature detection and per-function target attributes
+//
+// SIMD kernels are compiled into every build and picked at runtime. MSVC lets
+// any function use any intrinsic; GCC and Clang need the target attribute on
+// each kernel instead of a global -mavx2.
+// ----------------------------------------------------------------------------
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ARCH_X86 1
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define ARCH_ARM64 1
+#endif
+
+#if defined(ARCH_X86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(ARCH_ARM64)
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE2
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct CpuFeatures
+{
+    bool sse2 = false;
+    bool sse41 = false;
+    bool avx2 = false;
+    bool neon = false;
+};
+
+inline CpuFeatures detectCpuFeatures()
+{
+    CpuFeatures features;
+
+#if defined(ARCH_X86)
+    int regs[4] = {};
+    auto cpuid = [&regs](int leaf, int subleaf)
+    {
+#if defined(_MSC_VER)
+        __cpuidex(regs, leaf, subleaf);
+#else
+        unsigned int a, b, c, d;
+        __cpuid_count(leaf, subleaf, a, b, c, d);
+        regs[0] = (int)a; regs[1] = (int)b; regs[2] = (int)c; regs[3] = (int)d;
+#endif
+    };
+
+    cpuid(0, 0);
+    int maxLeaf = regs[0];
+
+    cpuid(1, 0);
+    features.sse2 = (regs[3] & (1 << 26)) != 0;
+    features.sse41 = (regs[2] & (1 << 19)) != 0;
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+
+    // AVX state has to be enabled by the OS as well
+    bool ymmEnabled = false;
+    if (osxsave && avx)
+    {
+#if defined(_MSC_VER)
+        unsigned long long xcr0 = _xgetbv(0);
+#else
+        unsigned int eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        unsigned long long xcr0 = ((unsigned long long)edx << 32) | eax;
+#endif
+        ymmEnabled = (xcr0 & 0x6) == 0x6;
+    }
+
+    if (maxLeaf >= 7 && ymmEnabled)
+    {
+        cpuid(7, 0);
+        features.avx2 = (regs[1] & (1 << 5)) != 0;
+    }
+#elif defined(ARCH_ARM64)
+    // NEON is mandatory on AArch64
+    features.neon = true;
+#endif
+
+    return features;
+}
+
+inline const CpuFeatures& cpuFeatures()
+{
+    static const CpuFeatures features = detectCpuFeatures();
+    return features;
+}
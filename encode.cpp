@@ -1,5 +1,4 @@
 #include <chrono>
-#include <thread>
 #pragma comment(lib, "dxgi.lib")
 #pragma comment(lib, "D3D11.lib")
 #pragma comment(lib, "mfplat.lib")
@@ -9,11 +8,16 @@
 #pragma comment(lib, "Winmm.lib")
 
 // std
+#include <atomic>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 // Windows
+#define NOMINMAX
 #include <windows.h>
 #include <atlbase.h>
 
@@ -28,87 +32,424 @@
 #include <mferror.h>
 #include <codecapi.h>
 
-// Error handling
-#define CHECK(x) if (!(x)) { printf("%s(%d) %s was false\n", __FILE__, __LINE__, #x); throw std::exception(); }
-#define CHECK_HR(x) { HRESULT hr_ = (x); if (FAILED(hr_)) { printf("%s(%d) %s failed with 0x%x\n", __FILE__, __LINE__, #x, hr_); throw std::exception(); } }
-
-// Constants
-constexpr UINT ENCODE_WIDTH = 1280;
-constexpr UINT ENCODE_HEIGHT = 720;
-//constexpr UINT ENCODE_FRAMES = 60;
-constexpr UINT64 mfDuration = /*10000000 / ENCODE_FRAMES*/ 16000;
-UINT64 mfTicks = 0;
-
-class Encoder : public IMFAsyncCallback
+// Project
+#include "benchmark_suite.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder.h"
+#include "encoder_backend.h"
+#include "encoder_caps.h"
+#include "encoder_config.h"
+#include "event_pump.h"
+#include "frame_pool.h"
+#include "frame_preprocessor.h"
+#include "frame_source.h"
+#include "frame_tracer.h"
+#include "ladder_encoder.h"
+#include "live_segmenter.h"
+#include "metrics_exporter.h"
+#include "metrics_registry.h"
+#include "mp4_muxer.h"
+#include "recording_journal.h"
+#include "resource_tracker.h"
+#include "seek_index.h"
+#include "software_backend.h"
+#include "tile_scheduler.h"
+#include "upload_pipeline.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// D3D11 input frame pool
+//
+// Every slot owns a dynamic texture, the DXGI media buffer wrapping it and a
+// tracked sample holding that buffer. acquire() hands the sample out and the
+// pool drops its own reference; once the MFT releases its last reference the
+// sample calls Invoke below and the slot goes back into the ring.
+//
+// For a staged upload the textures are copy targets instead: GPU only, bound
+// for the video encoder where the driver allows it.
+// ----------------------------------------------------------------------------
+
+class D3D11FramePool : public IFramePool, public IMFAsyncCallback
 {
 public:
-    Encoder()
+    D3D11FramePool(ID3D11Device* device, UINT capacity, DXGI_FORMAT format, UINT width, UINT height, bool copyTarget = false)
+        : ring(capacity), textures(capacity), buffers(capacity), samples(capacity), sampleKeys(capacity)
     {
-        // ------------------------------------------------------------------------
-        // Open File
-        // ------------------------------------------------------------------------
+        D3D11_TEXTURE2D_DESC desc;
+        ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+
+        desc.Format = format;
+        desc.Width = width;
+        desc.Height = height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.SampleDesc.Count = 1;
+        desc.CPUAccessFlags = copyTarget ? 0 : D3D11_CPU_ACCESS_WRITE;
+        desc.Usage = copyTarget ? D3D11_USAGE_DEFAULT : D3D11_USAGE_DYNAMIC;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        textureBytes = format == DXGI_FORMAT_NV12 ? (size_t)width * height * 3 / 2 : (size_t)width * height * 4;
+
+        // Older drivers refuse the encoder binding, their MFTs read shader resources
+        if (copyTarget)
+        {
+            D3D11_TEXTURE2D_DESC encoderDesc = desc;
+            encoderDesc.BindFlags = D3D11_BIND_VIDEO_ENCODER;
+            CComPtr<ID3D11Texture2D> probe;
+            if (SUCCEEDED(device->CreateTexture2D(&encoderDesc, nullptr, &probe)))
+                desc = encoderDesc;
+        }
 
-        fout.open("vid.h264", std::ios::binary | std::ios::out | std::ios::trunc);
+        for (UINT i = 0; i < capacity; i++)
+        {
+            CHECK_HR(device->CreateTexture2D(&desc, nullptr, &textures[i]));
+            TRACK_CREATED(ResourceKind::Texture, textures[i].p, textureBytes);
+            CHECK_HR(MFCreateDXGISurfaceBuffer(__uuidof(ID3D11Texture2D), textures[i], 0, FALSE, &buffers[i]));
+            TRACK_CREATED(ResourceKind::Buffer, buffers[i].p, 0);
+
+            CComPtr<IMFTrackedSample> tracked;
+            CHECK_HR(MFCreateTrackedSample(&tracked));
+            CHECK(samples[i] = tracked);
+            CHECK_HR(samples[i]->AddBuffer(buffers[i]));
+            sampleKeys[i] = samples[i].p;
+        }
+        ring.addAllocations(capacity * 3);
+    }
 
-        // ------------------------------------------------------------------------
-        // Initialize D3D11
-        // ------------------------------------------------------------------------
+    ~D3D11FramePool()
+    {
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            if (buffers[i])
+                TRACK_DESTROYED(ResourceKind::Buffer, buffers[i].p, 0);
+            if (textures[i])
+                TRACK_DESTROYED(ResourceKind::Texture, textures[i].p, textureBytes);
+        }
+    }
 
-        CHECK_HR(CreateDXGIFactory1(IID_PPV_ARGS(&factory)));
-        UINT index = 0;
-        HRESULT adapterHr;
-        while (true)
+    ID3D11Texture2D* texture(uint32_t slot) { return textures[slot]; }
+
+    // Sample for an acquired slot. The caller's reference is the only one
+    // left, so releasing it after ProcessInput is what recycles the slot. On
+    // failure the pool keeps the sample and the slot only has to be released.
+    HRESULT takeSample(uint32_t slot, CComPtr<IMFSample>& sample)
+    {
+        CComQIPtr<IMFTrackedSample> tracked(samples[slot]);
+        if (!tracked)
+            return E_NOINTERFACE;
+        HRESULT hr = tracked->SetAllocator(this, nullptr);
+        if (FAILED(hr))
+            return hr;
+
+        sample.Attach(samples[slot].Detach());
+        return S_OK;
+    }
+
+    bool acquire(uint32_t& slot) override { return ring.acquire(slot); }
+    void release(uint32_t slot) override { ring.release(slot); }
+    uint32_t capacity() const override { return ring.capacity(); }
+    uint32_t inFlight() const override { return ring.inFlight(); }
+    FramePoolStats stats() const override { return ring.stats(); }
+    void setReleaseCallback(std::function<void(uint32_t)> callback) override { ring.setReleaseCallback(std::move(callback)); }
+
+    // dummy IUnknown impl, the pool outlives every sample it hands out
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override { return E_NOTIMPL; }
+    ULONG STDMETHODCALLTYPE AddRef(void) override { return 1; }
+    ULONG STDMETHODCALLTYPE Release(void) override { return 1; }
+
+    HRESULT STDMETHODCALLTYPE GetParameters(DWORD* pdwFlags, DWORD* pdwQueue) override { return E_NOTIMPL; }
+
+    // The tracked sample was released by everyone else, take it back
+    HRESULT STDMETHODCALLTYPE Invoke(IMFAsyncResult* pAsyncResult) override
+    {
+        CComPtr<IUnknown> object;
+        HRESULT hr = pAsyncResult->GetObject(&object);
+        if (FAILED(hr))
+            return hr;
+
+        CComQIPtr<IMFSample> sample(object);
+        for (uint32_t slot = 0; slot < ring.capacity(); slot++)
         {
-            adapterHr = factory->EnumAdapters(index++, &adapter);
-            if (FAILED(adapterHr))
+            if (sampleKeys[slot] == sample.p)
             {
-                printf("adapter not found\n");
-                break;
+                samples[slot] = sample;
+                ring.release(slot);
+                return S_OK;
             }
+        }
+        return E_UNEXPECTED;
+    }
 
-            CHECK_HR(adapter->GetDesc(&desc));
-            break;
+private:
+    FrameRing ring;
+    std::vector<CComPtr<ID3D11Texture2D>> textures;
+    std::vector<CComPtr<IMFMediaBuffer>> buffers;
+    std::vector<CComPtr<IMFSample>> samples;
+    std::vector<IMFSample*> sampleKeys;
+    size_t textureBytes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// D3D11 staging ring
+//
+// The CPU side of a staged upload, see upload_pipeline.h: staging textures the
+// fill maps and writes, a CopyResource into the input pool's texture per
+// frame, and an event query ended right behind it as the copy's fence. The
+// context is multithread protected, so the fill thread may map while the
+// input side copies.
+// ----------------------------------------------------------------------------
+
+class D3D11StagingRing : public IStagingDevice
+{
+public:
+    D3D11StagingRing(ID3D11Device* device, ID3D11DeviceContext* context, D3D11FramePool& inputs, EventPump& eventPump, UINT count,
+                     DXGI_FORMAT format, UINT width, UINT height)
+        : context(context), inputs(inputs), eventPump(eventPump), textures(count), queries(count), copied(count, 0)
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+        desc.Format = format;
+        desc.Width = width;
+        desc.Height = height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.SampleDesc.Count = 1;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        desc.Usage = D3D11_USAGE_STAGING;
+        textureBytes = format == DXGI_FORMAT_NV12 ? (size_t)width * height * 3 / 2 : (size_t)width * height * 4;
+
+        D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_EVENT, 0 };
+        for (UINT i = 0; i < count; i++)
+        {
+            CHECK_HR(device->CreateTexture2D(&desc, nullptr, &textures[i]));
+            TRACK_CREATED(ResourceKind::Texture, textures[i].p, textureBytes);
+            CHECK_HR(device->CreateQuery(&queryDesc, &queries[i]));
+        }
+    }
+
+    ~D3D11StagingRing()
+    {
+        for (CComPtr<ID3D11Texture2D>& texture : textures)
+            TRACK_DESTROYED(ResourceKind::Texture, texture.p, textureBytes);
+    }
+
+    uint32_t stagingCount() const override { return (uint32_t)textures.size(); }
+
+    // The fence passed, so the map does not wait for the GPU
+    bool mapStaging(uint32_t buffer, uint8_t*& data, size_t& pitch) override
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        ZeroMemory(&mapped, sizeof(D3D11_MAPPED_SUBRESOURCE));
+        HRESULT hr = context->Map(textures[buffer], 0, D3D11_MAP_WRITE, 0, &mapped);
+        if (FAILED(hr))
+        {
+            eventPump.fail({ hr, "ID3D11DeviceContext::Map(staging)" });
+            return false;
         }
+        data = static_cast<uint8_t*>(mapped.pData);
+        pitch = mapped.RowPitch;
+        return true;
+    }
 
+    void unmapStaging(uint32_t buffer) override { context->Unmap(textures[buffer], 0); }
+
+    void copyToInput(uint32_t buffer, const InputFrame& input) override
+    {
+        context->CopyResource(inputs.texture(input.slot), textures[buffer]);
+        context->End(queries[buffer]);
+        copied[buffer] = 1;
+    }
+
+    // Flushes, so a fence nobody else submits work behind still passes
+    bool copyDone(uint32_t buffer) override
+    {
+        if (!copied[buffer])
+            return true;
+        if (context->GetData(queries[buffer], nullptr, 0, 0) != S_OK)
+            return false;
+        copied[buffer] = 0;
+        return true;
+    }
+
+private:
+    ID3D11DeviceContext* context;
+    D3D11FramePool& inputs;
+    EventPump& eventPump;
+    std::vector<CComPtr<ID3D11Texture2D>> textures;
+    std::vector<CComPtr<ID3D11Query>> queries;
+    std::vector<uint8_t> copied;                    // a fence is pending; the pipeline orders copies and fills
+    size_t textureBytes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Output packet
+//
+// Keeps the MFT's output buffer locked, and the sample alive, until the last
+// consumer drops the packet, so nothing copies the bitstream out of it.
+// ----------------------------------------------------------------------------
+
+class MfPacketBuffer : public PacketBuffer
+{
+public:
+    // Takes over the lock on the sample's buffer
+    MfPacketBuffer(IMFSample* sample, IMFMediaBuffer* lockedBuffer, BYTE* encodedData, DWORD encodedLength)
+        : sample(sample), mediaBuffer(lockedBuffer)
+    {
+        LONGLONG sampleTime = 0, sampleDuration = 0;
+        sample->GetSampleTime(&sampleTime);
+        sample->GetSampleDuration(&sampleDuration);
+
+        data = encodedData;
+        size = encodedLength;
+        time = sampleTime;
+        duration = sampleDuration;
+        keyframe = MFGetAttributeUINT32(sample, MFSampleExtension_CleanPoint, FALSE) != FALSE;
+        TRACK_CREATED(ResourceKind::Packet, this, size);
+    }
+
+protected:
+    // May run on the writer or any other consumer thread
+    void recycle() override
+    {
+        mediaBuffer->Unlock();
+        TRACK_DESTROYED(ResourceKind::Packet, this, size);
+        delete this;
+    }
+
+private:
+    CComPtr<IMFSample> sample;
+    CComPtr<IMFMediaBuffer> mediaBuffer;
+};
+
+// ----------------------------------------------------------------------------
+// Encoder enumeration
+// ----------------------------------------------------------------------------
+
+static uint64_t luidValue(const LUID& luid)
+{
+    return ((uint64_t)(uint32_t)luid.HighPart << 32) | luid.LowPart;
+}
+
+static std::string toUtf8(const wchar_t* text)
+{
+    int size = WideCharToMultiByte(CP_UTF8, 0, text, -1, nullptr, 0, nullptr, nullptr);
+    if (size <= 1)
+        return std::string();
+    std::string result((size_t)size - 1, 0);
+    WideCharToMultiByte(CP_UTF8, 0, text, -1, &result[0], size, nullptr, nullptr);
+    return result;
+}
+
+// Hardware H.264 encoders bound to one adapter, for any input format when
+// inputFormat is null. The caller releases the activates.
+static HRESULT enumHardwareEncoders(uint64_t luid, const GUID* inputFormat, IMFActivate*** activates, UINT32* count)
+{
+    CComPtr<IMFAttributes> attributes;
+    HRESULT hr = MFCreateAttributes(&attributes, 1);
+    if (FAILED(hr))
+        return hr;
+    LUID adapterLuid = { (DWORD)luid, (LONG)(luid >> 32) };
+    hr = attributes->SetBlob(MFT_ENUM_ADAPTER_LUID, (BYTE*)&adapterLuid, sizeof(LUID));
+    if (FAILED(hr))
+        return hr;
+
+    MFT_REGISTER_TYPE_INFO inInfo = { MFMediaType_Video, inputFormat ? *inputFormat : GUID_NULL };
+    MFT_REGISTER_TYPE_INFO outInfo = { MFMediaType_Video, MFVideoFormat_H264 };
+    return MFTEnum2(MFT_CATEGORY_VIDEO_ENCODER, MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+        inputFormat ? &inInfo : nullptr, &outInfo, attributes, activates, count);
+}
+
+static std::string activateClsid(IMFActivate* activate)
+{
+    GUID clsid;
+    if (FAILED(activate->GetGUID(MFT_TRANSFORM_CLSID_Attribute, &clsid)))
+        return std::string();
+    wchar_t text[40];
+    StringFromGUID2(clsid, text, 40);
+    return toUtf8(text);
+}
+
+// ----------------------------------------------------------------------------
+// Shared adapter device
+//
+// One D3D11 device and DXGI device manager per adapter, used by every session
+// on it. The immediate context is shared too, so it is multithread protected.
+// ----------------------------------------------------------------------------
+
+struct MfSharedDevice
+{
+    AdapterIdentity identity;
+    CComPtr<IDXGIAdapter> adapter;
+    CComPtr<ID3D11Device> device11;
+    CComPtr<ID3D11DeviceContext> context11;
+    CComPtr<IMFDXGIDeviceManager> deviceManager;
+    UINT resetToken = 0;
+
+    void create()
+    {
         D3D_FEATURE_LEVEL featureLevels[] = {D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0, D3D_FEATURE_LEVEL_10_1, D3D_FEATURE_LEVEL_10_0};
         CHECK_HR(D3D11CreateDevice(adapter, D3D_DRIVER_TYPE_UNKNOWN, nullptr, D3D11_CREATE_DEVICE_VIDEO_SUPPORT, featureLevels, 4, D3D11_SDK_VERSION, &device11, NULL, &context11));
 
         {
-            // Probably not necessary in this application, but maybe the MFT requires it?
-            //CComQIPtr<ID3D10Multithread> mt{device11};
-            //CHECK(mt);
-            //mt->SetMultithreadProtected(TRUE);
+            // Sessions map input frames from their own strands and the MFTs
+            // use the device from their work queue threads
+            CComQIPtr<ID3D10Multithread> mt{device11};
+            CHECK(mt);
+            mt->SetMultithreadProtected(TRUE);
         }
 
-        // Create device manager
-        UINT resetToken;
         CHECK_HR(MFCreateDXGIDeviceManager(&resetToken, &deviceManager));
         CHECK_HR(deviceManager->ResetDevice(device11.p, resetToken));
+    }
+};
 
+// ----------------------------------------------------------------------------
+// Media Foundation backend
+//
+// The hardware encoder MFT on a shared D3D11 device. Events come from the
+// MFT's event generator on the MF work queue, which only counts them into the
+// event pump and asks for the next one; the pipeline sees them in batches on
+// the worker pool. Nothing here throws once the MFT runs: a failed call
+// becomes the backend's status and an Error event.
+// ----------------------------------------------------------------------------
+
+class MfEncoderBackend : public IEncoderBackend, public IMFAsyncCallback
+{
+public:
+    // Activates the probed encoder on the device's adapter. Without a worker
+    // pool the backend runs its events on a private thread.
+    MfEncoderBackend(std::shared_ptr<MfSharedDevice> device, const EncoderConfig& config, const EncoderCaps& encoder, WorkerPool* workers = nullptr)
+        : shared(std::move(device)), encodeConfig(config),
+          ownWorkers(workers ? nullptr : new WorkerPool(1)),
+          eventPump(workers ? *workers : *ownWorkers)
+    {
+        encoderInputFrameFormat = config.format == FrameFormat::NV12 ? MFVideoFormat_NV12 : MFVideoFormat_ARGB32;
+
+        device11 = shared->device11;
+        context11 = shared->context11;
+        deviceManager = shared->deviceManager;
 
         // ------------------------------------------------------------------------
         // Initialize hardware encoder MFT
         // ------------------------------------------------------------------------
 
         {
-            // Find the encoder
+            // The encoder bound to this adapter, the one the probe described
             CComHeapPtr<IMFActivate*> activateRaw;
             UINT32 activateCount = 0;
+            CHECK_HR(enumHardwareEncoders(shared->identity.luid, &encoderInputFrameFormat, &activateRaw, &activateCount));
 
-            // Input & output types
-            MFT_REGISTER_TYPE_INFO inInfo = { MFMediaType_Video, MFVideoFormat_ARGB32 };
-            MFT_REGISTER_TYPE_INFO outInfo = { MFMediaType_Video, MFVideoFormat_H264 };
-
-            //CComPtr<IMFAttributes> enumAttrs;
-            //CHECK_HR(MFCreateAttributes(&enumAttrs, 1));
-            //CHECK_HR(enumAttrs->SetBlob(MFT_ENUM_ADAPTER_LUID, (BYTE*)&desc.AdapterLuid, sizeof(LUID)));
-
-            CHECK_HR(MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER, MFT_ENUM_FLAG_HARDWARE, &inInfo, &outInfo, &activateRaw, &activateCount));
-
-            CHECK(activateCount != 0);
+            UINT32 chosen = activateCount;
+            for (UINT32 i = 0; i < activateCount; i++)
+            {
+                if (chosen == activateCount && (encoder.clsid.empty() || activateClsid(activateRaw[i]) == encoder.clsid))
+                    chosen = i;
+            }
+            CHECK(chosen != activateCount);
+            activate = activateRaw[chosen];
 
-            // Choose the first returned encoder
-            CComPtr<IMFActivate> activate = activateRaw[0];
+            for (UINT32 i = 0; i < activateCount; i++)
+                activateRaw[i]->Release();
 
             // Activate
             CHECK_HR(activate->ActivateObject(IID_PPV_ARGS(&processor)));
@@ -118,36 +459,8 @@ public:
             CHECK_HR(processorAttrs->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE));
             CHECK(events = processor);
             CHECK_HR(processor->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER, reinterpret_cast<ULONG_PTR>(deviceManager.p)));
-
-            // Memory management
-            //for (UINT32 i = 0; i < activateCount; i++)
-            //    activateRaw[i]->Release();
         }
 
-
-        // ------------------------------------------------------------------------
-        // Query encoder name (not necessary, but nice) and unlock for async use
-        // ------------------------------------------------------------------------
-        /*
-        {
-            UINT32 nameLength;
-            std::wstring name;
-
-            CHECK_HR(processorAttrs->GetStringLength(MFT_FRIENDLY_NAME_Attribute, &nameLength));
-
-            // IMFAttributes::GetString returns a null-terminated wide string
-            name.resize((size_t)nameLength + 1);
-            CHECK_HR(processorAttrs->GetString(MFT_FRIENDLY_NAME_Attribute, &name[0], (UINT32)name.size(), &nameLength));
-            name.resize(nameLength);
-
-            printf("Using %ls\n", name.c_str());
-
-            // Unlock the transform for async use and get event generator
-            CHECK_HR(processorAttrs->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE));
-            CHECK(events = processor);
-        }
-        */
-
         // Get stream IDs (expect 1 input and 1 output stream)
         {
             HRESULT hr = processor->GetStreamIDs(1, &inputStreamID, 1, &outputStreamID);
@@ -169,13 +482,20 @@ public:
         CComPtr<IMFMediaType> outputType;
         CHECK_HR(MFCreateMediaType(&outputType));
 
-        CHECK_HR(outputType->SetUINT32(MF_MT_MPEG2_PROFILE, eAVEncH264VProfile_High));
-        CHECK_HR(outputType->SetUINT32(MF_MT_MPEG2_LEVEL, eAVEncH264VLevel4_2));
+        // Codec settings have to be in place before the output type
+        if (config.lowLatency)
+            CHECK_HR(processorAttrs->SetUINT32(MF_LOW_LATENCY, TRUE));
+        configureCodec(config);
+
+        CHECK_HR(outputType->SetUINT32(MF_MT_MPEG2_PROFILE, (UINT32)config.profile));
+        if (config.level != 0)
+            CHECK_HR(outputType->SetUINT32(MF_MT_MPEG2_LEVEL, config.level));
         CHECK_HR(outputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
         CHECK_HR(outputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
-        CHECK_HR(outputType->SetUINT32(MF_MT_AVG_BITRATE, 4000000));
-        CHECK_HR(MFSetAttributeSize(outputType, MF_MT_FRAME_SIZE, ENCODE_WIDTH, ENCODE_HEIGHT));
-        //CHECK_HR(MFSetAttributeRatio(outputType, MF_MT_FRAME_RATE, 60, 1));
+        if (config.rateControl != RateControl::Quality)
+            CHECK_HR(outputType->SetUINT32(MF_MT_AVG_BITRATE, config.bitrate));
+        CHECK_HR(MFSetAttributeSize(outputType, MF_MT_FRAME_SIZE, config.width, config.height));
+        CHECK_HR(MFSetAttributeRatio(outputType, MF_MT_FRAME_RATE, config.frameRate.num, config.frameRate.den));
         CHECK_HR(outputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive));
         CHECK_HR(outputType->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE));
 
@@ -186,51 +506,247 @@ public:
         CHECK_HR(processor->GetInputAvailableType(inputStreamID, 0, &inputType));
 
         CHECK_HR(inputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
-        CHECK_HR(inputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_ARGB32));
-        CHECK_HR(MFSetAttributeSize(inputType, MF_MT_FRAME_SIZE, ENCODE_WIDTH, ENCODE_HEIGHT));
-        CHECK_HR(MFSetAttributeRatio(inputType, MF_MT_FRAME_RATE, 30, 1));
+        CHECK_HR(inputType->SetGUID(MF_MT_SUBTYPE, encoderInputFrameFormat));
+        CHECK_HR(MFSetAttributeSize(inputType, MF_MT_FRAME_SIZE, config.width, config.height));
+        CHECK_HR(MFSetAttributeRatio(inputType, MF_MT_FRAME_RATE, config.frameRate.num, config.frameRate.den));
+        if (encoderInputFrameFormat == MFVideoFormat_NV12)
+        {
+            // Tell the encoder what the color converter produces
+            CHECK_HR(inputType->SetUINT32(MF_MT_YUV_MATRIX, MFVideoTransferMatrix_BT709));
+            CHECK_HR(inputType->SetUINT32(MF_MT_VIDEO_NOMINAL_RANGE, MFNominalRange_16_235));
+        }
 
         CHECK_HR(processor->SetInputType(inputStreamID, inputType, 0));
 
 
         // ------------------------------------------------------------------------
-        // Create sample allocator
+        // Create input frame pool
         // ------------------------------------------------------------------------
-        /*
-        {
-            MFCreateVideoSampleAllocatorEx(IID_PPV_ARGS(&allocator));
-            CHECK(allocator);
 
-            CComPtr<IMFAttributes> allocAttrs;
-            MFCreateAttributes(&allocAttrs, 2);
+        createInputPool(false);
+    }
 
-            CHECK_HR(allocAttrs->SetUINT32(MF_SA_D3D11_BINDFLAGS, D3D11_BIND_RENDER_TARGET));
-            CHECK_HR(allocAttrs->SetUINT32(MF_SA_D3D11_USAGE, D3D11_USAGE_DEFAULT));
+    ~MfEncoderBackend()
+    {
+        shutdown();
+    }
 
-            CHECK_HR(allocator->SetDirectXManager(deviceManager));
-            CHECK_HR(allocator->InitializeSampleAllocatorEx(1, 2, allocAttrs, inputType));
-        }
-        */
+    void start(IEncoderEventSink* sink) override
+    {
+        eventPump.start(sink);
 
         // ------------------------------------------------------------------------
         // Start encoding
         // ------------------------------------------------------------------------
-        events->BeginGetEvent(this, nullptr);
+        CHECK_HR(events->BeginGetEvent(this, nullptr));
 
-        //CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, NULL));
         CHECK_HR(processor->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, NULL));
         CHECK_HR(processor->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, NULL));   
     }
 
-    ~Encoder()
+    void drain() override
+    {
+        HRESULT hr = processor->ProcessMessage(MFT_MESSAGE_NOTIFY_END_OF_STREAM, 0);
+        if (SUCCEEDED(hr))
+            hr = processor->ProcessMessage(MFT_MESSAGE_COMMAND_DRAIN, 0);
+        if (FAILED(hr))
+            eventPump.fail({ hr, "ProcessMessage(MFT_MESSAGE_COMMAND_DRAIN)" });
+    }
+
+    bool acquireInput(InputFrame& frame) override
+    {
+        uint32_t slot;
+        if (!inputPool->acquire(slot))
+            return false;
+
+        // The staging ring's copy fills it
+        if (staging)
+        {
+            frame.slot = slot;
+            frame.data = nullptr;
+            frame.pitch = 0;
+            return true;
+        }
+
+        D3D11_MAPPED_SUBRESOURCE mappedResource;
+        ZeroMemory(&mappedResource, sizeof(D3D11_MAPPED_SUBRESOURCE));
+        // Lock texture
+        HRESULT hr = context11->Map(inputPool->texture(slot), 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource);
+        if (FAILED(hr))
+        {
+            inputPool->release(slot);
+            eventPump.fail({ hr, "ID3D11DeviceContext::Map" });
+            return false;
+        }
+
+        frame.slot = slot;
+        frame.data = static_cast<uint8_t*>(mappedResource.pData);
+        frame.pitch = mappedResource.RowPitch;
+        return true;
+    }
+
+    void releaseInput(const InputFrame& frame) override
+    {
+        if (!staging)
+            context11->Unmap(inputPool->texture(frame.slot), 0);
+        inputPool->release(frame.slot);
+    }
+
+    void submitInput(const InputFrame& frame, int64_t time, int64_t duration) override
+    {
+        //  Reenable GPU access to the texture data.
+        if (!staging)
+            context11->Unmap(inputPool->texture(frame.slot), 0);
+
+        CComPtr<IMFSample> sample;
+        HRESULT hr = inputPool->takeSample(frame.slot, sample);
+        if (FAILED(hr))
+        {
+            inputPool->release(frame.slot);
+            eventPump.fail({ hr, "IMFTrackedSample::SetAllocator" });
+            return;
+        }
+
+        // Other fields for sample
+        hr = sample->SetSampleTime(time);
+        if (SUCCEEDED(hr))
+            hr = sample->SetSampleDuration(duration);
+
+        // A sample the MFT did not take goes back to the pool with the last reference
+        if (SUCCEEDED(hr))
+            hr = processor->ProcessInput(inputStreamID, sample, 0);
+        if (FAILED(hr))
+            eventPump.fail({ hr, "IMFTransform::ProcessInput" });
+    }
+
+    void setInputReleaseCallback(std::function<void()> callback) override
+    {
+        eventPump.setInputReleaseCallback(std::move(callback));
+    }
+
+    OutputStatus processOutput(EncodedPacket& packet) override
+    {
+        DWORD status;
+        MFT_OUTPUT_DATA_BUFFER outputBuffer = {};
+        outputBuffer.dwStreamID = outputStreamID;
+
+        HRESULT hr = processor->ProcessOutput(0, 1, &outputBuffer, &status);
+        if (outputBuffer.pEvents)
+            outputBuffer.pEvents->Release();
+        if (hr == MF_E_TRANSFORM_STREAM_CHANGE)
+            return OutputStatus::StreamChange;
+        if (hr == MF_E_TRANSFORM_NEED_MORE_INPUT)
+            return OutputStatus::NoOutput;
+
+        // Take over the reference returned by ProcessOutput
+        CComPtr<IMFSample> sample;
+        sample.Attach(outputBuffer.pSample);
+        if (FAILED(hr))
+            return fail(hr, "IMFTransform::ProcessOutput");
+
+        CComPtr<IMFMediaBuffer> mediaBuffer;
+        BYTE* encodedData;
+        DWORD encodedLength;
+        hr = sample->GetBufferByIndex(0, &mediaBuffer);
+        if (FAILED(hr))
+            return fail(hr, "IMFSample::GetBufferByIndex");
+        hr = mediaBuffer->Lock(&encodedData, nullptr, &encodedLength);
+        if (FAILED(hr))
+            return fail(hr, "IMFMediaBuffer::Lock");
+
+        packet = EncodedPacket(new MfPacketBuffer(sample, mediaBuffer, encodedData, encodedLength));
+        return OutputStatus::Ok;
+    }
+
+    void renegotiateOutput() override
+    {
+        // Stream format change.
+        HRESULT hr = processor->GetStreamIDs(1, &inputStreamID, 1, &outputStreamID);
+        if (hr == E_NOTIMPL)
+        {
+            inputStreamID = 0;
+            outputStreamID = 0;
+            hr = S_OK;
+        }
+
+        CComPtr<IMFMediaType> availableOutputType;
+        for (DWORD typeIndex = 0;; ++typeIndex)
+        {
+            hr = processor->GetOutputAvailableType(outputStreamID, typeIndex, &availableOutputType);
+            if (FAILED(hr))
+            {
+                // Out of types without finding H264 is MF_E_NO_MORE_TYPES
+                eventPump.fail({ hr, "IMFTransform::GetOutputAvailableType" });
+                return;
+            }
+
+            // Check if the type is H264
+            GUID majorType, subType;
+            availableOutputType->GetMajorType(&majorType);
+            availableOutputType->GetGUID(MF_MT_SUBTYPE, &subType);
+            if (majorType == MFMediaType_Video && subType == MFVideoFormat_H264)
+            {
+                // found
+                break;
+            }
+            availableOutputType.Release();
+        }
+
+        // Set the new type
+        hr = processor->SetOutputType(outputStreamID, availableOutputType.p, 0);
+        if (FAILED(hr))
+            eventPump.fail({ hr, "IMFTransform::SetOutputType" });
+    }
+
+    void shutdown() override
     {
-        fout.close();
+        if (stopping.exchange(true))
+            return;
+
+        // Completes the outstanding BeginGetEvent with MF_E_SHUTDOWN
+        MFShutdownObject(processor);
+        eventPump.close();
+    }
+
+    // Each setting on its own, so one the driver does not take leaves the
+    // others in place. The MFT applies them from the next ProcessInput on.
+    bool applyControl(const EncoderControl& control) override
+    {
+        bool ok = true;
+        if (control.bitrate != 0)
+            ok = SUCCEEDED(setCodecValue(codec, CODECAPI_AVEncCommonMeanBitRate, control.bitrate)) && ok;
+        if (control.maxBitrate != 0)
+            ok = SUCCEEDED(setCodecValue(codec, CODECAPI_AVEncCommonMaxBitRate, control.maxBitrate)) && ok;
+        if (control.qpBounds)
+        {
+            ok = SUCCEEDED(setCodecValue(codec, CODECAPI_AVEncVideoMinQP, control.minQp)) && ok;
+            ok = SUCCEEDED(setCodecValue(codec, CODECAPI_AVEncVideoMaxQP, control.maxQp)) && ok;
+        }
+        if (control.forceKeyframe)
+            ok = SUCCEEDED(setCodecValue(codec, CODECAPI_AVEncVideoForceKeyFrame, 1)) && ok;
+        if (control.qp != 0)
+        {
+            // Every frame type, as at setup
+            VARIANT qp;
+            qp.vt = VT_UI8;
+            qp.ullVal = control.qp;
+            ok = SUCCEEDED(codec->SetValue(&CODECAPI_AVEncVideoEncodeQP, &qp)) && ok;
+        }
+
+        // Rate control follows the sample times, which already use the new rate
+        return ok;
     }
 
-    void stop()
+    const EncoderConfig& config() const override { return encodeConfig; }
+    EncoderStatus status() const override { return eventPump.status(); }
+
+    // The input textures become the staging ring's copy targets
+    IStagingDevice* enableStaging(uint32_t buffers) override
     {
-        processor->ProcessMessage(MFT_MESSAGE_NOTIFY_END_OF_STREAM, 0);
-        processor->ProcessMessage(MFT_MESSAGE_COMMAND_DRAIN, 0);
+        const EncoderConfig& config = encodeConfig;
+        createInputPool(true);
+        staging = std::make_unique<D3D11StagingRing>(device11, context11, *inputPool, eventPump, buffers, inputPoolFormat(), config.width, config.height);
+        return staging.get();
     }
 
     // dummy IUnknown impl
@@ -247,166 +763,133 @@ public:
         return S_OK;
     }
 
+    // Runs on the MF work queue: counts the event into the pump and asks for
+    // the next one, failures included. Nothing may throw out of here.
     HRESULT STDMETHODCALLTYPE Invoke(IMFAsyncResult* pAsyncResult) override
     {
-        HRESULT hr = S_OK;
-
         CComPtr<IMFMediaEvent> event;
-        CHECK_HR(events->EndGetEvent(pAsyncResult, &event));
-
-        MediaEventType eventType;
-        CHECK_HR(event->GetType(&eventType));
+        HRESULT hr = events->EndGetEvent(pAsyncResult, &event);
+        if (stopping)
+            return S_OK;
+
+        MediaEventType eventType = MEUnknown;
+        HRESULT eventStatus = S_OK;
+        if (SUCCEEDED(hr))
+            hr = event->GetType(&eventType);
+        if (SUCCEEDED(hr))
+            hr = event->GetStatus(&eventStatus);
+        if (FAILED(hr))
+        {
+            eventPump.fail({ hr, "IMFMediaEventGenerator::EndGetEvent" });
+            return S_OK;
+        }
 
         switch (eventType)
         {
         case METransformNeedInput:
-        {
-            // Generate texture
-            CComPtr<ID3D11Texture2D> texture;
-            D3D11_TEXTURE2D_DESC desc;
-            ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
-
-            desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-            desc.Width = ENCODE_WIDTH;
-            desc.Height = ENCODE_HEIGHT;
-            desc.MipLevels = 1;
-            desc.ArraySize = 1;
-            desc.SampleDesc.Count = 1;
-            desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-            desc.Usage = D3D11_USAGE_DYNAMIC;
-            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-
-            HRESULT hr = device11->CreateTexture2D(&desc, nullptr, &texture);
-            if (FAILED(hr))
-            {
-                printf("?\n");
-                break;
-            }
-
-            D3D11_MAPPED_SUBRESOURCE mappedResource;
-            ZeroMemory(&mappedResource, sizeof(D3D11_MAPPED_SUBRESOURCE));
-            DWORD length = ENCODE_WIDTH * ENCODE_HEIGHT * 4;
-            // Lock texture
-            CHECK_HR(context11->Map(texture, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
-            //  Update the vertex buffer here.
-            memset(mappedResource.pData, 200, length);
-            //  Reenable GPU access to the vertex buffer data.
-            context11->Unmap(texture, 0);
-
-            // Create media buffer backed by DXGI
-            IMFMediaBuffer* dxgiMediaBuffer;
-            CHECK_HR(MFCreateDXGISurfaceBuffer(__uuidof(ID3D11Texture2D), texture, 0, FALSE, &dxgiMediaBuffer));
-
-            // Create sample
-            IMFSample* dxgiSample;
-            CHECK_HR(MFCreateSample(&dxgiSample));
-            CHECK_HR(dxgiSample->AddBuffer(dxgiMediaBuffer));
-
-            // Other fields for sample
-            mfTicks += mfDuration;
-            CHECK_HR(dxgiSample->SetSampleTime(mfTicks));
-            hr = (dxgiSample->SetSampleDuration(mfDuration));
-            if (FAILED(hr))
-            {
-                printf("??\n");
-                break;
-            }
-
-            CHECK_HR(processor->ProcessInput(inputStreamID, dxgiSample, 0));
-
-            // Dereferencing the device once after feeding each frame "fixes" the leak.
-            //device.p->Release();
-
+            eventPump.post(EncoderEvent::NeedInput);
             break;
-        }
 
         case METransformHaveOutput:
-        {
-            DWORD status;
-            MFT_OUTPUT_DATA_BUFFER outputBuffer = {};
-            outputBuffer.dwStreamID = outputStreamID;
+            eventPump.post(EncoderEvent::HaveOutput);
+            break;
 
-            hr = (processor->ProcessOutput(0, 1, &outputBuffer, &status));
-            if (hr == MF_E_TRANSFORM_STREAM_CHANGE)
-            {
-                // Stream format change.
-                hr = processor->GetStreamIDs(1, &inputStreamID, 1, &outputStreamID);
-                if (hr == E_NOTIMPL)
-                {
-                    inputStreamID = 0;
-                    outputStreamID = 0;
-                    hr = S_OK;
-                }
+        case METransformDrainComplete:
+            eventPump.post(EncoderEvent::DrainComplete);
+            return S_OK;
 
-                CComPtr<IMFMediaType> availableOutputType;
-                for (DWORD typeIndex = 0;; ++typeIndex)
-                {
-                    CHECK_HR(processor->GetOutputAvailableType(outputStreamID, typeIndex, &availableOutputType));
-                    
-                    // Check if the type is H264
-                    GUID majorType, subType;
-                    availableOutputType->GetMajorType(&majorType);
-                    availableOutputType->GetGUID(MF_MT_SUBTYPE, &subType);
-                    if (majorType == MFMediaType_Video && subType == MFVideoFormat_H264)
-                    {
-                        // found
-                        break;
-                    }
-                    availableOutputType.Release();
-                }
+        case MEError:
+            eventPump.fail({ eventStatus, "MEError" });
+            return S_OK;
+        }
 
-                UINT32 width, height, bitrate, frameNumerator, frameDenominator;
-                MFGetAttributeSize(availableOutputType.p, MF_MT_FRAME_SIZE, &width, &height);
-                MFGetAttributeRatio(availableOutputType.p, MF_MT_FRAME_RATE, &frameNumerator, &frameDenominator);
-                availableOutputType->GetUINT32(MF_MT_AVG_BITRATE, &bitrate);
-                // Set the new type
-                CHECK_HR(processor->SetOutputType(outputStreamID, availableOutputType.p, 0));
-                break;
-            }
-            CHECK_HR(hr);
+        hr = events->BeginGetEvent(this, nullptr);
+        if (FAILED(hr))
+            eventPump.fail({ hr, "IMFMediaEventGenerator::BeginGetEvent" });
+        return S_OK;
+    }
 
-            DWORD bufCount;
-            DWORD bufLength;
-            CHECK_HR(outputBuffer.pSample->GetBufferCount(&bufCount));
+private:
+    static HRESULT setCodecValue(ICodecAPI* codec, const GUID& property, UINT32 value)
+    {
+        VARIANT variant;
+        variant.vt = VT_UI4;
+        variant.ulVal = value;
+        return codec->SetValue(&property, &variant);
+    }
 
-            CComPtr<IMFMediaBuffer> outBuffer;
-            CHECK_HR(outputBuffer.pSample->GetBufferByIndex(0, &outBuffer));
-            CHECK_HR(outBuffer->GetCurrentLength(&bufLength));
+    OutputStatus fail(HRESULT hr, const char* operation)
+    {
+        eventPump.fail({ hr, operation });
+        return OutputStatus::Failed;
+    }
 
-            printf("METransformHaveOutput buffers=%d, bytes=%d\n", bufCount, bufLength);
+    // Rate control, GOP structure and latency through ICodecAPI
+    DXGI_FORMAT inputPoolFormat() const
+    {
+        return encoderInputFrameFormat == MFVideoFormat_NV12 ? DXGI_FORMAT_NV12 : DXGI_FORMAT_B8G8R8A8_UNORM;
+    }
 
-            // write bytes to file
-            BYTE* encodedData;
-            DWORD encodedLength;
-            CHECK_HR(outBuffer->Lock(&encodedData, nullptr, &encodedLength));
-            fout.write((char*)encodedData, encodedLength);
-            CHECK_HR(outBuffer->Unlock());
+    void createInputPool(bool copyTarget)
+    {
+        const EncoderConfig& config = encodeConfig;
+        inputPool = std::make_unique<D3D11FramePool>(device11, INPUT_POOL_SIZE + config.lookahead, inputPoolFormat(), config.width, config.height, copyTarget);
+        // Released on an MF thread, refilled on the input side
+        inputPool->setReleaseCallback([this](uint32_t) { eventPump.releaseInput(); });
+    }
 
-            // Release the sample as it is not processed further.
-            if (outputBuffer.pSample)
-                outputBuffer.pSample->Release();
-            if (outputBuffer.pEvents)
-                outputBuffer.pEvents->Release();
-            break;
-        }
+    void configureCodec(const EncoderConfig& config)
+    {
+        codec = processor;
+        CHECK(codec);
 
-        case METransformDrainComplete:
+        switch (config.rateControl)
         {
-            return hr;
+        case RateControl::Cbr:
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonRateControlMode, eAVEncCommonRateControlMode_CBR));
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonMeanBitRate, config.bitrate));
+            break;
+        case RateControl::Vbr:
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonRateControlMode,
+                config.maxBitrate != 0 ? eAVEncCommonRateControlMode_PeakConstrainedVBR : eAVEncCommonRateControlMode_UnconstrainedVBR));
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonMeanBitRate, config.bitrate));
+            if (config.maxBitrate != 0)
+                CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonMaxBitRate, config.maxBitrate));
+            break;
+        case RateControl::Quality:
+        {
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncCommonRateControlMode, eAVEncCommonRateControlMode_Quality));
+            // Same QP for every frame type
+            VARIANT qp;
+            qp.vt = VT_UI8;
+            qp.ullVal = config.qp;
+            CHECK_HR(codec->SetValue(&CODECAPI_AVEncVideoEncodeQP, &qp));
+            break;
         }
         }
 
-        CHECK_HR(events->BeginGetEvent(this, nullptr));
+        if (config.gopLength != 0)
+            CHECK_HR(setCodecValue(codec, CODECAPI_AVEncMPVGOPSize, config.gopLength));
+        // The muxers write no decode timestamps, so no B-frames even where an
+        // MFT defaults to some; one without the property has none to turn off
+        setCodecValue(codec, CODECAPI_AVEncMPVDefaultBPictureCount, 0);
 
-        return hr;
+        if (config.lowLatency)
+        {
+            VARIANT lowLatency;
+            lowLatency.vt = VT_BOOL;
+            lowLatency.boolVal = VARIANT_TRUE;
+            CHECK_HR(codec->SetValue(&CODECAPI_AVLowLatencyMode, &lowLatency));
+        }
     }
 
-private:
-    std::ofstream fout;
+    std::shared_ptr<MfSharedDevice> shared;
+    EncoderConfig encodeConfig;
+    CComQIPtr<ICodecAPI> codec;
+    std::unique_ptr<WorkerPool> ownWorkers;
+    EventPump eventPump;
+    std::atomic<bool> stopping{false};
 
-    DXGI_ADAPTER_DESC desc;
-    CComPtr<IDXGIFactory1> factory;
-    CComPtr<IDXGIAdapter> adapter;
     CComPtr<IMFActivate> activate;
     CComPtr<IMFTransform> processor;
     CComPtr<IMFAttributes> processorAttrs;
@@ -415,346 +898,811 @@ private:
     CComPtr<IMFDXGIDeviceManager> deviceManager;
     CComPtr<ID3D11Device> device11;
     CComPtr<ID3D11DeviceContext> context11;
-    GUID encoderInputFrameFormat = MFVideoFormat_ARGB32;
+    GUID encoderInputFrameFormat;
 
     DWORD inputStreamID;
     DWORD outputStreamID;
-};
-
-void runEncode();
-
-int main()
-{
-    CHECK_HR(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED));
-    CHECK_HR(MFStartup(MF_VERSION));
 
-    Encoder encoder;
-    std::this_thread::sleep_for(std::chrono::seconds(5));
-    encoder.stop();
+    std::unique_ptr<D3D11FramePool> inputPool;
+    std::unique_ptr<D3D11StagingRing> staging;
+};
 
-    CHECK_HR(MFShutdown());
+// ----------------------------------------------------------------------------
+// Media Foundation capability probe
+//
+// Every hardware H.264 MFT bound to an adapter is activated on a device of
+// that adapter and configured with growing demands until it refuses. The
+// session limit is found by opening sessions until the driver says no.
+// ----------------------------------------------------------------------------
 
-    return 0;
-}
+constexpr uint32_t MAX_PROBED_SESSIONS = 32;
 
-void runEncode()
+class MfCapabilityProbe : public ICapabilityProbe
 {
-    DXGI_ADAPTER_DESC desc;
-    CComPtr<IDXGIFactory1> factory;
-    CComPtr<IDXGIAdapter> adapter;
-    CComPtr<ID3D11Device> device;
-    CComPtr<ID3D11DeviceContext> context;
-    CComPtr<IMFDXGIDeviceManager> deviceManager;
-
-    CComPtr<IMFVideoSampleAllocatorEx> allocator;
-    CComPtr<IMFTransform> transform;
-    CComPtr<IMFAttributes> transformAttrs;
-    CComQIPtr<IMFMediaEventGenerator> eventGen;
-    DWORD inputStreamID;
-    DWORD outputStreamID;
-
-    // ------------------------------------------------------------------------
-    // Open File
-    // ------------------------------------------------------------------------
-
-    std::ofstream fout;
-    fout.open("vid.h264", std::ios::binary | std::ios::out | std::ios::trunc);
-
-    // ------------------------------------------------------------------------
-    // Initialize D3D11
-    // ------------------------------------------------------------------------
-
-    CHECK_HR(CreateDXGIFactory1(IID_PPV_ARGS(&factory)));
-    UINT index = 0;
-    HRESULT adapterHr;
-    while (true)
+public:
+    MfCapabilityProbe()
     {
-        adapterHr = factory->EnumAdapters(index++, &adapter);
-        if (FAILED(adapterHr))
-            break;
-
-        CHECK_HR(adapter->GetDesc(&desc));
+        CHECK_HR(CreateDXGIFactory1(IID_PPV_ARGS(&factory)));
+    }
 
-        // Check for software adapter
-        if (desc.VendorId == 0x1002 || desc.VendorId == 0x10DE)
+    std::vector<AdapterIdentity> adapters() override
+    {
+        std::vector<AdapterIdentity> result;
+        CComPtr<IDXGIAdapter> adapter;
+        for (UINT index = 0; SUCCEEDED(factory->EnumAdapters(index, &adapter)); index++)
         {
-            break;
+            DXGI_ADAPTER_DESC desc;
+            CHECK_HR(adapter->GetDesc(&desc));
+
+            AdapterIdentity identity;
+            identity.index = index;
+            identity.luid = luidValue(desc.AdapterLuid);
+            identity.vendorId = desc.VendorId;
+            identity.deviceId = desc.DeviceId;
+            identity.subSysId = desc.SubSysId;
+            identity.revision = desc.Revision;
+            identity.description = toUtf8(desc.Description);
+
+            // The user-mode driver version, which is what DXGI reports here
+            LARGE_INTEGER driverVersion;
+            if (SUCCEEDED(adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion)))
+                identity.driverVersion = (uint64_t)driverVersion.QuadPart;
+
+            result.push_back(identity);
+            adapter.Release();
         }
+        return result;
     }
 
-    D3D_FEATURE_LEVEL featureLevels[] = {D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0, D3D_FEATURE_LEVEL_10_1, D3D_FEATURE_LEVEL_10_0};
-    CHECK_HR(D3D11CreateDevice(adapter, adapter ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE, nullptr, D3D11_CREATE_DEVICE_VIDEO_SUPPORT | D3D11_CREATE_DEVICE_DEBUG, featureLevels, 4, D3D11_SDK_VERSION, &device, NULL, &context));
-
+    std::vector<EncoderCaps> probe(const AdapterIdentity& identity) override
     {
-        // Probably not necessary in this application, but maybe the MFT requires it?
-        CComQIPtr<ID3D10Multithread> mt(device);
-        CHECK(mt);
-        mt->SetMultithreadProtected(TRUE);
-    }
+        std::vector<EncoderCaps> encoders;
 
-    // Create device manager
-    UINT resetToken;
-    CHECK_HR(MFCreateDXGIDeviceManager(&resetToken, &deviceManager));
-    CHECK_HR(deviceManager->ResetDevice(device, resetToken));
-
-
-    // ------------------------------------------------------------------------
-    // Initialize hardware encoder MFT
-    // ------------------------------------------------------------------------
+        MfSharedDevice device;
+        device.identity = identity;
+        CHECK_HR(factory->EnumAdapters(identity.index, &device.adapter));
+        try
+        {
+            device.create();
+        }
+        catch (const std::exception&)
+        {
+            // No video support, so no encoder either
+            return encoders;
+        }
 
-    {
-        // Find the encoder
         CComHeapPtr<IMFActivate*> activateRaw;
         UINT32 activateCount = 0;
+        if (FAILED(enumHardwareEncoders(identity.luid, nullptr, &activateRaw, &activateCount)))
+            return encoders;
 
-        // Input & output types
-        MFT_REGISTER_TYPE_INFO inInfo = { MFMediaType_Video, MFVideoFormat_NV12 };
-        MFT_REGISTER_TYPE_INFO outInfo = { MFMediaType_Video, MFVideoFormat_H264 };
-
-        //CComPtr<IMFAttributes> enumAttrs;
-        //CHECK_HR(MFCreateAttributes(&enumAttrs, 1));
-        //CHECK_HR(enumAttrs->SetBlob(MFT_ENUM_ADAPTER_LUID, (BYTE*)&desc.AdapterLuid, sizeof(LUID)));
-
-        CHECK_HR(MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER, MFT_ENUM_FLAG_HARDWARE, &inInfo, &outInfo, &activateRaw, &activateCount));
-
-        CHECK(activateCount != 0);
-
-        // Choose the first returned encoder
-        CComPtr<IMFActivate> activate = activateRaw[1];
-
-        // Memory management
         for (UINT32 i = 0; i < activateCount; i++)
-            activateRaw[i]->Release();
+        {
+            CComPtr<IMFActivate> activate;
+            activate.Attach(activateRaw[i]);
 
-        // Activate
-        CHECK_HR(activate->ActivateObject(IID_PPV_ARGS(&transform)));
+            EncoderCaps caps;
+            caps.hardware = true;
+            caps.clsid = activateClsid(activate);
 
-        // Get attributes
-        CHECK_HR(transform->GetAttributes(&transformAttrs));
-    }
+            UINT32 nameLength;
+            if (SUCCEEDED(activate->GetStringLength(MFT_FRIENDLY_NAME_Attribute, &nameLength)))
+            {
+                std::wstring name((size_t)nameLength + 1, 0);
+                activate->GetString(MFT_FRIENDLY_NAME_Attribute, &name[0], (UINT32)name.size(), &nameLength);
+                caps.name = toUtf8(name.c_str());
+            }
 
+            // Registered input types
+            UINT32 blobSize;
+            if (SUCCEEDED(activate->GetBlobSize(MFT_INPUT_TYPES_Attributes, &blobSize)))
+            {
+                std::vector<MFT_REGISTER_TYPE_INFO> types(blobSize / sizeof(MFT_REGISTER_TYPE_INFO));
+                activate->GetBlob(MFT_INPUT_TYPES_Attributes, (UINT8*)types.data(), blobSize, nullptr);
+                for (const MFT_REGISTER_TYPE_INFO& type : types)
+                {
+                    if (type.guidSubtype == MFVideoFormat_NV12)
+                        caps.inputFormats |= formatFlag(FrameFormat::NV12);
+                    if (type.guidSubtype == MFVideoFormat_ARGB32)
+                        caps.inputFormats |= formatFlag(FrameFormat::BGRA);
+                }
+            }
 
-    // ------------------------------------------------------------------------
-    // Query encoder name (not necessary, but nice) and unlock for async use
-    // ------------------------------------------------------------------------
+            probeLimits(device, activate, caps);
+            activate->ShutdownObject();
+            encoders.push_back(caps);
+        }
+        return encoders;
+    }
 
+private:
+    // Configures a fresh instance of the encoder, false when it refuses
+    static bool configure(MfSharedDevice& device, IMFTransform* transform, UINT32 width, UINT32 height, UINT32 profile)
     {
-        UINT32 nameLength;
-        std::wstring name;
-
-        CHECK_HR(transformAttrs->GetStringLength(MFT_FRIENDLY_NAME_Attribute, &nameLength));
+        CComPtr<IMFAttributes> attrs;
+        if (FAILED(transform->GetAttributes(&attrs)) || FAILED(attrs->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE)))
+            return false;
+        if (FAILED(transform->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER, reinterpret_cast<ULONG_PTR>(device.deviceManager.p))))
+            return false;
 
-        // IMFAttributes::GetString returns a null-terminated wide string
-        name.resize((size_t)nameLength + 1);
-        CHECK_HR(transformAttrs->GetString(MFT_FRIENDLY_NAME_Attribute, &name[0], (UINT32)name.size(), &nameLength));
-        name.resize(nameLength);
-
-        printf("Using %ls\n", name.c_str());
+        CComPtr<IMFMediaType> outputType;
+        if (FAILED(MFCreateMediaType(&outputType)))
+            return false;
+        outputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        outputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264);
+        outputType->SetUINT32(MF_MT_MPEG2_PROFILE, profile);
+        outputType->SetUINT32(MF_MT_AVG_BITRATE, 4000000);
+        MFSetAttributeSize(outputType, MF_MT_FRAME_SIZE, width, height);
+        MFSetAttributeRatio(outputType, MF_MT_FRAME_RATE, 30, 1);
+        outputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        return SUCCEEDED(transform->SetOutputType(0, outputType, 0));
+    }
 
-        // Unlock the transform for async use and get event generator
-        CHECK_HR(transformAttrs->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE));
-        CHECK(eventGen = transform);
+    // Through the activate the enumeration bound to this adapter, not the
+    // CLSID, which two adapters from one vendor share
+    static bool tryConfiguration(MfSharedDevice& device, IMFActivate* activate, UINT32 width, UINT32 height, UINT32 profile)
+    {
+        CComPtr<IMFTransform> transform;
+        if (FAILED(activate->ActivateObject(IID_PPV_ARGS(&transform))))
+            return false;
+        bool ok = configure(device, transform, width, height, profile);
+        transform.Release();
+        activate->ShutdownObject();
+        return ok;
     }
 
-    // Get stream IDs (expect 1 input and 1 output stream)
+    static void probeLimits(MfSharedDevice& device, IMFActivate* activate, EncoderCaps& caps)
     {
-        HRESULT hr = transform->GetStreamIDs(1, &inputStreamID, 1, &outputStreamID);
-        if (hr == E_NOTIMPL)
+        const UINT32 sizes[][2] = { { 8192, 8192 }, { 8192, 4320 }, { 4096, 4096 }, { 4096, 2304 }, { 3840, 2160 }, { 2560, 1440 }, { 1920, 1080 } };
+        for (const auto& size : sizes)
         {
-            inputStreamID = 0;
-            outputStreamID = 0;
-            hr = S_OK;
+            if (tryConfiguration(device, activate, size[0], size[1], eAVEncH264VProfile_Main))
+            {
+                caps.maxWidth = size[0];
+                caps.maxHeight = size[1];
+                break;
+            }
+        }
+
+        const UINT32 profiles[] = { eAVEncH264VProfile_Base, eAVEncH264VProfile_Main, eAVEncH264VProfile_High };
+        for (UINT32 profile : profiles)
+        {
+            if (tryConfiguration(device, activate, 1280, 720, profile))
+                caps.profiles |= profileFlag(profile);
+        }
+
+        // Streaming sessions held open at once, until the driver refuses one
+        std::vector<CComPtr<IMFTransform>> sessions;
+        while (sessions.size() < MAX_PROBED_SESSIONS)
+        {
+            // Detached, so the next ActivateObject creates another instance
+            CComPtr<IMFTransform> transform;
+            if (FAILED(activate->ActivateObject(IID_PPV_ARGS(&transform))))
+                break;
+            if (FAILED(activate->DetachObject()))
+            {
+                transform.Release();
+                activate->ShutdownObject();
+                break;
+            }
+            bool ok = configure(device, transform, 1280, 720, eAVEncH264VProfile_Main) &&
+                SUCCEEDED(transform->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0));
+            if (!ok)
+            {
+                MFShutdownObject(transform);
+                break;
+            }
+            sessions.push_back(transform);
+        }
+        caps.maxSessions = sessions.size() < MAX_PROBED_SESSIONS ? (uint32_t)sessions.size() : 0;
+        for (CComPtr<IMFTransform>& transform : sessions)
+        {
+            transform->ProcessMessage(MFT_MESSAGE_NOTIFY_END_STREAMING, 0);
+            MFShutdownObject(transform);
         }
-        CHECK_HR(hr);
     }
 
+    CComPtr<IDXGIFactory1> factory;
+};
 
-    // ------------------------------------------------------------------------
-    // Configure hardware encoder MFT
-    // ------------------------------------------------------------------------
+// ----------------------------------------------------------------------------
+// Media Foundation backend factory
+//
+// Adapters come from the capability registry, so startup only probes when
+// the cache is missing or a driver changed. Every adapter with a hardware
+// encoder gets one shared device, created with its first session.
+// ----------------------------------------------------------------------------
 
-    // Set D3D manager
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER, reinterpret_cast<ULONG_PTR>(deviceManager.p)));
+class MfBackendFactory : public IEncoderBackendFactory
+{
+public:
+    // A non-zero sessionsPerAdapter replaces the probed session limits
+    explicit MfBackendFactory(const std::string& cachePath = "encoder_caps.cache", uint32_t sessionsPerAdapter = 0)
+    {
+        MfCapabilityProbe probe;
+        registry.refresh(probe, cachePath);
 
-    // Set output type
-    CComPtr<IMFMediaType> outputType;
-    CHECK_HR(MFCreateMediaType(&outputType));
+        CComPtr<IDXGIFactory1> dxgi;
+        CHECK_HR(CreateDXGIFactory1(IID_PPV_ARGS(&dxgi)));
+        for (const AdapterCaps& adapter : registry.adapters())
+        {
+            if (!hasHardwareEncoder(adapter))
+                continue;
+
+            std::shared_ptr<MfSharedDevice> device = std::make_shared<MfSharedDevice>();
+            device->identity = adapter.identity;
+            CHECK_HR(dxgi->EnumAdapters(adapter.identity.index, &device->adapter));
+            devices.push_back(device);
+            caps.push_back(adapter);
+            limits.push_back(sessionsPerAdapter != 0 ? sessionsPerAdapter : adapterSessionLimit(adapter));
+        }
+        CHECK(!devices.empty());
+    }
 
-    CHECK_HR(outputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
-    CHECK_HR(outputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
-    CHECK_HR(outputType->SetUINT32(MF_MT_AVG_BITRATE, 30000000));
-    CHECK_HR(MFSetAttributeSize(outputType, MF_MT_FRAME_SIZE, ENCODE_WIDTH, ENCODE_HEIGHT));
-    CHECK_HR(MFSetAttributeRatio(outputType, MF_MT_FRAME_RATE, 60, 1));
-    CHECK_HR(outputType->SetUINT32(MF_MT_INTERLACE_MODE, 2));
-    CHECK_HR(outputType->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE));
+    uint32_t adapterCount() const override { return (uint32_t)devices.size(); }
+    uint32_t sessionLimit(uint32_t adapter) const override { return limits[adapter]; }
 
-    CHECK_HR(transform->SetOutputType(outputStreamID, outputType, 0));
+    bool supports(uint32_t adapter, const EncoderConfig& config) const override
+    {
+        return bestEncoder(caps[adapter], config) >= 0;
+    }
 
-    // Set input type
-    CComPtr<IMFMediaType> inputType;
-    CHECK_HR(transform->GetInputAvailableType(inputStreamID, 0, &inputType));
+    std::unique_ptr<IEncoderBackend> createBackend(uint32_t adapter, const EncoderConfig& config, WorkerPool& workers) override
+    {
+        CHECK(adapter < devices.size());
+        int encoder = bestEncoder(caps[adapter], config);
+        CHECK(encoder >= 0);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!devices[adapter]->device11)
+                devices[adapter]->create();
+        }
+        return std::unique_ptr<IEncoderBackend>(new MfEncoderBackend(devices[adapter], config, caps[adapter].encoders[encoder], &workers));
+    }
 
-    CHECK_HR(inputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
-    CHECK_HR(inputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12));
-    CHECK_HR(MFSetAttributeSize(inputType, MF_MT_FRAME_SIZE, ENCODE_WIDTH, ENCODE_HEIGHT));
-    CHECK_HR(MFSetAttributeRatio(inputType, MF_MT_FRAME_RATE, 60, 1));
+    const std::vector<AdapterCaps>& adapters() const { return caps; }
+    CapabilityRegistryStats probeStats() const { return registry.refreshStats(); }
 
-    CHECK_HR(transform->SetInputType(inputStreamID, inputType, 0));
+private:
+    CapabilityRegistry registry;
+    std::vector<std::shared_ptr<MfSharedDevice>> devices;
+    std::vector<AdapterCaps> caps;
+    std::vector<uint32_t> limits;
+    std::mutex mutex;
+};
 
+static std::unique_ptr<IEncoderBackendFactory> createFactory(bool software)
+{
+    if (software)
+        return std::make_unique<SoftwareBackendFactory>(SoftwareBackendOptions());
+    return std::make_unique<MfBackendFactory>();
+}
 
-    // ------------------------------------------------------------------------
-    // Create sample allocator
-    // ------------------------------------------------------------------------
+// The standard renditions of the stream from one capture: vid_720p.h264 and
+// vid_720p.mp4 and so on, keyframes on the same frames in all of them
+static LadderOptions standardLadderOptions(const EncoderConfig& config)
+{
+    LadderOptions options;
+    options.source = config;
+    options.rungs = standardLadder(config);
+    for (LadderRung& rung : options.rungs)
+        rung.path = "vid_" + std::to_string(rung.height) + "p.h264";
+    return options;
+}
 
+// --source: bars (the default), motion, shm:<name> for a frame ring another
+// process writes, anything else a raw or Y4M file. Patterns and raw files
+// are width x height; patterns are NV12 for NV12 encoders.
+static std::unique_ptr<IFrameSource> openFrameSource(const std::string& spec, const FileSourceOptions& fileOptions, FrameFormat target,
+                                                    std::string& error)
+{
+    if (spec == "bars")
+        return std::make_unique<PatternSource>(TestPattern::Bar, PictureFormat::BGRA, fileOptions.width, fileOptions.height);
+    if (spec == "motion")
     {
-        MFCreateVideoSampleAllocatorEx(IID_PPV_ARGS(&allocator));
-        CHECK(allocator);
-
-        CComPtr<IMFAttributes> allocAttrs;
-        MFCreateAttributes(&allocAttrs, 2);
+        PictureFormat format = target == FrameFormat::NV12 ? PictureFormat::NV12 : PictureFormat::BGRA;
+        if (format == PictureFormat::NV12 && (fileOptions.width % 2 != 0 || fileOptions.height % 2 != 0))
+        {
+            error = "the NV12 motion pattern needs an even size";
+            return nullptr;
+        }
+        return std::make_unique<PatternSource>(TestPattern::Motion, format, fileOptions.width, fileOptions.height);
+    }
+    if (spec.compare(0, 4, "shm:") == 0)
+    {
+        std::unique_ptr<FrameRingSource> ring = std::make_unique<FrameRingSource>();
+        if (!ring->open(spec.substr(4), error))
+            return nullptr;
+        return ring;
+    }
+    std::unique_ptr<FileFrameSource> file = std::make_unique<FileFrameSource>();
+    if (!file->open(spec, fileOptions, error))
+        return nullptr;
+    return file;
+}
 
-        CHECK_HR(allocAttrs->SetUINT32(MF_SA_D3D11_BINDFLAGS, D3D11_BIND_RENDER_TARGET));
-        CHECK_HR(allocAttrs->SetUINT32(MF_SA_D3D11_USAGE, D3D11_USAGE_DEFAULT));
+static int encodeLadder(IEncoderBackendFactory& factory, const LadderOptions& options, const FrameSchedulerOptions& schedule, IFrameSource& source,
+                        MetricsRegistry* metrics, MetricsExporter* exporter)
+{
+    const EncoderConfig& config = options.source;
 
-        CHECK_HR(allocator->SetDirectXManager(deviceManager));
-        CHECK_HR(allocator->InitializeSampleAllocatorEx(1, 2, allocAttrs, inputType));
+    // First adapter whose encoder can take every rung
+    uint32_t adapter = 0;
+    auto supportsAll = [&](uint32_t candidate)
+    {
+        for (const LadderRung& rung : options.rungs)
+        {
+            if (!factory.supports(candidate, ladderRungConfig(config, rung)))
+                return false;
+        }
+        return true;
+    };
+    while (adapter < factory.adapterCount() && !supportsAll(adapter))
+        adapter++;
+    CHECK(adapter < factory.adapterCount());
+
+    WorkerPool workers;
+    std::vector<std::unique_ptr<Mp4Muxer>> muxers;
+    LadderEncoder ladder(factory, adapter, options, workers);
+    ladder.setFrameSource(&source);
+    if (metrics)
+        ladder.setMetrics(*metrics);
+    for (size_t i = 0; i < options.rungs.size(); i++)
+    {
+        Mp4MuxerOptions muxerOptions;
+        muxerOptions.width = options.rungs[i].width;
+        muxerOptions.height = options.rungs[i].height;
+        muxers.emplace_back(new Mp4Muxer(("vid_" + std::to_string(options.rungs[i].height) + "p.mp4").c_str(), muxerOptions));
+        ladder.addConsumer(i, muxers.back().get());
     }
+    ladder.setSchedule(schedule);
+    ladder.start();
 
+    int exitCode = 0;
+    if (!ladder.waitForDrain())
+    {
+        EncoderStatus failure = ladder.status();
+        fprintf(stderr, "encode: %s failed with 0x%08X\n", failure.operation, (unsigned)failure.code);
+        exitCode = 1;
+    }
+    bool written = true;
+    for (std::unique_ptr<Mp4Muxer>& muxer : muxers)
+        written = muxer->finish() && written;
+    written = ladder.closeWriters() && written;
+    if (!written)
+    {
+        fprintf(stderr, "encode: writing an output file failed\n");
+        exitCode = 1;
+    }
 
-    // ------------------------------------------------------------------------
-    // Start encoding
-    // ------------------------------------------------------------------------
-
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, NULL));
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, NULL));
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, NULL));
+    // The last StatsD push, while the rungs' series are still there
+    if (exporter)
+        exporter->stop();
 
-    // Encode loop
-    /*
-    for (int i = 0; i < ENCODE_FRAMES; i++)
+    LadderStats stats = ladder.stats();
+    printf("Frames captured %llu, converted %llu, dropped %llu\n", (unsigned long long)stats.schedule.captured,
+        (unsigned long long)stats.conversions, (unsigned long long)stats.schedule.dropped);
+    for (const LadderRungStats& rung : stats.rungs)
     {
-        // Get next event
-        CComPtr<IMFMediaEvent> event;
-        CHECK_HR(eventGen->GetEvent(0, &event));
+        printf("  %ux%u: %llu frames, %llu keyframes, %.1f MB, %.2f ms scaling per frame\n", rung.width, rung.height,
+            (unsigned long long)rung.framesOut, (unsigned long long)rung.keyframes, rung.bytes / 1e6,
+            rung.framesIn ? rung.scaleUs / 1000.0 / rung.framesIn : 0.0);
+    }
+    return exitCode;
+}
 
-        MediaEventType eventType;
-        CHECK_HR(event->GetType(&eventType));
+int main(int argc, char** argv)
+{
+    // Settings from --config files and --key value pairs, checked before any device is touched
+    EncoderConfig config;
+    std::vector<std::string> rest;
+    std::string error;
+    if (!parseConfigArguments(argc, argv, config, rest, error) || !validateConfig(config, error))
+    {
+        fprintf(stderr, "encode: %s\n", error.c_str());
+        return 1;
+    }
 
-        switch (eventType)
+    // --software runs the pipeline against the stand-in instead of the GPU
+    // --schedule picks realtime capture, a bounded capture queue or fast (offline)
+    // --trace writes a Chrome trace of every frame's way from fill to file
+    // --live writes HLS/DASH segments and playlists into a directory, the
+    // segment length (--segment-ms) sets the GOP so every segment starts on an IDR
+    // --ladder encodes 1080p/720p/480p/360p renditions (those up to the
+    // configured size) from one capture instead of one stream
+    // --durable syncs vid.h264 at every GOP and journals it to vid.h264.wal,
+    // so ./recover can make a playable recording of it after a crash
+    // --capture-size captures at another size and scales every frame to the
+    // configured one, --scale-filter picks how (and how the ladder scales)
+    // --source takes pictures from a pattern, a raw or Y4M file (raw files
+    // are --source-format at --capture-size or --size) or a shared memory
+    // ring; --loop repeats a file, which otherwise ends the stream
+    // --track-leaks remembers where every sample, buffer, texture and packet
+    // was created and lists the ones still alive at the end (exit code 1)
+    // --metrics-port serves Prometheus text on 127.0.0.1:port/metrics and
+    // --statsd-port pushes StatsD to 127.0.0.1:port every --statsd-ms
+    // --upload-ahead fills that many frames ahead into staging textures and
+    // copies them into the encoder's while it encodes (--schedule fast only)
+    // --tile-threads converts, scales and analyzes BGRA pictures in one pass
+    // of cache sized tiles on that many threads, --pin-threads pins them
+    // --benchmark runs the sweep in benchmark_suite.h, everything after it is for the sweep
+    bool software = false;
+    bool ladder = false;
+    bool durable = false;
+    bool benchmark = false;
+    BenchmarkCommand benchmarkCommand;
+    uint64_t seconds = 5;
+    FrameSchedulerOptions schedule;
+    schedule.mode = FrameSchedule::RealTime;
+    const char* tracePath = nullptr;
+    const char* liveDirectory = nullptr;
+    LiveSegmenterOptions liveOptions;
+    uint64_t segmentMs = 2000;
+    uint64_t liveWindow = liveOptions.windowSegments;
+    uint32_t captureWidth = 0;
+    uint32_t captureHeight = 0;
+    ScaleFilter scaleFilter = ScaleFilter::Bicubic;
+    bool scaleFilterSet = false;
+    std::string sourceSpec = "bars";
+    FileSourceOptions fileOptions;
+    MetricsExporterOptions metricsOptions;
+    uint64_t metricsPort = 0;
+    uint64_t statsdPort = 0;
+    uint64_t statsdMs = (uint64_t)metricsOptions.statsdInterval.count();
+    uint64_t uploadAhead = 0;
+    uint64_t tileThreads = 0;
+    bool pinThreads = false;
+    for (size_t i = 0; i < rest.size(); i++)
+    {
+        if (rest[i] == "--software")
+            software = true;
+        else if (rest[i] == "--seconds" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], seconds))
+            i++;
+        else if (rest[i] == "--schedule" && i + 1 < rest.size() && parseFrameSchedule(rest[i + 1], schedule.mode))
+            i++;
+        else if (rest[i] == "--trace" && i + 1 < rest.size())
+            tracePath = rest[++i].c_str();
+        else if (rest[i] == "--ladder")
+            ladder = true;
+        else if (rest[i] == "--durable")
+            durable = true;
+        else if (rest[i] == "--live" && i + 1 < rest.size())
+            liveDirectory = rest[++i].c_str();
+        else if (rest[i] == "--segment-ms" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], segmentMs) && segmentMs >= 100)
+            i++;
+        else if (rest[i] == "--segment-format" && i + 1 < rest.size() && parseSegmentFormat(rest[i + 1], liveOptions.format))
+            i++;
+        else if (rest[i] == "--live-window" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], liveWindow) && liveWindow != 0 && liveWindow <= 1000)
+            i++;
+        else if (rest[i] == "--capture-size" && i + 1 < rest.size() && parseSize(rest[i + 1], captureWidth, captureHeight) &&
+                 captureWidth != 0 && captureHeight != 0)
+            i++;
+        else if (rest[i] == "--scale-filter" && i + 1 < rest.size() && parseScaleFilter(rest[i + 1], scaleFilter))
         {
-        case METransformNeedInput:
+            scaleFilterSet = true;
+            i++;
+        }
+        else if (rest[i] == "--source" && i + 1 < rest.size())
+            sourceSpec = rest[++i];
+        else if (rest[i] == "--source-format" && i + 1 < rest.size() && parsePictureFormat(rest[i + 1], fileOptions.format))
+            i++;
+        else if (rest[i] == "--loop")
+            fileOptions.loop = true;
+        else if (rest[i] == "--track-leaks")
+            resourceTracker().setLeakTracking(true);
+        else if (rest[i] == "--metrics-port" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], metricsPort) && metricsPort != 0 && metricsPort <= 65535)
+            i++;
+        else if (rest[i] == "--statsd-port" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], statsdPort) && statsdPort != 0 && statsdPort <= 65535)
+            i++;
+        else if (rest[i] == "--statsd-ms" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], statsdMs) && statsdMs >= 100)
+            i++;
+        else if (rest[i] == "--upload-ahead" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], uploadAhead) &&
+                 uploadAhead >= MIN_UPLOAD_DEPTH && uploadAhead <= MAX_UPLOAD_DEPTH)
+            i++;
+        else if (rest[i] == "--tile-threads" && i + 1 < rest.size() && parseUnsigned(rest[i + 1], tileThreads) &&
+                 tileThreads != 0 && tileThreads <= MAX_TILE_THREADS)
+            i++;
+        else if (rest[i] == "--pin-threads")
+            pinThreads = true;
+        else if (rest[i] == "--benchmark")
         {
-            // Generate texture
-            CComPtr<ID3D11Texture2D> texture;
-            D3D11_TEXTURE2D_DESC desc;
-            ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
-
-            desc.Format = DXGI_FORMAT_NV12;
-            desc.Width = ENCODE_WIDTH;
-            desc.Height = ENCODE_HEIGHT;
-            desc.MipLevels = 1;
-            desc.ArraySize = 1;
-            desc.SampleDesc.Count = 1;
-            desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-            desc.Usage = D3D11_USAGE_DYNAMIC;
-            desc.BindFlags = D3D11_BIND_VIDEO_ENCODER;
-
-            HRESULT hr = device->CreateTexture2D(&desc, nullptr, &texture);
-            if (FAILED(hr))
+            benchmark = true;
+            if (!parseBenchmarkArguments(std::vector<std::string>(rest.begin() + i + 1, rest.end()), benchmarkCommand, error))
             {
-                printf("?\n");
-                return;
+                fprintf(stderr, "encode: %s\n", error.c_str());
+                return 1;
             }
+            break;
+        }
+        else
+        {
+            fprintf(stderr, "encode: unknown argument %s\n", rest[i].c_str());
+            return 1;
+        }
+    }
+    if (benchmark)
+    {
+        CHECK_HR(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED));
+        CHECK_HR(MFStartup(MF_VERSION));
+        benchmarkCommand.suite.base = config;
+        int code = runBenchmarkCommand(*createFactory(software), benchmarkCommand);
+        CHECK_HR(MFShutdown());
+        return code;
+    }
 
-            D3D11_MAPPED_SUBRESOURCE mappedResource;
-            ZeroMemory(&mappedResource, sizeof(D3D11_MAPPED_SUBRESOURCE));
-            DWORD length = ENCODE_WIDTH * ENCODE_HEIGHT * 3 / 2;
-            // Lock texture
-            CHECK_HR(context->Map(texture, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource));
-            //  Update the vertex buffer here.
-            memset(mappedResource.pData, 200, length);
-            //  Reenable GPU access to the vertex buffer data.
-            context->Unmap(texture, 0);
-
-            // Create media buffer backed by DXGI
-            IMFMediaBuffer* dxgiMediaBuffer;
-            CHECK_HR(MFCreateDXGISurfaceBuffer(__uuidof(ID3D11Texture2D), texture, 0, FALSE, &dxgiMediaBuffer));
-
-            // Create sample
-            IMFSample* dxgiSample;
-            CHECK_HR(MFCreateSample(&dxgiSample));
-            CHECK_HR(dxgiSample->AddBuffer(dxgiMediaBuffer));
+    if (uploadAhead != 0 && (ladder || schedule.mode != FrameSchedule::AsFastAsPossible || config.lookahead != 0))
+    {
+        fprintf(stderr, "encode: --upload-ahead fills ahead of one --schedule fast stream without a lookahead\n");
+        return 1;
+    }
+    if (ladder && (liveDirectory || tracePath || tileThreads != 0 || schedule.mode == FrameSchedule::BoundedQueue))
+    {
+        fprintf(stderr, "encode: --ladder does not go with --live, --trace, --tile-threads or --schedule queue\n");
+        return 1;
+    }
+    if (ladder && !validateLadder(standardLadderOptions(config), error))
+    {
+        fprintf(stderr, "encode: %s\n", error.c_str());
+        return 1;
+    }
+    if (ladder && durable)
+    {
+        fprintf(stderr, "encode: --durable records one stream, not a --ladder\n");
+        return 1;
+    }
+    if (ladder && captureWidth != 0)
+    {
+        fprintf(stderr, "encode: --ladder captures at --size, not --capture-size\n");
+        return 1;
+    }
+    if (captureWidth != 0 && config.format == FrameFormat::NV12 && (captureWidth % 2 != 0 || captureHeight % 2 != 0))
+    {
+        fprintf(stderr, "encode: NV12 needs an even --capture-size\n");
+        return 1;
+    }
 
-            // Other fields for sample
-            mfTicks += mfDuration;
-            CHECK_HR(dxgiSample->SetSampleTime(mfTicks));
-            CHECK_HR(dxgiSample->SetSampleDuration(mfDuration));
+    // Pictures of another size are scaled, a ladder's source has its size
+    fileOptions.width = captureWidth != 0 ? captureWidth : config.width;
+    fileOptions.height = captureWidth != 0 ? captureHeight : config.height;
+    std::unique_ptr<IFrameSource> source = openFrameSource(sourceSpec, fileOptions, config.format, error);
+    if (!source)
+    {
+        fprintf(stderr, "encode: %s\n", error.c_str());
+        return 1;
+    }
+    FrameSourceInfo sourceInfo = source->info();
+    if (config.format == FrameFormat::BGRA && sourceInfo.format != PictureFormat::BGRA)
+    {
+        fprintf(stderr, "encode: BGRA encoding takes BGRA pictures, not %s\n", pictureFormatName(sourceInfo.format));
+        return 1;
+    }
+    if (ladder && (sourceInfo.width != config.width || sourceInfo.height != config.height))
+    {
+        fprintf(stderr, "encode: --ladder needs a %ux%u source, not %ux%u\n", config.width, config.height, sourceInfo.width, sourceInfo.height);
+        return 1;
+    }
+    if (config.format == FrameFormat::NV12 && (sourceInfo.width % 2 != 0 || sourceInfo.height % 2 != 0))
+    {
+        fprintf(stderr, "encode: NV12 needs a source of even size\n");
+        return 1;
+    }
 
-            CHECK_HR(transform->ProcessInput(inputStreamID, dxgiSample, 0));
+    // Segments cut on IDRs, so the GOP follows the segment length
+    if (liveDirectory)
+    {
+        liveOptions.directory = liveDirectory;
+        liveOptions.segmentDuration = std::chrono::milliseconds(segmentMs);
+        liveOptions.windowSegments = (uint32_t)liveWindow;
+        liveOptions.width = config.width;
+        liveOptions.height = config.height;
+        liveOptions.bandwidth = config.rateControl == RateControl::Quality ? 0 : std::max(config.bitrate, config.maxBitrate);
+        config.gopLength = segmentGopLength(config.frameRate, liveOptions.segmentDuration);
+        if (!validateConfig(config, error))
+        {
+            fprintf(stderr, "encode: %s\n", error.c_str());
+            return 1;
+        }
+    }
 
-            // Dereferencing the device once after feeding each frame "fixes" the leak.
-            //device.p->Release();
+    // The stream is as long as asked for whether frames come in real time or
+    // not, or until a file source ends
+    schedule.frames = std::max<uint64_t>(1, seconds * config.frameRate.num / config.frameRate.den);
+    printf("Encoding %s, %llu frames %s\n", describeConfig(config).c_str(), (unsigned long long)schedule.frames, frameScheduleName(schedule.mode));
 
-            break;
+    // Series are only recorded when something exports them
+    MetricsRegistry metricsRegistry;
+    std::unique_ptr<MetricsExporter> exporter;
+    if (metricsPort != 0 || statsdPort != 0)
+    {
+        metricsOptions.prometheusPort = (uint16_t)metricsPort;
+        metricsOptions.statsdPort = (uint16_t)statsdPort;
+        metricsOptions.statsdInterval = std::chrono::milliseconds(statsdMs);
+        exporter = std::make_unique<MetricsExporter>(metricsRegistry, metricsOptions);
+        if (!exporter->start(error))
+        {
+            fprintf(stderr, "encode: %s\n", error.c_str());
+            return 1;
         }
+        if (metricsPort != 0)
+            printf("Metrics on http://127.0.0.1:%u/metrics\n", (unsigned)exporter->prometheusPort());
+    }
+    MetricsRegistry* metrics = exporter ? &metricsRegistry : nullptr;
 
-        case METransformHaveOutput:
-        {
-            DWORD status;
-            MFT_OUTPUT_DATA_BUFFER outputBuffer = {};
-            outputBuffer.dwStreamID = outputStreamID;
+    CHECK_HR(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED));
+    CHECK_HR(MFStartup(MF_VERSION));
 
-            CHECK_HR(transform->ProcessOutput(0, 1, &outputBuffer, &status));
+    ResourceSnapshot startResources = resourceTracker().snapshot();
+    int exitCode = 0;
+    if (ladder)
+    {
+        LadderOptions ladderOptions = standardLadderOptions(config);
+        if (scaleFilterSet)
+            ladderOptions.filter = scaleFilter;
+        exitCode = encodeLadder(*createFactory(software), ladderOptions, schedule, *source, metrics, exporter.get());
+    }
+    else
+    {
+        std::unique_ptr<IEncoderBackendFactory> factory = createFactory(software);
 
-            DWORD bufCount;
-            DWORD bufLength;
-            CHECK_HR(outputBuffer.pSample->GetBufferCount(&bufCount));
+        // First adapter whose encoder can take the stream
+        uint32_t adapter = 0;
+        while (adapter < factory->adapterCount() && !factory->supports(adapter, config))
+            adapter++;
+        CHECK(adapter < factory->adapterCount());
 
-            CComPtr<IMFMediaBuffer> outBuffer;
-            CHECK_HR(outputBuffer.pSample->GetBufferByIndex(0, &outBuffer));
-            CHECK_HR(outBuffer->GetCurrentLength(&bufLength));
+        WorkerPool workers;
+        std::unique_ptr<IEncoderBackend> backend = factory->createBackend(adapter, config, workers);
 
-            printf("METransformHaveOutput buffers=%d, bytes=%d\n", bufCount, bufLength);
+        // Tiles of every picture, for as long as the encoder fills frames
+        std::unique_ptr<TileScheduler> tiles;
+        if (tileThreads != 0)
+        {
+            TileSchedulerOptions tileOptions;
+            tileOptions.threads = (uint32_t)tileThreads;
+            tileOptions.pin = pinThreads;
+            tiles = std::make_unique<TileScheduler>(tileOptions);
+        }
 
-            // write bytes to file
-            BYTE* encodedData;
-            DWORD encodedLength;
-            CHECK_HR(outBuffer->Lock(&encodedData, nullptr, &encodedLength));
-            fout.write((char*)encodedData, encodedLength);
-            CHECK_HR(outBuffer->Unlock());
+        // Playable fragmented MP4 next to the raw elementary stream
+        Mp4MuxerOptions muxerOptions;
+        muxerOptions.width = config.width;
+        muxerOptions.height = config.height;
+        Mp4Muxer muxer("vid.mp4", muxerOptions);
+
+        // Frame to file offset for tools that seek in or cut vid.h264
+        SeekIndexWriter index("vid.h264.idx");
+
+        // Live segments and playlists, written on the pool
+        std::unique_ptr<LiveSegmenter> live;
+        if (liveDirectory)
+            live = std::make_unique<LiveSegmenter>(liveOptions, &workers);
+
+        // Interactive streams go to the file frame by frame
+        FrameTracerOptions traceOptions;
+        traceOptions.chromeTraceFrames = tracePath ? (size_t)(seconds + 1) * 1000 : 0;
+        FrameTracer tracer(traceOptions);
+
+        // Synced GOP by GOP and journaled, see recording_journal.h
+        std::unique_ptr<RecordingJournal> journal;
+        if (durable)
+            journal = std::make_unique<RecordingJournal>("vid.h264.wal", config.width, config.height);
+
+        // Declared before the encoder, whose output side reports to it to the end
+        std::unique_ptr<EncoderMetrics> encoderMetrics;
+        if (metrics)
+            encoderMetrics = std::make_unique<EncoderMetrics>(*metrics, MetricLabels{ { "stream", "vid" } });
+
+        Encoder encoder(*backend, "vid.h264", config.lowLatency ? lowLatencyWriterOptions() : BitstreamWriterOptions());
+        encoder.setTracer(&tracer);
+        encoder.setMetrics(encoderMetrics.get());
+        encoder.setJournal(journal.get());
+        encoder.addConsumer(&muxer);
+        encoder.addConsumer(&index);
+        if (live)
+            encoder.addConsumer(live.get());
+        encoder.setSchedule(schedule, &workers);
+        encoder.setFrameSource(source.get(), scaleFilter, &workers);
+        encoder.setPreprocessing(tiles.get());
+        if (uploadAhead != 0)
+        {
+            UploadPipelineOptions uploadOptions;
+            uploadOptions.depth = (uint32_t)uploadAhead;
+            CHECK(encoder.setUploadPipeline(uploadOptions, &workers));
+        }
+        encoder.start();
 
-            // Release the sample as it is not processed further.
-            if (outputBuffer.pSample)
-                outputBuffer.pSample->Release();
-            if (outputBuffer.pEvents)
-                outputBuffer.pEvents->Release();
-            break;
+        // The encoder drains by itself after the last frame. The last
+        // fragment is written once everything has come out.
+        // A failed encoder still leaves a playable file of what came out
+        bool drained = encoder.waitForDrain();
+        if (!drained)
+        {
+            EncoderStatus failure = encoder.status();
+            fprintf(stderr, "encode: %s failed with 0x%08X\n", failure.operation, (unsigned)failure.code);
+            exitCode = 1;
         }
+        bool written = muxer.finish();
+        written = index.finish() && written;
+        if (live)
+        {
+            live->finish();
+            LiveSegmenterStats segments = live->stats();
+            printf("Live %s: %llu segments, %llu in the window, %llu write failures\n", segmentFormatName(liveOptions.format),
+                (unsigned long long)segments.segments, (unsigned long long)live->window().size(), (unsigned long long)segments.writeFailures);
         }
-    }
-    */
 
-    // ------------------------------------------------------------------------
-    // Finish encoding
-    // ------------------------------------------------------------------------
-
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_NOTIFY_END_OF_STREAM, NULL));
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_NOTIFY_END_STREAMING, NULL));
-    CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_COMMAND_DRAIN, NULL));
-
-    // Shutdown
-    printf("Finished encoding\n");
-
-    // I've tried all kinds of things...
-    //CHECK_HR(transform->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER, reinterpret_cast<ULONG_PTR>(nullptr)));
-
-    //transform->SetInputType(inputStreamID, NULL, 0);
-    //transform->SetOutputType(outputStreamID, NULL, 0);
+        // Written stamps come from the writer thread, which is done once it is closed
+        written = encoder.closeWriter() && written;
+        if (!written)
+        {
+            fprintf(stderr, "encode: writing an output file failed\n");
+            exitCode = 1;
+        }
+        if (exporter)
+            exporter->stop();
+        FrameTracerStats trace = tracer.stats();
+        printf("Latency over %llu frames (%llu never written), fill to bitstream p50 %.2f ms p95 %.2f ms p99 %.2f ms, fill to file p99 %.2f ms\n",
+            (unsigned long long)trace.frames, (unsigned long long)trace.abandoned, trace.captureToBitstream.percentile(0.5) / 1000, trace.captureToBitstream.percentile(0.95) / 1000,
+            trace.captureToBitstream.percentile(0.99) / 1000, trace.endToEnd.percentile(0.99) / 1000);
+        if (journal)
+        {
+            BitstreamWriterStats written = encoder.writerStats();
+            RecordingJournalStats journaled = journal->stats();
+            printf("Durable: %llu syncs (max %.2f ms), %llu GOPs committed (max %.2f ms), journal %.1f KB for %.1f MB\n",
+                (unsigned long long)written.syncCalls, written.syncMaxUs / 1000, (unsigned long long)journaled.commits,
+                journaled.commitMaxUs / 1000, journaled.bytes / 1024.0, written.bytesWritten / 1e6);
+        }
+        FrameSchedulerStats scheduled = encoder.schedulerStats();
+        printf("Frames captured %llu, repeated %llu, skipped %llu, dropped %llu\n", (unsigned long long)scheduled.captured,
+            (unsigned long long)scheduled.duplicated, (unsigned long long)scheduled.skipped, (unsigned long long)scheduled.dropped);
+        if (uploadAhead != 0)
+        {
+            UploadPipelineStats uploaded = encoder.uploadStats();
+            printf("Upload: %llu frames staged (%.2f ms each), at most %u ahead, %llu fills waited on a copy, %llu requests on a fill\n",
+                (unsigned long long)uploaded.filled, uploaded.fillUs / 1000, uploaded.maxAhead, (unsigned long long)uploaded.fenceWaits,
+                (unsigned long long)uploaded.starved);
+        }
+        if (tiles)
+        {
+            FramePreprocessorStats preprocessed = encoder.preprocessStats();
+            TileSchedulerStats tiled = tiles->stats();
+            printf("Tiles: %llu frames in %u tiles of %u rows (%.0f KB each, %.2f ms a frame) on %u threads over %u nodes, %llu of %llu tiles stolen\n",
+                (unsigned long long)preprocessed.frames, preprocessed.tiles, preprocessed.tileRows, preprocessed.tileBytes / 1024.0,
+                preprocessed.frameUs / 1000, tiled.threads, tiled.nodes, (unsigned long long)tiled.stolenTiles,
+                (unsigned long long)tiled.tiles);
+        }
+        if (config.lookahead != 0)
+        {
+            LookaheadStats analyzed = encoder.lookaheadStats();
+            printf("Lookahead: %llu frames analyzed (%.0f us each), %llu scene cuts, %llu flashes passed over\n",
+                (unsigned long long)analyzed.frames, analyzed.analysisUs, (unsigned long long)analyzed.sceneCuts,
+                (unsigned long long)analyzed.flashes);
+        }
+        if (tracePath)
+            CHECK(tracer.writeChromeTrace(tracePath));
+    }
 
-    //transform->DeleteInputStream(inputStreamID);
+    // Every encoder, pool and packet is gone by now
+    ResourceSnapshot endResources = resourceTracker().snapshot();
+    printf("Resources:");
+    for (ResourceKind kind : { ResourceKind::Sample, ResourceKind::Buffer, ResourceKind::Texture, ResourceKind::Packet })
+    {
+        const ResourceCounts& counts = endResources[kind];
+        printf(" %s peak %lld (%.1f MB), %.2f per frame, %lld left;", resourceKindName(kind), (long long)counts.peakLive,
+            counts.peakBytes / 1e6, createdPerFrame(startResources, endResources, kind, schedule.frames),
+            (long long)(counts.live - startResources[kind].live));
+    }
+    printf("\n");
+    if (resourceTracker().leakTracking() && resourceTracker().reportLeaks(stderr) != 0)
+        exitCode = 1;
+    if (exporter)
+    {
+        MetricsExporterStats exported = exporter->stats();
+        printf("Metrics: %llu scrapes, %llu StatsD datagrams, %llu send failures\n", (unsigned long long)exported.scrapes,
+            (unsigned long long)exported.datagrams, (unsigned long long)exported.sendFailures);
+    }
 
-    //deviceManager->ResetDevice(NULL, resetToken);
+    CHECK_HR(MFShutdown());
 
-    CHECK_HR(MFShutdownObject(transform));
-    fout.close();
-}
\ No newline at end of file
+    return exitCode;
+}
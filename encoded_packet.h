@@ -0,0 +1,308 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "resource_tracker.h"
+
+// ----------------------------------------------------------------------------
+// Encoded packets
+//
+// One access unit, shared by reference count between every consumer (file
+// writer, muxer, network sinks) instead of being copied for each of them. The
+// buffer behind a packet stays locked and alive until the last handle drops;
+// what happens then is up to the buffer: the MF one unlocks and releases its
+// IMFMediaBuffer, the pooled one goes back to its pool.
+// ----------------------------------------------------------------------------
+
+struct ByteSpan
+{
+    const uint8_t* data;
+    size_t size;
+};
+
+class PacketBuffer
+{
+public:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    int64_t time = 0;
+    int64_t duration = 0;
+    bool keyframe = false;
+
+protected:
+    virtual ~PacketBuffer() {}
+
+    // The last handle is gone
+    virtual void recycle() = 0;
+
+private:
+    friend class EncodedPacket;
+    std::atomic<uint32_t> refs{0};
+};
+
+class EncodedPacket
+{
+public:
+    EncodedPacket() {}
+
+    explicit EncodedPacket(PacketBuffer* buffer)
+        : buffer(buffer)
+    {
+        if (buffer)
+            buffer->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    EncodedPacket(const EncodedPacket& other)
+        : EncodedPacket(other.buffer)
+    {
+    }
+
+    EncodedPacket(EncodedPacket&& other) noexcept
+        : buffer(other.buffer)
+    {
+        other.buffer = nullptr;
+    }
+
+    EncodedPacket& operator=(EncodedPacket other) noexcept
+    {
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+
+    ~EncodedPacket()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if (buffer && buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            buffer->recycle();
+        buffer = nullptr;
+    }
+
+    explicit operator bool() const { return buffer != nullptr; }
+
+    const uint8_t* data() const { return buffer->data; }
+    size_t size() const { return buffer->size; }
+    int64_t time() const { return buffer->time; }
+    int64_t duration() const { return buffer->duration; }
+    bool keyframe() const { return buffer->keyframe; }
+    uint32_t useCount() const { return buffer ? buffer->refs.load(std::memory_order_relaxed) : 0; }
+
+    ByteSpan span() const { return { buffer->data, buffer->size }; }
+
+    ByteSpan span(size_t offset, size_t size) const
+    {
+        CHECK(offset <= buffer->size && size <= buffer->size - offset);
+        return { buffer->data + offset, size };
+    }
+
+private:
+    PacketBuffer* buffer = nullptr;
+};
+
+// Anything that wants every access unit: writer, muxer, streaming sink
+class IPacketConsumer
+{
+public:
+    virtual ~IPacketConsumer() {}
+    virtual void onPacket(const EncodedPacket& packet) = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Scatter-gather view
+//
+// A list of byte ranges that can be written with one writev. Ranges taken
+// from packets keep those packets alive; plain spans have to outlive the list.
+// ----------------------------------------------------------------------------
+
+class PacketGather
+{
+public:
+    void add(const EncodedPacket& packet)
+    {
+        add(packet, 0, packet.size());
+    }
+
+    void add(const EncodedPacket& packet, size_t offset, size_t size)
+    {
+        if (owners.empty() || owners.back().data() != packet.data())
+            owners.push_back(packet);
+        add(packet.span(offset, size));
+    }
+
+    void add(ByteSpan span)
+    {
+        if (span.size == 0)
+            return;
+
+        // Merge with the previous range when contiguous
+        if (!ranges.empty() && ranges.back().data + ranges.back().size == span.data)
+            ranges.back().size += span.size;
+        else
+            ranges.push_back(span);
+        bytes += span.size;
+    }
+
+    void clear()
+    {
+        ranges.clear();
+        owners.clear();
+        bytes = 0;
+    }
+
+    const std::vector<ByteSpan>& spans() const { return ranges; }
+    size_t size() const { return bytes; }
+
+private:
+    std::vector<ByteSpan> ranges;
+    std::vector<EncodedPacket> owners;
+    size_t bytes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Packet pool
+//
+// Buffers keep their capacity when recycled, so after warm-up producing a
+// packet allocates nothing. Buffers may outlive the pool; they are freed
+// instead of recycled then.
+// ----------------------------------------------------------------------------
+
+struct PacketPoolStats
+{
+    uint64_t allocations = 0; // buffers created
+    uint64_t reuses = 0;      // acquire() served from the free list
+    uint64_t outstanding = 0; // buffers held by packets right now
+};
+
+class PacketPool
+{
+    struct State;
+
+public:
+    class Buffer : public PacketBuffer
+    {
+    public:
+        // Fill storage, then commit() to point the packet at it
+        std::vector<uint8_t> storage;
+
+        Buffer()
+        {
+            TRACK_CREATED(ResourceKind::Packet, this, 0);
+        }
+
+        ~Buffer()
+        {
+            TRACK_DESTROYED(ResourceKind::Packet, this, trackedBytes);
+        }
+
+        void commit()
+        {
+            data = storage.data();
+            size = storage.size();
+
+            // Capacity only changes while the packet is being filled
+            if (storage.capacity() != trackedBytes)
+            {
+                resourceTracker().resized(ResourceKind::Packet, this, trackedBytes, storage.capacity());
+                trackedBytes = storage.capacity();
+            }
+        }
+
+    protected:
+        void recycle() override;
+
+    private:
+        friend class PacketPool;
+        std::shared_ptr<State> state;
+        size_t trackedBytes = 0;    // capacity last reported to the tracker
+    };
+
+    PacketPool()
+        : state(std::make_shared<State>())
+    {
+    }
+
+    ~PacketPool()
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->open = false;
+        for (Buffer* buffer : state->free)
+            delete buffer;
+        state->free.clear();
+    }
+
+    // Empty buffer with whatever capacity it had last time
+    EncodedPacket acquire(Buffer*& buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stats.outstanding++;
+            if (!state->free.empty())
+            {
+                buffer = state->free.back();
+                state->free.pop_back();
+                state->stats.reuses++;
+            }
+            else
+            {
+                buffer = new Buffer();
+                buffer->state = state;
+                state->stats.allocations++;
+            }
+        }
+
+        buffer->storage.clear();
+        buffer->commit();
+        buffer->time = 0;
+        buffer->duration = 0;
+        buffer->keyframe = false;
+        return EncodedPacket(buffer);
+    }
+
+    // Packet holding a copy of data
+    EncodedPacket copy(const uint8_t* data, size_t size)
+    {
+        Buffer* buffer;
+        EncodedPacket packet = acquire(buffer);
+        buffer->storage.assign(data, data + size);
+        buffer->commit();
+        return packet;
+    }
+
+    PacketPoolStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->stats;
+    }
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        std::vector<Buffer*> free;
+        PacketPoolStats stats;
+        bool open = true;
+    };
+
+    std::shared_ptr<State> state;
+};
+
+inline void PacketPool::Buffer::recycle()
+{
+    std::shared_ptr<State> owner = state;
+    std::lock_guard<std::mutex> lock(owner->mutex);
+    owner->stats.outstanding--;
+    if (owner->open)
+        owner->free.push_back(this);
+    else
+        delete this;
+}
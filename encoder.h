@@ -0,0 +1,862 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "color_convert.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder_backend.h"
+#include "frame_preprocessor.h"
+#include "frame_scaler.h"
+#include "frame_source.h"
+#include "frame_tracer.h"
+#include "lookahead.h"
+#include "upload_pipeline.h"
+#include "metrics_registry.h"
+#include "tile_scheduler.h"
+#include "worker_pool.h"
+
+// Constants
+constexpr uint32_t INPUT_POOL_SIZE = 8;
+constexpr size_t CONTROL_LOG_SIZE = 256;
+
+// ----------------------------------------------------------------------------
+// Frame scheduling
+//
+// AsFastAsPossible answers every NeedInput with a new frame right away, for
+// offline transcodes. The other two modes capture on a monotonic clock at the
+// configured frame rate, one frame slot per tick, and time every frame by its
+// slot, so sample times stay on wall-clock time:
+//
+// - RealTime hands each captured frame straight to the encoder. A tick the
+//   encoder has asked for nothing by is dropped.
+// - BoundedQueue captures into a queue of at most queueFrames that NeedInput
+//   requests take from, so an encoder stall shorter than the queue costs
+//   latency instead of frames. Neither side waits for the other: a full
+//   queue drops the new frame, an empty one leaves the request pending until
+//   the next capture.
+//
+// A tick that runs late repeats the last picture for the slots it slept
+// through, up to maxRepeatFrames of them, and skips the rest.
+//
+// With a lookahead (config.lookahead, see lookahead.h) every mode fills
+// frames ahead of the requests: a frame waits in the lookahead until the
+// frames after it are in, then in the capture queue for a request. Its
+// decision goes in with it, an IDR for a scene cut and in quality mode the
+// frame's QP.
+// ----------------------------------------------------------------------------
+
+enum class FrameSchedule { AsFastAsPossible, RealTime, BoundedQueue };
+
+inline const char* frameScheduleName(FrameSchedule schedule)
+{
+    switch (schedule)
+    {
+    case FrameSchedule::AsFastAsPossible: return "fast";
+    case FrameSchedule::RealTime: return "realtime";
+    case FrameSchedule::BoundedQueue: return "queue";
+    }
+    return "?";
+}
+
+inline bool parseFrameSchedule(const std::string& text, FrameSchedule& schedule)
+{
+    for (FrameSchedule candidate : { FrameSchedule::AsFastAsPossible, FrameSchedule::RealTime, FrameSchedule::BoundedQueue })
+    {
+        if (text == frameScheduleName(candidate))
+        {
+            schedule = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct FrameSchedulerOptions
+{
+    FrameSchedule mode = FrameSchedule::AsFastAsPossible;
+    uint64_t frames = 0;                // slots before the encoder drains by itself, 0 = until stop()
+    uint32_t queueFrames = 4;           // BoundedQueue only
+    uint32_t maxRepeatFrames = 2;       // missed slots filled with the last picture
+};
+
+// Every slot is captured, duplicated or skipped. Captured and duplicated
+// frames either reach the encoder or are dropped.
+struct FrameSchedulerStats
+{
+    uint64_t slots = 0;
+    uint64_t captured = 0;              // new pictures
+    uint64_t duplicated = 0;            // the last picture again, for a slot a late tick missed
+    uint64_t skipped = 0;               // missed slots beyond maxRepeatFrames
+    uint64_t dropped = 0;               // no request or queue room for the frame
+    uint64_t maxQueued = 0;
+    int64_t maxLateUs = 0;              // latest tick behind its slot
+};
+
+// ----------------------------------------------------------------------------
+// Encode pipeline
+//
+// Backend-agnostic half of the encoder: answers NeedInput with filled frames,
+// timestamps them, writes output and handles stream changes. Everything that
+// talks to the actual encoder lives behind IEncoderBackend.
+// ----------------------------------------------------------------------------
+
+// A runtime change and the frame it landed on
+struct AppliedControl
+{
+    uint64_t frame;                                     // first frame encoded with it
+    EncoderControl control;                             // every request since the last frame, merged
+    std::chrono::steady_clock::time_point requested;    // of the earliest of them
+    std::chrono::steady_clock::time_point applied;
+    bool accepted;                                      // false when the encoder refused part of it
+};
+
+class Encoder : public IEncoderEventSink
+{
+public:
+    // The file is written by its own thread, see bitstream_writer.h
+    Encoder(IEncoderBackend& backend, const char* path, const BitstreamWriterOptions& writerOptions = BitstreamWriterOptions())
+        : backend(backend), writer(path, writerOptions), rate(backend.config().frameRate), target(backend.config())
+    {
+        backend.setInputReleaseCallback([this]() { feedInput(); });
+        setCaptureSize(backend.config().width, backend.config().height);
+        if (backend.config().lookahead != 0)
+            setLookahead(LookaheadOptions());
+        baseQp = sentQp = backend.config().qp;
+    }
+
+    // No tick or backend event may still be running into a destroyed pipeline
+    ~Encoder()
+    {
+        if (upload)
+            upload->close();
+        if (pacer)
+            pacer->close();
+        backend.shutdown();
+    }
+
+    // How frames are captured, see above. Set before start(). The paced modes
+    // run their clock on the given workers or on a thread of their own.
+    void setSchedule(const FrameSchedulerOptions& options, WorkerPool* workers = nullptr)
+    {
+        CHECK(options.mode != FrameSchedule::BoundedQueue || options.queueFrames != 0);
+        schedule = options;
+        if (options.mode == FrameSchedule::AsFastAsPossible)
+            return;
+        if (!workers)
+        {
+            ownPacerWorkers.reset(new WorkerPool(1));
+            workers = ownPacerWorkers.get();
+        }
+        pacer.reset(new SerialQueue(*workers));
+    }
+
+    // Where pictures come from, the bar pattern at the encoder's size unless
+    // set. Pictures of another size are scaled with the filter, in slices on
+    // the workers when there are any. The source ending ends the stream. Set
+    // before start(); the source must outlive the encoder.
+    void setFrameSource(IFrameSource* frameSource, ScaleFilter filter = ScaleFilter::Bicubic, WorkerPool* workers = nullptr)
+    {
+        CHECK(frameSource != nullptr);
+        const EncoderConfig& config = backend.config();
+        uploader.reset(new PictureUploader(frameSource->info(), config.format, config.width, config.height, filter, workers));
+        source = frameSource;
+    }
+
+    // The bar pattern captured at this size and scaled to the encoder's
+    void setCaptureSize(uint32_t width, uint32_t height, ScaleFilter filter = ScaleFilter::Bicubic, WorkerPool* workers = nullptr)
+    {
+        CHECK(width != 0 && height != 0);
+        ownSource.reset(new PatternSource(TestPattern::Bar, PictureFormat::BGRA, width, height));
+        setFrameSource(ownSource.get(), filter, workers);
+    }
+
+    // BGRA and RGBA pictures are converted, scaled and, with a lookahead,
+    // analyzed in one pass over cache sized tiles on the scheduler, see
+    // frame_preprocessor.h; other formats keep their path. Set before
+    // start(); the scheduler must outlive the encoder.
+    void setPreprocessing(TileScheduler* scheduler)
+    {
+        tiles = scheduler;
+    }
+
+    void start()
+    {
+        if (tiles)
+            uploader->useTiles(*tiles, lookahead != nullptr);
+        if (upload)
+            upload->start();
+        backend.start(this);
+        if (pacer)
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            clockStart = std::chrono::steady_clock::now();
+            pacer->post([this]() { onTick(); });
+        }
+    }
+
+    // Stops capturing and returns right away. Frames still queued go into the
+    // encoder first, then it drains. Any thread, any number of times.
+    void beginStop()
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            stopCapture();
+        }
+        // Waits for a tick that is running, which then finds capture stopped
+        if (pacer)
+            pacer->close();
+    }
+
+    // Stops capturing and waits for the encoder's DrainComplete. Returns
+    // false when it did not come in time or the encoder failed, see status().
+    bool stop(std::chrono::milliseconds timeout = std::chrono::milliseconds(5000))
+    {
+        beginStop();
+        return waitForDrain(timeout);
+    }
+
+    // NeedInput runs on the backend's input side, everything else on its
+    // output side, see event_pump.h
+    void onEncoderEvent(EncoderEvent event, uint32_t count) override
+    {
+        switch (event)
+        {
+        case EncoderEvent::NeedInput:
+        {
+            {
+                std::lock_guard<std::recursive_mutex> lock(inputMutex);
+                pendingInput += count;
+            }
+            feedInput();
+            break;
+        }
+
+        case EncoderEvent::HaveOutput:
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                EncodedPacket packet;
+                OutputStatus status = backend.processOutput(packet);
+                if (status == OutputStatus::StreamChange)
+                {
+                    // Stream format change
+                    backend.renegotiateOutput();
+                    streamChanges++;
+                    if (metrics)
+                        metrics->streamChanged();
+                    continue;
+                }
+                if (status == OutputStatus::Failed)
+                    break;
+                if (status != OutputStatus::Ok)
+                    continue;
+                if (tracer)
+                    tracer->stamp(TraceStage::Output, packet.time());
+
+                // Every consumer shares the encoder's buffer, which is released
+                // when the last of them is done with it. The writer thread never
+                // blocks this one on the disk.
+                writer.write(packet);
+                for (IPacketConsumer* consumer : consumers)
+                    consumer->onPacket(packet);
+
+                framesOut++;
+                bytesOut += packet.size();
+                if (metrics)
+                    metrics->output(packet, writer.queueBytes());
+            }
+            break;
+        }
+
+        case EncoderEvent::DrainComplete:
+        {
+            {
+                std::lock_guard<std::mutex> lock(drainMutex);
+                drained = true;
+            }
+            drainDone.notify_all();
+            break;
+        }
+
+        case EncoderEvent::Error:
+        {
+            // Nothing more goes in, and there is no drain to wait for
+            {
+                std::lock_guard<std::recursive_mutex> lock(inputMutex);
+                stopping = true;
+                drainRequested = true;
+            }
+            {
+                std::lock_guard<std::mutex> lock(drainMutex);
+                failed = true;
+            }
+            drainDone.notify_all();
+            break;
+        }
+        }
+    }
+
+    // Changes the running stream from any thread. The change is checked
+    // against the settings every earlier change leads to and lands on the
+    // next frame submitted; error says why it was refused.
+    bool control(const EncoderControl& change, std::string& error)
+    {
+        std::lock_guard<std::mutex> lock(controlMutex);
+        if (!validateControl(target, change, error))
+            return false;
+        target = withControl(target, change);
+
+        if (!controlPending)
+        {
+            pendingControl = EncoderControl();
+            requestedAt = std::chrono::steady_clock::now();
+        }
+        mergeControl(pendingControl, change);
+
+        // A peak that follows the bitrate has to reach the encoder as well
+        if (change.bitrate != 0 && target.maxBitrate != 0)
+            pendingControl.maxBitrate = target.maxBitrate;
+        controlPending = true;
+        return true;
+    }
+
+    // The stream settings once every accepted change has landed
+    EncoderConfig currentConfig() const
+    {
+        std::lock_guard<std::mutex> lock(controlMutex);
+        return target;
+    }
+
+    // The last CONTROL_LOG_SIZE changes, oldest first
+    std::vector<AppliedControl> appliedControls() const
+    {
+        std::lock_guard<std::mutex> lock(controlMutex);
+        return std::vector<AppliedControl>(controlLog.begin(), controlLog.end());
+    }
+
+    FrameSchedulerStats schedulerStats() const
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        return scheduleStats;
+    }
+
+    // Stamps every frame from fill to file. Set before start().
+    void setTracer(FrameTracer* frameTracer)
+    {
+        tracer = frameTracer;
+        if (frameTracer)
+            writer.setWrittenCallback([frameTracer](int64_t time) { frameTracer->stamp(TraceStage::Written, time); });
+    }
+
+    // Durable recording: the file is synced at GOP boundaries and every
+    // complete GOP is committed to the journal. Set before start().
+    void setJournal(IWriteJournal* journal) { writer.setJournal(journal); }
+
+    // Gets every access unit after the file writer. Add before start().
+    void addConsumer(IPacketConsumer* consumer) { consumers.push_back(consumer); }
+
+    // Counts frames, bytes, drops and latencies into the session's series,
+    // see metrics_registry.h. Set before start(); outlives the encoder.
+    void setMetrics(EncoderMetrics* encoderMetrics)
+    {
+        metrics = encoderMetrics;
+        if (encoderMetrics)
+            encoderMetrics->setTargetBitrate(target.bitrate);
+    }
+
+    // Thresholds for the lookahead the config asks for; its depth is the
+    // config's. Set before start().
+    void setLookahead(const LookaheadOptions& options)
+    {
+        const EncoderConfig& config = backend.config();
+        CHECK(config.lookahead != 0);
+        LookaheadOptions withDepth = options;
+        withDepth.depth = config.lookahead;
+        lookahead.reset(new Lookahead(withDepth, config.width, config.height));
+    }
+
+    // Fills frames ahead into the backend's staging buffers, on the workers
+    // or a thread of its own, see upload_pipeline.h. Only the fast schedule
+    // captures ahead of the encoder, and the lookahead reads what the CPU
+    // wrote, so it goes with neither the paced modes nor a lookahead. false
+    // when the backend has no staging. Set before start(), after the
+    // schedule and the source.
+    bool setUploadPipeline(const UploadPipelineOptions& options, WorkerPool* workers = nullptr)
+    {
+        CHECK(schedule.mode == FrameSchedule::AsFastAsPossible && !lookahead && !upload);
+        IStagingDevice* device = backend.enableStaging(options.depth);
+        if (!device)
+            return false;
+        if (!workers)
+        {
+            ownUploadWorkers.reset(new WorkerPool(1));
+            workers = ownUploadWorkers.get();
+        }
+
+        // The source and uploader are the fill's alone from now on
+        upload.reset(new UploadPipeline(options, *device, *workers, [this](uint8_t* data, size_t pitch)
+        {
+            SourceRead read = capturePicture();
+            if (read != SourceRead::End)
+                uploader->upload(source->picture(), data, pitch);
+            return read;
+        }, [this]() { feedInput(); }));
+        return true;
+    }
+
+    UploadPipelineStats uploadStats() const { return upload ? upload->stats() : UploadPipelineStats(); }
+
+    FramePreprocessorStats preprocessStats() const { return uploader->tileStats(); }
+
+    LookaheadStats lookaheadStats() const
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        return lookahead ? lookahead->stats() : LookaheadStats();
+    }
+
+    uint64_t inputFrames() const { return framesIn; }
+    uint64_t outputFrames() const { return framesOut; }
+    uint64_t outputBytes() const { return bytesOut; }
+    uint64_t streamChangeCount() const { return streamChanges; }
+    bool drainComplete() const { return drained; }
+
+    // Ok unless the encoder failed, which also ends the stream
+    EncoderStatus status() const { return backend.status(); }
+
+    // After beginStop(), or once the scheduled frames are in, until the last
+    // output is through. false when the encoder failed instead.
+    bool waitForDrain(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(drainMutex);
+        drainDone.wait_for(lock, timeout, [this]() { return drained.load() || failed; });
+        return drained;
+    }
+
+    bool waitForDrain()
+    {
+        std::unique_lock<std::mutex> lock(drainMutex);
+        drainDone.wait(lock, [this]() { return drained.load() || failed; });
+        return drained;
+    }
+    BitstreamWriterStats writerStats() const { return writer.stats(); }
+
+    // Gets everything into the file and stops the writer thread. After the
+    // drain only; false when the file could not be written.
+    bool closeWriter() { return writer.close(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // A runtime change goes in with the frame it landed on, the lookahead's
+    // hints with the frame they are for
+    struct CapturedFrame
+    {
+        InputFrame frame;
+        int64_t time;
+        int64_t duration;
+        bool controlled = false;
+        AppliedControl control;
+        LookaheadDecision decision;
+    };
+
+    // Answers outstanding NeedInput requests. When the backend is out of input
+    // frames the requests stay pending until one is released. Paced modes
+    // only take captured frames here, their ticks do the capturing. With a
+    // lookahead, frames are captured ahead of the requests and answer them
+    // from the capture queue once decided.
+    void feedInput()
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        if (schedule.mode == FrameSchedule::BoundedQueue || lookahead)
+            feedCaptured();
+        if (schedule.mode != FrameSchedule::AsFastAsPossible)
+            return;
+
+        while (pendingInput > 0 && !stopping)
+        {
+            InputFrame frame;
+            SourceRead read;
+            if (upload)
+            {
+                // Filled ahead; the fill comes back here once there is a frame
+                if (!upload->peek(read))
+                    return;
+                if (read != SourceRead::End && !backend.acquireInput(frame))
+                    return;
+            }
+            else
+            {
+                if (!backend.acquireInput(frame))
+                    return;
+                read = capturePicture();
+            }
+
+            // The frame taken for a picture past the source's end goes back
+            if (read == SourceRead::End)
+            {
+                if (!upload)
+                    backend.releaseInput(frame);
+                stopCapture();
+                return;
+            }
+
+            // Submitting may release a frame and re-enter through the release
+            // callback, so the request is consumed before it is submitted.
+            // The lookahead consumes it when the frame leaves the queue.
+            if (!lookahead)
+                pendingInput--;
+
+            uint64_t slot = nextSlot++;
+            scheduleStats.slots++;
+            if (read == SourceRead::Fresh)
+                scheduleStats.captured++;
+            else
+                scheduleStats.duplicated++;
+            CapturedFrame filled = fillSlot(frame, slot);
+            if (lookahead)
+                queueForLookahead(filled);
+            else
+                submit(filled);
+
+            if (schedule.frames != 0 && nextSlot == schedule.frames)
+                stopCapture();
+        }
+    }
+
+    // Queued frames go in oldest first, one per request
+    void feedCaptured()
+    {
+        while (pendingInput > 0 && !captureQueue.empty())
+        {
+            CapturedFrame next = captureQueue.front();
+            captureQueue.pop_front();
+            pendingInput--;
+            submit(next);
+        }
+        if (metrics)
+            metrics->setCaptureQueue(captureQueue.size());
+        if (stopping)
+            stopCapture();
+    }
+
+    // One run of the clock: the slot that is due now, and any a late run
+    // slept through
+    void onTick()
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        if (stopping)
+            return;
+
+        Clock::time_point now = Clock::now();
+        int64_t lateUs = std::chrono::duration_cast<std::chrono::microseconds>(now - slotStart(nextSlot)).count();
+        scheduleStats.maxLateUs = std::max(scheduleStats.maxLateUs, lateUs);
+
+        uint64_t due = nextSlot;
+        while (slotStart(due + 1) <= now && (schedule.frames == 0 || due + 1 < schedule.frames))
+            due++;
+
+        for (uint64_t slot = nextSlot; slot <= due; slot++)
+        {
+            scheduleStats.slots++;
+            if (due - slot > schedule.maxRepeatFrames)
+            {
+                scheduleStats.skipped++;
+                if (metrics)
+                    metrics->skippedSlot();
+            }
+            else
+                captureSlot(slot, slot == due);
+            if (stopping)
+                return;
+        }
+        nextSlot = due + 1;
+
+        if (schedule.frames != 0 && nextSlot == schedule.frames)
+        {
+            stopCapture();
+            return;
+        }
+        pacer->postAt(slotStart(nextSlot), [this]() { onTick(); });
+    }
+
+    // A source with nothing new repeats its last picture, as a late tick does.
+    // With a lookahead both modes queue, decided frames wait for requests.
+    void captureSlot(uint64_t slot, bool fresh)
+    {
+        SourceRead read = fresh ? capturePicture() : SourceRead::Same;
+        if (read == SourceRead::End)
+        {
+            stopCapture();
+            return;
+        }
+        if (read == SourceRead::Fresh)
+            scheduleStats.captured++;
+        else
+            scheduleStats.duplicated++;
+
+        bool room = schedule.mode == FrameSchedule::RealTime && !lookahead ? pendingInput > 0 : captureQueue.size() < schedule.queueFrames;
+        InputFrame frame;
+        if (!room || !backend.acquireInput(frame))
+        {
+            scheduleStats.dropped++;
+            if (metrics)
+                metrics->droppedFrame();
+            return;
+        }
+
+        CapturedFrame filled = fillSlot(frame, slot);
+        if (lookahead)
+        {
+            queueForLookahead(filled);
+            return;
+        }
+        if (schedule.mode == FrameSchedule::RealTime)
+        {
+            pendingInput--;
+            submit(filled);
+            return;
+        }
+
+        captureQueue.push_back(filled);
+        scheduleStats.maxQueued = std::max<uint64_t>(scheduleStats.maxQueued, captureQueue.size());
+        feedCaptured();
+    }
+
+    // Changes go in right before the frame they land on, and times follow
+    // the frame rate exactly from the slot it changed on
+    CapturedFrame fillSlot(const InputFrame& frame, uint64_t slot)
+    {
+        CapturedFrame filled;
+        filled.controlled = takePendingControl(filled.control, framesFilled++, slot);
+        filled.frame = frame;
+        filled.time = frameTime(slot);
+        filled.duration = frameTime(slot + 1) - filled.time;
+
+        if (tracer)
+            tracer->stamp(TraceStage::Fill, filled.time);
+        fillFrame(frame);
+        return filled;
+    }
+
+    // Holding inputMutex. The frame is analyzed now and waits until depth
+    // frames after it have been.
+    void queueForLookahead(const CapturedFrame& filled)
+    {
+        // Tiles that filled the frame made its block means on the way
+        const uint8_t* blocks = uploader->blocks();
+        if (blocks)
+            lookahead->pushBlocks(blocks);
+        else
+            lookahead->push(filled.frame.data, filled.frame.pitch);
+        lookaheadFrames.push_back(filled);
+        takeDecided();
+        feedCaptured();
+    }
+
+    void takeDecided()
+    {
+        LookaheadDecision decision;
+        while (lookahead->pop(decision))
+        {
+            lookaheadFrames.front().decision = decision;
+            captureQueue.push_back(lookaheadFrames.front());
+            lookaheadFrames.pop_front();
+        }
+        scheduleStats.maxQueued = std::max<uint64_t>(scheduleStats.maxQueued, captureQueue.size());
+    }
+
+    // A scene cut is an IDR. In quality mode the frame's QP is the stream's
+    // plus the frame's offset, sent only when it changes; the other modes
+    // leave QP to the encoder's rate control.
+    void addLookaheadHints(const LookaheadDecision& decision, EncoderControl& change)
+    {
+        if (decision.sceneCut)
+            change.forceKeyframe = true;
+        if (backend.config().rateControl != RateControl::Quality)
+            return;
+        if (change.qp != 0)
+            baseQp = change.qp;
+        uint32_t qp = (uint32_t)std::max<int32_t>(1, std::min<int32_t>(51, (int32_t)baseQp + decision.qpOffset));
+        if (qp != sentQp || change.qp != 0)
+        {
+            change.qp = qp;
+            sentQp = qp;
+        }
+    }
+
+    void submit(const CapturedFrame& filled)
+    {
+        EncoderControl change;
+        if (filled.controlled)
+            change = filled.control.control;
+        if (lookahead)
+            addLookaheadHints(filled.decision, change);
+        if (!change.empty())
+        {
+            bool accepted = backend.applyControl(change);
+            if (filled.controlled)
+                logControl(filled.control, accepted);
+        }
+
+        if (tracer)
+            tracer->stamp(TraceStage::Submit, filled.time);
+        // Stamped first, the frame can come out before submitInput returns
+        if (metrics)
+            metrics->submitted(filled.time);
+        backend.submitInput(filled.frame, filled.time, filled.duration);
+        framesIn++;
+    }
+
+    // Holding inputMutex. The drain waits for the queue, nothing may follow
+    // it into the encoder.
+    void stopCapture()
+    {
+        stopping = true;
+        if (upload)
+            upload->stop();
+
+        // Whatever is in the lookahead is decided with the frames there are
+        if (lookahead && lookahead->pending() != 0)
+        {
+            lookahead->flush();
+            takeDecided();
+            feedCaptured();
+            return;
+        }
+        if (!drainRequested && captureQueue.empty())
+        {
+            drainRequested = true;
+            backend.drain();
+        }
+    }
+
+    Clock::time_point slotStart(uint64_t slot) const
+    {
+        return clockStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<int64_t, std::ratio<1, 10000000>>(frameTime(slot)));
+    }
+
+    int64_t frameTime(uint64_t slot) const
+    {
+        return rateTime + rationalFrameTime(rate, slot - rateSlot);
+    }
+
+    // The changes requested since the last frame, for this one. A new frame
+    // rate times this frame already.
+    bool takePendingControl(AppliedControl& applied, uint64_t frame, uint64_t slot)
+    {
+        if (!controlPending)
+            return false;
+
+        {
+            std::lock_guard<std::mutex> lock(controlMutex);
+            applied.control = pendingControl;
+            applied.requested = requestedAt;
+            controlPending = false;
+        }
+
+        applied.frame = frame;
+        if (applied.control.frameRate.num != 0)
+        {
+            rateTime = frameTime(slot);
+            rateSlot = slot;
+            rate = applied.control.frameRate;
+        }
+        return true;
+    }
+
+    // Right before the frame it landed on goes in
+    void logControl(AppliedControl applied, bool accepted)
+    {
+        applied.accepted = accepted;
+        applied.applied = std::chrono::steady_clock::now();
+        if (metrics && accepted && applied.control.bitrate != 0)
+            metrics->setTargetBitrate(applied.control.bitrate);
+
+        std::lock_guard<std::mutex> lock(controlMutex);
+        if (controlLog.size() == CONTROL_LOG_SIZE)
+            controlLog.pop_front();
+        controlLog.push_back(applied);
+    }
+
+    SourceRead capturePicture()
+    {
+        return source->next();
+    }
+
+    // A staged frame was filled ahead, the copy brings it in
+    void fillFrame(const InputFrame& frame)
+    {
+        if (upload)
+            upload->copyInto(frame);
+        else
+            uploader->upload(source->picture(), frame.data, frame.pitch);
+    }
+
+    IEncoderBackend& backend;
+    BitstreamWriter writer;
+    std::vector<IPacketConsumer*> consumers;
+
+    // The bar pattern unless another source is set
+    std::unique_ptr<IFrameSource> ownSource;
+    IFrameSource* source = nullptr;
+    std::unique_ptr<PictureUploader> uploader;
+    TileScheduler* tiles = nullptr;
+
+    FrameTracer* tracer = nullptr;
+    EncoderMetrics* metrics = nullptr;
+
+    // The pool is declared first so the queue on it goes first
+    FrameSchedulerOptions schedule;
+    std::unique_ptr<WorkerPool> ownPacerWorkers;
+    std::unique_ptr<SerialQueue> pacer;
+    std::unique_ptr<WorkerPool> ownUploadWorkers;
+    std::unique_ptr<UploadPipeline> upload;
+
+    mutable std::recursive_mutex inputMutex;
+    uint32_t pendingInput = 0;
+    std::deque<CapturedFrame> captureQueue;
+    std::unique_ptr<Lookahead> lookahead;
+    std::deque<CapturedFrame> lookaheadFrames;      // analyzed, not decided yet
+    uint32_t baseQp = 0;                            // quality mode, the stream's QP
+    uint32_t sentQp = 0;                            // and the last one the encoder got
+    Clock::time_point clockStart;
+    uint64_t nextSlot = 0;
+    uint64_t framesFilled = 0;
+    bool stopping = false;
+    bool drainRequested = false;
+    FrameSchedulerStats scheduleStats;
+
+    // Sample times restart from the slot the rate last changed on
+    Rational rate;
+    uint64_t rateSlot = 0;
+    int64_t rateTime = 0;
+
+    mutable std::mutex controlMutex;
+    EncoderConfig target;
+    EncoderControl pendingControl;
+    std::chrono::steady_clock::time_point requestedAt;
+    std::atomic<bool> controlPending{false};
+    std::deque<AppliedControl> controlLog;
+
+    std::atomic<uint64_t> framesIn{0};
+    std::atomic<uint64_t> framesOut{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::atomic<uint64_t> streamChanges{0};
+    std::atomic<bool> drained{false};
+    bool failed = false;
+    std::mutex drainMutex;
+    std::condition_variable drainDone;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+// Project
+#include "encoded_packet.h"
+#include "encoder_config.h"
+
+// ----------------------------------------------------------------------------
+// Encoder backend interface
+//
+// A backend wraps one asynchronous encoder (the Media Foundation MFT, or the
+// software stand-in) and reports the same events an async MFT does. The
+// pipeline in encoder.h drives any backend through this interface.
+// Timestamps are in 100ns units, like Media Foundation sample times.
+//
+// Failures while encoding come back as an EncoderStatus and an Error event,
+// never as an exception: they start on MF callback threads and worker tasks,
+// where nothing could catch one.
+// ----------------------------------------------------------------------------
+
+enum class EncoderEvent
+{
+    NeedInput,     // the encoder can take one more input frame per count
+    HaveOutput,    // one output per count is ready for processOutput()
+    DrainComplete, // every queued frame has been output after drain()
+    Error,         // the encoder failed, see status(); nothing follows
+};
+
+enum class OutputStatus
+{
+    Ok,
+    StreamChange, // output type changed, call renegotiateOutput() and wait for the next HaveOutput
+    NoOutput,
+    Failed,       // see status(), an Error event follows
+};
+
+// The first failure of a backend. code is an HRESULT, negative on failure,
+// and operation names the call that returned it.
+struct EncoderStatus
+{
+    int32_t code = 0;
+    const char* operation = "";
+
+    bool ok() const { return code >= 0; }
+};
+
+// Input frame mapped for CPU writes between acquireInput() and submitInput(),
+// or without data when a staging device fills it
+struct InputFrame
+{
+    uint32_t slot;
+    uint8_t* data;
+    size_t pitch;
+};
+
+class IEncoderEventSink
+{
+public:
+    virtual ~IEncoderEventSink() {}
+    // count events of the same kind at once: NeedInput and HaveOutput that
+    // piled up arrive as one call, the others always have a count of 1
+    virtual void onEncoderEvent(EncoderEvent event, uint32_t count) = 0;
+};
+
+// Staging memory for a pipelined upload, see upload_pipeline.h. The CPU
+// writes a staging buffer, the device copies it into an input frame and
+// fences the copy; the buffer is written again once the fence has passed.
+class IStagingDevice
+{
+public:
+    virtual ~IStagingDevice() {}
+
+    virtual uint32_t stagingCount() const = 0;
+
+    // For CPU writes until unmapStaging(). false when the device failed,
+    // which the backend reports like any other failure.
+    virtual bool mapStaging(uint32_t buffer, uint8_t*& data, size_t& pitch) = 0;
+    virtual void unmapStaging(uint32_t buffer) = 0;
+
+    // Queues the copy into an acquired input frame and a fence behind it.
+    // The copy is ahead of the frame on the device, submitInput() may follow
+    // right away.
+    virtual void copyToInput(uint32_t buffer, const InputFrame& input) = 0;
+
+    // Whether the fence after the buffer's last copy has passed, without waiting
+    virtual bool copyDone(uint32_t buffer) = 0;
+};
+
+class IEncoderBackend
+{
+public:
+    virtual ~IEncoderBackend() {}
+
+    // Events may arrive on any thread. NeedInput comes from the input side,
+    // the other events from the output side; each side is serial, but the
+    // two run concurrently. See event_pump.h.
+    virtual void start(IEncoderEventSink* sink) = 0;
+
+    // Fails without blocking when every input frame is still with the encoder
+    virtual bool acquireInput(InputFrame& frame) = 0;
+    // A frame the encoder did not take comes back to the pool, and the
+    // failure is reported through status() and an Error event
+    virtual void submitInput(const InputFrame& frame, int64_t time, int64_t duration) = 0;
+    // Gives back a frame from acquireInput() that is not going to be submitted
+    virtual void releaseInput(const InputFrame& frame) = 0;
+
+    // Called on the input side after an input frame came back, so pending
+    // NeedInput requests can be answered
+    virtual void setInputReleaseCallback(std::function<void()> callback) = 0;
+
+    // One access unit, valid for as long as any copy of the handle is held
+    virtual OutputStatus processOutput(EncodedPacket& packet) = 0;
+    virtual void renegotiateOutput() = 0;
+
+    // End of stream, DrainComplete follows the last output
+    virtual void drain() = 0;
+
+    // Stops events and releases the encoder; no event is running or follows
+    // once this returns, unless called from an event. Safe to call twice.
+    virtual void shutdown() = 0;
+
+    // Changes the running encoder, from the thread submitting input and right
+    // before the frame it applies to. The frame rate only changes the sample
+    // times the caller passes. false when the encoder refused part of it.
+    virtual bool applyControl(const EncoderControl& control) = 0;
+
+    // What the encoder was opened with, runtime changes are not reflected
+    virtual const EncoderConfig& config() const = 0;
+
+    // Ok until the first failure while encoding, which it then keeps
+    virtual EncoderStatus status() const = 0;
+
+    // Staging buffers for a pipelined upload. From then on the device's
+    // copies fill the input frames, and acquireInput() hands them out
+    // without CPU memory. Before start(); nullptr when the backend has none.
+    virtual IStagingDevice* enableStaging(uint32_t /*buffers*/) { return nullptr; }
+};
+
+// ----------------------------------------------------------------------------
+// Backend factory
+//
+// Creates backends on a given adapter, sharing that adapter's device between
+// all of them. Events of every backend run on the worker pool passed in.
+// ----------------------------------------------------------------------------
+
+class WorkerPool;
+
+class IEncoderBackendFactory
+{
+public:
+    virtual ~IEncoderBackendFactory() {}
+
+    virtual uint32_t adapterCount() const = 0;
+
+    // Concurrent encode sessions the adapter's hardware allows, 0 for no limit
+    virtual uint32_t sessionLimit(uint32_t adapter) const = 0;
+
+    // Whether one of the adapter's encoders can take the configuration
+    virtual bool supports(uint32_t adapter, const EncoderConfig& config) const = 0;
+
+    virtual std::unique_ptr<IEncoderBackend> createBackend(uint32_t adapter, const EncoderConfig& config, WorkerPool& workers) = 0;
+};
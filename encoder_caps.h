@@ -0,0 +1,397 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Project
+#include "common.h"
+#include "encoder_backend.h"
+
+// ----------------------------------------------------------------------------
+// Encoder capabilities
+//
+// What every adapter's H.264 encoders can do. Probing means activating each
+// MFT and trying configurations, which takes long enough to matter at startup,
+// so results are cached on disk and only probed again when an adapter's
+// driver version changes.
+// ----------------------------------------------------------------------------
+
+enum H264ProfileFlags : uint32_t
+{
+    PROFILE_BASELINE = 1,
+    PROFILE_MAIN = 2,
+    PROFILE_HIGH = 4,
+};
+
+// From profile_idc (66, 77, 100), which is also what eAVEncH264VProfile uses
+inline uint32_t profileFlag(uint32_t profileIdc)
+{
+    switch (profileIdc)
+    {
+    case 66: return PROFILE_BASELINE;
+    case 77: return PROFILE_MAIN;
+    case 100: return PROFILE_HIGH;
+    default: return 0;
+    }
+}
+
+inline uint32_t formatFlag(FrameFormat format)
+{
+    return format == FrameFormat::NV12 ? 1 : 2;
+}
+
+struct EncoderCaps
+{
+    std::string name;
+    std::string clsid;          // to activate the same MFT again, empty for fakes
+    bool hardware = true;
+    uint32_t maxWidth = 0;
+    uint32_t maxHeight = 0;
+    uint32_t profiles = 0;      // H264ProfileFlags
+    uint32_t maxSessions = 0;   // concurrent sessions, 0 = no limit found
+    uint32_t inputFormats = 0;  // formatFlag() bits
+};
+
+// The part of an adapter that is cheap to enumerate. Everything but the
+// index and LUID, which change between boots, identifies the cache entry.
+struct AdapterIdentity
+{
+    uint32_t index = 0;
+    uint64_t luid = 0;
+    uint32_t vendorId = 0;
+    uint32_t deviceId = 0;
+    uint32_t subSysId = 0;
+    uint32_t revision = 0;
+    uint64_t driverVersion = 0;
+    std::string description;
+
+    bool sameHardware(const AdapterIdentity& other) const
+    {
+        return vendorId == other.vendorId && deviceId == other.deviceId && subSysId == other.subSysId &&
+            revision == other.revision && driverVersion == other.driverVersion;
+    }
+};
+
+struct AdapterCaps
+{
+    AdapterIdentity identity;
+    std::vector<EncoderCaps> encoders;
+};
+
+inline bool encoderMatches(const EncoderCaps& caps, const EncoderConfig& config)
+{
+    if (config.width > caps.maxWidth || config.height > caps.maxHeight)
+        return false;
+    if (!(caps.inputFormats & formatFlag(config.format)))
+        return false;
+    return (caps.profiles & profileFlag((uint32_t)config.profile)) != 0;
+}
+
+// Best matching encoder on one adapter, hardware first and then the one with
+// most sessions, or -1 when none matches
+inline int bestEncoder(const AdapterCaps& adapter, const EncoderConfig& config)
+{
+    int best = -1;
+    for (size_t i = 0; i < adapter.encoders.size(); i++)
+    {
+        const EncoderCaps& caps = adapter.encoders[i];
+        if (!encoderMatches(caps, config))
+            continue;
+        if (best < 0)
+        {
+            best = (int)i;
+            continue;
+        }
+
+        const EncoderCaps& current = adapter.encoders[best];
+        uint64_t sessions = caps.maxSessions == 0 ? UINT32_MAX + 1ull : caps.maxSessions;
+        uint64_t currentSessions = current.maxSessions == 0 ? UINT32_MAX + 1ull : current.maxSessions;
+        if (caps.hardware != current.hardware ? caps.hardware : sessions > currentSessions)
+            best = (int)i;
+    }
+    return best;
+}
+
+inline bool hasHardwareEncoder(const AdapterCaps& adapter)
+{
+    for (const EncoderCaps& encoder : adapter.encoders)
+    {
+        if (encoder.hardware)
+            return true;
+    }
+    return false;
+}
+
+// The adapter's encoders share its hardware, so the most any of them allows
+inline uint32_t adapterSessionLimit(const AdapterCaps& adapter)
+{
+    uint32_t limit = 1;
+    for (const EncoderCaps& encoder : adapter.encoders)
+    {
+        if (encoder.hardware)
+            limit = limit == 0 || encoder.maxSessions == 0 ? 0 : std::max(limit, encoder.maxSessions);
+    }
+    return limit;
+}
+
+// ----------------------------------------------------------------------------
+// Probes
+// ----------------------------------------------------------------------------
+
+class ICapabilityProbe
+{
+public:
+    virtual ~ICapabilityProbe() {}
+
+    // Fast, runs at every startup
+    virtual std::vector<AdapterIdentity> adapters() = 0;
+
+    // Slow, only runs for adapters the cache does not know
+    virtual std::vector<EncoderCaps> probe(const AdapterIdentity& adapter) = 0;
+};
+
+// Stands in for the Media Foundation probe on machines without one. The
+// delay imitates what activating and configuring each MFT costs.
+class FakeCapabilityProbe : public ICapabilityProbe
+{
+public:
+    explicit FakeCapabilityProbe(std::vector<AdapterCaps> machine, std::chrono::milliseconds probeDelay = std::chrono::milliseconds(0))
+        : machine(std::move(machine)), probeDelay(probeDelay)
+    {
+    }
+
+    // A workstation with a discrete GPU, an iGPU and the Basic Render Driver
+    static std::vector<AdapterCaps> workstation()
+    {
+        std::vector<AdapterCaps> machine(3);
+
+        machine[0].identity = AdapterIdentity{ 0, 0x1234, 0x10DE, 0x2684, 0x16F310DE, 0xA1, 0x001F000E0C0B3C8Aull, "NVIDIA GeForce RTX 4090" };
+        machine[0].encoders.push_back(EncoderCaps{ "NVIDIA H.264 Encoder MFT", "{60F44560-5A20-4857-BFEF-D29773CB8040}",
+            true, 4096, 4096, PROFILE_BASELINE | PROFILE_MAIN | PROFILE_HIGH, 8, 3 });
+
+        machine[1].identity = AdapterIdentity{ 1, 0x5678, 0x8086, 0xA780, 0x88821043, 0x04, 0x001F00000B0F1B1Cull, "Intel(R) UHD Graphics 770" };
+        machine[1].encoders.push_back(EncoderCaps{ "Intel Quick Sync Video H.264 Encoder MFT", "{4BE8D3C0-0515-4A37-AD55-E4BAE19AF471}",
+            true, 4096, 2304, PROFILE_BASELINE | PROFILE_MAIN | PROFILE_HIGH, 0, 1 });
+
+        machine[2].identity = AdapterIdentity{ 2, 0x9ABC, 0x1414, 0x008C, 0, 0, 0x000A000047BA0000ull, "Microsoft Basic Render Driver" };
+        return machine;
+    }
+
+    std::vector<AdapterIdentity> adapters() override
+    {
+        std::vector<AdapterIdentity> identities;
+        for (const AdapterCaps& adapter : machine)
+            identities.push_back(adapter.identity);
+        return identities;
+    }
+
+    std::vector<EncoderCaps> probe(const AdapterIdentity& adapter) override
+    {
+        probes++;
+        std::this_thread::sleep_for(probeDelay);
+        for (const AdapterCaps& known : machine)
+        {
+            if (known.identity.luid == adapter.luid)
+                return known.encoders;
+        }
+        return std::vector<EncoderCaps>();
+    }
+
+    // For driver update tests
+    std::vector<AdapterCaps>& hardware() { return machine; }
+    uint32_t probeCount() const { return probes; }
+
+private:
+    std::vector<AdapterCaps> machine;
+    std::chrono::milliseconds probeDelay;
+    uint32_t probes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Capability cache
+//
+// A text file with one adapter line followed by its encoder lines:
+//
+//     adapter <vendor> <device> <subsys> <revision> <driver version>
+//     encoder <hw> <max width> <max height> <profiles> <sessions> <formats> <clsid|-> <name>
+//
+// Numbers are hex, the name runs to the end of the line. Anything that does
+// not parse makes the whole file count as missing.
+// ----------------------------------------------------------------------------
+
+constexpr const char* CAPABILITY_CACHE_HEADER = "# encoder capability cache v2";
+
+class CapabilityCache
+{
+public:
+    bool load(const char* path)
+    {
+        entries.clear();
+
+        std::ifstream fin(path);
+        std::string line;
+        if (!std::getline(fin, line) || line != CAPABILITY_CACHE_HEADER)
+            return false;
+
+        while (std::getline(fin, line))
+        {
+            std::istringstream in(line);
+            in >> std::hex;
+            std::string kind;
+            in >> kind;
+
+            if (kind == "adapter")
+            {
+                AdapterCaps entry;
+                in >> entry.identity.vendorId >> entry.identity.deviceId >> entry.identity.subSysId >>
+                    entry.identity.revision >> entry.identity.driverVersion;
+                if (!in)
+                    return fail();
+                entries.push_back(entry);
+            }
+            else if (kind == "encoder" && !entries.empty())
+            {
+                EncoderCaps caps;
+                uint32_t hardware;
+                in >> hardware >> caps.maxWidth >> caps.maxHeight >> caps.profiles >> caps.maxSessions >>
+                    caps.inputFormats >> caps.clsid;
+                if (!in)
+                    return fail();
+                caps.hardware = hardware != 0;
+                if (caps.clsid == "-")
+                    caps.clsid.clear();
+                in >> std::ws;
+                std::getline(in, caps.name);
+                entries.back().encoders.push_back(caps);
+            }
+            else if (!kind.empty())
+            {
+                return fail();
+            }
+        }
+        return true;
+    }
+
+    bool save(const char* path) const
+    {
+        std::ofstream fout(path, std::ios::trunc);
+        fout << CAPABILITY_CACHE_HEADER << "\n" << std::hex;
+        for (const AdapterCaps& entry : entries)
+        {
+            const AdapterIdentity& id = entry.identity;
+            fout << "adapter " << id.vendorId << " " << id.deviceId << " " << id.subSysId << " " << id.revision << " " << id.driverVersion << "\n";
+            for (const EncoderCaps& caps : entry.encoders)
+            {
+                fout << "encoder " << (caps.hardware ? 1 : 0) << " " << caps.maxWidth << " " << caps.maxHeight << " " << caps.profiles << " " <<
+                    caps.maxSessions << " " << caps.inputFormats << " " <<
+                    (caps.clsid.empty() ? "-" : caps.clsid) << " " << caps.name << "\n";
+            }
+        }
+        return (bool)fout;
+    }
+
+    const std::vector<EncoderCaps>* find(const AdapterIdentity& adapter) const
+    {
+        for (const AdapterCaps& entry : entries)
+        {
+            if (entry.identity.sameHardware(adapter))
+                return &entry.encoders;
+        }
+        return nullptr;
+    }
+
+    // Replaces the entries of adapters with the same hardware but an older driver
+    void store(const AdapterIdentity& adapter, const std::vector<EncoderCaps>& encoders)
+    {
+        for (size_t i = 0; i < entries.size();)
+        {
+            const AdapterIdentity& id = entries[i].identity;
+            if (id.vendorId == adapter.vendorId && id.deviceId == adapter.deviceId && id.subSysId == adapter.subSysId && id.revision == adapter.revision)
+                entries.erase(entries.begin() + i);
+            else
+                i++;
+        }
+        entries.push_back(AdapterCaps{ adapter, encoders });
+    }
+
+    size_t size() const { return entries.size(); }
+
+private:
+    bool fail()
+    {
+        entries.clear();
+        return false;
+    }
+
+    std::vector<AdapterCaps> entries;
+};
+
+// ----------------------------------------------------------------------------
+// Capability registry
+//
+// The capabilities of the adapters present right now: enumerated every time,
+// probed only on a cache miss.
+// ----------------------------------------------------------------------------
+
+struct CapabilityRegistryStats
+{
+    uint32_t adapters = 0;
+    uint32_t cacheHits = 0;
+    uint32_t probes = 0;
+    bool cacheWritten = false;
+};
+
+class CapabilityRegistry
+{
+public:
+    // An empty path probes every adapter and writes nothing
+    void refresh(ICapabilityProbe& probe, const std::string& cachePath)
+    {
+        stats = CapabilityRegistryStats();
+        adapterCaps.clear();
+
+        CapabilityCache cache;
+        if (!cachePath.empty())
+            cache.load(cachePath.c_str());
+
+        bool changed = false;
+        for (const AdapterIdentity& identity : probe.adapters())
+        {
+            AdapterCaps adapter;
+            adapter.identity = identity;
+
+            const std::vector<EncoderCaps>* cached = cache.find(identity);
+            if (cached)
+            {
+                adapter.encoders = *cached;
+                stats.cacheHits++;
+            }
+            else
+            {
+                adapter.encoders = probe.probe(identity);
+                cache.store(identity, adapter.encoders);
+                stats.probes++;
+                changed = true;
+            }
+            adapterCaps.push_back(adapter);
+            stats.adapters++;
+        }
+
+        if (changed && !cachePath.empty())
+            stats.cacheWritten = cache.save(cachePath.c_str());
+    }
+
+    const std::vector<AdapterCaps>& adapters() const { return adapterCaps; }
+    CapabilityRegistryStats refreshStats() const { return stats; }
+
+private:
+    std::vector<AdapterCaps> adapterCaps;
+    CapabilityRegistryStats stats;
+};
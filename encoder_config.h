@@ -0,0 +1,709 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Encoder configuration
+//
+// Everything about a stream that used to be a compile-time constant. The same
+// keys work on the command line (--bitrate 6M), in INI files (bitrate = 6M)
+// and in flat JSON objects ("bitrate": "6M" or 6000000). Validation happens
+// once, up front, so a bad ladder rung fails before any device is touched.
+// ----------------------------------------------------------------------------
+
+enum class FrameFormat { NV12, BGRA };
+
+enum class RateControl
+{
+    Cbr,      // bitrate is the target and the ceiling
+    Vbr,      // bitrate on average, peaks up to maxBitrate
+    Quality,  // constant QP, no bitrate target
+};
+
+// Values are profile_idc, which is also what eAVEncH264VProfile uses
+enum class H264Profile : uint32_t
+{
+    Baseline = 66,
+    Main = 77,
+    High = 100,
+};
+
+struct Rational
+{
+    uint32_t num;
+    uint32_t den;
+};
+
+// Sample time of frame n in 100ns units at a constant rate. Computed from the
+// exact rate rather than summed, so 30000/1001 does not drift.
+inline int64_t rationalFrameTime(const Rational& rate, uint64_t frame)
+{
+    uint64_t whole = frame / rate.num;
+    uint64_t part = frame % rate.num;
+    return (int64_t)(whole * 10000000ull * rate.den + part * 10000000ull * rate.den / rate.num);
+}
+
+struct EncoderConfig
+{
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    Rational frameRate = { 30, 1 };
+    RateControl rateControl = RateControl::Cbr;
+    uint32_t bitrate = 4000000;     // bits per second
+    uint32_t maxBitrate = 0;        // VBR peak, 0 = encoder default
+    uint32_t qp = 26;               // Quality mode only
+    uint32_t gopLength = 60;        // frames from IDR to IDR, 0 = encoder default
+    H264Profile profile = H264Profile::High;
+    uint32_t level = 0;             // level_idc, 41 for 4.1, 0 = encoder picks
+    bool lowLatency = false;
+    FrameFormat format = FrameFormat::NV12;
+    uint32_t lookahead = 0;         // frames analyzed before one goes in, 0 = none, see lookahead.h
+
+    int64_t frameTime(uint64_t frame) const
+    {
+        return rationalFrameTime(frameRate, frame);
+    }
+
+    int64_t frameDuration(uint64_t frame) const
+    {
+        return frameTime(frame + 1) - frameTime(frame);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Names
+// ----------------------------------------------------------------------------
+
+inline const char* rateControlName(RateControl mode)
+{
+    switch (mode)
+    {
+    case RateControl::Cbr: return "cbr";
+    case RateControl::Vbr: return "vbr";
+    case RateControl::Quality: return "quality";
+    }
+    return "?";
+}
+
+inline const char* profileName(H264Profile profile)
+{
+    switch (profile)
+    {
+    case H264Profile::Baseline: return "baseline";
+    case H264Profile::Main: return "main";
+    case H264Profile::High: return "high";
+    }
+    return "?";
+}
+
+inline const char* frameFormatName(FrameFormat format)
+{
+    return format == FrameFormat::NV12 ? "nv12" : "bgra";
+}
+
+// One line for logs, e.g. "1920x1080 30000/1001 fps cbr 6000 kbps gop 60 high nv12"
+inline std::string describeConfig(const EncoderConfig& config)
+{
+    std::ostringstream out;
+    out << config.width << "x" << config.height << " " << config.frameRate.num;
+    if (config.frameRate.den != 1)
+        out << "/" << config.frameRate.den;
+    out << " fps " << rateControlName(config.rateControl);
+    if (config.rateControl == RateControl::Quality)
+        out << " qp " << config.qp;
+    else
+        out << " " << config.bitrate / 1000 << " kbps";
+    if (config.rateControl == RateControl::Vbr && config.maxBitrate != 0)
+        out << " max " << config.maxBitrate / 1000 << " kbps";
+    out << " gop " << config.gopLength;
+    out << " " << profileName(config.profile);
+    if (config.level != 0)
+        out << " level " << config.level / 10 << "." << config.level % 10;
+    if (config.lowLatency)
+        out << " low-latency";
+    if (config.lookahead != 0)
+        out << " lookahead " << config.lookahead;
+    out << " " << frameFormatName(config.format);
+    return out.str();
+}
+
+// ----------------------------------------------------------------------------
+// Validation
+// ----------------------------------------------------------------------------
+
+constexpr uint32_t MAX_ENCODE_DIMENSION = 8192;
+
+inline bool validLevel(uint32_t level)
+{
+    static const uint32_t levels[] = { 10, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42, 50, 51, 52 };
+    for (uint32_t known : levels)
+    {
+        if (level == known)
+            return true;
+    }
+    return false;
+}
+
+// Checks the combination, not just single values. error says what is wrong.
+inline bool validateConfig(const EncoderConfig& config, std::string& error)
+{
+    if (config.width == 0 || config.height == 0 || config.width > MAX_ENCODE_DIMENSION || config.height > MAX_ENCODE_DIMENSION)
+        error = "width and height must be between 2 and " + std::to_string(MAX_ENCODE_DIMENSION);
+    else if (config.width % 2 != 0 || config.height % 2 != 0)
+        error = "width and height must be even for 4:2:0";
+    else if (config.frameRate.num == 0 || config.frameRate.den == 0)
+        error = "frame rate must be positive";
+    else if (config.frameRate.num > 1000000 || config.frameRate.den > 1000000)
+        error = "frame rate terms above 1000000";
+    else if (config.frameRate.num > 1000ull * config.frameRate.den)
+        error = "frame rate above 1000 fps";
+    else if (config.rateControl != RateControl::Quality && (config.bitrate < 16000 || config.bitrate > 1000000000))
+        error = "bitrate must be between 16 kbps and 1 Gbps";
+    else if (config.rateControl == RateControl::Vbr && config.maxBitrate != 0 && config.maxBitrate < config.bitrate)
+        error = "max bitrate is below the bitrate";
+    else if (config.rateControl != RateControl::Vbr && config.maxBitrate != 0)
+        error = "max bitrate only applies to vbr";
+    else if (config.rateControl == RateControl::Quality && config.qp > 51)
+        error = "qp must be between 0 and 51";
+    else if (config.level != 0 && !validLevel(config.level))
+        error = "unknown level " + std::to_string(config.level);
+    else if (config.lookahead != 0 && (config.lookahead < 5 || config.lookahead > 30))
+        error = "lookahead must be 0 or between 5 and 30 frames";
+    else if (config.lookahead != 0 && config.lowLatency)
+        error = "a lookahead delays every frame, which low-latency mode rules out";
+    else if (config.lookahead != 0 && config.format != FrameFormat::NV12)
+        error = "the lookahead analyzes NV12 luma";
+    else
+        return true;
+    return false;
+}
+
+// Interactive streaming: the encoder's low-latency mode, CBR so frames stay
+// small and even, and a long GOP since a lost
+// frame is repaired with a keyframe on request (EncoderControl) rather than
+// by waiting for the next one. Settings given later still override it.
+inline void applyLowLatencyProfile(EncoderConfig& config)
+{
+    config.lowLatency = true;
+    config.rateControl = RateControl::Cbr;
+    config.maxBitrate = 0;
+    config.gopLength = (uint32_t)std::max<uint64_t>(1, 10ull * config.frameRate.num / config.frameRate.den);
+    config.lookahead = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Runtime changes
+//
+// What can change on a running encoder without tearing it down. A change
+// takes effect on the first frame submitted after it was requested.
+// ----------------------------------------------------------------------------
+
+struct EncoderControl
+{
+    uint32_t bitrate = 0;               // 0 = unchanged
+    uint32_t maxBitrate = 0;            // VBR peak, 0 = unchanged
+    bool qpBounds = false;              // minQp and maxQp apply
+    uint32_t minQp = 0;
+    uint32_t maxQp = 51;
+    Rational frameRate = { 0, 0 };      // num 0 = unchanged
+    bool forceKeyframe = false;
+    uint32_t qp = 0;                    // quality mode QP, 0 = unchanged
+
+    bool empty() const
+    {
+        return bitrate == 0 && maxBitrate == 0 && !qpBounds && frameRate.num == 0 && !forceKeyframe && qp == 0;
+    }
+};
+
+// Later settings win, a keyframe request stays
+inline void mergeControl(EncoderControl& into, const EncoderControl& change)
+{
+    if (change.bitrate != 0)
+        into.bitrate = change.bitrate;
+    if (change.maxBitrate != 0)
+        into.maxBitrate = change.maxBitrate;
+    if (change.qpBounds)
+    {
+        into.qpBounds = true;
+        into.minQp = change.minQp;
+        into.maxQp = change.maxQp;
+    }
+    if (change.frameRate.num != 0)
+        into.frameRate = change.frameRate;
+    into.forceKeyframe = into.forceKeyframe || change.forceKeyframe;
+    if (change.qp != 0)
+        into.qp = change.qp;
+}
+
+// The stream settings after a change. A VBR peak that is not given keeps its
+// ratio to the mean bitrate.
+inline EncoderConfig withControl(const EncoderConfig& config, const EncoderControl& change)
+{
+    EncoderConfig next = config;
+    if (change.bitrate != 0)
+    {
+        next.bitrate = change.bitrate;
+        if (change.maxBitrate == 0 && config.maxBitrate != 0)
+            next.maxBitrate = (uint32_t)((uint64_t)config.maxBitrate * change.bitrate / config.bitrate);
+    }
+    if (change.maxBitrate != 0)
+        next.maxBitrate = change.maxBitrate;
+    if (change.frameRate.num != 0)
+        next.frameRate = change.frameRate;
+    if (change.qp != 0)
+        next.qp = change.qp;
+    return next;
+}
+
+inline bool validateControl(const EncoderConfig& config, const EncoderControl& change, std::string& error)
+{
+    if (config.rateControl == RateControl::Quality && (change.bitrate != 0 || change.maxBitrate != 0 || change.qpBounds))
+    {
+        error = "quality mode has no bitrate to change";
+        return false;
+    }
+    if (config.rateControl != RateControl::Quality && change.qp != 0)
+    {
+        error = "only quality mode has a QP to change";
+        return false;
+    }
+    if (change.qp > 51)
+    {
+        error = "qp must be between 0 and 51";
+        return false;
+    }
+    if (change.qpBounds && (change.minQp > change.maxQp || change.maxQp > 51))
+    {
+        error = "qp bounds must satisfy min <= max <= 51";
+        return false;
+    }
+    if (change.frameRate.num != 0 && change.frameRate.den == 0)
+    {
+        error = "frame rate must be positive";
+        return false;
+    }
+    return validateConfig(withControl(config, change), error);
+}
+
+// ----------------------------------------------------------------------------
+// Parsing
+// ----------------------------------------------------------------------------
+
+// Lower case with '_' as '-', so lowLatency, low_latency and low-latency match
+inline std::string configKey(const std::string& key)
+{
+    std::string normal;
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        char c = key[i];
+        if (c == '_')
+            c = '-';
+        if (isupper((unsigned char)c) && i > 0 && islower((unsigned char)key[i - 1]))
+            normal += '-';
+        normal += (char)tolower((unsigned char)c);
+    }
+    return normal;
+}
+
+inline bool isConfigKey(const std::string& key)
+{
+    static const char* keys[] = { "width", "height", "size", "fps", "frame-rate", "rate-control", "bitrate", "max-bitrate", "qp",
+        "gop", "gop-length", "profile", "level", "low-latency", "preset", "format", "lookahead" };
+    std::string normal = configKey(key);
+    for (const char* known : keys)
+    {
+        if (normal == known)
+            return true;
+    }
+    return false;
+}
+
+inline bool isBoolKey(const std::string& key)
+{
+    return configKey(key) == "low-latency";
+}
+
+inline bool parseUnsigned(const std::string& text, uint64_t& value)
+{
+    if (text.empty() || !isdigit((unsigned char)text[0]))
+        return false;
+    char* end;
+    value = strtoull(text.c_str(), &end, 10);
+    return *end == 0;
+}
+
+// 1920x1080
+inline bool parseSize(const std::string& text, uint32_t& width, uint32_t& height)
+{
+    size_t x = text.find('x');
+    uint64_t w, h;
+    if (x == std::string::npos || !parseUnsigned(text.substr(0, x), w) || !parseUnsigned(text.substr(x + 1), h) || w > UINT32_MAX || h > UINT32_MAX)
+        return false;
+    width = (uint32_t)w;
+    height = (uint32_t)h;
+    return true;
+}
+
+// 6000000, 6000k or 6M
+inline bool parseBitrate(const std::string& text, uint32_t& bitrate)
+{
+    if (text.empty())
+        return false;
+    uint64_t scale = 1;
+    std::string digits = text;
+    char suffix = (char)tolower((unsigned char)text.back());
+    if (suffix == 'k' || suffix == 'm')
+    {
+        scale = suffix == 'k' ? 1000 : 1000000;
+        digits.pop_back();
+    }
+
+    // Fractions only with a suffix, 2.5M
+    char* end;
+    double value = strtod(digits.c_str(), &end);
+    if (digits.empty() || *end != 0 || value < 0 || (scale == 1 && digits.find('.') != std::string::npos))
+        return false;
+    double bits = value * scale;
+    if (bits > UINT32_MAX)
+        return false;
+    bitrate = (uint32_t)(bits + 0.5);
+    return true;
+}
+
+// 30, 30/1, 30000/1001, or the usual decimal shorthands 23.976, 29.97 and 59.94
+inline bool parseFrameRate(const std::string& text, Rational& rate)
+{
+    size_t slash = text.find('/');
+    uint64_t num, den = 1;
+    if (slash != std::string::npos)
+    {
+        if (!parseUnsigned(text.substr(0, slash), num) || !parseUnsigned(text.substr(slash + 1), den))
+            return false;
+    }
+    else if (text == "23.976" || text == "29.97" || text == "59.94" || text == "119.88")
+    {
+        num = text == "23.976" ? 24000 : text == "29.97" ? 30000 : text == "59.94" ? 60000 : 120000;
+        den = 1001;
+    }
+    else if (!parseUnsigned(text, num))
+    {
+        return false;
+    }
+
+    if (num == 0 || den == 0 || num > UINT32_MAX || den > UINT32_MAX)
+        return false;
+    rate = { (uint32_t)num, (uint32_t)den };
+    return true;
+}
+
+inline bool parseBool(const std::string& text, bool& value)
+{
+    if (text == "1" || text == "true" || text == "yes" || text == "on")
+        value = true;
+    else if (text == "0" || text == "false" || text == "no" || text == "off")
+        value = false;
+    else
+        return false;
+    return true;
+}
+
+// One key/value pair from any source
+inline bool setConfigValue(EncoderConfig& config, const std::string& rawKey, const std::string& value, std::string& error)
+{
+    std::string key = configKey(rawKey);
+    uint64_t number = 0;
+    bool ok = true;
+
+    if (key == "width" || key == "height" || key == "qp" || key == "gop" || key == "gop-length" || key == "lookahead")
+    {
+        ok = parseUnsigned(value, number) && number <= UINT32_MAX;
+        uint32_t& field = key == "width" ? config.width : key == "height" ? config.height : key == "qp" ? config.qp :
+            key == "lookahead" ? config.lookahead : config.gopLength;
+        field = (uint32_t)number;
+    }
+    else if (key == "size")
+        ok = parseSize(value, config.width, config.height);
+    else if (key == "fps" || key == "frame-rate")
+        ok = parseFrameRate(value, config.frameRate);
+    else if (key == "bitrate")
+        ok = parseBitrate(value, config.bitrate);
+    else if (key == "max-bitrate")
+        ok = parseBitrate(value, config.maxBitrate);
+    else if (key == "rate-control")
+    {
+        if (value == "cbr")
+            config.rateControl = RateControl::Cbr;
+        else if (value == "vbr")
+            config.rateControl = RateControl::Vbr;
+        else if (value == "quality" || value == "cqp")
+            config.rateControl = RateControl::Quality;
+        else
+            ok = false;
+    }
+    else if (key == "profile")
+    {
+        if (value == "baseline")
+            config.profile = H264Profile::Baseline;
+        else if (value == "main")
+            config.profile = H264Profile::Main;
+        else if (value == "high")
+            config.profile = H264Profile::High;
+        else
+            ok = false;
+    }
+    else if (key == "level")
+    {
+        // 4.1 or 41, auto for the encoder's choice
+        size_t dot = value.find('.');
+        uint64_t major, minor = 0;
+        if (value == "auto")
+            config.level = 0;
+        else if (dot != std::string::npos)
+        {
+            ok = parseUnsigned(value.substr(0, dot), major) && parseUnsigned(value.substr(dot + 1), minor) && minor < 10;
+            config.level = (uint32_t)(major * 10 + minor);
+        }
+        else
+        {
+            ok = parseUnsigned(value, major) && major < 100;
+            config.level = major < 10 ? (uint32_t)major * 10 : (uint32_t)major;
+        }
+    }
+    else if (key == "low-latency")
+        ok = parseBool(value, config.lowLatency);
+    else if (key == "preset")
+    {
+        ok = value == "low-latency";
+        if (ok)
+            applyLowLatencyProfile(config);
+    }
+    else if (key == "format")
+    {
+        if (value == "nv12")
+            config.format = FrameFormat::NV12;
+        else if (value == "bgra")
+            config.format = FrameFormat::BGRA;
+        else
+            ok = false;
+    }
+    else
+    {
+        error = "unknown setting " + rawKey;
+        return false;
+    }
+
+    if (!ok)
+        error = "bad value '" + value + "' for " + rawKey;
+    return ok;
+}
+
+inline std::string trimmed(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return std::string();
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+// key = value lines. Sections, ; and # comments are allowed and ignored.
+inline bool parseConfigIni(const std::string& text, EncoderConfig& config, std::string& error)
+{
+    std::istringstream in(text);
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++)
+    {
+        line = trimmed(line);
+        if (line.empty() || line[0] == ';' || line[0] == '#' || line[0] == '[')
+            continue;
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos)
+        {
+            error = "line " + std::to_string(number) + ": expected key = value";
+            return false;
+        }
+        if (!setConfigValue(config, trimmed(line.substr(0, equals)), trimmed(line.substr(equals + 1)), error))
+        {
+            error = "line " + std::to_string(number) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+// A flat object of strings, numbers and booleans. Nothing nests in a config.
+inline bool parseConfigJson(const std::string& text, EncoderConfig& config, std::string& error)
+{
+    size_t i = 0;
+    auto skipSpace = [&]() { while (i < text.size() && isspace((unsigned char)text[i])) i++; };
+    auto fail = [&](const std::string& what) { error = "json offset " + std::to_string(i) + ": " + what; return false; };
+    auto readString = [&](std::string& out) -> bool
+    {
+        if (i >= text.size() || text[i] != '"')
+            return false;
+        out.clear();
+        for (i++; i < text.size() && text[i] != '"'; i++)
+        {
+            if (text[i] == '\\')
+            {
+                if (++i >= text.size())
+                    return false;
+                char c = text[i];
+                out += c == 'n' ? '\n' : c == 't' ? '\t' : c;
+                continue;
+            }
+            out += text[i];
+        }
+        if (i >= text.size())
+            return false;
+        i++;
+        return true;
+    };
+
+    skipSpace();
+    if (i >= text.size() || text[i++] != '{')
+        return fail("expected {");
+    skipSpace();
+    if (i < text.size() && text[i] == '}')
+    {
+        i++;
+        skipSpace();
+        return i == text.size() ? true : fail("text after the object");
+    }
+
+    while (true)
+    {
+        std::string key, value;
+        skipSpace();
+        if (!readString(key))
+            return fail("expected a key");
+        skipSpace();
+        if (i >= text.size() || text[i++] != ':')
+            return fail("expected :");
+        skipSpace();
+
+        if (i < text.size() && text[i] == '"')
+        {
+            if (!readString(value))
+                return fail("unterminated string");
+        }
+        else
+        {
+            // Number or literal, up to the next separator
+            size_t start = i;
+            while (i < text.size() && text[i] != ',' && text[i] != '}' && !isspace((unsigned char)text[i]))
+                i++;
+            value = text.substr(start, i - start);
+            if (value.empty() || value == "null" || value[0] == '{' || value[0] == '[')
+                return fail("unsupported value for " + key);
+        }
+
+        if (!setConfigValue(config, key, value, error))
+            return fail(error);
+
+        skipSpace();
+        if (i < text.size() && text[i] == ',')
+        {
+            i++;
+            continue;
+        }
+        if (i < text.size() && text[i] == '}')
+        {
+            i++;
+            break;
+        }
+        return fail("expected , or }");
+    }
+
+    skipSpace();
+    return i == text.size() ? true : fail("text after the object");
+}
+
+// JSON when the file starts with {, INI otherwise
+inline bool loadConfigFile(const char* path, EncoderConfig& config, std::string& error)
+{
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin)
+    {
+        error = std::string("cannot open ") + path;
+        return false;
+    }
+    std::stringstream contents;
+    contents << fin.rdbuf();
+    std::string text = contents.str();
+
+    bool ok = trimmed(text).compare(0, 1, "{") == 0 ? parseConfigJson(text, config, error) : parseConfigIni(text, config, error);
+    if (!ok)
+        error = std::string(path) + ": " + error;
+    return ok;
+}
+
+// --key value or --key=value, applied in order, so settings after
+// --config <file> override the file. Boolean flags may go without a value.
+// Arguments that are not settings end up in unused for the caller.
+inline bool parseConfigArguments(int argc, char** argv, EncoderConfig& config, std::vector<std::string>& unused, std::string& error)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            unused.push_back(arg);
+            continue;
+        }
+
+        std::string key = arg.substr(2), value;
+        size_t equals = key.find('=');
+        bool inlineValue = equals != std::string::npos;
+        if (inlineValue)
+        {
+            value = key.substr(equals + 1);
+            key = key.substr(0, equals);
+        }
+
+        if (key == "config")
+        {
+            if (!inlineValue && i + 1 >= argc)
+            {
+                error = "--config needs a file";
+                return false;
+            }
+            if (!loadConfigFile(inlineValue ? value.c_str() : argv[++i], config, error))
+                return false;
+            continue;
+        }
+
+        // Not a setting: leave it and its value to the caller
+        if (!isConfigKey(key))
+        {
+            unused.push_back(arg);
+            continue;
+        }
+
+        if (!inlineValue)
+        {
+            if (isBoolKey(key) && (i + 1 >= argc || strncmp(argv[i + 1], "--", 2) == 0))
+                value = "1";
+            else if (i + 1 < argc)
+                value = argv[++i];
+            else
+            {
+                error = "--" + key + " needs a value";
+                return false;
+            }
+        }
+        if (!setConfigValue(config, key, value, error))
+            return false;
+    }
+    return true;
+}
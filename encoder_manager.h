@@ -0,0 +1,247 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "common.h"
+#include "encoder.h"
+#include "encoder_backend.h"
+#include "metrics_registry.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Encoder manager
+//
+// Runs many encode sessions in one process. The backend factory shares one
+// device per adapter between its sessions, every session's events run on one
+// worker pool, and a session goes to the least loaded adapter whose encoder
+// supports it and is below the hardware's concurrent session limit.
+// ----------------------------------------------------------------------------
+
+struct SessionOptions
+{
+    EncoderConfig config;
+    std::string path = "vid.h264";
+    BitstreamWriterOptions writer;
+    FrameSchedulerOptions schedule;             // paced sessions tick on the manager's workers
+    FrameTracer* tracer = nullptr;              // one per session, outlives it
+    MetricsRegistry* metrics = nullptr;         // series labelled session="<id>", outlives the manager
+};
+
+struct EncoderManagerOptions
+{
+    uint32_t workerThreads = 0;                 // 0 = one per core
+    uint32_t maxSessions = 0;                   // across all adapters, 0 = no limit
+    std::chrono::milliseconds drainTimeout{5000};
+};
+
+struct EncoderManagerStats
+{
+    uint64_t opened = 0;
+    uint64_t closed = 0;
+    uint64_t rejected = 0;                      // refused by admission control
+    uint64_t drainTimeouts = 0;
+    std::vector<uint32_t> sessionsPerAdapter;
+    WorkerPoolStats workers;
+};
+
+class EncoderSession
+{
+public:
+    EncoderSession(uint64_t id, uint32_t adapter, std::unique_ptr<IEncoderBackend> backend, const SessionOptions& options, WorkerPool& workers)
+        : sessionId(id), adapterIndex(adapter), backendPtr(std::move(backend))
+    {
+        encoderPtr.reset(new Encoder(*backendPtr, options.path.c_str(), options.writer));
+        if (options.metrics)
+        {
+            metricsPtr.reset(new EncoderMetrics(*options.metrics, { { "session", std::to_string(id) } }));
+            encoderPtr->setMetrics(metricsPtr.get());
+        }
+        encoderPtr->setSchedule(options.schedule, &workers);
+        encoderPtr->setTracer(options.tracer);
+    }
+
+    // The encoder shuts the backend down before either goes away
+    ~EncoderSession()
+    {
+        encoderPtr.reset();
+        backendPtr.reset();
+        metricsPtr.reset();
+    }
+
+    // Releases the hardware session. Only the encoder's counters are of use after this.
+    void shutdown()
+    {
+        backendPtr->shutdown();
+    }
+
+    uint64_t id() const { return sessionId; }
+    uint32_t adapter() const { return adapterIndex; }
+    Encoder& encoder() { return *encoderPtr; }
+    IEncoderBackend& backend() { return *backendPtr; }
+
+private:
+    uint64_t sessionId;
+    uint32_t adapterIndex;
+    std::unique_ptr<IEncoderBackend> backendPtr;
+    std::unique_ptr<Encoder> encoderPtr;
+    std::unique_ptr<EncoderMetrics> metricsPtr;
+};
+
+class EncoderManager
+{
+public:
+    EncoderManager(IEncoderBackendFactory& factory, const EncoderManagerOptions& options = EncoderManagerOptions())
+        : factory(factory), options(options), workers(options.workerThreads), active(factory.adapterCount(), 0)
+    {
+        CHECK(factory.adapterCount() != 0);
+    }
+
+    ~EncoderManager()
+    {
+        closeAll();
+    }
+
+    // Started session, or nullptr when every adapter that can take it is at its limit
+    std::shared_ptr<EncoderSession> open(const SessionOptions& sessionOptions)
+    {
+        uint32_t adapter = 0;
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!admit(sessionOptions.config, adapter))
+            {
+                rejected++;
+                return nullptr;
+            }
+            active[adapter]++;
+            id = nextId++;
+        }
+
+        std::shared_ptr<EncoderSession> session;
+        try
+        {
+            session = std::make_shared<EncoderSession>(id, adapter, factory.createBackend(adapter, sessionOptions.config, workers), sessionOptions, workers);
+            session->encoder().start();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active[adapter]--;
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.push_back(session);
+        opened++;
+        return session;
+    }
+
+    // Drains the session, waits for its last output and frees its slot.
+    // Returns false when the drain timed out.
+    bool close(const std::shared_ptr<EncoderSession>& session)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = std::find(sessions.begin(), sessions.end(), session);
+            if (found == sessions.end())
+                return false;
+            sessions.erase(found);
+        }
+
+        bool drained = session->encoder().stop(options.drainTimeout);
+
+        session->shutdown();
+
+        uint32_t adapter = session->adapter();
+        std::lock_guard<std::mutex> lock(mutex);
+        active[adapter]--;
+        closed++;
+        drainTimeouts += drained ? 0 : 1;
+        return drained;
+    }
+
+    void closeAll()
+    {
+        std::vector<std::shared_ptr<EncoderSession>> all;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            all = sessions;
+        }
+
+        // Drain everything at once rather than one session after the other
+        for (const std::shared_ptr<EncoderSession>& session : all)
+            session->encoder().beginStop();
+        for (const std::shared_ptr<EncoderSession>& session : all)
+            close(session);
+    }
+
+    size_t sessionCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sessions.size();
+    }
+
+    EncoderManagerStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EncoderManagerStats stats;
+        stats.opened = opened;
+        stats.closed = closed;
+        stats.rejected = rejected;
+        stats.drainTimeouts = drainTimeouts;
+        stats.sessionsPerAdapter = active;
+        stats.workers = workers.stats();
+        return stats;
+    }
+
+    WorkerPool& workerPool() { return workers; }
+
+private:
+    // Least loaded adapter that supports the configuration and has room, holding the lock
+    bool admit(const EncoderConfig& config, uint32_t& adapter) const
+    {
+        uint32_t total = 0;
+        for (uint32_t count : active)
+            total += count;
+        if (options.maxSessions != 0 && total >= options.maxSessions)
+            return false;
+
+        bool found = false;
+        for (uint32_t i = 0; i < active.size(); i++)
+        {
+            uint32_t limit = factory.sessionLimit(i);
+            if (limit != 0 && active[i] >= limit)
+                continue;
+            if (!factory.supports(i, config))
+                continue;
+            if (!found || active[i] < active[adapter])
+            {
+                adapter = i;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    IEncoderBackendFactory& factory;
+    EncoderManagerOptions options;
+    WorkerPool workers;
+
+    mutable std::mutex mutex;
+    std::vector<uint32_t> active;
+    std::vector<std::shared_ptr<EncoderSession>> sessions;
+    uint64_t nextId = 1;
+    uint64_t opened = 0;
+    uint64_t closed = 0;
+    uint64_t rejected = 0;
+    uint64_t drainTimeouts = 0;
+};
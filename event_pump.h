@@ -0,0 +1,231 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Project
+#include "encoder_backend.h"
+#include "mpsc_queue.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Event pump
+//
+// Carries a backend's events from wherever they are raised (the MF work
+// queue, the stand-in's timers) to the pipeline. Posting takes no lock and
+// never waits: NeedInput and HaveOutput are only counted, so however many
+// pile up while the pipeline is busy, the input side takes every credit and
+// the output side every ready output in one batch. DrainComplete and Error
+// go through a lock-free queue and reach the output side after every output
+// posted before them.
+//
+// Input and output each run on their own strand of the worker pool, so
+// submitting frames and draining outputs overlap while each stays serial. A
+// side is only handed to the pool when it goes from idle to busy; a busy
+// side picks up whatever is posted meanwhile on its way out.
+// ----------------------------------------------------------------------------
+
+struct EventPumpStats
+{
+    uint64_t needInput = 0;             // events posted
+    uint64_t haveOutput = 0;
+    uint64_t inputBatches = 0;          // calls into the sink
+    uint64_t outputBatches = 0;
+    uint32_t largestInputBatch = 0;
+    uint32_t largestOutputBatch = 0;
+    uint64_t lost = 0;                  // control events that found the queue full
+};
+
+class EventPump
+{
+public:
+    static constexpr size_t CONTROL_EVENTS = 16;
+
+    explicit EventPump(WorkerPool& workers)
+        : input(workers), output(workers), control(CONTROL_EVENTS)
+    {
+    }
+
+    ~EventPump()
+    {
+        close();
+    }
+
+    // Before the first event
+    void start(IEncoderEventSink* eventSink)
+    {
+        sink = eventSink;
+    }
+
+    // Runs on the input side, see IEncoderBackend::setInputReleaseCallback
+    void setInputReleaseCallback(std::function<void()> callback)
+    {
+        inputReleased = std::move(callback);
+    }
+
+    // Any thread
+    void post(EncoderEvent event)
+    {
+        switch (event)
+        {
+        case EncoderEvent::NeedInput:
+            credits.fetch_add(1);
+            counters.needInput.fetch_add(1, std::memory_order_relaxed);
+            wakeInput();
+            break;
+
+        case EncoderEvent::HaveOutput:
+            outputs.fetch_add(1);
+            counters.haveOutput.fetch_add(1, std::memory_order_relaxed);
+            wakeOutput();
+            break;
+
+        default:
+            if (!control.push(event))
+                counters.lost.fetch_add(1, std::memory_order_relaxed);
+            wakeOutput();
+            break;
+        }
+    }
+
+    // Any thread, when an input frame came back from the encoder
+    void releaseInput()
+    {
+        released.store(true);
+        wakeInput();
+    }
+
+    // Keeps the first failure and reports it with an Error event
+    void fail(EncoderStatus failure)
+    {
+        {
+            std::lock_guard<std::mutex> lock(statusMutex);
+            if (!firstFailure.ok())
+                return;
+            firstFailure = failure;
+        }
+        post(EncoderEvent::Error);
+    }
+
+    EncoderStatus status() const
+    {
+        std::lock_guard<std::mutex> lock(statusMutex);
+        return firstFailure;
+    }
+
+    // Nothing reaches the sink once this returns, unless called from it
+    void close()
+    {
+        input.close();
+        output.close();
+    }
+
+    EventPumpStats stats() const
+    {
+        EventPumpStats result;
+        result.needInput = counters.needInput.load(std::memory_order_relaxed);
+        result.haveOutput = counters.haveOutput.load(std::memory_order_relaxed);
+        result.inputBatches = counters.inputBatches.load(std::memory_order_relaxed);
+        result.outputBatches = counters.outputBatches.load(std::memory_order_relaxed);
+        result.largestInputBatch = counters.largestInputBatch.load(std::memory_order_relaxed);
+        result.largestOutputBatch = counters.largestOutputBatch.load(std::memory_order_relaxed);
+        result.lost = counters.lost.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    // The runner clears its flag before it takes the counts, so an event
+    // posted after the take finds the side idle and wakes it again
+    void wakeInput()
+    {
+        if (!inputScheduled.exchange(true))
+            input.post([this]() { runInput(); });
+    }
+
+    void wakeOutput()
+    {
+        if (!outputScheduled.exchange(true))
+            output.post([this]() { runOutput(); });
+    }
+
+    void runInput()
+    {
+        inputScheduled.store(false);
+        bool frameBack = released.exchange(false);
+        uint32_t count = credits.exchange(0);
+        if (count != 0)
+        {
+            counters.inputBatches.fetch_add(1, std::memory_order_relaxed);
+            raise(counters.largestInputBatch, count);
+            sink->onEncoderEvent(EncoderEvent::NeedInput, count);
+        }
+        else if (frameBack && inputReleased)
+        {
+            // NeedInput retries the pending requests anyway
+            inputReleased();
+        }
+    }
+
+    // Outputs before the control event that followed them
+    void runOutput()
+    {
+        outputScheduled.store(false);
+        deliverOutputs();
+        EncoderEvent event;
+        while (control.pop(event))
+        {
+            deliverOutputs();
+            sink->onEncoderEvent(event, 1);
+        }
+    }
+
+    void deliverOutputs()
+    {
+        uint32_t count = outputs.exchange(0);
+        if (count == 0)
+            return;
+        counters.outputBatches.fetch_add(1, std::memory_order_relaxed);
+        raise(counters.largestOutputBatch, count);
+        sink->onEncoderEvent(EncoderEvent::HaveOutput, count);
+    }
+
+    // Only one side writes each maximum
+    static void raise(std::atomic<uint32_t>& maximum, uint32_t value)
+    {
+        if (value > maximum.load(std::memory_order_relaxed))
+            maximum.store(value, std::memory_order_relaxed);
+    }
+
+    struct Counters
+    {
+        std::atomic<uint64_t> needInput{0};
+        std::atomic<uint64_t> haveOutput{0};
+        std::atomic<uint64_t> inputBatches{0};
+        std::atomic<uint64_t> outputBatches{0};
+        std::atomic<uint32_t> largestInputBatch{0};
+        std::atomic<uint32_t> largestOutputBatch{0};
+        std::atomic<uint64_t> lost{0};
+    };
+
+    IEncoderEventSink* sink = nullptr;
+    std::function<void()> inputReleased;
+
+    SerialQueue input;
+    SerialQueue output;
+
+    // Posted from any thread, taken by the sides
+    alignas(64) std::atomic<uint32_t> credits{0};
+    std::atomic<bool> released{false};
+    std::atomic<bool> inputScheduled{false};
+    alignas(64) std::atomic<uint32_t> outputs{0};
+    std::atomic<bool> outputScheduled{false};
+    MpscQueue<EncoderEvent> control;
+
+    mutable std::mutex statusMutex;
+    EncoderStatus firstFailure;
+    Counters counters;
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "resource_tracker.h"
+
+// ----------------------------------------------------------------------------
+// Input frame pool
+//
+// A fixed ring of input frames that are created once and recycled when the
+// encoder is done with them. acquire() never allocates: when every slot is in
+// flight it fails and the caller has to hold the request until release().
+// ----------------------------------------------------------------------------
+
+struct FramePoolStats
+{
+    uint64_t acquired = 0;    // successful acquire() calls
+    uint64_t released = 0;    // release() calls
+    uint64_t exhausted = 0;   // acquire() calls that found no free slot
+    uint64_t allocations = 0; // backing allocations, all made at construction
+    uint32_t highWater = 0;   // most slots in flight at once
+};
+
+class IFramePool
+{
+public:
+    virtual ~IFramePool() {}
+
+    virtual bool acquire(uint32_t& slot) = 0;
+    virtual void release(uint32_t slot) = 0;
+
+    virtual uint32_t capacity() const = 0;
+    virtual uint32_t inFlight() const = 0;
+    virtual FramePoolStats stats() const = 0;
+
+    // Called (without any pool lock held) after a slot became free again
+    virtual void setReleaseCallback(std::function<void(uint32_t)> callback) = 0;
+};
+
+// Slot bookkeeping shared by the pool implementations. Free slots are handed
+// out in FIFO order so the slot released longest ago is reused first, which
+// gives the GPU the most time to finish with a texture before it is refilled.
+class FrameRing
+{
+public:
+    explicit FrameRing(uint32_t capacity)
+        : freeSlots(capacity), busy(capacity, false)
+    {
+        CHECK(capacity != 0);
+        for (uint32_t i = 0; i < capacity; i++)
+            freeSlots[i] = i;
+        freeCount = capacity;
+    }
+
+    bool acquire(uint32_t& slot)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (freeCount == 0)
+        {
+            counters.exhausted++;
+            return false;
+        }
+
+        slot = freeSlots[head];
+        head = (head + 1) % capacity();
+        freeCount--;
+        busy[slot] = true;
+
+        counters.acquired++;
+        if (capacity() - freeCount > counters.highWater)
+            counters.highWater = capacity() - freeCount;
+        TRACK_CREATED(ResourceKind::Sample, slotKey(slot), 0);
+        return true;
+    }
+
+    void release(uint32_t slot)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            CHECK(slot < capacity() && busy[slot]);
+
+            busy[slot] = false;
+            freeSlots[(head + freeCount) % capacity()] = slot;
+            freeCount++;
+            counters.released++;
+        }
+        TRACK_DESTROYED(ResourceKind::Sample, slotKey(slot), 0);
+
+        if (onRelease)
+            onRelease(slot);
+    }
+
+    uint32_t capacity() const { return (uint32_t)freeSlots.size(); }
+
+    uint32_t inFlight() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capacity() - freeCount;
+    }
+
+    FramePoolStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+    void addAllocations(uint64_t count) { counters.allocations += count; }
+    void setReleaseCallback(std::function<void(uint32_t)> callback) { onRelease = std::move(callback); }
+
+private:
+    // An address of this ring's own for each slot, for the tracker
+    const void* slotKey(uint32_t slot) const { return freeSlots.data() + slot; }
+
+    mutable std::mutex mutex;
+    std::vector<uint32_t> freeSlots;
+    std::vector<bool> busy;
+    uint32_t head = 0;
+    uint32_t freeCount = 0;
+    FramePoolStats counters;
+    std::function<void(uint32_t)> onRelease;
+};
+
+// ----------------------------------------------------------------------------
+// CPU memory implementation
+//
+// One allocation backs every slot. Each frame starts on a 64 byte boundary so
+// the SIMD kernels can use aligned loads on the first row.
+// ----------------------------------------------------------------------------
+
+class CpuFramePool : public IFramePool
+{
+public:
+    static constexpr size_t ALIGNMENT = 64;
+
+    CpuFramePool(uint32_t capacity, size_t frameBytes)
+        : ring(capacity)
+    {
+        frameStride = (frameBytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        storage.resize(frameStride * capacity + ALIGNMENT);
+        ring.addAllocations(1);
+
+        uintptr_t base = reinterpret_cast<uintptr_t>(storage.data());
+        frames = reinterpret_cast<uint8_t*>((base + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+        this->frameBytes = frameBytes;
+        TRACK_CREATED(ResourceKind::Buffer, storage.data(), storage.size());
+    }
+
+    ~CpuFramePool()
+    {
+        TRACK_DESTROYED(ResourceKind::Buffer, storage.data(), storage.size());
+    }
+
+    uint8_t* data(uint32_t slot)
+    {
+        CHECK(slot < ring.capacity());
+        return frames + frameStride * slot;
+    }
+
+    size_t size() const { return frameBytes; }
+
+    bool acquire(uint32_t& slot) override { return ring.acquire(slot); }
+    void release(uint32_t slot) override { ring.release(slot); }
+    uint32_t capacity() const override { return ring.capacity(); }
+    uint32_t inFlight() const override { return ring.inFlight(); }
+    FramePoolStats stats() const override { return ring.stats(); }
+    void setReleaseCallback(std::function<void(uint32_t)> callback) override { ring.setReleaseCallback(std::move(callback)); }
+
+private:
+    FrameRing ring;
+    std::vector<uint8_t> storage;
+    uint8_t* frames = nullptr;
+    size_t frameStride = 0;
+    size_t frameBytes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Shared frames
+//
+// A frame that several readers take at the same time, such as a converted
+// source frame that every rung of a ladder scales from. Handles count
+// references like EncodedPacket does, and the slot goes back to the pool
+// when the last handle is dropped. The pool has to outlive its handles.
+// ----------------------------------------------------------------------------
+
+class SharedFramePool;
+
+class SharedFrame
+{
+public:
+    SharedFrame() {}
+
+    SharedFrame(const SharedFrame& other)
+        : SharedFrame(other.pool, other.slot)
+    {
+    }
+
+    SharedFrame(SharedFrame&& other) noexcept
+        : pool(other.pool), slot(other.slot)
+    {
+        other.pool = nullptr;
+    }
+
+    SharedFrame& operator=(SharedFrame other) noexcept
+    {
+        std::swap(pool, other.pool);
+        std::swap(slot, other.slot);
+        return *this;
+    }
+
+    ~SharedFrame()
+    {
+        reset();
+    }
+
+    inline void reset();
+
+    explicit operator bool() const { return pool != nullptr; }
+
+    inline uint8_t* data() const;
+    inline uint32_t useCount() const;
+
+private:
+    friend class SharedFramePool;
+
+    inline SharedFrame(SharedFramePool* pool, uint32_t slot);
+
+    SharedFramePool* pool = nullptr;
+    uint32_t slot = 0;
+};
+
+class SharedFramePool
+{
+public:
+    SharedFramePool(uint32_t capacity, size_t frameBytes)
+        : frames(capacity, frameBytes), refs(new std::atomic<uint32_t>[capacity])
+    {
+        for (uint32_t i = 0; i < capacity; i++)
+            refs[i].store(0, std::memory_order_relaxed);
+    }
+
+    // Fails without allocating when every frame is held
+    bool acquire(SharedFrame& frame)
+    {
+        uint32_t slot;
+        if (!frames.acquire(slot))
+            return false;
+        frame = SharedFrame(this, slot);
+        return true;
+    }
+
+    size_t size() const { return frames.size(); }
+    uint32_t capacity() const { return frames.capacity(); }
+    uint32_t inFlight() const { return frames.inFlight(); }
+    FramePoolStats stats() const { return frames.stats(); }
+
+    // Called after the last handle of a frame was dropped
+    void setReleaseCallback(std::function<void(uint32_t)> callback) { frames.setReleaseCallback(std::move(callback)); }
+
+private:
+    friend class SharedFrame;
+
+    void addRef(uint32_t slot)
+    {
+        refs[slot].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(uint32_t slot)
+    {
+        if (refs[slot].fetch_sub(1, std::memory_order_acq_rel) == 1)
+            frames.release(slot);
+    }
+
+    CpuFramePool frames;
+    std::unique_ptr<std::atomic<uint32_t>[]> refs;
+};
+
+inline SharedFrame::SharedFrame(SharedFramePool* pool, uint32_t slot)
+    : pool(pool), slot(slot)
+{
+    if (pool)
+        pool->addRef(slot);
+}
+
+inline void SharedFrame::reset()
+{
+    if (pool)
+        pool->release(slot);
+    pool = nullptr;
+}
+
+inline uint8_t* SharedFrame::data() const
+{
+    return pool->frames.data(slot);
+}
+
+inline uint32_t SharedFrame::useCount() const
+{
+    return pool ? pool->refs[slot].load(std::memory_order_relaxed) : 0;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Project
+#include "color_convert.h"
+#include "common.h"
+#include "frame_scaler.h"
+#include "lookahead.h"
+#include "tile_scheduler.h"
+
+// ----------------------------------------------------------------------------
+// Frame preprocessing
+//
+// BGRA or RGBA pictures to NV12 at the encoder's size, in tiles of output
+// rows on a tile scheduler. Each tile does every step while its rows are in
+// L2, instead of one whole frame pass per step:
+//
+// 1. Convert the source rows the tile reads to NV12: straight into the
+//    output at the same size, else into the thread's own scratch rows.
+// 2. Scale those rows into the tile's output rows.
+// 3. With analyze set, reduce the tile's output luma to the 4x4 block means
+//    Lookahead::pushBlocks() takes, so the lookahead does not read the frame
+//    once more.
+//
+// A tile's height is a multiple of 4 sized with tileRowsFor() from the L2
+// the topology reports. Tiles that scale convert the few source rows their
+// filter shares with the next tile as well, which is cheaper than making
+// them wait for each other. Each row is converted and scaled by the same
+// kernels and the same integer math as ColorConverter and FrameScaler, so
+// the output is byte for byte what converting the whole frame and then
+// scaling it makes. Scratch is allocated by the thread that uses it, so it
+// sits on that thread's node.
+// ----------------------------------------------------------------------------
+
+struct FramePreprocessorStats
+{
+    uint64_t frames = 0;
+    uint32_t tiles = 0;                 // per frame
+    uint32_t tileRows = 0;              // output rows of every tile but the last
+    size_t tileBytes = 0;               // written and read back by one tile, about
+    double frameUs = 0;                 // per frame, on average
+};
+
+class FramePreprocessor
+{
+public:
+    // Sizes are even. cacheBytes 0 takes the L2 size of the topology.
+    FramePreprocessor(TileScheduler& scheduler, const ColorConverter& converter, uint32_t sourceWidth, uint32_t sourceHeight,
+                      uint32_t width, uint32_t height, ScaleFilter filter = ScaleFilter::Bicubic, bool analyze = false,
+                      size_t cacheBytes = 0)
+        : scheduler(scheduler), converter(converter), sourceWidth(sourceWidth), sourceHeight(sourceHeight), width(width), height(height),
+          analyze(analyze), kernels(analysisKernels(bestAnalysisKernel())), scratch(scheduler.threadCount())
+    {
+        CHECK(sourceWidth % 2 == 0 && sourceHeight % 2 == 0 && width % 2 == 0 && height % 2 == 0 && height >= LOOKAHEAD_BLOCK);
+        if (cacheBytes == 0)
+            cacheBytes = cpuTopology().l2Bytes;
+
+        // What a tile writes and reads back per output row has to stay in
+        // L2: the output, and when scaling the converted source rows and the
+        // row between the passes. The source is read once and passes through.
+        size_t rowBytes = (size_t)width * 3 / 2;
+        if (sourceWidth != width || sourceHeight != height)
+        {
+            scaler.reset(new FrameScaler(sourceWidth, sourceHeight, width, height, filter));
+            rowBytes += (size_t)((double)sourceHeight / height * sourceWidth * 3 / 2) + (size_t)sourceWidth * 2;
+        }
+        rows = tileRowsFor(height, rowBytes, scheduler.threadCount(), LOOKAHEAD_BLOCK, cacheBytes);
+        tiles = (height + rows - 1) / rows;
+        counters.tiles = tiles;
+        counters.tileRows = rows;
+        counters.tileBytes = rowBytes * rows;
+
+        // The source rows each tile converts, so scratch fits the largest
+        if (scaler)
+        {
+            for (uint32_t tile = 0; tile < tiles; tile++)
+            {
+                uint32_t begin, end;
+                scaler->nv12SourceRows(tile * rows, std::min((tile + 1) * rows, height), begin, end);
+                sourceSpans.push_back({ begin, end });
+                maxSpan = std::max(maxSpan, end - begin);
+            }
+        }
+        if (analyze)
+            blockPlane.resize((size_t)(width / LOOKAHEAD_BLOCK) * (height / LOOKAHEAD_BLOCK));
+    }
+
+    // One picture into an NV12 frame at the output size
+    void process(const uint8_t* source, size_t sourcePitch, const Nv12Frame& destination)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        scheduler.run(tiles, [&](uint32_t tile, uint32_t thread) { runTile(tile, thread, source, sourcePitch, destination); });
+        frameNs += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        frames++;
+    }
+
+    // The last frame's luma as 4x4 block means, width / 4 by height / 4 of
+    // them; nullptr unless analyzing
+    const uint8_t* blocks() const { return analyze ? blockPlane.data() : nullptr; }
+
+    bool scales() const { return scaler != nullptr; }
+
+    FramePreprocessorStats stats() const
+    {
+        FramePreprocessorStats result = counters;
+        result.frames = frames;
+        result.frameUs = result.frames ? frameNs / 1000.0 / result.frames : 0;
+        return result;
+    }
+
+private:
+    struct SourceSpan
+    {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // One thread's converted source rows and the scaler's row between passes
+    struct Scratch
+    {
+        std::vector<uint8_t> nv12;
+        std::vector<int16_t> between;
+    };
+
+    void runTile(uint32_t tile, uint32_t thread, const uint8_t* source, size_t sourcePitch, const Nv12Frame& destination)
+    {
+        const uint32_t first = tile * rows;
+        const uint32_t last = std::min(first + rows, height);
+        if (!scaler)
+            converter.convertRows(source, sourcePitch, width, first, last, destination);
+        else
+        {
+            Scratch& own = scratch[thread];
+            if (own.nv12.empty())
+            {
+                own.nv12.resize((size_t)sourceWidth * maxSpan * 3 / 2);
+                own.between.resize((size_t)sourceWidth * 4);
+            }
+
+            // The span's rows as a frame of their own, whose row 0 is span.begin
+            const SourceSpan& span = sourceSpans[tile];
+            const uint32_t spanRows = span.end - span.begin;
+            Nv12Frame converted = { own.nv12.data(), sourceWidth, own.nv12.data() + (size_t)sourceWidth * spanRows, sourceWidth };
+            converter.convertRows(source + sourcePitch * span.begin, sourcePitch, sourceWidth, 0, spanRows, converted);
+            scaler->scaleNv12Rows(converted, span.begin, destination, first, last, own.between.data());
+        }
+
+        if (analyze)
+        {
+            const uint32_t blocksX = width / LOOKAHEAD_BLOCK;
+            const uint32_t blocksY = height / LOOKAHEAD_BLOCK;
+            for (uint32_t y = first / LOOKAHEAD_BLOCK; y < std::min(last / LOOKAHEAD_BLOCK, blocksY); y++)
+                kernels.decimateRow(destination.y + destination.yPitch * y * LOOKAHEAD_BLOCK, destination.yPitch, blocksX,
+                                    blockPlane.data() + (size_t)blocksX * y);
+        }
+    }
+
+    TileScheduler& scheduler;
+    ColorConverter converter;
+    std::unique_ptr<FrameScaler> scaler;
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    uint32_t width;
+    uint32_t height;
+    bool analyze;
+    AnalysisKernels kernels;
+
+    uint32_t rows = 0;
+    uint32_t tiles = 0;
+    std::vector<SourceSpan> sourceSpans;
+    uint32_t maxSpan = 0;
+    std::vector<Scratch> scratch;       // per scheduler thread
+    std::vector<uint8_t> blockPlane;
+
+    FramePreprocessorStats counters;    // the layout, set once
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> frameNs{0};
+};
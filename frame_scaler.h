@@ -0,0 +1,868 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Project
+#include "color_convert.h"
+#include "common.h"
+#include "cpu_features.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Image scaling
+//
+// Separable and table driven. Each output row is a weighted sum of a few
+// source rows. That sum is taken at full source width into a 16 bit row with
+// six fractional bits, and each output pixel is then a weighted sum of a few
+// pixels of that row. Weights are Q14 and sum to exactly one, so flat areas
+// stay flat. Both passes have SIMD kernels that do the same integer math,
+// with no sum that can overflow, so they are bit exact with the scalar one.
+//
+// A plane is rows of pixels with 1, 2 or 4 interleaved channels. NV12 is a
+// luma plane plus a chroma plane at half the size; BGRA is one plane of 4
+// channels. Pixel centers map onto pixel centers.
+// ----------------------------------------------------------------------------
+
+enum class ScaleKernel { Auto, Scalar, Sse2, Avx2, Neon };
+
+// Bilinear interpolates between the two nearest pixels. It is the fastest
+// and aliases when shrinking by more than two. Bicubic is Catmull-Rom,
+// widened when shrinking. Area averages the source pixels each output pixel
+// covers, and is bilinear when enlarging.
+enum class ScaleFilter { Bilinear, Bicubic, Area };
+
+inline const char* scaleKernelName(ScaleKernel kernel)
+{
+    switch (kernel)
+    {
+    case ScaleKernel::Scalar: return "scalar";
+    case ScaleKernel::Sse2: return "sse2";
+    case ScaleKernel::Avx2: return "avx2";
+    case ScaleKernel::Neon: return "neon";
+    default: return "auto";
+    }
+}
+
+inline bool scaleKernelSupported(ScaleKernel kernel)
+{
+    switch (kernel)
+    {
+    case ScaleKernel::Scalar: return true;
+    case ScaleKernel::Sse2: return cpuFeatures().sse2;
+    case ScaleKernel::Avx2: return cpuFeatures().avx2;
+    case ScaleKernel::Neon: return cpuFeatures().neon;
+    default: return false;
+    }
+}
+
+inline ScaleKernel bestScaleKernel()
+{
+    if (scaleKernelSupported(ScaleKernel::Avx2))
+        return ScaleKernel::Avx2;
+    if (scaleKernelSupported(ScaleKernel::Neon))
+        return ScaleKernel::Neon;
+    if (scaleKernelSupported(ScaleKernel::Sse2))
+        return ScaleKernel::Sse2;
+    return ScaleKernel::Scalar;
+}
+
+inline const char* scaleFilterName(ScaleFilter filter)
+{
+    switch (filter)
+    {
+    case ScaleFilter::Bilinear: return "bilinear";
+    case ScaleFilter::Bicubic: return "bicubic";
+    case ScaleFilter::Area: return "area";
+    }
+    return "?";
+}
+
+inline bool parseScaleFilter(const std::string& text, ScaleFilter& filter)
+{
+    for (ScaleFilter candidate : { ScaleFilter::Bilinear, ScaleFilter::Bicubic, ScaleFilter::Area })
+    {
+        if (text == scaleFilterName(candidate))
+        {
+            filter = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fixed point: Q14 weights, Q6 between the passes
+constexpr int SCALE_WEIGHT_SHIFT = 14;
+constexpr int SCALE_ROW_SHIFT = 8;
+constexpr int SCALE_COLUMN_SHIFT = 20;
+constexpr uint32_t MAX_SCALE_TAPS = 64;
+
+// One axis: output pixel i is the sum over k < taps of
+// weights[i * taps + k] * source[offsets[i] + k]. Taps are even whenever the
+// source has room, so the kernels can take them in pairs.
+struct ScaleTable
+{
+    uint32_t taps = 0;
+    std::vector<uint32_t> offsets;
+    std::vector<int16_t> weights;
+};
+
+inline double catmullRom(double x)
+{
+    x = std::fabs(x);
+    if (x < 1)
+        return 1.5 * x * x * x - 2.5 * x * x + 1;
+    if (x < 2)
+        return -0.5 * x * x * x + 2.5 * x * x - 4 * x + 2;
+    return 0;
+}
+
+// Weights past an edge fold onto the edge pixel, so a window always lies
+// inside the source
+inline ScaleTable makeScaleTable(uint32_t source, uint32_t destination, ScaleFilter filter)
+{
+    CHECK(source != 0 && destination != 0);
+    const double scale = (double)source / destination;
+    const bool area = filter == ScaleFilter::Area && scale > 1;
+    const double stretch = filter == ScaleFilter::Bicubic && scale > 1 ? scale : 1;
+    const double support = area ? scale / 2 + 0.5 : filter == ScaleFilter::Bicubic ? 2 * stretch : 1;
+
+    // Each output's weights by clamped source position, trimmed to the nonzero span
+    std::vector<int64_t> firsts(destination);
+    std::vector<std::vector<double>> spans(destination);
+    uint32_t taps = 1;
+    for (uint32_t i = 0; i < destination; i++)
+    {
+        double center = (i + 0.5) * scale - 0.5;
+        int64_t low = std::max<int64_t>((int64_t)std::floor(center - support), 0);
+        int64_t high = std::min<int64_t>((int64_t)std::ceil(center + support), source - 1);
+        std::vector<double> weights((size_t)(high - low + 1), 0.0);
+        for (int64_t position = (int64_t)std::floor(center - support); position <= (int64_t)std::ceil(center + support); position++)
+        {
+            double weight;
+            if (area)
+                weight = std::max(0.0, std::min(position + 0.5, center + scale / 2) - std::max(position - 0.5, center - scale / 2));
+            else if (filter == ScaleFilter::Bicubic)
+                weight = catmullRom((position - center) / stretch);
+            else
+                weight = std::max(0.0, 1.0 - std::fabs(position - center));
+            int64_t clamped = std::min<int64_t>(std::max<int64_t>(position, low), high);
+            weights[(size_t)(clamped - low)] += weight;
+        }
+
+        size_t first = 0;
+        size_t last = weights.size();
+        while (first + 1 < last && std::fabs(weights[first]) < 1e-9)
+            first++;
+        while (last - 1 > first && std::fabs(weights[last - 1]) < 1e-9)
+            last--;
+        firsts[i] = low + (int64_t)first;
+        spans[i].assign(weights.begin() + first, weights.begin() + last);
+        taps = std::max(taps, (uint32_t)spans[i].size());
+    }
+    if (taps % 2 != 0 && taps < source)
+        taps++;
+    CHECK(taps <= MAX_SCALE_TAPS);
+
+    ScaleTable table;
+    table.taps = taps;
+    table.offsets.resize(destination);
+    table.weights.assign((size_t)destination * taps, 0);
+    for (uint32_t i = 0; i < destination; i++)
+    {
+        const std::vector<double>& weights = spans[i];
+        int64_t start = std::min<int64_t>(firsts[i], source - taps);
+        size_t shift = (size_t)(firsts[i] - start);
+        double total = 0;
+        for (double weight : weights)
+            total += weight;
+
+        // The largest weight takes the rounding, so they sum to exactly one
+        int16_t* quantized = &table.weights[(size_t)i * taps];
+        int32_t sum = 0;
+        size_t largest = 0;
+        for (size_t k = 0; k < weights.size(); k++)
+        {
+            quantized[shift + k] = (int16_t)std::lround(weights[k] / total * (1 << SCALE_WEIGHT_SHIFT));
+            sum += quantized[shift + k];
+            if (weights[k] > weights[largest])
+                largest = k;
+        }
+        quantized[shift + largest] = (int16_t)(quantized[shift + largest] + (1 << SCALE_WEIGHT_SHIFT) - sum);
+        table.offsets[i] = (uint32_t)start;
+    }
+    return table;
+}
+
+// Tables depend only on the sizes and the filter, so every scaler for the
+// same pair shares one, built the first time it is asked for
+inline std::shared_ptr<const ScaleTable> cachedScaleTable(uint32_t source, uint32_t destination, ScaleFilter filter)
+{
+    static std::mutex mutex;
+    static std::map<std::tuple<uint32_t, uint32_t, ScaleFilter>, std::shared_ptr<const ScaleTable>> tables;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<const ScaleTable>& table = tables[std::make_tuple(source, destination, filter)];
+    if (!table)
+        table = std::make_shared<const ScaleTable>(makeScaleTable(source, destination, filter));
+    return table;
+}
+
+// Weighted sum of taps source rows, bytes [begin, end) of each, into Q6
+typedef void (*ScaleRowsFn)(const uint8_t* const* rows, const int16_t* weights, uint32_t taps, uint32_t begin, uint32_t end, int16_t* out);
+
+// Output pixels [begin, end) of a Q6 row
+typedef void (*ScaleColumnsFn)(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out);
+
+inline int32_t loadPair(const int16_t* values)
+{
+    int32_t pair;
+    memcpy(&pair, values, sizeof(pair));
+    return pair;
+}
+
+// ----------------------------------------------------------------------------
+// Scalar
+// ----------------------------------------------------------------------------
+
+inline void scaleRowsScalar(const uint8_t* const* rows, const int16_t* weights, uint32_t taps, uint32_t begin, uint32_t end, int16_t* out)
+{
+    for (uint32_t x = begin; x < end; x++)
+    {
+        int32_t sum = 0;
+        for (uint32_t k = 0; k < taps; k++)
+            sum += weights[k] * rows[k][x];
+        out[x] = (int16_t)((sum + (1 << (SCALE_ROW_SHIFT - 1))) >> SCALE_ROW_SHIFT);
+    }
+}
+
+template <uint32_t Channels>
+inline void scaleColumnsScalar(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    for (uint32_t i = begin; i < end; i++)
+    {
+        const int16_t* weights = &table.weights[(size_t)i * taps];
+        const int16_t* pixels = row + (size_t)table.offsets[i] * Channels;
+        for (uint32_t c = 0; c < Channels; c++)
+        {
+            int32_t sum = 0;
+            for (uint32_t k = 0; k < taps; k++)
+                sum += weights[k] * pixels[k * Channels + c];
+            out[i * Channels + c] = clampToByte((sum + (1 << (SCALE_COLUMN_SHIFT - 1))) >> SCALE_COLUMN_SHIFT);
+        }
+    }
+}
+
+#if defined(ARCH_X86)
+
+// ----------------------------------------------------------------------------
+// SSE2
+//
+// Vertically rows go in pairs: interleaving two widened rows lines each byte
+// up with the same byte of the other row, and madd weighs and adds both at
+// once. Horizontally taps go in pairs too, which is why tables have an even
+// number of them; the pixels of a pair are shuffled next to each other.
+// ----------------------------------------------------------------------------
+
+inline int32_t weightPair(const int16_t* weights, uint32_t k, uint32_t taps)
+{
+    uint32_t second = k + 1 < taps ? (uint16_t)weights[k + 1] : 0;
+    return (int32_t)((uint32_t)(uint16_t)weights[k] | (second << 16));
+}
+
+TARGET_SSE2 inline void scaleRowsSse2(const uint8_t* const* rows, const int16_t* weights, uint32_t taps, uint32_t begin, uint32_t end, int16_t* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (SCALE_ROW_SHIFT - 1));
+
+    uint32_t x = begin;
+    for (; x + 16 <= end; x += 16)
+    {
+        __m128i sum0 = zero;
+        __m128i sum1 = zero;
+        __m128i sum2 = zero;
+        __m128i sum3 = zero;
+        for (uint32_t k = 0; k < taps; k += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + x));
+            __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + x)) : zero;
+            __m128i coef = _mm_set1_epi32(weightPair(weights, k, taps));
+
+            __m128i alo = _mm_unpacklo_epi8(a, zero);
+            __m128i ahi = _mm_unpackhi_epi8(a, zero);
+            __m128i blo = _mm_unpacklo_epi8(b, zero);
+            __m128i bhi = _mm_unpackhi_epi8(b, zero);
+            sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), coef));
+            sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), coef));
+            sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), coef));
+            sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), coef));
+        }
+
+        sum0 = _mm_srai_epi32(_mm_add_epi32(sum0, round), SCALE_ROW_SHIFT);
+        sum1 = _mm_srai_epi32(_mm_add_epi32(sum1, round), SCALE_ROW_SHIFT);
+        sum2 = _mm_srai_epi32(_mm_add_epi32(sum2, round), SCALE_ROW_SHIFT);
+        sum3 = _mm_srai_epi32(_mm_add_epi32(sum3, round), SCALE_ROW_SHIFT);
+        _mm_storeu_si128((__m128i*)(out + x), _mm_packs_epi32(sum0, sum1));
+        _mm_storeu_si128((__m128i*)(out + x + 8), _mm_packs_epi32(sum2, sum3));
+    }
+
+    if (x < end)
+        scaleRowsScalar(rows, weights, taps, x, end, out);
+}
+
+// Four Q20 sums to four bytes
+TARGET_SSE2 inline void storeColumnsSse2(__m128i sum, uint8_t* out)
+{
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (SCALE_COLUMN_SHIFT - 1))), SCALE_COLUMN_SHIFT);
+    __m128i packed = _mm_packs_epi32(sum, sum);
+    int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+    memcpy(out, &bytes, sizeof(bytes));
+}
+
+// Luma, four output pixels at a time, each tap pair one 32 bit load
+TARGET_SSE2 inline void scaleColumns1Sse2(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const uint32_t* offsets = table.offsets.data();
+    const int16_t* weights = table.weights.data();
+
+    uint32_t i = begin;
+    if (taps % 2 == 0)
+    {
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128i sum = _mm_setzero_si128();
+            for (uint32_t k = 0; k < taps; k += 2)
+            {
+                __m128i pixels = _mm_setr_epi32(loadPair(row + offsets[i] + k), loadPair(row + offsets[i + 1] + k),
+                                                loadPair(row + offsets[i + 2] + k), loadPair(row + offsets[i + 3] + k));
+                __m128i coef = _mm_setr_epi32(loadPair(weights + (size_t)i * taps + k), loadPair(weights + (size_t)(i + 1) * taps + k),
+                                              loadPair(weights + (size_t)(i + 2) * taps + k), loadPair(weights + (size_t)(i + 3) * taps + k));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, coef));
+            }
+            storeColumnsSse2(sum, out + i);
+        }
+    }
+    scaleColumnsScalar<1>(row, table, i, end, out);
+}
+
+// Interleaved chroma, two output pixels at a time. A tap pair is
+// U V U V, shuffled to U U V V.
+TARGET_SSE2 inline void scaleColumns2Sse2(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const uint32_t* offsets = table.offsets.data();
+    const int16_t* weights = table.weights.data();
+
+    uint32_t i = begin;
+    if (taps % 2 == 0)
+    {
+        for (; i + 2 <= end; i += 2)
+        {
+            __m128i sum = _mm_setzero_si128();
+            for (uint32_t k = 0; k < taps; k += 2)
+            {
+                __m128i a = _mm_loadl_epi64((const __m128i*)(row + ((size_t)offsets[i] + k) * 2));
+                __m128i b = _mm_loadl_epi64((const __m128i*)(row + ((size_t)offsets[i + 1] + k) * 2));
+                __m128i pixels = _mm_unpacklo_epi64(a, b);
+                pixels = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+                int32_t first = loadPair(weights + (size_t)i * taps + k);
+                int32_t second = loadPair(weights + (size_t)(i + 1) * taps + k);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_setr_epi32(first, first, second, second)));
+            }
+            storeColumnsSse2(sum, out + (size_t)i * 2);
+        }
+    }
+    scaleColumnsScalar<2>(row, table, i, end, out);
+}
+
+// BGRA, one output pixel at a time. A tap pair is two whole pixels, which
+// unpack into channel pairs.
+TARGET_SSE2 inline void scaleColumns4Sse2(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const uint32_t* offsets = table.offsets.data();
+    const int16_t* weights = table.weights.data();
+
+    uint32_t i = begin;
+    if (taps % 2 == 0)
+    {
+        for (; i < end; i++)
+        {
+            __m128i sum = _mm_setzero_si128();
+            for (uint32_t k = 0; k < taps; k += 2)
+            {
+                __m128i pixels = _mm_loadu_si128((const __m128i*)(row + ((size_t)offsets[i] + k) * 4));
+                pixels = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pixels, _mm_set1_epi32(loadPair(weights + (size_t)i * taps + k))));
+            }
+            storeColumnsSse2(sum, out + (size_t)i * 4);
+        }
+    }
+    scaleColumnsScalar<4>(row, table, i, end, out);
+}
+
+// ----------------------------------------------------------------------------
+// AVX2
+//
+// Vertically 16 bytes per iteration: widening with cvtepu8 keeps bytes in
+// order, so the in-lane unpack and pack cancel out. Horizontally luma and
+// chroma gather their tap pairs, eight and four output pixels at a time;
+// BGRA loads are contiguous already and stay SSE2.
+// ----------------------------------------------------------------------------
+
+TARGET_AVX2 inline void scaleRowsAvx2(const uint8_t* const* rows, const int16_t* weights, uint32_t taps, uint32_t begin, uint32_t end, int16_t* out)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (SCALE_ROW_SHIFT - 1));
+
+    uint32_t x = begin;
+    for (; x + 16 <= end; x += 16)
+    {
+        __m256i lo = zero;
+        __m256i hi = zero;
+        for (uint32_t k = 0; k < taps; k += 2)
+        {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[k] + x)));
+            __m256i b = k + 1 < taps ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[k + 1] + x))) : zero;
+            __m256i coef = _mm256_set1_epi32(weightPair(weights, k, taps));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), coef));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), coef));
+        }
+
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), SCALE_ROW_SHIFT);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), SCALE_ROW_SHIFT);
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_packs_epi32(lo, hi));
+    }
+
+    if (x < end)
+        scaleRowsSse2(rows, weights, taps, x, end, out);
+}
+
+// Eight Q20 sums in order to eight bytes
+TARGET_AVX2 inline void storeColumnsAvx2(__m256i sum, uint8_t* out)
+{
+    sum = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1 << (SCALE_COLUMN_SHIFT - 1))), SCALE_COLUMN_SHIFT);
+    __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(packed, packed));
+}
+
+TARGET_AVX2 inline void scaleColumns1Avx2(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const int16_t* weights = table.weights.data();
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint32_t i = begin;
+    if (taps % 2 == 0)
+    {
+        for (; i + 8 <= end; i += 8)
+        {
+            // Indices in 16 bit units, gathered with a scale of 2
+            __m256i offsets = _mm256_loadu_si256((const __m256i*)(table.offsets.data() + i));
+            __m256i weightIndices = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32((int32_t)i), lanes), _mm256_set1_epi32((int32_t)taps));
+            __m256i sum = _mm256_setzero_si256();
+            for (uint32_t k = 0; k < taps; k += 2)
+            {
+                __m256i tap = _mm256_set1_epi32((int32_t)k);
+                __m256i pixels = _mm256_i32gather_epi32((const int*)row, _mm256_add_epi32(offsets, tap), 2);
+                __m256i coef = _mm256_i32gather_epi32((const int*)weights, _mm256_add_epi32(weightIndices, tap), 2);
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(pixels, coef));
+            }
+            storeColumnsAvx2(sum, out + i);
+        }
+    }
+    scaleColumns1Sse2(row, table, i, end, out);
+}
+
+TARGET_AVX2 inline void scaleColumns2Avx2(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const int16_t* weights = table.weights.data();
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const __m256i duplicate = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+
+    uint32_t i = begin;
+    if (taps % 2 == 0)
+    {
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128i offsets = _mm_slli_epi32(_mm_loadu_si128((const __m128i*)(table.offsets.data() + i)), 1);
+            __m128i weightIndices = _mm_mullo_epi32(_mm_add_epi32(_mm_set1_epi32((int32_t)i), lanes), _mm_set1_epi32((int32_t)taps));
+            __m256i sum = _mm256_setzero_si256();
+            for (uint32_t k = 0; k < taps; k += 2)
+            {
+                __m256i pixels = _mm256_i32gather_epi64((const long long*)row, _mm_add_epi32(offsets, _mm_set1_epi32((int32_t)k * 2)), 2);
+                pixels = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+                __m128i pairs = _mm_i32gather_epi32((const int*)weights, _mm_add_epi32(weightIndices, _mm_set1_epi32((int32_t)k)), 2);
+                __m256i coef = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(pairs), duplicate);
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(pixels, coef));
+            }
+            storeColumnsAvx2(sum, out + (size_t)i * 2);
+        }
+    }
+    scaleColumns2Sse2(row, table, i, end, out);
+}
+
+#endif
+
+#if defined(ARCH_ARM64)
+
+// ----------------------------------------------------------------------------
+// NEON
+//
+// Vertically 16 bytes per iteration, one tap at a time. Horizontally luma
+// takes four output pixels at a time, its taps loaded lane by lane, and BGRA
+// one pixel with all four channels per load; chroma stays scalar.
+// ----------------------------------------------------------------------------
+
+inline void scaleRowsNeon(const uint8_t* const* rows, const int16_t* weights, uint32_t taps, uint32_t begin, uint32_t end, int16_t* out)
+{
+    const int32x4_t round = vdupq_n_s32(1 << (SCALE_ROW_SHIFT - 1));
+
+    uint32_t x = begin;
+    for (; x + 16 <= end; x += 16)
+    {
+        int32x4_t sum[4] = { vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0) };
+        for (uint32_t k = 0; k < taps; k++)
+        {
+            uint8x16_t bytes = vld1q_u8(rows[k] + x);
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(bytes)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(bytes)));
+            sum[0] = vmlal_n_s16(sum[0], vget_low_s16(lo), weights[k]);
+            sum[1] = vmlal_n_s16(sum[1], vget_high_s16(lo), weights[k]);
+            sum[2] = vmlal_n_s16(sum[2], vget_low_s16(hi), weights[k]);
+            sum[3] = vmlal_n_s16(sum[3], vget_high_s16(hi), weights[k]);
+        }
+
+        for (int i = 0; i < 4; i++)
+            sum[i] = vshrq_n_s32(vaddq_s32(sum[i], round), SCALE_ROW_SHIFT);
+        vst1q_s16(out + x, vcombine_s16(vmovn_s32(sum[0]), vmovn_s32(sum[1])));
+        vst1q_s16(out + x + 8, vcombine_s16(vmovn_s32(sum[2]), vmovn_s32(sum[3])));
+    }
+
+    if (x < end)
+        scaleRowsScalar(rows, weights, taps, x, end, out);
+}
+
+// Four Q20 sums to four bytes
+inline void storeColumnsNeon(int32x4_t sum, uint8_t* out)
+{
+    sum = vshrq_n_s32(vaddq_s32(sum, vdupq_n_s32(1 << (SCALE_COLUMN_SHIFT - 1))), SCALE_COLUMN_SHIFT);
+    int16x4_t narrow = vqmovn_s32(sum);
+    uint8x8_t bytes = vqmovun_s16(vcombine_s16(narrow, narrow));
+    vst1_lane_u32((uint32_t*)out, vreinterpret_u32_u8(bytes), 0);
+}
+
+inline void scaleColumns1Neon(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    const uint32_t* offsets = table.offsets.data();
+    const int16_t* weights = table.weights.data();
+
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4)
+    {
+        int32x4_t sum = vdupq_n_s32(0);
+        for (uint32_t k = 0; k < taps; k++)
+        {
+            int16x4_t pixels = vdup_n_s16(0);
+            int16x4_t coef = vdup_n_s16(0);
+            pixels = vld1_lane_s16(row + offsets[i] + k, pixels, 0);
+            pixels = vld1_lane_s16(row + offsets[i + 1] + k, pixels, 1);
+            pixels = vld1_lane_s16(row + offsets[i + 2] + k, pixels, 2);
+            pixels = vld1_lane_s16(row + offsets[i + 3] + k, pixels, 3);
+            coef = vld1_lane_s16(weights + (size_t)i * taps + k, coef, 0);
+            coef = vld1_lane_s16(weights + (size_t)(i + 1) * taps + k, coef, 1);
+            coef = vld1_lane_s16(weights + (size_t)(i + 2) * taps + k, coef, 2);
+            coef = vld1_lane_s16(weights + (size_t)(i + 3) * taps + k, coef, 3);
+            sum = vmlal_s16(sum, pixels, coef);
+        }
+        storeColumnsNeon(sum, out + i);
+    }
+    scaleColumnsScalar<1>(row, table, i, end, out);
+}
+
+inline void scaleColumns4Neon(const int16_t* row, const ScaleTable& table, uint32_t begin, uint32_t end, uint8_t* out)
+{
+    const uint32_t taps = table.taps;
+    for (uint32_t i = begin; i < end; i++)
+    {
+        const int16_t* weights = &table.weights[(size_t)i * taps];
+        const int16_t* pixels = row + (size_t)table.offsets[i] * 4;
+        int32x4_t sum = vdupq_n_s32(0);
+        for (uint32_t k = 0; k < taps; k++)
+            sum = vmlal_n_s16(sum, vld1_s16(pixels + k * 4), weights[k]);
+        storeColumnsNeon(sum, out + (size_t)i * 4);
+    }
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// Scaler
+//
+// Tables come from the cache. A plane that is the same size on both sides
+// is copied row by row. setSlices() splits the output rows into bands that
+// run on a worker pool. The calling thread takes bands as well, so it only
+// ever waits for a band another thread is already running, and never for
+// one still queued behind it. One scaler serves one caller at a time.
+// ----------------------------------------------------------------------------
+
+class FrameScaler
+{
+public:
+    FrameScaler(uint32_t sourceWidth, uint32_t sourceHeight, uint32_t width, uint32_t height,
+                ScaleFilter filter = ScaleFilter::Bilinear, ScaleKernel kernel = ScaleKernel::Auto)
+        : sourceWidth(sourceWidth), sourceHeight(sourceHeight), width(width), height(height), filter(filter)
+    {
+        CHECK(sourceWidth != 0 && sourceHeight != 0 && width != 0 && height != 0);
+        if (kernel == ScaleKernel::Auto)
+            kernel = bestScaleKernel();
+        CHECK(scaleKernelSupported(kernel));
+        this->kernel = kernel;
+
+        scaleRows = scaleRowsScalar;
+        columns1 = scaleColumnsScalar<1>;
+        columns2 = scaleColumnsScalar<2>;
+        columns4 = scaleColumnsScalar<4>;
+        switch (kernel)
+        {
+#if defined(ARCH_X86)
+        case ScaleKernel::Sse2:
+            scaleRows = scaleRowsSse2;
+            columns1 = scaleColumns1Sse2;
+            columns2 = scaleColumns2Sse2;
+            columns4 = scaleColumns4Sse2;
+            break;
+        case ScaleKernel::Avx2:
+            scaleRows = scaleRowsAvx2;
+            columns1 = scaleColumns1Avx2;
+            columns2 = scaleColumns2Avx2;
+            columns4 = scaleColumns4Sse2;
+            break;
+#endif
+#if defined(ARCH_ARM64)
+        case ScaleKernel::Neon:
+            scaleRows = scaleRowsNeon;
+            columns1 = scaleColumns1Neon;
+            columns4 = scaleColumns4Neon;
+            break;
+#endif
+        default:
+            break;
+        }
+
+        full = makePlane(sourceWidth, sourceHeight, width, height);
+        if (sourceWidth % 2 == 0 && sourceHeight % 2 == 0 && width % 2 == 0 && height % 2 == 0)
+            half = makePlane(sourceWidth / 2, sourceHeight / 2, width / 2, height / 2);
+        setSlices(nullptr, 1);
+    }
+
+    // Bands of output rows per plane, run on workers, 1 for none
+    void setSlices(WorkerPool* pool, uint32_t count)
+    {
+        CHECK(count != 0);
+        workers = pool;
+        slices = std::min(count, height);
+        scratch.assign(slices, std::vector<int16_t>((size_t)sourceWidth * 4));
+    }
+
+    // NV12 sizes, so even
+    void scaleNv12(const Nv12Frame& source, const Nv12Frame& destination)
+    {
+        CHECK(half.rows != nullptr);
+        runBands([&](uint32_t band)
+        {
+            scalePlane(full, 1, band, source.y, source.yPitch, destination.y, destination.yPitch);
+            scalePlane(half, 2, band, source.uv, source.uvPitch, destination.uv, destination.uvPitch);
+        });
+    }
+
+    void scaleBgra(const uint8_t* source, size_t sourcePitch, uint8_t* destination, size_t pitch)
+    {
+        runBands([&](uint32_t band) { scalePlane(full, 4, band, source, sourcePitch, destination, pitch); });
+    }
+
+    // The even luma rows [begin, end) of the source that NV12 output rows
+    // [first, last) read, for callers that make the source band by band
+    void nv12SourceRows(uint32_t first, uint32_t last, uint32_t& begin, uint32_t& end) const
+    {
+        CHECK(half.rows != nullptr && first < last && last <= height && first % 2 == 0 && last % 2 == 0);
+        uint32_t lumaBegin, lumaEnd, chromaBegin, chromaEnd;
+        sourceRows(full, first, last, lumaBegin, lumaEnd);
+        sourceRows(half, first / 2, last / 2, chromaBegin, chromaEnd);
+        begin = std::min(lumaBegin, chromaBegin * 2) & ~1u;
+        end = std::min(std::max(lumaEnd, chromaEnd * 2) + 1, sourceHeight) & ~1u;
+    }
+
+    // NV12 output rows [first, last), both even, from a source that starts at
+    // luma row sourceRow and holds the rows nv12SourceRows() names. between
+    // takes sourceWidth * 4 values and belongs to the caller, so any number
+    // of threads can scale bands of one frame at once.
+    void scaleNv12Rows(const Nv12Frame& source, uint32_t sourceRow, const Nv12Frame& destination, uint32_t first, uint32_t last,
+                       int16_t* between) const
+    {
+        CHECK(half.rows != nullptr && first % 2 == 0 && last % 2 == 0 && sourceRow % 2 == 0);
+        scalePlaneRows(full, 1, first, last, source.y, source.yPitch, sourceRow, destination.y, destination.yPitch, between);
+        scalePlaneRows(half, 2, first / 2, last / 2, source.uv, source.uvPitch, sourceRow / 2, destination.uv, destination.uvPitch, between);
+    }
+
+    // The same size on both sides
+    bool copies() const { return full.copy; }
+
+    ScaleKernel activeKernel() const { return kernel; }
+    ScaleFilter activeFilter() const { return filter; }
+    uint32_t sliceCount() const { return slices; }
+
+    // The tables of the full size plane, shared through the cache
+    const ScaleTable& columnTable() const { return *full.columns; }
+    const ScaleTable& rowTable() const { return *full.rows; }
+
+private:
+    struct Plane
+    {
+        std::shared_ptr<const ScaleTable> columns;
+        std::shared_ptr<const ScaleTable> rows;
+        uint32_t sourceWidth = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        bool copy = false;
+    };
+
+    Plane makePlane(uint32_t fromWidth, uint32_t fromHeight, uint32_t toWidth, uint32_t toHeight) const
+    {
+        Plane plane;
+        plane.columns = cachedScaleTable(fromWidth, toWidth, filter);
+        plane.rows = cachedScaleTable(fromHeight, toHeight, filter);
+        plane.sourceWidth = fromWidth;
+        plane.width = toWidth;
+        plane.height = toHeight;
+        plane.copy = fromWidth == toWidth && fromHeight == toHeight;
+        return plane;
+    }
+
+    // Runs every band once, on the pool and on this thread
+    void runBands(const std::function<void(uint32_t)>& band)
+    {
+        if (slices == 1 || !workers)
+        {
+            for (uint32_t i = 0; i < slices; i++)
+                band(i);
+            return;
+        }
+
+        // Helpers that start after the last band only touch this
+        struct Bands
+        {
+            std::atomic<uint32_t> next{0};
+            uint32_t count = 0;
+            uint32_t finished = 0;
+            const std::function<void(uint32_t)>* run = nullptr;
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+        std::shared_ptr<Bands> bands = std::make_shared<Bands>();
+        bands->count = slices;
+        bands->run = &band;
+
+        auto work = [bands]()
+        {
+            uint32_t index;
+            while ((index = bands->next.fetch_add(1)) < bands->count)
+            {
+                (*bands->run)(index);
+                std::lock_guard<std::mutex> lock(bands->mutex);
+                if (++bands->finished == bands->count)
+                    bands->done.notify_all();
+            }
+        };
+        for (uint32_t i = 1; i < slices; i++)
+            workers->post(work);
+        work();
+
+        std::unique_lock<std::mutex> lock(bands->mutex);
+        bands->done.wait(lock, [&]() { return bands->finished == bands->count; });
+    }
+
+    void scalePlane(const Plane& plane, uint32_t channels, uint32_t band, const uint8_t* source, size_t sourcePitch, uint8_t* destination, size_t pitch)
+    {
+        uint32_t first = (uint32_t)((uint64_t)plane.height * band / slices);
+        uint32_t last = (uint32_t)((uint64_t)plane.height * (band + 1) / slices);
+        scalePlaneRows(plane, channels, first, last, source, sourcePitch, 0, destination, pitch, scratch[band].data());
+    }
+
+    // Output rows [first, last) from a source whose first row is sourceRow
+    void scalePlaneRows(const Plane& plane, uint32_t channels, uint32_t first, uint32_t last, const uint8_t* source, size_t sourcePitch,
+                        uint32_t sourceRow, uint8_t* destination, size_t pitch, int16_t* between) const
+    {
+        if (plane.copy)
+        {
+            for (uint32_t row = first; row < last; row++)
+                memcpy(destination + pitch * row, source + sourcePitch * (row - sourceRow), (size_t)plane.width * channels);
+            return;
+        }
+
+        const ScaleTable& rows = *plane.rows;
+        const ScaleTable& columns = *plane.columns;
+        const uint32_t sourceBytes = plane.sourceWidth * channels;
+        ScaleColumnsFn scaleColumns = channels == 1 ? columns1 : channels == 2 ? columns2 : columns4;
+        const uint8_t* taps[MAX_SCALE_TAPS];
+        for (uint32_t row = first; row < last; row++)
+        {
+            for (uint32_t k = 0; k < rows.taps; k++)
+                taps[k] = source + sourcePitch * (rows.offsets[row] + k - sourceRow);
+            scaleRows(taps, &rows.weights[(size_t)row * rows.taps], rows.taps, 0, sourceBytes, between);
+            scaleColumns(between, columns, 0, plane.width, destination + pitch * row);
+        }
+    }
+
+    // Source rows [begin, end) of one plane that output rows [first, last) read
+    static void sourceRows(const Plane& plane, uint32_t first, uint32_t last, uint32_t& begin, uint32_t& end)
+    {
+        if (plane.copy)
+        {
+            begin = first;
+            end = last;
+            return;
+        }
+        const ScaleTable& rows = *plane.rows;
+        begin = UINT32_MAX;
+        end = 0;
+        for (uint32_t row = first; row < last; row++)
+        {
+            begin = std::min(begin, rows.offsets[row]);
+            end = std::max(end, rows.offsets[row] + rows.taps);
+        }
+    }
+
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    uint32_t width;
+    uint32_t height;
+    ScaleFilter filter;
+    ScaleKernel kernel;
+    ScaleRowsFn scaleRows;
+    ScaleColumnsFn columns1;
+    ScaleColumnsFn columns2;
+    ScaleColumnsFn columns4;
+    Plane full;
+    Plane half;
+    WorkerPool* workers = nullptr;
+    uint32_t slices = 1;
+    std::vector<std::vector<int16_t>> scratch;
+};
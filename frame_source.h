@@ -0,0 +1,1352 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Project
+#include "color_convert.h"
+#include "common.h"
+#include "cpu_features.h"
+#include "encoder_config.h"
+#include "frame_preprocessor.h"
+#include "frame_scaler.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Frame sources
+//
+// Where the pictures that go into the encoder come from. A source has one
+// format and size for its whole life and hands out one picture at a time,
+// which stays valid until it is asked for the next. Three of them:
+// - PatternSource draws test pictures: the moving bar the probes look for,
+//   or panning texture with a moving object and a slow fade, so rate control
+//   sees motion like a camera's.
+// - FileFrameSource reads raw frames or Y4M through a memory mapping. Its
+//   pictures point into the mapping, nothing is copied before the upload.
+// - FrameRingSource takes frames another process writes into a ring in
+//   shared memory, FrameRingProducer is that process's end.
+// PictureUploader then copies, converts or scales a picture into an
+// encoder input frame.
+// ----------------------------------------------------------------------------
+
+// Planes back to back: BGRA and RGBA are one plane of 4 bytes a pixel, NV12
+// luma then interleaved chroma at half size, I420 luma, U and V
+enum class PictureFormat { BGRA, RGBA, NV12, I420 };
+
+inline const char* pictureFormatName(PictureFormat format)
+{
+    switch (format)
+    {
+    case PictureFormat::BGRA: return "bgra";
+    case PictureFormat::RGBA: return "rgba";
+    case PictureFormat::NV12: return "nv12";
+    default: return "i420";
+    }
+}
+
+inline bool parsePictureFormat(const std::string& text, PictureFormat& format)
+{
+    if (text == "bgra")
+        format = PictureFormat::BGRA;
+    else if (text == "rgba")
+        format = PictureFormat::RGBA;
+    else if (text == "nv12")
+        format = PictureFormat::NV12;
+    else if (text == "i420" || text == "yuv420p")
+        format = PictureFormat::I420;
+    else
+        return false;
+    return true;
+}
+
+inline bool isYuvFormat(PictureFormat format)
+{
+    return format == PictureFormat::NV12 || format == PictureFormat::I420;
+}
+
+// YUV formats need even sizes
+inline size_t pictureBytes(PictureFormat format, uint32_t width, uint32_t height)
+{
+    size_t pixels = (size_t)width * height;
+    return isYuvFormat(format) ? pixels * 3 / 2 : pixels * 4;
+}
+
+struct SourcePicture
+{
+    PictureFormat format = PictureFormat::BGRA;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    const uint8_t* planes[3] = {};
+    size_t pitches[3] = {};
+};
+
+// The planes of a picture stored back to back from data
+inline SourcePicture pictureAt(PictureFormat format, uint32_t width, uint32_t height, const uint8_t* data)
+{
+    SourcePicture picture;
+    picture.format = format;
+    picture.width = width;
+    picture.height = height;
+    picture.planes[0] = data;
+    const size_t lumaBytes = (size_t)width * height;
+    switch (format)
+    {
+    case PictureFormat::NV12:
+        picture.pitches[0] = width;
+        picture.planes[1] = data + lumaBytes;
+        picture.pitches[1] = width;
+        break;
+    case PictureFormat::I420:
+        picture.pitches[0] = width;
+        picture.planes[1] = data + lumaBytes;
+        picture.pitches[1] = width / 2;
+        picture.planes[2] = data + lumaBytes + lumaBytes / 4;
+        picture.pitches[2] = width / 2;
+        break;
+    default:
+        picture.pitches[0] = (size_t)width * 4;
+        break;
+    }
+    return picture;
+}
+
+// Black in limited range YUV, opaque black in RGB
+inline void fillBlack(PictureFormat format, uint32_t width, uint32_t height, uint8_t* data)
+{
+    const size_t lumaBytes = (size_t)width * height;
+    if (isYuvFormat(format))
+    {
+        memset(data, 16, lumaBytes);
+        memset(data + lumaBytes, 128, lumaBytes / 2);
+        return;
+    }
+    for (size_t i = 0; i < lumaBytes; i++)
+    {
+        data[i * 4 + 0] = 0;
+        data[i * 4 + 1] = 0;
+        data[i * 4 + 2] = 0;
+        data[i * 4 + 3] = 255;
+    }
+}
+
+struct FrameSourceInfo
+{
+    PictureFormat format = PictureFormat::BGRA;
+    uint32_t width = 0;
+    uint32_t height = 0;
+};
+
+// Fresh: a new picture. Same: none yet, the last one again (a live source
+// between frames). End: there will be no more.
+enum class SourceRead { Fresh, Same, End };
+
+class IFrameSource
+{
+public:
+    virtual ~IFrameSource() {}
+
+    virtual FrameSourceInfo info() const = 0;
+
+    // Moves on to the next picture. Called by one thread at a time.
+    virtual SourceRead next() = 0;
+
+    // The current picture, valid until next(). Before the first next() a
+    // source shows a picture of its own, blank for the ones without one.
+    virtual const SourcePicture& picture() const = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Test patterns
+//
+// Bar is the synthetic capture the pipeline always had: flat grey BGRA with
+// a 16 pixel dark bar that moves one pixel right on every new picture, so a
+// repeated picture is the same and a new one is not. The probes in bench.cpp
+// find frame n by its bar at n + 1.
+//
+// Motion is built from a tile of smooth texture with a little grain, made
+// once. The background pans across it, a box of the same texture at another
+// offset moves over it on a Lissajous path, and the brightness of the whole
+// picture drifts slowly. Each row is copies out of the tile plus a
+// saturating add, the one kernel per instruction set. Pans move an even
+// number of pixels a frame, so NV12 chroma moves exactly with its luma.
+// ----------------------------------------------------------------------------
+
+enum class TestPattern { Bar, Motion };
+
+enum class PatternKernel { Auto, Scalar, Sse2, Avx2, Neon };
+
+inline const char* patternKernelName(PatternKernel kernel)
+{
+    switch (kernel)
+    {
+    case PatternKernel::Scalar: return "scalar";
+    case PatternKernel::Sse2: return "sse2";
+    case PatternKernel::Avx2: return "avx2";
+    case PatternKernel::Neon: return "neon";
+    default: return "auto";
+    }
+}
+
+inline bool patternKernelSupported(PatternKernel kernel)
+{
+    switch (kernel)
+    {
+    case PatternKernel::Scalar: return true;
+    case PatternKernel::Sse2: return cpuFeatures().sse2;
+    case PatternKernel::Avx2: return cpuFeatures().avx2;
+    case PatternKernel::Neon: return cpuFeatures().neon;
+    default: return false;
+    }
+}
+
+inline PatternKernel bestPatternKernel()
+{
+    if (patternKernelSupported(PatternKernel::Avx2))
+        return PatternKernel::Avx2;
+    if (patternKernelSupported(PatternKernel::Neon))
+        return PatternKernel::Neon;
+    if (patternKernelSupported(PatternKernel::Sse2))
+        return PatternKernel::Sse2;
+    return PatternKernel::Scalar;
+}
+
+// Tile side in pixels, a power of two
+constexpr uint32_t PATTERN_TILE = 512;
+
+// out[i] = in[i] + delta, saturated. delta is -255..255.
+typedef void (*PatternRowFn)(const uint8_t* in, size_t count, int delta, uint8_t* out);
+
+inline void patternRowScalar(const uint8_t* in, size_t count, int delta, uint8_t* out)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = (uint8_t)std::min(255, std::max(0, in[i] + delta));
+}
+
+#if defined(ARCH_X86)
+
+TARGET_SSE2
+inline void patternRowSse2(const uint8_t* in, size_t count, int delta, uint8_t* out)
+{
+    const __m128i up = _mm_set1_epi8((char)std::max(0, delta));
+    const __m128i down = _mm_set1_epi8((char)std::max(0, -delta));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_subs_epu8(_mm_adds_epu8(v, up), down));
+    }
+    patternRowScalar(in + i, count - i, delta, out + i);
+}
+
+TARGET_AVX2
+inline void patternRowAvx2(const uint8_t* in, size_t count, int delta, uint8_t* out)
+{
+    const __m256i up = _mm256_set1_epi8((char)std::max(0, delta));
+    const __m256i down = _mm256_set1_epi8((char)std::max(0, -delta));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_subs_epu8(_mm256_adds_epu8(v, up), down));
+    }
+    patternRowSse2(in + i, count - i, delta, out + i);
+}
+
+#endif
+
+#if defined(ARCH_ARM64)
+
+inline void patternRowNeon(const uint8_t* in, size_t count, int delta, uint8_t* out)
+{
+    const uint8x16_t up = vdupq_n_u8((uint8_t)std::max(0, delta));
+    const uint8x16_t down = vdupq_n_u8((uint8_t)std::max(0, -delta));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        vst1q_u8(out + i, vqsubq_u8(vqaddq_u8(vld1q_u8(in + i), up), down));
+    patternRowScalar(in + i, count - i, delta, out + i);
+}
+
+#endif
+
+inline PatternRowFn patternRowFunction(PatternKernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(ARCH_X86)
+    case PatternKernel::Sse2: return patternRowSse2;
+    case PatternKernel::Avx2: return patternRowAvx2;
+#endif
+#if defined(ARCH_ARM64)
+    case PatternKernel::Neon: return patternRowNeon;
+#endif
+    default: return patternRowScalar;
+    }
+}
+
+class PatternSource : public IFrameSource
+{
+public:
+    // Bar is BGRA only. Motion is BGRA, RGBA or NV12. frames is how many
+    // pictures there are before End, 0 for no end.
+    PatternSource(TestPattern pattern, PictureFormat format, uint32_t width, uint32_t height,
+                  uint64_t frames = 0, PatternKernel kernel = PatternKernel::Auto)
+        : pattern(pattern), frames(frames)
+    {
+        CHECK(width != 0 && height != 0);
+        CHECK(pattern == TestPattern::Motion || format == PictureFormat::BGRA);
+        CHECK(format != PictureFormat::I420);
+        CHECK(!isYuvFormat(format) || (width % 2 == 0 && height % 2 == 0));
+        if (kernel == PatternKernel::Auto)
+            kernel = bestPatternKernel();
+        CHECK(patternKernelSupported(kernel));
+        this->kernel = kernel;
+        addRow = patternRowFunction(kernel);
+
+        sourceInfo = { format, width, height };
+        storage.resize(pictureBytes(format, width, height));
+        current = pictureAt(format, width, height, storage.data());
+        if (pattern == TestPattern::Bar)
+        {
+            memset(storage.data(), 200, storage.size());
+            return;
+        }
+
+        makeTiles();
+        draw(0);
+    }
+
+    FrameSourceInfo info() const override { return sourceInfo; }
+
+    SourceRead next() override
+    {
+        if (frames != 0 && pictures == frames)
+            return SourceRead::End;
+        pictures++;
+        if (pattern == TestPattern::Bar)
+            moveBar();
+        else
+            draw(pictures);
+        return SourceRead::Fresh;
+    }
+
+    const SourcePicture& picture() const override { return current; }
+
+    PatternKernel activeKernel() const { return kernel; }
+    uint64_t count() const { return pictures; }
+
+private:
+    void moveBar()
+    {
+        const uint32_t width = sourceInfo.width;
+        const size_t pitch = (size_t)width * 4;
+        const uint32_t barWidth = std::min(16u, width);
+        uint32_t span = width - barWidth + 1;
+        size_t previous = (size_t)((pictures - 1) % span) * 4;
+        size_t next = (size_t)(pictures % span) * 4;
+        for (uint32_t row = 0; row < sourceInfo.height; row++)
+        {
+            uint8_t* line = &storage[pitch * row];
+            memset(line + previous, 200, barWidth * 4);
+            memset(line + next, 40, barWidth * 4);
+        }
+    }
+
+    // Sums of sines with whole periods across the tile, so it wraps without
+    // a seam, plus grain. Luma stays in the limited range and chroma near
+    // grey, BGRA tiles are the same texture per channel at other phases.
+    void makeTiles()
+    {
+        std::mt19937 random(20240611);
+        std::uniform_real_distribution<double> phase(0.0, 6.283185307179586);
+        std::uniform_int_distribution<int> grain(-6, 6);
+        auto texture = [&](uint32_t side, uint32_t channels, double center, double amplitude, double low, double high)
+        {
+            std::vector<uint8_t> tile((size_t)side * side * channels);
+            for (uint32_t c = 0; c < channels; c++)
+            {
+                double p0 = phase(random), p1 = phase(random), p2 = phase(random);
+                for (uint32_t y = 0; y < side; y++)
+                {
+                    for (uint32_t x = 0; x < side; x++)
+                    {
+                        double u = 6.283185307179586 * x / side;
+                        double v = 6.283185307179586 * y / side;
+                        double value = 0.55 * std::sin(2 * u + 3 * v + p0) + 0.3 * std::sin(7 * u - 5 * v + p1) * std::cos(3 * u + p2) + 0.15 * std::sin(19 * u + 23 * v + p1);
+                        value = center + amplitude * value + grain(random);
+                        tile[((size_t)y * side + x) * channels + c] = (uint8_t)std::min(high, std::max(low, std::round(value)));
+                    }
+                }
+            }
+            return tile;
+        };
+
+        if (sourceInfo.format == PictureFormat::NV12)
+        {
+            lumaTile = texture(PATTERN_TILE, 1, 120, 80, 16, 235);
+            chromaTile = texture(PATTERN_TILE / 2, 2, 128, 36, 16, 240);
+            return;
+        }
+        lumaTile = texture(PATTERN_TILE, 4, 120, 90, 0, 255);
+        for (size_t i = 3; i < lumaTile.size(); i += 4)
+            lumaTile[i] = 255;
+    }
+
+    // Picture t: background at (4t, 2t) in the tile, the box at its own
+    // offset and path, brightness drifting by up to 12 either way
+    void draw(uint64_t t)
+    {
+        const uint32_t width = sourceInfo.width;
+        const uint32_t height = sourceInfo.height;
+        const uint32_t boxWidth = std::max<uint32_t>(2, width / 4) & ~1u;
+        const uint32_t boxHeight = std::max<uint32_t>(2, height / 4) & ~1u;
+        const double s = (double)t;
+        uint32_t boxX = (uint32_t)std::lround((width - boxWidth) * 0.5 * (1 + std::sin(s * 0.031))) & ~1u;
+        uint32_t boxY = (uint32_t)std::lround((height - boxHeight) * 0.5 * (1 + std::sin(s * 0.047 + 1.0))) & ~1u;
+        const int delta = (int)std::lround(12 * std::sin(s * 0.02));
+
+        Layer background = { (uint32_t)(4 * t), (uint32_t)(2 * t), delta };
+        Layer box = { (uint32_t)(PATTERN_TILE / 2 - 6 * t), (uint32_t)(PATTERN_TILE / 3 + 2 * t), delta + 24 };
+        Rect area = { boxX, boxY, std::min(boxWidth, width - boxX), std::min(boxHeight, height - boxY) };
+
+        if (sourceInfo.format == PictureFormat::NV12)
+        {
+            uint8_t* y = storage.data();
+            uint8_t* uv = y + (size_t)width * height;
+            drawPlane(lumaTile, PATTERN_TILE, 1, width, height, y, width, background, box, area);
+
+            // Chroma at half size and half the offsets, without the fade
+            Layer chromaBackground = { background.x / 2, background.y / 2, 0 };
+            Layer chromaBox = { box.x / 2, box.y / 2, 0 };
+            Rect chromaArea = { area.x / 2, area.y / 2, area.width / 2, area.height / 2 };
+            drawPlane(chromaTile, PATTERN_TILE / 2, 2, width / 2, height / 2, uv, width, chromaBackground, chromaBox, chromaArea);
+            return;
+        }
+        drawPlane(lumaTile, PATTERN_TILE, 4, width, height, storage.data(), (size_t)width * 4, background, box, area);
+    }
+
+    struct Layer
+    {
+        uint32_t x;     // tile offset of the plane's top left pixel
+        uint32_t y;
+        int delta;
+    };
+
+    struct Rect
+    {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    void drawPlane(const std::vector<uint8_t>& tile, uint32_t side, uint32_t channels, uint32_t width, uint32_t height,
+                   uint8_t* plane, size_t pitch, const Layer& background, const Layer& box, const Rect& area)
+    {
+        for (uint32_t row = 0; row < height; row++)
+        {
+            uint8_t* line = plane + pitch * row;
+            drawSpan(tile, side, channels, background, row, 0, width, line);
+            if (row >= area.y && row < area.y + area.height)
+                drawSpan(tile, side, channels, box, row - area.y, area.x, area.width, line);
+        }
+    }
+
+    // Pixels [x, x + count) of a row, from the tile with wrap around
+    void drawSpan(const std::vector<uint8_t>& tile, uint32_t side, uint32_t channels, const Layer& layer, uint32_t row,
+                  uint32_t x, uint32_t count, uint8_t* line) const
+    {
+        const uint8_t* tileRow = &tile[(size_t)((row + layer.y) & (side - 1)) * side * channels];
+        uint32_t column = (layer.x + x) & (side - 1);
+        uint8_t* out = line + (size_t)x * channels;
+        while (count > 0)
+        {
+            uint32_t run = std::min(count, side - column);
+            addRow(tileRow + (size_t)column * channels, (size_t)run * channels, layer.delta, out);
+            out += (size_t)run * channels;
+            count -= run;
+            column = 0;
+        }
+    }
+
+    TestPattern pattern;
+    uint64_t frames;
+    PatternKernel kernel;
+    PatternRowFn addRow;
+    FrameSourceInfo sourceInfo;
+    std::vector<uint8_t> storage;
+    std::vector<uint8_t> lumaTile;
+    std::vector<uint8_t> chromaTile;
+    SourcePicture current;
+    uint64_t pictures = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Memory mapped files
+//
+// Read only and mapped whole; the kernel pages frames in as they are read.
+// Sequential access is announced up front, a few frames ahead of the reader
+// are asked for (MADV_WILLNEED starts their reads without waiting on them)
+// and frames behind it are let go, so a long file does not pile up in the
+// process's resident set. Windows takes FILE_FLAG_SEQUENTIAL_SCAN instead.
+// ----------------------------------------------------------------------------
+
+class MappedFile
+{
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const std::string& path, std::string& error)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            error = "cannot open " + path;
+            return false;
+        }
+        LARGE_INTEGER fileSize = {};
+        GetFileSizeEx(file, &fileSize);
+        length = (size_t)fileSize.QuadPart;
+        if (length != 0)
+        {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+                base = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "cannot open " + path;
+            return false;
+        }
+        struct stat status = {};
+        fstat(fd, &status);
+        length = (size_t)status.st_size;
+        if (length != 0)
+        {
+            void* view = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (view != MAP_FAILED)
+            {
+                base = (const uint8_t*)view;
+                madvise(view, length, MADV_SEQUENTIAL);
+            }
+        }
+#endif
+        if (!base)
+        {
+            error = length == 0 ? path + " is empty" : "cannot map " + path;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (base)
+            UnmapViewOfFile(base);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base)
+            munmap((void*)base, length);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    const uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+
+    // Starts reading a range in, without waiting for it
+    void willNeed(size_t offset, size_t bytes)
+    {
+#ifndef _WIN32
+        advise(offset, bytes, MADV_WILLNEED);
+#else
+        (void)offset;
+        (void)bytes;
+#endif
+    }
+
+    // Drops a range from this process; the page cache keeps it
+    void done(size_t offset, size_t bytes)
+    {
+#ifndef _WIN32
+        advise(offset, bytes, MADV_DONTNEED);
+#else
+        (void)offset;
+        (void)bytes;
+#endif
+    }
+
+    uint64_t adviseCalls() const { return advised; }
+
+private:
+#ifndef _WIN32
+    // Whole pages inside the range only, a page shared with a frame that is
+    // still in use is never dropped
+    void advise(size_t offset, size_t bytes, int advice)
+    {
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t end = std::min(length, offset + bytes);
+        size_t first = advice == MADV_DONTNEED ? (offset + page - 1) / page * page : offset / page * page;
+        size_t last = advice == MADV_DONTNEED ? end / page * page : std::min(length, (end + page - 1) / page * page);
+        if (first >= last)
+            return;
+        madvise((void*)(base + first), last - first, advice);
+        advised++;
+    }
+
+    int fd = -1;
+#else
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+    uint64_t advised = 0;
+};
+
+// ----------------------------------------------------------------------------
+// File source
+//
+// Raw files are frames of one format and size back to back; a trailing part
+// frame is ignored. Y4M has its size and chroma format in the header (only
+// 4:2:0 is taken) and a FRAME line before every frame, found as the reader
+// gets there. Pictures point straight into the mapping. Looping starts over
+// at the first frame instead of returning End.
+// ----------------------------------------------------------------------------
+
+struct FileSourceOptions
+{
+    PictureFormat format = PictureFormat::I420;     // raw files only
+    uint32_t width = 0;                             // raw files only
+    uint32_t height = 0;
+    bool loop = false;
+    uint32_t readaheadFrames = 4;
+};
+
+struct FileSourceStats
+{
+    uint64_t frames = 0;        // pictures handed out
+    uint64_t loops = 0;
+    uint64_t adviseCalls = 0;
+};
+
+// By extension, or by the Y4M signature
+inline bool isY4mFile(const std::string& path, const uint8_t* data, size_t size)
+{
+    static const char signature[] = "YUV4MPEG2 ";
+    if (size >= sizeof(signature) - 1 && memcmp(data, signature, sizeof(signature) - 1) == 0)
+        return true;
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+}
+
+class FileFrameSource : public IFrameSource
+{
+public:
+    bool open(const std::string& path, const FileSourceOptions& fileOptions, std::string& error)
+    {
+        options = fileOptions;
+        if (!file.open(path, error))
+            return false;
+
+        y4m = isY4mFile(path, file.data(), file.size());
+        if (y4m)
+        {
+            if (!parseY4mHeader(error))
+                return false;
+        }
+        else
+        {
+            sourceInfo = { options.format, options.width, options.height };
+            firstFrame = 0;
+            if (sourceInfo.width == 0 || sourceInfo.height == 0)
+            {
+                error = "raw input needs a size";
+                return false;
+            }
+        }
+
+        if (isYuvFormat(sourceInfo.format) && (sourceInfo.width % 2 != 0 || sourceInfo.height % 2 != 0))
+        {
+            error = "YUV input needs an even size";
+            return false;
+        }
+        frameBytes = pictureBytes(sourceInfo.format, sourceInfo.width, sourceInfo.height);
+        if (!y4m && file.size() < firstFrame + frameBytes)
+        {
+            error = path + " is shorter than one frame";
+            return false;
+        }
+
+        blank.resize(frameBytes);
+        fillBlack(sourceInfo.format, sourceInfo.width, sourceInfo.height, blank.data());
+        current = pictureAt(sourceInfo.format, sourceInfo.width, sourceInfo.height, blank.data());
+        position = releasedTo = aheadTo = firstFrame;
+        return true;
+    }
+
+    FrameSourceInfo info() const override { return sourceInfo; }
+
+    SourceRead next() override
+    {
+        size_t data = 0;
+        if (!frameAt(position, data))
+        {
+            if (!options.loop || stats.frames == 0)
+                return SourceRead::End;
+            stats.loops++;
+            position = firstFrame;
+            if (!frameAt(position, data))
+                return SourceRead::End;
+        }
+
+        // The last picture is done with once next() is called. Frames ahead
+        // are asked for as the window moves, each range once.
+        if (data < releasedTo)
+            releasedTo = aheadTo = firstFrame;
+        file.done(releasedTo, data - releasedTo);
+        releasedTo = data;
+        size_t windowEnd = data + (data + frameBytes - position) * (options.readaheadFrames + 1);
+        if (windowEnd > aheadTo)
+        {
+            file.willNeed(std::max(aheadTo, data), windowEnd - std::max(aheadTo, data));
+            aheadTo = windowEnd;
+        }
+
+        current = pictureAt(sourceInfo.format, sourceInfo.width, sourceInfo.height, file.data() + data);
+        position = data + frameBytes;
+        stats.frames++;
+        return SourceRead::Fresh;
+    }
+
+    const SourcePicture& picture() const override { return current; }
+
+    FileSourceStats getStats() const
+    {
+        FileSourceStats result = stats;
+        result.adviseCalls = file.adviseCalls();
+        return result;
+    }
+
+    bool isY4m() const { return y4m; }
+
+    // Y4M frame rate, 0/0 when the header has none and for raw files
+    Rational frameRate() const { return rate; }
+
+    // The mapped file, to check that pictures point into it
+    const uint8_t* mappedData() const { return file.data(); }
+    size_t mappedSize() const { return file.size(); }
+
+private:
+    // The frame that starts at offset, its data after the FRAME line for Y4M
+    bool frameAt(size_t offset, size_t& data) const
+    {
+        if (!y4m)
+        {
+            data = offset;
+            return offset + frameBytes <= file.size();
+        }
+        const size_t size = file.size();
+        if (offset + 6 > size || memcmp(file.data() + offset, "FRAME", 5) != 0)
+            return false;
+        const uint8_t* end = (const uint8_t*)memchr(file.data() + offset, '\n', std::min<size_t>(size - offset, 256));
+        if (!end)
+            return false;
+        data = (size_t)(end - file.data()) + 1;
+        return data + frameBytes <= size;
+    }
+
+    // YUV4MPEG2 W<width> H<height> F<num>:<den> C<chroma> ..., one line
+    bool parseY4mHeader(std::string& error)
+    {
+        const char* text = (const char*)file.data();
+        const uint8_t* newline = (const uint8_t*)memchr(text, '\n', std::min<size_t>(file.size(), 1024));
+        if (!newline || file.size() < 10 || memcmp(text, "YUV4MPEG2 ", 10) != 0)
+        {
+            error = "not a Y4M file";
+            return false;
+        }
+        std::string header(text, (const char*)newline);
+        firstFrame = (size_t)(newline - file.data()) + 1;
+        sourceInfo = { PictureFormat::I420, 0, 0 };
+
+        size_t at = 10;
+        while (at < header.size())
+        {
+            size_t end = header.find(' ', at);
+            if (end == std::string::npos)
+                end = header.size();
+            std::string field = header.substr(at, end - at);
+            at = end + 1;
+            if (field.empty())
+                continue;
+            std::string value = field.substr(1);
+            switch (field[0])
+            {
+            case 'W': sourceInfo.width = (uint32_t)strtoul(value.c_str(), nullptr, 10); break;
+            case 'H': sourceInfo.height = (uint32_t)strtoul(value.c_str(), nullptr, 10); break;
+            case 'F':
+            {
+                size_t colon = value.find(':');
+                if (colon != std::string::npos)
+                    rate = { (uint32_t)strtoul(value.c_str(), nullptr, 10), (uint32_t)strtoul(value.c_str() + colon + 1, nullptr, 10) };
+                break;
+            }
+            case 'C':
+                if (value.compare(0, 3, "420") != 0)
+                {
+                    error = "Y4M chroma " + value + " is not 4:2:0";
+                    return false;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        if (sourceInfo.width == 0 || sourceInfo.height == 0)
+        {
+            error = "Y4M header has no size";
+            return false;
+        }
+        return true;
+    }
+
+    FileSourceOptions options;
+    MappedFile file;
+    FrameSourceInfo sourceInfo;
+    Rational rate = { 0, 0 };
+    bool y4m = false;
+    size_t firstFrame = 0;
+    size_t frameBytes = 0;
+    size_t position = 0;
+    size_t releasedTo = 0;
+    size_t aheadTo = 0;
+    std::vector<uint8_t> blank;
+    SourcePicture current;
+    FileSourceStats stats;
+};
+
+// ----------------------------------------------------------------------------
+// Shared memory
+//
+// A named, read-write mapping two processes can open. The side that creates
+// it sizes it and removes the name when it closes; the other side's mapping
+// stays valid until it closes too.
+// ----------------------------------------------------------------------------
+
+class SharedMemory
+{
+public:
+    SharedMemory() {}
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    ~SharedMemory()
+    {
+        close();
+    }
+
+    // Replaces an object of the same name that a crashed producer left
+    bool create(const std::string& name, size_t size, std::string& error)
+    {
+        close();
+#ifdef _WIN32
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, objectName(name).c_str());
+        if (mapping)
+            base = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+        std::string path = objectName(name);
+        shm_unlink(path.c_str());
+        int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0)
+        {
+            owned = path;
+            if (ftruncate(fd, (off_t)size) == 0)
+            {
+                void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (view != MAP_FAILED)
+                    base = (uint8_t*)view;
+            }
+            ::close(fd);
+        }
+#endif
+        if (!base)
+        {
+            error = "cannot create shared memory " + name;
+            close();
+            return false;
+        }
+        length = size;
+        return true;
+    }
+
+    bool open(const std::string& name, std::string& error)
+    {
+        close();
+#ifdef _WIN32
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, objectName(name).c_str());
+        if (mapping)
+            base = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        MEMORY_BASIC_INFORMATION region = {};
+        if (base && VirtualQuery(base, &region, sizeof(region)))
+            length = region.RegionSize;
+#else
+        int fd = shm_open(objectName(name).c_str(), O_RDWR, 0);
+        if (fd >= 0)
+        {
+            struct stat status = {};
+            fstat(fd, &status);
+            length = (size_t)status.st_size;
+            void* view = length ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (view != MAP_FAILED)
+                base = (uint8_t*)view;
+            ::close(fd);
+        }
+#endif
+        if (!base)
+        {
+            error = "cannot open shared memory " + name;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (base)
+            UnmapViewOfFile(base);
+        if (mapping)
+            CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        if (base)
+            munmap(base, length);
+        if (!owned.empty())
+            shm_unlink(owned.c_str());
+        owned.clear();
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    static std::string objectName(const std::string& name)
+    {
+#ifdef _WIN32
+        return "Local\\" + name;
+#else
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#else
+    std::string owned;
+#endif
+    uint8_t* base = nullptr;
+    size_t length = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Frame ring
+//
+// A header page, then slots of one picture each. The producer writes a
+// picture into a free slot and publishes it with one store of (sequence,
+// slot). The consumer takes the newest picture: it stores the slot it is
+// about to read and then checks that picture is still the newest; the
+// producer reads that slot back after each publish and writes into neither
+// it nor the newest one. Both sides use sequentially consistent atomics, so
+// either the producer sees the reader's slot or the reader sees a newer
+// picture and tries again, and a slot being read is never written. With
+// three or more slots the producer never waits. Pictures the consumer was
+// too slow for are skipped, not queued: a live source wants the newest.
+// ----------------------------------------------------------------------------
+
+constexpr uint32_t FRAME_RING_MAGIC = 0x474E5246;  // "FRNG"
+constexpr uint32_t FRAME_RING_VERSION = 1;
+constexpr uint32_t FRAME_RING_NO_SLOT = 0xFFFFFFFF;
+constexpr size_t FRAME_RING_HEADER_BYTES = 4096;
+constexpr uint32_t FRAME_RING_MAX_SLOTS = 255;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock free atomics across processes");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "the ring needs lock free atomics across processes");
+
+struct FrameRingHeader
+{
+    std::atomic<uint32_t> magic;        // stored last, after the rest of the header
+    uint32_t version;
+    uint32_t format;                    // PictureFormat
+    uint32_t width;
+    uint32_t height;
+    uint32_t slots;
+    uint64_t slotBytes;                 // a picture rounded up to 64 bytes
+    alignas(64) std::atomic<uint64_t> published;    // sequence << 8 | slot of the newest picture, plus one; 0 for none
+    std::atomic<uint32_t> closed;                   // no more pictures after the newest
+    alignas(64) std::atomic<uint32_t> reading;      // the consumer's slot, FRAME_RING_NO_SLOT for none
+};
+
+static_assert(sizeof(FrameRingHeader) <= FRAME_RING_HEADER_BYTES, "ring header outgrew its page");
+
+inline size_t frameRingSlotBytes(PictureFormat format, uint32_t width, uint32_t height)
+{
+    return (pictureBytes(format, width, height) + 63) / 64 * 64;
+}
+
+struct FrameRingStats
+{
+    uint64_t frames = 0;        // pictures published or taken
+    uint64_t skipped = 0;       // consumer: published and never taken
+    uint64_t retries = 0;       // consumer: the newest changed while taking it
+};
+
+class FrameRingProducer
+{
+public:
+    ~FrameRingProducer()
+    {
+        close();
+    }
+
+    bool create(const std::string& name, PictureFormat format, uint32_t width, uint32_t height, uint32_t slots, std::string& error)
+    {
+        if (slots < 3 || slots > FRAME_RING_MAX_SLOTS || width == 0 || height == 0 ||
+            (isYuvFormat(format) && (width % 2 != 0 || height % 2 != 0)))
+        {
+            error = "bad frame ring layout";
+            return false;
+        }
+        const size_t slotBytes = frameRingSlotBytes(format, width, height);
+        if (!memory.create(name, FRAME_RING_HEADER_BYTES + slotBytes * slots, error))
+            return false;
+
+        header = new (memory.data()) FrameRingHeader();
+        header->version = FRAME_RING_VERSION;
+        header->format = (uint32_t)format;
+        header->width = width;
+        header->height = height;
+        header->slots = slots;
+        header->slotBytes = slotBytes;
+        header->published.store(0);
+        header->closed.store(0);
+        header->reading.store(FRAME_RING_NO_SLOT);
+        header->magic.store(FRAME_RING_MAGIC);
+        return true;
+    }
+
+    // A slot for the next picture, neither the one being read nor the newest
+    SourcePicture beginFrame()
+    {
+        CHECK(header != nullptr);
+        uint64_t newest = header->published.load();
+        uint32_t newestSlot = newest ? (uint32_t)((newest - 1) & 0xFF) : FRAME_RING_NO_SLOT;
+        uint32_t reading = header->reading.load();
+        for (uint32_t i = 1; i <= header->slots; i++)
+        {
+            uint32_t slot = (writeSlot + i) % header->slots;
+            if (slot != newestSlot && slot != reading)
+            {
+                writeSlot = slot;
+                break;
+            }
+        }
+        return pictureAt((PictureFormat)header->format, header->width, header->height, slotData(writeSlot));
+    }
+
+    uint8_t* frameData() const { return slotData(writeSlot); }
+
+    // Hands the picture from beginFrame() over
+    void publish()
+    {
+        header->published.store(((sequence++ << 8) | writeSlot) + 1);
+        stats.frames++;
+    }
+
+    // Consumers see End after the last picture. Keeps the mapping until the
+    // producer is destroyed, or until create() for another ring.
+    void close()
+    {
+        if (header)
+            header->closed.store(1);
+    }
+
+    FrameRingStats getStats() const { return stats; }
+
+private:
+    uint8_t* slotData(uint32_t slot) const
+    {
+        return memory.data() + FRAME_RING_HEADER_BYTES + (size_t)header->slotBytes * slot;
+    }
+
+    SharedMemory memory;
+    FrameRingHeader* header = nullptr;
+    uint32_t writeSlot = 0;
+    uint64_t sequence = 0;
+    FrameRingStats stats;
+};
+
+class FrameRingSource : public IFrameSource
+{
+public:
+    ~FrameRingSource()
+    {
+        if (header)
+            header->reading.store(FRAME_RING_NO_SLOT);
+    }
+
+    bool open(const std::string& name, std::string& error)
+    {
+        if (!memory.open(name, error))
+            return false;
+        header = (FrameRingHeader*)memory.data();
+        bool valid = memory.size() >= FRAME_RING_HEADER_BYTES && header->magic.load() == FRAME_RING_MAGIC &&
+                header->version == FRAME_RING_VERSION && header->format <= (uint32_t)PictureFormat::I420 &&
+                header->slots >= 3 && header->slots <= FRAME_RING_MAX_SLOTS &&
+                header->slotBytes >= pictureBytes((PictureFormat)header->format, header->width, header->height) &&
+                memory.size() >= FRAME_RING_HEADER_BYTES + header->slotBytes * header->slots;
+        if (!valid)
+        {
+            error = name + " is not a frame ring";
+            header = nullptr;
+            memory.close();
+            return false;
+        }
+
+        sourceInfo = { (PictureFormat)header->format, header->width, header->height };
+        blank.resize(pictureBytes(sourceInfo.format, sourceInfo.width, sourceInfo.height));
+        fillBlack(sourceInfo.format, sourceInfo.width, sourceInfo.height, blank.data());
+        current = pictureAt(sourceInfo.format, sourceInfo.width, sourceInfo.height, blank.data());
+        return true;
+    }
+
+    FrameSourceInfo info() const override { return sourceInfo; }
+
+    SourceRead next() override
+    {
+        CHECK(header != nullptr);
+        for (;;)
+        {
+            // closed is read first: a picture published before it is still taken
+            bool closed = header->closed.load() != 0;
+            uint64_t newest = header->published.load();
+            if (newest == 0 || newest - 1 == taken)
+                return closed ? SourceRead::End : SourceRead::Same;
+
+            uint32_t slot = (uint32_t)((newest - 1) & 0xFF);
+            header->reading.store(slot);
+            if (header->published.load() != newest)
+            {
+                stats.retries++;
+                continue;
+            }
+
+            uint64_t sequence = (newest - 1) >> 8;
+            if (taken != NONE)
+                stats.skipped += sequence - (taken >> 8) - 1;
+            else
+                stats.skipped += sequence;
+            taken = newest - 1;
+            stats.frames++;
+            current = pictureAt(sourceInfo.format, sourceInfo.width, sourceInfo.height,
+                                memory.data() + FRAME_RING_HEADER_BYTES + (size_t)header->slotBytes * slot);
+            return SourceRead::Fresh;
+        }
+    }
+
+    const SourcePicture& picture() const override { return current; }
+
+    FrameRingStats getStats() const { return stats; }
+
+private:
+    static constexpr uint64_t NONE = ~0ull;
+
+    SharedMemory memory;
+    FrameRingHeader* header = nullptr;
+    FrameSourceInfo sourceInfo;
+    uint64_t taken = NONE;
+    std::vector<uint8_t> blank;
+    SourcePicture current;
+    FrameRingStats stats;
+};
+
+// ----------------------------------------------------------------------------
+// Upload
+//
+// From a source picture into an encoder input frame. NV12 input takes every
+// format: NV12 is copied, I420 has its chroma interleaved, BGRA and RGBA are
+// converted. A picture of another size is converted at its own size into a
+// staging frame and scaled from there; NV12 pictures scale straight from the
+// source. BGRA input takes BGRA pictures only, copied or scaled. With tiles
+// BGRA and RGBA pictures are converted and scaled in one pass instead.
+// ----------------------------------------------------------------------------
+
+inline void interleaveChroma(const uint8_t* u, size_t uPitch, const uint8_t* v, size_t vPitch, uint32_t width, uint32_t height, uint8_t* uv, size_t uvPitch)
+{
+    for (uint32_t row = 0; row < height; row++)
+    {
+        const uint8_t* uRow = u + uPitch * row;
+        const uint8_t* vRow = v + vPitch * row;
+        uint8_t* out = uv + uvPitch * row;
+        for (uint32_t x = 0; x < width; x++)
+        {
+            out[2 * x] = uRow[x];
+            out[2 * x + 1] = vRow[x];
+        }
+    }
+}
+
+class PictureUploader
+{
+public:
+    PictureUploader(const FrameSourceInfo& source, FrameFormat target, uint32_t width, uint32_t height,
+                    ScaleFilter filter = ScaleFilter::Bicubic, WorkerPool* workers = nullptr)
+        : source(source), target(target), width(width), height(height), filter(filter),
+          converter(ColorMatrix::BT709, ColorRange::Limited, source.format == PictureFormat::RGBA ? PixelOrder::RGBA : PixelOrder::BGRA)
+    {
+        CHECK(target == FrameFormat::NV12 || source.format == PictureFormat::BGRA);
+        CHECK(target != FrameFormat::NV12 || (width % 2 == 0 && height % 2 == 0));
+        if (source.width == width && source.height == height)
+            return;
+
+        CHECK(target != FrameFormat::NV12 || (source.width % 2 == 0 && source.height % 2 == 0));
+        scaler.reset(new FrameScaler(source.width, source.height, width, height, filter));
+        if (workers)
+            scaler->setSlices(workers, workers->threadCount());
+        if (target == FrameFormat::NV12 && source.format != PictureFormat::NV12)
+        {
+            staging.resize(pictureBytes(PictureFormat::NV12, source.width, source.height));
+            stagingFrame = { staging.data(), source.width, staging.data() + (size_t)source.width * source.height, source.width };
+        }
+    }
+
+    // NV12 frames keep the interleaved chroma plane right below the luma plane
+    void upload(const SourcePicture& picture, uint8_t* data, size_t pitch)
+    {
+        CHECK(picture.format == source.format && picture.width == source.width && picture.height == source.height);
+        if (target == FrameFormat::BGRA)
+        {
+            if (scaler)
+                scaler->scaleBgra(picture.planes[0], picture.pitches[0], data, pitch);
+            else
+                copyPlane(picture.planes[0], picture.pitches[0], (size_t)width * 4, height, data, pitch);
+            return;
+        }
+
+        Nv12Frame frame = { data, pitch, data + pitch * height, pitch };
+        if (preprocessor)
+        {
+            preprocessor->process(picture.planes[0], picture.pitches[0], frame);
+            return;
+        }
+        if (picture.format == PictureFormat::NV12)
+        {
+            if (scaler)
+            {
+                // The scaler only reads its source
+                Nv12Frame from = { (uint8_t*)picture.planes[0], picture.pitches[0], (uint8_t*)picture.planes[1], picture.pitches[1] };
+                scaler->scaleNv12(from, frame);
+                return;
+            }
+            copyPlane(picture.planes[0], picture.pitches[0], width, height, frame.y, frame.yPitch);
+            copyPlane(picture.planes[1], picture.pitches[1], width, height / 2, frame.uv, frame.uvPitch);
+            return;
+        }
+
+        const Nv12Frame& converted = scaler ? stagingFrame : frame;
+        if (picture.format == PictureFormat::I420)
+        {
+            copyPlane(picture.planes[0], picture.pitches[0], picture.width, picture.height, converted.y, converted.yPitch);
+            interleaveChroma(picture.planes[1], picture.pitches[1], picture.planes[2], picture.pitches[2],
+                             picture.width / 2, picture.height / 2, converted.uv, converted.uvPitch);
+        }
+        else
+        {
+            converter.convert(picture.planes[0], picture.pitches[0], picture.width, picture.height, converted);
+        }
+        if (scaler)
+            scaler->scaleNv12(stagingFrame, frame);
+    }
+
+    bool scales() const { return scaler != nullptr || (preprocessor && preprocessor->scales()); }
+
+    // BGRA and RGBA pictures into NV12 frames go through one pass of cache
+    // sized tiles on the scheduler instead, see frame_preprocessor.h; with
+    // analyze set that pass leaves the lookahead's block means in blocks().
+    // false for other formats, which keep their path.
+    bool useTiles(TileScheduler& scheduler, bool analyze)
+    {
+        if (target != FrameFormat::NV12 || (source.format != PictureFormat::BGRA && source.format != PictureFormat::RGBA) ||
+            source.width % 2 != 0 || source.height % 2 != 0)
+            return false;
+        preprocessor.reset(new FramePreprocessor(scheduler, converter, source.width, source.height, width, height, filter, analyze));
+        return true;
+    }
+
+    // The last uploaded frame's block means, or nullptr, see useTiles()
+    const uint8_t* blocks() const { return preprocessor ? preprocessor->blocks() : nullptr; }
+
+    FramePreprocessorStats tileStats() const { return preprocessor ? preprocessor->stats() : FramePreprocessorStats(); }
+
+private:
+    static void copyPlane(const uint8_t* from, size_t fromPitch, size_t rowBytes, uint32_t rows, uint8_t* to, size_t toPitch)
+    {
+        for (uint32_t row = 0; row < rows; row++)
+            memcpy(to + toPitch * row, from + fromPitch * row, rowBytes);
+    }
+
+    FrameSourceInfo source;
+    FrameFormat target;
+    uint32_t width;
+    uint32_t height;
+    ScaleFilter filter;
+    ColorConverter converter;
+    std::unique_ptr<FrameScaler> scaler;
+    std::unique_ptr<FramePreprocessor> preprocessor;
+    std::vector<uint8_t> staging;
+    Nv12Frame stagingFrame = {};
+};
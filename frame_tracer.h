@@ -0,0 +1,346 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Project
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// Per-frame latency tracing
+//
+// Every frame is stamped at four points: when its texture is filled, when it
+// goes into the encoder (ProcessInput), when the access unit comes out
+// (METransformHaveOutput) and when it is completely in the file. Stamps are
+// matched by sample time, which is all the output side knows about a frame,
+// so reordering encoders trace correctly too.
+//
+// Completed frames go into latency histograms and, optionally, into a Chrome
+// trace (chrome://tracing or ui.perfetto.dev) with one lane per stage. A
+// frame the encoder drops is never written; once frames filled more than
+// `reorder` after it are, its slot is freed and it counts as abandoned.
+// ----------------------------------------------------------------------------
+
+enum class TraceStage : uint32_t { Fill, Submit, Output, Written };
+
+constexpr uint32_t TRACE_STAGES = 4;
+
+inline uint32_t highestSetBit(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#else
+    return 63 - (uint32_t)__builtin_clzll(value);
+#endif
+}
+
+// Log-linear buckets with 16 steps per power of two, about 6% resolution
+// from 1 us to over an hour
+class LatencyHistogram
+{
+public:
+    void record(uint64_t us)
+    {
+        buckets[bucketOf(us)]++;
+        samples++;
+        totalUs += us;
+        maxUs = std::max(maxUs, us);
+    }
+
+    // Middle of the bucket the p-quantile falls into, p in [0, 1]
+    double percentile(double p) const
+    {
+        if (samples == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(p * (samples - 1)) + 1;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKETS; i++)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min((bucketLow(i) + bucketLow(i + 1)) / 2.0, (double)maxUs);
+        }
+        return (double)maxUs;
+    }
+
+    // Adds another histogram's samples, e.g. from another session
+    void merge(const LatencyHistogram& other)
+    {
+        for (uint32_t i = 0; i < BUCKETS; i++)
+            buckets[i] += other.buckets[i];
+        samples += other.samples;
+        totalUs += other.totalUs;
+        maxUs = std::max(maxUs, other.maxUs);
+    }
+
+    uint64_t count() const { return samples; }
+    double meanUs() const { return samples ? (double)totalUs / samples : 0; }
+    uint64_t max() const { return maxUs; }
+
+private:
+    static constexpr uint32_t SUB = 16;
+    static constexpr uint32_t BUCKETS = 29 * SUB;
+
+    static uint32_t bucketOf(uint64_t us)
+    {
+        if (us < SUB)
+            return (uint32_t)us;
+        uint32_t exponent = highestSetBit(us);
+        uint32_t index = (exponent - 3) * SUB + (uint32_t)(us >> (exponent - 4)) - SUB;
+        return std::min(index, BUCKETS - 1);
+    }
+
+    static double bucketLow(uint32_t index)
+    {
+        if (index < SUB)
+            return index;
+        uint32_t exponent = index / SUB + 3;
+        return (double)((uint64_t)(SUB + index % SUB) << (exponent - 4));
+    }
+
+    uint64_t buckets[BUCKETS] = {};
+    uint64_t samples = 0;
+    uint64_t totalUs = 0;
+    uint64_t maxUs = 0;
+};
+
+struct FrameTracerOptions
+{
+    uint32_t slots = 1024;              // frames between fill and file at most, power of two
+    uint32_t reorder = 16;              // frames a later one can be written ahead of an earlier one
+    size_t chromeTraceFrames = 0;       // frames kept for writeChromeTrace, 0 = none
+};
+
+struct FrameTracerStats
+{
+    uint64_t frames = 0;                // traced from fill to file
+    uint64_t lost = 0;                  // stamps without a frame to go with, or no slot left
+    uint64_t abandoned = 0;             // filled and never written, dropped by the encoder
+    LatencyHistogram captureToBitstream;// fill to encoder output
+    LatencyHistogram endToEnd;          // fill to file
+    LatencyHistogram fill;              // fill to ProcessInput
+    LatencyHistogram encode;            // ProcessInput to output
+    LatencyHistogram write;             // output to file
+};
+
+class FrameTracer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit FrameTracer(const FrameTracerOptions& options = FrameTracerOptions())
+        : options(options), slots(options.slots), origin(Clock::now())
+    {
+        CHECK(options.slots != 0 && (options.slots & (options.slots - 1)) == 0);
+        mask = options.slots - 1;
+        trace.reserve(options.chromeTraceFrames);
+    }
+
+    // Any thread. Fill starts a frame, Written completes it.
+    void stamp(TraceStage stage, int64_t sampleTime, Clock::time_point when = Clock::now())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Slot* slot = stage == TraceStage::Fill ? insert(sampleTime) : find(sampleTime);
+        if (!slot)
+        {
+            tracerStats.lost++;
+            return;
+        }
+        slot->stamps[(uint32_t)stage] = when;
+        slot->seen |= 1u << (uint32_t)stage;
+        if (stage == TraceStage::Written)
+            complete(*slot);
+    }
+
+    FrameTracerStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tracerStats;
+    }
+
+    // Complete events per stage, times in microseconds since the tracer was created
+    bool writeChromeTrace(const char* path) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        FILE* file = fopen(path, "w");
+        if (!file)
+            return false;
+
+        static const char* names[] = { "fill", "encode", "write" };
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"encoder\"}}");
+        for (uint32_t lane = 0; lane < 3; lane++)
+            fprintf(file, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", lane + 1, names[lane]);
+        for (const TracedFrame& frame : trace)
+        {
+            for (uint32_t lane = 0; lane < 3; lane++)
+            {
+                double begin = microseconds(frame.stamps[lane]);
+                double end = microseconds(frame.stamps[lane + 1]);
+                fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu,\"time\":%lld}}",
+                    lane + 1, names[lane], begin, end - begin, (unsigned long long)frame.sequence, (long long)frame.sampleTime);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    struct Slot
+    {
+        bool used = false;
+        int64_t sampleTime = 0;
+        uint64_t sequence = 0;
+        uint32_t seen = 0;
+        Clock::time_point stamps[TRACE_STAGES];
+    };
+
+    struct TracedFrame
+    {
+        uint64_t sequence;
+        int64_t sampleTime;
+        Clock::time_point stamps[TRACE_STAGES];
+    };
+
+    uint32_t home(int64_t sampleTime) const
+    {
+        return (uint32_t)(((uint64_t)sampleTime * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    }
+
+    // Open addressing with linear probing, the table is sized for the frames in flight
+    Slot* insert(int64_t sampleTime)
+    {
+        if (occupied * 2 >= slots.size() && writtenSequence != sweptSequence)
+            freeAbandoned();
+
+        for (uint32_t i = 0, index = home(sampleTime); i <= mask; i++, index = (index + 1) & mask)
+        {
+            Slot& slot = slots[index];
+            if (slot.used && slot.sampleTime != sampleTime)
+                continue;
+
+            // A time seen again starts over
+            if (!slot.used)
+                occupied++;
+            slot = Slot();
+            slot.used = true;
+            slot.sampleTime = sampleTime;
+            slot.sequence = sequence++;
+            return &slot;
+        }
+        return nullptr;
+    }
+
+    Slot* find(int64_t sampleTime)
+    {
+        for (uint32_t i = 0, index = home(sampleTime); i <= mask; i++, index = (index + 1) & mask)
+        {
+            Slot& slot = slots[index];
+            if (!slot.used)
+                break;
+            if (slot.sampleTime == sampleTime)
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    void complete(Slot& slot)
+    {
+        const uint32_t all = (1u << TRACE_STAGES) - 1;
+        if (slot.seen == all)
+        {
+            tracerStats.frames++;
+            writtenSequence = std::max(writtenSequence, slot.sequence);
+            tracerStats.captureToBitstream.record(elapsedUs(slot, TraceStage::Fill, TraceStage::Output));
+            tracerStats.endToEnd.record(elapsedUs(slot, TraceStage::Fill, TraceStage::Written));
+            tracerStats.fill.record(elapsedUs(slot, TraceStage::Fill, TraceStage::Submit));
+            tracerStats.encode.record(elapsedUs(slot, TraceStage::Submit, TraceStage::Output));
+            tracerStats.write.record(elapsedUs(slot, TraceStage::Output, TraceStage::Written));
+            if (trace.size() < options.chromeTraceFrames)
+            {
+                TracedFrame frame;
+                frame.sequence = slot.sequence;
+                frame.sampleTime = slot.sampleTime;
+                std::copy(slot.stamps, slot.stamps + TRACE_STAGES, frame.stamps);
+                trace.push_back(frame);
+            }
+        }
+        else
+        {
+            tracerStats.lost++;
+        }
+        remove(slot);
+    }
+
+    // Frames filled well before the latest one written are not coming any more
+    void freeAbandoned()
+    {
+        sweptSequence = writtenSequence;
+        std::vector<int64_t> stale;
+        for (const Slot& slot : slots)
+        {
+            if (slot.used && slot.sequence + options.reorder < writtenSequence)
+                stale.push_back(slot.sampleTime);
+        }
+        for (int64_t sampleTime : stale)
+        {
+            remove(*find(sampleTime));
+            tracerStats.abandoned++;
+        }
+    }
+
+    // Removing from a probed table: later entries of the run move back to
+    // where a lookup still finds them
+    void remove(Slot& slot)
+    {
+        uint32_t hole = (uint32_t)(&slot - slots.data());
+        slots[hole].used = false;
+        occupied--;
+        for (uint32_t index = (hole + 1) & mask; slots[index].used; index = (index + 1) & mask)
+        {
+            uint32_t want = home(slots[index].sampleTime);
+            bool movable = hole <= index ? (want <= hole || want > index) : (want <= hole && want > index);
+            if (movable)
+            {
+                slots[hole] = slots[index];
+                slots[index].used = false;
+                hole = index;
+            }
+        }
+    }
+
+    static uint64_t elapsedUs(const Slot& slot, TraceStage from, TraceStage to)
+    {
+        Clock::duration elapsed = slot.stamps[(uint32_t)to] - slot.stamps[(uint32_t)from];
+        return elapsed.count() < 0 ? 0 : (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+    double microseconds(Clock::time_point when) const
+    {
+        return std::chrono::duration<double, std::micro>(when - origin).count();
+    }
+
+    FrameTracerOptions options;
+    std::vector<Slot> slots;
+    uint32_t mask;
+    Clock::time_point origin;
+
+    mutable std::mutex mutex;
+    uint64_t sequence = 0;
+    size_t occupied = 0;
+    uint64_t writtenSequence = 0;       // latest fill of a frame written
+    uint64_t sweptSequence = 0;
+    FrameTracerStats tracerStats;
+    std::vector<TracedFrame> trace;
+};
@@ -0,0 +1,689 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "color_convert.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder.h"
+#include "encoder_backend.h"
+#include "encoder_config.h"
+#include "frame_pool.h"
+#include "frame_scaler.h"
+#include "frame_source.h"
+#include "metrics_registry.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Rendition ladder
+//
+// Encodes one source at several sizes for adaptive streaming. Each frame is
+// captured and converted to NV12 once, into a shared frame. Every rung holds
+// a reference to it while its scaler writes the rung's input frame straight
+// from it, so no rung copies the source. Each rung scales and submits on its
+// own strand of the worker pool, so the rungs run in parallel.
+//
+// A frame goes to every rung or to none. It is only captured once every rung
+// has asked for input and has an input frame to put it in. All rungs share
+// one GOP length, and a keyframe request reaches every rung on the same
+// frame, so keyframes fall on the same frames in every rendition and
+// segments and switch points line up.
+// ----------------------------------------------------------------------------
+
+struct LadderRung
+{
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t bitrate = 3000000;
+    std::string path;                   // raw H.264 of this rendition
+};
+
+struct LadderOptions
+{
+    EncoderConfig source;               // capture size, and everything but size and bitrate for every rung
+    std::vector<LadderRung> rungs;
+    uint32_t sharedFrames = 4;          // converted source frames in flight
+    ScaleFilter filter = ScaleFilter::Area; // from the source to each rung
+};
+
+// 1080p, 720p, 480p and 360p, those no taller than the source, at the
+// source's aspect ratio. A source below 360p is its own single rung.
+inline std::vector<LadderRung> standardLadder(const EncoderConfig& source)
+{
+    static const struct { uint32_t height; uint32_t bitrate; } steps[] =
+    {
+        { 1080, 6000000 }, { 720, 3000000 }, { 480, 1500000 }, { 360, 800000 },
+    };
+
+    std::vector<LadderRung> rungs;
+    for (const auto& step : steps)
+    {
+        if (step.height > source.height)
+            continue;
+        LadderRung rung;
+        rung.height = step.height;
+        rung.width = (uint32_t)std::lround((double)source.width * step.height / source.height / 2) * 2;
+        rung.bitrate = step.bitrate;
+        rungs.push_back(rung);
+    }
+    if (rungs.empty())
+    {
+        LadderRung rung;
+        rung.width = source.width;
+        rung.height = source.height;
+        rung.bitrate = source.bitrate;
+        rungs.push_back(rung);
+    }
+    return rungs;
+}
+
+// The source's settings at the rung's size and bitrate. A VBR peak keeps
+// its ratio to the bitrate; the level is left to the encoder below the top.
+inline EncoderConfig ladderRungConfig(const EncoderConfig& source, const LadderRung& rung)
+{
+    EncoderConfig config = source;
+    config.width = rung.width;
+    config.height = rung.height;
+    config.bitrate = rung.bitrate;
+    if (source.maxBitrate != 0)
+        config.maxBitrate = (uint32_t)((uint64_t)source.maxBitrate * rung.bitrate / source.bitrate);
+    if (rung.width != source.width || rung.height != source.height)
+        config.level = 0;
+    return config;
+}
+
+inline bool validateLadder(const LadderOptions& options, std::string& error)
+{
+    if (!validateConfig(options.source, error))
+        return false;
+    if (options.source.format != FrameFormat::NV12)
+        error = "a ladder encodes NV12";
+    else if (options.source.lookahead != 0)
+        error = "a ladder has no lookahead";
+    else if (options.rungs.empty())
+        error = "a ladder needs at least one rung";
+    else if (options.sharedFrames < 2)
+        error = "a ladder needs at least two shared frames";
+    else
+    {
+        for (const LadderRung& rung : options.rungs)
+        {
+            if (!validateConfig(ladderRungConfig(options.source, rung), error))
+            {
+                error = std::to_string(rung.width) + "x" + std::to_string(rung.height) + " rung: " + error;
+                return false;
+            }
+            if (rung.path.empty())
+            {
+                error = "every rung needs an output path";
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+struct LadderRungStats
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint64_t framesIn = 0;
+    uint64_t framesOut = 0;
+    uint64_t bytes = 0;
+    uint64_t keyframes = 0;
+    uint64_t scaleUs = 0;               // spent scaling from the shared frame
+};
+
+struct LadderStats
+{
+    FrameSchedulerStats schedule;
+    uint64_t conversions = 0;           // source frames converted, once for all rungs
+    FramePoolStats sharedFrames;
+    std::vector<LadderRungStats> rungs;
+};
+
+class LadderEncoder
+{
+public:
+    // Rungs are created on the factory's adapter, so they share its device.
+    // Their events, scaling and submits all run on workers.
+    LadderEncoder(IEncoderBackendFactory& factory, uint32_t adapter, const LadderOptions& options, WorkerPool& workers,
+                  const BitstreamWriterOptions& writerOptions = BitstreamWriterOptions())
+        : options(options), workers(workers),
+          sources(options.sharedFrames, (size_t)options.source.width * options.source.height * 3 / 2),
+          rate(options.source.frameRate)
+    {
+        std::string error;
+        CHECK(validateLadder(options, error));
+
+        for (size_t i = 0; i < options.rungs.size(); i++)
+        {
+            const LadderRung& rung = options.rungs[i];
+            EncoderConfig config = ladderRungConfig(options.source, rung);
+            rungs.emplace_back(new Rung(*this, factory.createBackend(adapter, config, workers), rung.path.c_str(), writerOptions));
+            rungs.back()->backend->setInputReleaseCallback([this]() { feed(); });
+        }
+        sources.setReleaseCallback([this](uint32_t) { feed(); });
+        ownSource.reset(new PatternSource(TestPattern::Bar, PictureFormat::BGRA, options.source.width, options.source.height));
+        setFrameSource(ownSource.get());
+    }
+
+    // Nothing may still run into a destroyed ladder: the clock, the rungs'
+    // strands (whose dropped tasks release shared frames) and the encoders
+    ~LadderEncoder()
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            stopping = true;
+            lastFrame.reset();
+            releaseReservedInputs();
+        }
+        if (pacer)
+            pacer->close();
+        for (std::unique_ptr<Rung>& rung : rungs)
+            rung->strand.close();
+        for (std::unique_ptr<Rung>& rung : rungs)
+            rung->backend->shutdown();
+    }
+
+    // AsFastAsPossible or RealTime, see FrameSchedule. Set before start().
+    void setSchedule(const FrameSchedulerOptions& schedulerOptions)
+    {
+        CHECK(schedulerOptions.mode != FrameSchedule::BoundedQueue);
+        schedule = schedulerOptions;
+        if (schedule.mode == FrameSchedule::RealTime)
+            pacer.reset(new SerialQueue(workers));
+    }
+
+    // Where pictures come from, the bar pattern unless set. The source has
+    // the ladder's source size; its pictures are converted to NV12 once for
+    // every rung. The source ending ends the ladder. Set before start().
+    void setFrameSource(IFrameSource* frameSource)
+    {
+        CHECK(frameSource != nullptr);
+        FrameSourceInfo info = frameSource->info();
+        CHECK(info.width == options.source.width && info.height == options.source.height);
+        uploader.reset(new PictureUploader(info, FrameFormat::NV12, info.width, info.height));
+        source = frameSource;
+    }
+
+    // Gets every access unit of one rung after its file writer. Add before start().
+    void addConsumer(size_t rung, IPacketConsumer* consumer) { rungs[rung]->consumers.push_back(consumer); }
+
+    // Every rung reports its series under the labels and rendition="WxH",
+    // see metrics_registry.h. Set before start(); the registry outlives the ladder.
+    void setMetrics(MetricsRegistry& registry, const MetricLabels& labels = MetricLabels())
+    {
+        for (std::unique_ptr<Rung>& rung : rungs)
+        {
+            const EncoderConfig& config = rung->backend->config();
+            MetricLabels rungLabels = labels;
+            rungLabels.emplace_back("rendition", std::to_string(config.width) + "x" + std::to_string(config.height));
+            rung->metrics.reset(new EncoderMetrics(registry, rungLabels));
+            rung->metrics->setTargetBitrate(config.bitrate);
+        }
+    }
+
+    void start()
+    {
+        for (std::unique_ptr<Rung>& rung : rungs)
+            rung->backend->start(rung.get());
+        if (pacer)
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            clockStart = Clock::now();
+            pacer->post([this]() { onTick(); });
+        }
+    }
+
+    // A keyframe in every rendition, on the next frame. Any thread.
+    void forceKeyframe()
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        keyframeRequested = true;
+    }
+
+    // Stops capturing, every rung drains after the frames it has
+    void beginStop()
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            stopCapture();
+        }
+        if (pacer)
+            pacer->close();
+    }
+
+    bool stop(std::chrono::milliseconds timeout = std::chrono::milliseconds(5000))
+    {
+        beginStop();
+        return waitForDrain(timeout);
+    }
+
+    // Until every rung's DrainComplete. false when one of them failed, which
+    // stops all of them, see status().
+    bool waitForDrain(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(drainMutex);
+        drainDone.wait_for(lock, timeout, [this]() { return drainedRungs == rungs.size() || failed; });
+        return drainedRungs == rungs.size() && !failed;
+    }
+
+    bool waitForDrain()
+    {
+        std::unique_lock<std::mutex> lock(drainMutex);
+        drainDone.wait(lock, [this]() { return drainedRungs == rungs.size() || failed; });
+        return drainedRungs == rungs.size() && !failed;
+    }
+
+    // The first rung's failure, ok when none failed
+    EncoderStatus status() const
+    {
+        for (const std::unique_ptr<Rung>& rung : rungs)
+        {
+            EncoderStatus status = rung->backend->status();
+            if (!status.ok())
+                return status;
+        }
+        return EncoderStatus();
+    }
+
+    // Gets every rendition into its file. After the drain only; false when
+    // one of the files could not be written.
+    bool closeWriters()
+    {
+        bool ok = true;
+        for (std::unique_ptr<Rung>& rung : rungs)
+            ok = rung->writer.close() && ok;
+        return ok;
+    }
+
+    size_t rungCount() const { return rungs.size(); }
+    const EncoderConfig& rungConfig(size_t rung) const { return rungs[rung]->backend->config(); }
+
+    LadderStats stats() const
+    {
+        LadderStats result;
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            result.schedule = scheduleStats;
+            result.conversions = conversions;
+        }
+        result.sharedFrames = sources.stats();
+        for (const std::unique_ptr<Rung>& rung : rungs)
+        {
+            LadderRungStats stats;
+            stats.width = rung->backend->config().width;
+            stats.height = rung->backend->config().height;
+            stats.framesIn = rung->framesIn;
+            stats.framesOut = rung->framesOut;
+            stats.bytes = rung->bytesOut;
+            stats.keyframes = rung->keyframes;
+            stats.scaleUs = rung->scaleUs;
+            result.rungs.push_back(stats);
+        }
+        return result;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // One rendition: its encoder, the scaler from the source to its size and
+    // the strand its frames are scaled and submitted on, in order
+    class Rung : public IEncoderEventSink
+    {
+    public:
+        Rung(LadderEncoder& ladder, std::unique_ptr<IEncoderBackend> encoder, const char* path, const BitstreamWriterOptions& writerOptions)
+            : ladder(ladder), backend(std::move(encoder)), writer(path, writerOptions),
+              scaler(ladder.options.source.width, ladder.options.source.height, backend->config().width, backend->config().height,
+                     ladder.options.filter),
+              strand(ladder.workers)
+        {
+        }
+
+        void onEncoderEvent(EncoderEvent event, uint32_t count) override
+        {
+            switch (event)
+            {
+            case EncoderEvent::NeedInput:
+                ladder.onNeedInput(*this, count);
+                break;
+
+            case EncoderEvent::HaveOutput:
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    EncodedPacket packet;
+                    OutputStatus status = backend->processOutput(packet);
+                    if (status == OutputStatus::StreamChange)
+                    {
+                        backend->renegotiateOutput();
+                        if (metrics)
+                            metrics->streamChanged();
+                        continue;
+                    }
+                    if (status == OutputStatus::Failed)
+                        break;
+                    if (status != OutputStatus::Ok)
+                        continue;
+
+                    writer.write(packet);
+                    for (IPacketConsumer* consumer : consumers)
+                        consumer->onPacket(packet);
+
+                    framesOut++;
+                    bytesOut += packet.size();
+                    keyframes += packet.keyframe() ? 1 : 0;
+                    if (metrics)
+                        metrics->output(packet, writer.queueBytes());
+                }
+                break;
+
+            case EncoderEvent::DrainComplete:
+                ladder.onRungDrained();
+                break;
+
+            case EncoderEvent::Error:
+                ladder.onRungFailed();
+                break;
+            }
+        }
+
+        // On the strand. The shared frame is dropped with the task.
+        void encode(const InputFrame& input, const SharedFrame& source, int64_t time, int64_t duration, bool keyframe)
+        {
+            const EncoderConfig& config = backend->config();
+            const uint32_t sourceWidth = ladder.options.source.width;
+            const uint32_t sourceHeight = ladder.options.source.height;
+
+            Clock::time_point scaleStart = Clock::now();
+            Nv12Frame from = { source.data(), sourceWidth, source.data() + (size_t)sourceWidth * sourceHeight, sourceWidth };
+            Nv12Frame to = { input.data, input.pitch, input.data + input.pitch * config.height, input.pitch };
+            scaler.scaleNv12(from, to);
+            scaleUs += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - scaleStart).count();
+
+            if (keyframe)
+            {
+                EncoderControl control;
+                control.forceKeyframe = true;
+                backend->applyControl(control);
+            }
+            if (metrics)
+                metrics->submitted(time);
+            backend->submitInput(input, time, duration);
+            framesIn++;
+        }
+
+        LadderEncoder& ladder;
+        std::unique_ptr<IEncoderBackend> backend;
+        BitstreamWriter writer;
+        std::vector<IPacketConsumer*> consumers;
+        FrameScaler scaler;
+        SerialQueue strand;
+        std::unique_ptr<EncoderMetrics> metrics;
+
+        // Under the ladder's inputMutex
+        uint32_t pendingInput = 0;
+        InputFrame input;
+        bool hasInput = false;
+
+        std::atomic<uint64_t> framesIn{0};
+        std::atomic<uint64_t> framesOut{0};
+        std::atomic<uint64_t> bytesOut{0};
+        std::atomic<uint64_t> keyframes{0};
+        std::atomic<uint64_t> scaleUs{0};
+    };
+
+    void onNeedInput(Rung& rung, uint32_t count)
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            rung.pendingInput += count;
+        }
+        feed();
+    }
+
+    // Fast mode: a new frame as soon as every rung can take one. Also runs
+    // when an input frame or a shared frame comes back.
+    void feed()
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        if (schedule.mode != FrameSchedule::AsFastAsPossible)
+            return;
+
+        while (!stopping && reserveInputs())
+        {
+            SharedFrame frame;
+            if (!sources.acquire(frame))
+                return;
+
+            SourceRead read = source->next();
+            if (read == SourceRead::End)
+            {
+                stopCapture();
+                return;
+            }
+
+            uint64_t slot = nextSlot++;
+            scheduleStats.slots++;
+            if (read == SourceRead::Fresh)
+                scheduleStats.captured++;
+            else
+                scheduleStats.duplicated++;
+            convert(frame);
+            dispatch(frame, slot);
+
+            if (schedule.frames != 0 && nextSlot == schedule.frames)
+                stopCapture();
+        }
+    }
+
+    // Every rung has a request and an input frame. One taken for a frame
+    // that does not happen is kept for the next, and given back at the end.
+    bool reserveInputs()
+    {
+        for (std::unique_ptr<Rung>& rung : rungs)
+        {
+            if (rung->pendingInput == 0)
+                return false;
+            if (!rung->hasInput && !rung->backend->acquireInput(rung->input))
+                return false;
+            rung->hasInput = true;
+        }
+        return true;
+    }
+
+    // Holding inputMutex, after reserveInputs()
+    void dispatch(const SharedFrame& frame, uint64_t slot)
+    {
+        int64_t time = rationalFrameTime(rate, slot);
+        int64_t duration = rationalFrameTime(rate, slot + 1) - time;
+        bool keyframe = keyframeRequested;
+        keyframeRequested = false;
+
+        for (std::unique_ptr<Rung>& entry : rungs)
+        {
+            Rung* rung = entry.get();
+            InputFrame input = rung->input;
+            rung->pendingInput--;
+            rung->hasInput = false;
+            rung->strand.post([rung, input, frame, time, duration, keyframe]() { rung->encode(input, frame, time, duration, keyframe); });
+        }
+    }
+
+    // Real time: the slot that is due and any a late tick slept through, as
+    // in Encoder. A repeated slot shares the last converted frame again.
+    void onTick()
+    {
+        std::lock_guard<std::recursive_mutex> lock(inputMutex);
+        if (stopping)
+            return;
+
+        Clock::time_point now = Clock::now();
+        int64_t lateUs = std::chrono::duration_cast<std::chrono::microseconds>(now - slotStart(nextSlot)).count();
+        scheduleStats.maxLateUs = std::max(scheduleStats.maxLateUs, lateUs);
+
+        uint64_t due = nextSlot;
+        while (slotStart(due + 1) <= now && (schedule.frames == 0 || due + 1 < schedule.frames))
+            due++;
+
+        for (uint64_t slot = nextSlot; slot <= due; slot++)
+        {
+            scheduleStats.slots++;
+            if (due - slot > schedule.maxRepeatFrames)
+                scheduleStats.skipped++;
+            else
+                captureSlot(slot, slot == due);
+            if (stopping)
+                return;
+        }
+        nextSlot = due + 1;
+
+        if (schedule.frames != 0 && nextSlot == schedule.frames)
+        {
+            stopCapture();
+            return;
+        }
+        pacer->postAt(slotStart(nextSlot), [this]() { onTick(); });
+    }
+
+    // A source with nothing new repeats the last converted frame
+    void captureSlot(uint64_t slot, bool fresh)
+    {
+        SourceRead read = fresh ? source->next() : SourceRead::Same;
+        if (read == SourceRead::End)
+        {
+            stopCapture();
+            return;
+        }
+        fresh = read == SourceRead::Fresh;
+        if (fresh)
+            scheduleStats.captured++;
+        else
+            scheduleStats.duplicated++;
+
+        if (!reserveInputs())
+        {
+            scheduleStats.dropped++;
+            return;
+        }
+
+        if (fresh || !lastFrame)
+        {
+            // The last frame is only kept for repeats, so it can go first
+            lastFrame.reset();
+            if (!sources.acquire(lastFrame))
+            {
+                scheduleStats.dropped++;
+                return;
+            }
+            convert(lastFrame);
+        }
+        dispatch(lastFrame, slot);
+    }
+
+    // Holding inputMutex. Each rung drains after the frames on its strand.
+    void stopCapture()
+    {
+        stopping = true;
+        lastFrame.reset();
+        releaseReservedInputs();
+        if (drainRequested)
+            return;
+        drainRequested = true;
+        for (std::unique_ptr<Rung>& entry : rungs)
+        {
+            Rung* rung = entry.get();
+            rung->strand.post([rung]() { rung->backend->drain(); });
+        }
+    }
+
+    // Holding inputMutex, once stopping
+    void releaseReservedInputs()
+    {
+        for (std::unique_ptr<Rung>& rung : rungs)
+        {
+            if (!rung->hasInput)
+                continue;
+            rung->hasInput = false;
+            rung->backend->releaseInput(rung->input);
+        }
+    }
+
+    void onRungDrained()
+    {
+        {
+            std::lock_guard<std::mutex> lock(drainMutex);
+            drainedRungs++;
+        }
+        drainDone.notify_all();
+    }
+
+    // One rendition failing ends the ladder, the others are not drained
+    void onRungFailed()
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(inputMutex);
+            stopping = true;
+            drainRequested = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(drainMutex);
+            failed = true;
+        }
+        drainDone.notify_all();
+    }
+
+    Clock::time_point slotStart(uint64_t slot) const
+    {
+        return clockStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<int64_t, std::ratio<1, 10000000>>(rationalFrameTime(rate, slot)));
+    }
+
+    // The one color conversion of the frame, for every rung
+    void convert(const SharedFrame& frame)
+    {
+        uploader->upload(source->picture(), frame.data(), options.source.width);
+        conversions++;
+    }
+
+    LadderOptions options;
+    WorkerPool& workers;
+    FrameSchedulerOptions schedule;
+
+    // Shared frames outlive the rungs, whose tasks hold them
+    SharedFramePool sources;
+    std::unique_ptr<IFrameSource> ownSource;
+    IFrameSource* source = nullptr;
+    std::unique_ptr<PictureUploader> uploader;
+
+    mutable std::recursive_mutex inputMutex;
+    std::unique_ptr<SerialQueue> pacer;
+    Clock::time_point clockStart;
+    Rational rate;
+    uint64_t nextSlot = 0;
+    uint64_t conversions = 0;
+    SharedFrame lastFrame;
+    bool keyframeRequested = false;
+    bool stopping = false;
+    bool drainRequested = false;
+    FrameSchedulerStats scheduleStats;
+
+    std::vector<std::unique_ptr<Rung>> rungs;
+
+    std::mutex drainMutex;
+    std::condition_variable drainDone;
+    size_t drainedRungs = 0;
+    bool failed = false;
+};
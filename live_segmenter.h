@@ -0,0 +1,735 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder_config.h"
+#include "mp4_muxer.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Live segmenter
+//
+// Cuts the encoder output into HLS/DASH segments as it comes out, so nothing
+// has to re-read the elementary stream: fMP4 (CMAF) segments behind an init
+// segment, or self-contained MPEG-TS segments. A segment ends on the first
+// IDR at or past its boundary, and boundaries sit on a fixed grid of the
+// segment duration, so renditions cut at the same times. segmentGopLength()
+// gives the GOP that puts an IDR on every boundary.
+//
+// The output side only appends to the segment being built. Finished segments
+// go to an I/O strand, which writes them to disk or keeps them in memory,
+// drops those that left the rolling window, and replaces the m3u8 playlist
+// and the MPD as a whole: written next to the old one, then renamed over it.
+// ----------------------------------------------------------------------------
+
+enum class SegmentFormat { Fmp4, MpegTs };
+
+enum class SegmentStorage { Disk, Memory };
+
+inline const char* segmentFormatName(SegmentFormat format)
+{
+    return format == SegmentFormat::Fmp4 ? "fmp4" : "ts";
+}
+
+inline bool parseSegmentFormat(const std::string& text, SegmentFormat& format)
+{
+    if (text == "fmp4")
+        format = SegmentFormat::Fmp4;
+    else if (text == "ts")
+        format = SegmentFormat::MpegTs;
+    else
+        return false;
+    return true;
+}
+
+// Frames from IDR to IDR for one IDR per segment, at least 1
+inline uint32_t segmentGopLength(const Rational& frameRate, std::chrono::milliseconds segmentDuration)
+{
+    uint64_t scaled = (uint64_t)segmentDuration.count() * frameRate.num;
+    uint64_t perSecond = 1000ull * frameRate.den;
+    return (uint32_t)std::max<uint64_t>(1, (scaled + perSecond / 2) / perSecond);
+}
+
+struct LiveSegmenterOptions
+{
+    SegmentFormat format = SegmentFormat::Fmp4;
+    SegmentStorage storage = SegmentStorage::Disk;
+    std::string directory = ".";
+    std::string name = "live";                          // live.m3u8, live.mpd, live_init.mp4, live_00001.m4s or .ts
+    std::chrono::milliseconds segmentDuration{2000};
+    uint32_t windowSegments = 6;                        // listed in the playlists
+    uint32_t keepSegments = 2;                          // kept after leaving the window, for players still fetching them
+    bool hls = true;
+    bool dash = true;                                   // fMP4 only
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t bandwidth = 0;                             // advertised bits per second, 0 = the largest segment's
+};
+
+// One finished segment. Times are in 100ns units from the first sample.
+struct LiveSegment
+{
+    uint64_t number;
+    int64_t time;
+    int64_t duration;
+    size_t bytes;
+    std::string uri;
+};
+
+struct LiveSegmenterStats
+{
+    uint64_t samples = 0;
+    uint64_t segments = 0;
+    uint64_t removed = 0;                               // left the window and the keep margin
+    uint64_t droppedBeforeKeyframe = 0;
+    uint64_t playlistUpdates = 0;
+    uint64_t writeFailures = 0;
+    uint64_t bytes = 0;
+    int64_t longestSegment = 0;
+    int64_t shortestSegment = 0;
+};
+
+// ----------------------------------------------------------------------------
+// MPEG-TS
+//
+// One H.264 program: PAT and PMT at the start of every segment, then a PES
+// per access unit with its PTS and a PCR in front of it. Access units get an
+// AUD if they do not start with one, as the TS mapping of H.264 requires.
+// Times are on the 90 kHz clock, shifted by a second so the PCR that runs
+// ahead of them never goes negative.
+// ----------------------------------------------------------------------------
+
+class MpegTsWriter
+{
+public:
+    static constexpr uint16_t PMT_PID = 0x1000;
+    static constexpr uint16_t VIDEO_PID = 0x100;
+    static constexpr size_t PACKET_SIZE = 188;
+
+    void writeTables(std::vector<uint8_t>& out)
+    {
+        static const uint8_t pat[] = {
+            0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00,       // table 0, 13 bytes, transport stream 1
+            0x00, 0x01, 0xE0 | (PMT_PID >> 8), PMT_PID & 0xFF,   // program 1
+        };
+        static const uint8_t pmt[] = {
+            0x02, 0xB0, 18, 0x00, 0x01, 0xC1, 0x00, 0x00,       // table 2, 18 bytes, program 1
+            0xE0 | (VIDEO_PID >> 8), VIDEO_PID & 0xFF, 0xF0, 0x00, // PCR on the video PID, no descriptors
+            0x1B, 0xE0 | (VIDEO_PID >> 8), VIDEO_PID & 0xFF, 0xF0, 0x00, // H.264
+        };
+        writeSection(out, 0, pat, sizeof(pat));
+        writeSection(out, PMT_PID, pmt, sizeof(pmt));
+    }
+
+    // time in 100ns units from the start of the stream
+    void writeAccessUnit(std::vector<uint8_t>& out, const EncodedPacket& packet, int64_t time)
+    {
+        uint64_t pts = ((uint64_t)std::max<int64_t>(time, 0) * 9 / 1000 + 90000) & 0x1FFFFFFFFull;
+        uint64_t pcr = (pts - 9000) & 0x1FFFFFFFFull;
+
+        pes.clear();
+        static const uint8_t header[] = { 0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x80, 0x80, 0x05 };
+        pes.insert(pes.end(), header, header + sizeof(header));
+        pes.push_back((uint8_t)(0x21 | ((pts >> 29) & 0x0E)));
+        pes.push_back((uint8_t)(pts >> 22));
+        pes.push_back((uint8_t)(0x01 | ((pts >> 14) & 0xFE)));
+        pes.push_back((uint8_t)(pts >> 7));
+        pes.push_back((uint8_t)(0x01 | ((pts << 1) & 0xFE)));
+
+        static const uint8_t aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xF0 };
+        if (!startsWithAud(packet))
+            pes.insert(pes.end(), aud, aud + sizeof(aud));
+        pes.insert(pes.end(), packet.data(), packet.data() + packet.size());
+
+        size_t offset = 0;
+        for (bool first = true; offset < pes.size(); first = false)
+        {
+            // The first packet carries the PCR, the last one the stuffing
+            size_t adaptation = first ? 8 : 0;
+            size_t take = std::min(pes.size() - offset, PACKET_SIZE - 4 - adaptation);
+            adaptation = PACKET_SIZE - 4 - take;
+
+            uint8_t* p = beginPacket(out, VIDEO_PID, first, adaptation != 0);
+            if (adaptation != 0)
+            {
+                p[4] = (uint8_t)(adaptation - 1);
+                if (adaptation > 1)
+                {
+                    p[5] = (uint8_t)((first ? 0x10 : 0) | (first && packet.keyframe() ? 0x40 : 0));
+                    size_t used = 2;
+                    if (first)
+                    {
+                        p[6] = (uint8_t)(pcr >> 25);
+                        p[7] = (uint8_t)(pcr >> 17);
+                        p[8] = (uint8_t)(pcr >> 9);
+                        p[9] = (uint8_t)(pcr >> 1);
+                        p[10] = (uint8_t)(((pcr & 1) << 7) | 0x7E);
+                        p[11] = 0;
+                        used += 6;
+                    }
+                    memset(p + 4 + used, 0xFF, adaptation - used);
+                }
+            }
+            memcpy(p + 4 + adaptation, &pes[offset], take);
+            offset += take;
+        }
+    }
+
+    // CRC-32/MPEG-2 of the PSI sections
+    static uint32_t crc32(const uint8_t* data, size_t size)
+    {
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < size; i++)
+        {
+            crc ^= (uint32_t)data[i] << 24;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+        return crc;
+    }
+
+private:
+    uint8_t* beginPacket(std::vector<uint8_t>& out, uint16_t pid, bool unitStart, bool adaptation)
+    {
+        size_t start = out.size();
+        out.resize(start + PACKET_SIZE);
+        uint8_t* p = &out[start];
+        uint8_t& counter = pid == VIDEO_PID ? videoCounter : pid == PMT_PID ? pmtCounter : patCounter;
+        p[0] = 0x47;
+        p[1] = (uint8_t)((unitStart ? 0x40 : 0) | (pid >> 8));
+        p[2] = (uint8_t)pid;
+        p[3] = (uint8_t)((adaptation ? 0x30 : 0x10) | counter);
+        counter = (counter + 1) & 0x0F;
+        return p;
+    }
+
+    void writeSection(std::vector<uint8_t>& out, uint16_t pid, const uint8_t* section, size_t size)
+    {
+        uint8_t* p = beginPacket(out, pid, true, false);
+        p[4] = 0;                                       // pointer_field
+        memcpy(p + 5, section, size);
+        uint32_t crc = crc32(section, size);
+        uint8_t* tail = p + 5 + size;
+        tail[0] = (uint8_t)(crc >> 24);
+        tail[1] = (uint8_t)(crc >> 16);
+        tail[2] = (uint8_t)(crc >> 8);
+        tail[3] = (uint8_t)crc;
+        memset(tail + 4, 0xFF, PACKET_SIZE - (size_t)(tail + 4 - p));
+    }
+
+    static bool startsWithAud(const EncodedPacket& packet)
+    {
+        const uint8_t* data = packet.data();
+        size_t size = packet.size();
+        if (size >= 5 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1)
+            return (data[4] & 0x1F) == NAL_AUD;
+        if (size >= 4 && data[0] == 0 && data[1] == 0 && data[2] == 1)
+            return (data[3] & 0x1F) == NAL_AUD;
+        return false;
+    }
+
+    std::vector<uint8_t> pes;
+    uint8_t patCounter = 0;
+    uint8_t pmtCounter = 0;
+    uint8_t videoCounter = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Playlists
+// ----------------------------------------------------------------------------
+
+// ISO 8601 duration, e.g. PT2.000S
+inline std::string dashDuration(int64_t ticks)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "PT%.3fS", ticks / 1e7);
+    return text;
+}
+
+inline std::string utcTimestamp(std::chrono::system_clock::time_point when)
+{
+    time_t seconds = std::chrono::system_clock::to_time_t(when);
+    tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return text;
+}
+
+struct LivePlaylistInfo
+{
+    SegmentFormat format;
+    std::string initUri;                                // fMP4 only
+    std::string mediaTemplate;                          // DASH $Number$ template
+    std::string codecs;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bandwidth;
+    int64_t targetDuration;                             // 100ns units
+    std::chrono::system_clock::time_point availabilityStart;
+    bool ended;
+};
+
+inline std::string buildHlsPlaylist(const LivePlaylistInfo& info, const std::deque<LiveSegment>& window)
+{
+    // At least the configured duration, and no segment may round to more
+    int64_t target = (info.targetDuration + 9999999) / 10000000;
+    for (const LiveSegment& segment : window)
+        target = std::max<int64_t>(target, (segment.duration + 5000000) / 10000000);
+
+    std::string text = "#EXTM3U\n";
+    text += info.format == SegmentFormat::Fmp4 ? "#EXT-X-VERSION:7\n" : "#EXT-X-VERSION:3\n";
+    text += "#EXT-X-TARGETDURATION:" + std::to_string(target) + "\n";
+    text += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(window.empty() ? 0 : window.front().number) + "\n";
+    text += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    if (info.format == SegmentFormat::Fmp4)
+        text += "#EXT-X-MAP:URI=\"" + info.initUri + "\"\n";
+    for (const LiveSegment& segment : window)
+    {
+        char extinf[48];
+        snprintf(extinf, sizeof(extinf), "#EXTINF:%.3f,\n", segment.duration / 1e7);
+        text += extinf;
+        text += segment.uri + "\n";
+    }
+    if (info.ended)
+        text += "#EXT-X-ENDLIST\n";
+    return text;
+}
+
+// SegmentTimeline with $Number$ addressing, runs of equal durations folded
+inline std::string buildDashManifest(const LivePlaylistInfo& info, const std::deque<LiveSegment>& window)
+{
+    int64_t windowDuration = 0;
+    for (const LiveSegment& segment : window)
+        windowDuration += segment.duration;
+    int64_t end = window.empty() ? 0 : window.back().time + window.back().duration;
+
+    std::string text = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    text += "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"";
+    if (info.ended)
+    {
+        text += " type=\"static\" mediaPresentationDuration=\"" + dashDuration(end) + "\"";
+    }
+    else
+    {
+        text += " type=\"dynamic\" availabilityStartTime=\"" + utcTimestamp(info.availabilityStart) + "\"";
+        text += " publishTime=\"" + utcTimestamp(std::chrono::system_clock::now()) + "\"";
+        text += " minimumUpdatePeriod=\"" + dashDuration(info.targetDuration) + "\"";
+        text += " timeShiftBufferDepth=\"" + dashDuration(windowDuration) + "\"";
+    }
+    text += " minBufferTime=\"" + dashDuration(info.targetDuration) + "\">\n";
+    text += "  <Period id=\"0\" start=\"PT0S\">\n";
+    text += "    <AdaptationSet contentType=\"video\" mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n";
+    text += "      <Representation id=\"0\" codecs=\"" + info.codecs + "\" width=\"" + std::to_string(info.width) + "\" height=\"" +
+        std::to_string(info.height) + "\" bandwidth=\"" + std::to_string(info.bandwidth) + "\">\n";
+    text += "        <SegmentTemplate timescale=\"10000000\" initialization=\"" + info.initUri + "\" media=\"" + info.mediaTemplate +
+        "\" startNumber=\"" + std::to_string(window.empty() ? 0 : window.front().number) + "\">\n";
+    text += "          <SegmentTimeline>\n";
+    for (size_t i = 0; i < window.size();)
+    {
+        size_t run = 1;
+        while (i + run < window.size() && window[i + run].duration == window[i].duration)
+            run++;
+        text += "            <S t=\"" + std::to_string(window[i].time) + "\" d=\"" + std::to_string(window[i].duration) + "\"";
+        if (run > 1)
+            text += " r=\"" + std::to_string(run - 1) + "\"";
+        text += "/>\n";
+        i += run;
+    }
+    text += "          </SegmentTimeline>\n";
+    text += "        </SegmentTemplate>\n";
+    text += "      </Representation>\n";
+    text += "    </AdaptationSet>\n";
+    text += "  </Period>\n";
+    text += "</MPD>\n";
+    return text;
+}
+
+// ----------------------------------------------------------------------------
+// Segmenter
+// ----------------------------------------------------------------------------
+
+class LiveSegmenter : public IPacketConsumer
+{
+public:
+    // Without a worker pool the segments are written by a thread of their own
+    explicit LiveSegmenter(const LiveSegmenterOptions& options, WorkerPool* workers = nullptr)
+        : options(options),
+          builder(options.width, options.height, 10000000),
+          ownWorkers(workers ? nullptr : new WorkerPool(1)),
+          io(workers ? *workers : *ownWorkers)
+    {
+        CHECK(options.segmentDuration.count() > 0 && options.windowSegments != 0);
+        segmentTicks = (int64_t)options.segmentDuration.count() * 10000;
+        extension = options.format == SegmentFormat::Fmp4 ? ".m4s" : ".ts";
+    }
+
+    ~LiveSegmenter()
+    {
+        finish();
+    }
+
+    // Called from the encoder's output side, one packet at a time
+    void onPacket(const EncodedPacket& packet) override
+    {
+        if (finished)
+            return;
+
+        if (!started)
+        {
+            if (!packet.keyframe() || (options.format == SegmentFormat::Fmp4 && !builder.readParameterSets(packet)))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                segmenterStats.droppedBeforeKeyframe++;
+                return;
+            }
+            started = true;
+            firstTime = packet.time();
+            availabilityStart = std::chrono::system_clock::now();
+            if (options.format == SegmentFormat::Fmp4)
+                publishInit();
+        }
+
+        // On the first IDR that reaches the next boundary, half a frame early counts
+        int64_t time = packet.time() - firstTime;
+        if (payload && packet.keyframe() && time + packet.duration() / 2 >= nextBoundary)
+            closeSegment(time);
+
+        if (!payload)
+            openSegment(time);
+
+        if (options.format == SegmentFormat::Fmp4)
+        {
+            Mp4Sample sample;
+            sample.time = packet.time();
+            sample.duration = packet.duration();
+            sample.keyframe = packet.keyframe();
+            sample.size = builder.appendSample(payload->storage, packet);
+            samples.push_back(sample);
+        }
+        else
+        {
+            ts.writeAccessUnit(payload->storage, packet, time);
+        }
+        lastEnd = time + packet.duration();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        segmenterStats.samples++;
+    }
+
+    // Publishes the last segment, ends the playlists and waits until
+    // everything is written
+    void finish()
+    {
+        if (finished)
+            return;
+        finished = true;
+        if (payload)
+            closeSegment(lastEnd);
+        if (started)
+            post([this]() { updatePlaylists(true); });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return pending == 0; });
+        lock.unlock();
+        io.close();
+    }
+
+    // The current playlists and the files they name, for serving from memory
+    std::string hlsPlaylist() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return hlsText;
+    }
+
+    std::string dashManifest() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dashText;
+    }
+
+    // Shares the file's buffers, nothing is copied. false once it was removed.
+    bool file(const std::string& uri, PacketGather& out) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = files.find(uri);
+        if (found == files.end())
+            return false;
+        out = found->second;
+        return true;
+    }
+
+    std::deque<LiveSegment> window() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return listed;
+    }
+
+    LiveSegmenterStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return segmenterStats;
+    }
+
+    std::string hlsName() const { return options.name + ".m3u8"; }
+    std::string dashName() const { return options.name + ".mpd"; }
+    std::string initName() const { return options.name + "_init.mp4"; }
+
+    std::string segmentName(uint64_t number) const
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "_%05llu", (unsigned long long)number);
+        return options.name + text + extension;
+    }
+
+private:
+    void openSegment(int64_t time)
+    {
+        segment = pool.acquire(payload);
+        segmentStart = time;
+        nextBoundary = ((time + segmentTicks / 2) / segmentTicks + 1) * segmentTicks;
+        if (options.format == SegmentFormat::Fmp4)
+            payload->storage.resize(8); // mdat header, filled in when the segment closes
+        else
+            ts.writeTables(payload->storage);
+    }
+
+    void closeSegment(int64_t end)
+    {
+        PacketGather data;
+        if (options.format == SegmentFormat::Fmp4)
+        {
+            PacketPool::Buffer* buffer;
+            EncodedPacket header = pool.acquire(buffer);
+            Mp4BoxWriter box(buffer->storage);
+            size_t styp = box.begin("styp");
+            box.fourcc("msdh");
+            box.u32(0);
+            box.fourcc("msdh");
+            box.fourcc("msix");
+            box.end(styp);
+            builder.writeMoof(buffer->storage, samples, builder.toTimescale(segmentStart), ++sequence);
+            buffer->commit();
+
+            Mp4BoxWriter mdatBox(payload->storage);
+            mdatBox.patch32(0, (uint32_t)payload->storage.size());
+            memcpy(&payload->storage[4], "mdat", 4);
+            data.add(header);
+            samples.clear();
+        }
+        payload->commit();
+        data.add(segment);
+
+        LiveSegment done;
+        done.number = ++segmentNumber;
+        done.time = segmentStart;
+        done.duration = end - segmentStart;
+        done.bytes = data.size();
+        done.uri = segmentName(done.number);
+        segment.reset();
+        payload = nullptr;
+
+        post([this, done, data]() { publish(done, data); });
+    }
+
+    void publishInit()
+    {
+        PacketPool::Buffer* buffer;
+        EncodedPacket init = pool.acquire(buffer);
+        builder.writeInitSegment(buffer->storage);
+        buffer->commit();
+        PacketGather data;
+        data.add(init);
+        std::string uri = initName();
+        post([this, uri, data]() { store(uri, data); });
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending++;
+        }
+        io.post([this, task]()
+        {
+            task();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                idle.notify_all();
+        });
+    }
+
+    // I/O strand from here on
+
+    void publish(const LiveSegment& segment, const PacketGather& data)
+    {
+        store(segment.uri, data);
+
+        std::vector<std::string> expired;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            segmenterStats.segments++;
+            segmenterStats.bytes += segment.bytes;
+            segmenterStats.longestSegment = std::max(segmenterStats.longestSegment, segment.duration);
+            segmenterStats.shortestSegment = segmenterStats.segments == 1 ? segment.duration : std::min(segmenterStats.shortestSegment, segment.duration);
+            peakBandwidth = std::max<uint64_t>(peakBandwidth, segment.duration > 0 ? segment.bytes * 80000000ull / segment.duration : 0);
+
+            listed.push_back(segment);
+            while (listed.size() > options.windowSegments)
+            {
+                retired.push_back(listed.front().uri);
+                listed.pop_front();
+            }
+            while (retired.size() > options.keepSegments)
+            {
+                expired.push_back(retired.front());
+                retired.pop_front();
+            }
+        }
+
+        // Out of the playlists first, then gone
+        updatePlaylists(false);
+        for (const std::string& uri : expired)
+            remove(uri);
+    }
+
+    void updatePlaylists(bool ended)
+    {
+        LivePlaylistInfo info;
+        std::deque<LiveSegment> current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = listed;
+            info.bandwidth = options.bandwidth != 0 ? options.bandwidth : (uint32_t)std::min<uint64_t>(peakBandwidth, UINT32_MAX);
+        }
+        info.format = options.format;
+        info.initUri = initName();
+        info.mediaTemplate = options.name + "_$Number%05d$" + extension;
+        info.codecs = options.format == SegmentFormat::Fmp4 ? builder.codecString() : "avc1";
+        info.width = options.width;
+        info.height = options.height;
+        info.targetDuration = segmentTicks;
+        info.availabilityStart = availabilityStart;
+        info.ended = ended;
+
+        std::string hls = options.hls ? buildHlsPlaylist(info, current) : std::string();
+        std::string dash = options.dash && options.format == SegmentFormat::Fmp4 ? buildDashManifest(info, current) : std::string();
+        bool ok = true;
+        if (options.storage == SegmentStorage::Disk)
+        {
+            ok = (hls.empty() || replaceText(hlsName(), hls)) && ok;
+            ok = (dash.empty() || replaceText(dashName(), dash)) && ok;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        hlsText = hls;
+        dashText = dash;
+        segmenterStats.playlistUpdates++;
+        segmenterStats.writeFailures += ok ? 0 : 1;
+    }
+
+    void store(const std::string& uri, const PacketGather& data)
+    {
+        bool ok = true;
+        if (options.storage == SegmentStorage::Disk)
+        {
+            OutputFile output;
+            ok = output.open(path(uri).c_str(), false) && output.write(data.spans().data(), data.spans().size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (options.storage == SegmentStorage::Memory)
+            files[uri] = data;
+        segmenterStats.writeFailures += ok ? 0 : 1;
+    }
+
+    void remove(const std::string& uri)
+    {
+        if (options.storage == SegmentStorage::Disk)
+            std::remove(path(uri).c_str());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        files.erase(uri);
+        segmenterStats.removed++;
+    }
+
+    // Readers see the old file or the new one, never part of either
+    bool replaceText(const std::string& uri, const std::string& text)
+    {
+        std::string target = path(uri);
+        std::string temporary = target + ".tmp";
+        OutputFile output;
+        ByteSpan span = { (const uint8_t*)text.data(), text.size() };
+        bool ok = output.open(temporary.c_str(), false) && output.write(&span, 1);
+        output.close();
+#ifdef _WIN32
+        return ok && MoveFileExA(temporary.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        return ok && std::rename(temporary.c_str(), target.c_str()) == 0;
+#endif
+    }
+
+    std::string path(const std::string& uri) const
+    {
+        return options.directory.empty() ? uri : options.directory + "/" + uri;
+    }
+
+    LiveSegmenterOptions options;
+    int64_t segmentTicks;
+    const char* extension;
+
+    // Output side
+    Mp4FragmentBuilder builder;
+    MpegTsWriter ts;
+    PacketPool pool;
+    bool started = false;
+    bool finished = false;
+    int64_t firstTime = 0;
+    int64_t segmentStart = 0;
+    int64_t nextBoundary = 0;
+    int64_t lastEnd = 0;
+    uint64_t segmentNumber = 0;
+    uint32_t sequence = 0;
+    std::vector<Mp4Sample> samples;
+    EncodedPacket segment;
+    PacketPool::Buffer* payload = nullptr;
+    std::chrono::system_clock::time_point availabilityStart;
+
+    // Shared with the I/O strand and readers
+    mutable std::mutex mutex;
+    std::condition_variable idle;
+    uint32_t pending = 0;
+    std::deque<LiveSegment> listed;
+    std::deque<std::string> retired;
+    std::map<std::string, PacketGather> files;
+    std::string hlsText;
+    std::string dashText;
+    uint64_t peakBandwidth = 0;
+    LiveSegmenterStats segmenterStats;
+
+    // The pool is declared first so the queue on it goes first
+    std::unique_ptr<WorkerPool> ownWorkers;
+    SerialQueue io;
+};
@@ -0,0 +1,612 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Project
+#include "common.h"
+#include "cpu_features.h"
+
+// ----------------------------------------------------------------------------
+// Lookahead
+//
+// Looks at frames before they go into the encoder, so IDRs can fall on scene
+// cuts and QP can follow the content. Every frame's NV12 luma is reduced to
+// 4x4 block means, and that small plane is compared with the previous
+// frame's: the mean absolute difference (SAD per block), the variance of the
+// plane, and the distance between their 64 bin histograms. pushBlocks()
+// takes block means a preprocessing pass made already, see
+// frame_preprocessor.h. A frame is only decided once depth frames after it
+// have been seen:
+//
+// - It is a scene cut when its histogram moved by histogramThreshold or more,
+//   its SAD is at least sadThreshold and sadRatio times the SAD of the frames
+//   before it (so a fast pan is no cut), no cut was in the last
+//   minCutInterval frames, and the picture does not come back within the
+//   next two frames (a flash).
+// - Its complexity is the spatial detail it adds: the plane's deviation for
+//   cuts and the first frame, its SAD plus a quarter of the deviation
+//   otherwise. Its QP offset is qpStrength * log2 of its complexity over the
+//   mean of the lookahead window up to the next likely cut, within
+//   +-maxQpOffset; cuts and the first frame get cutQpOffset, since
+//   everything after them refers to them.
+//
+// The kernels do integer math only, so every SIMD path is bit exact with the
+// scalar one and decisions are the same on every machine.
+// ----------------------------------------------------------------------------
+
+constexpr uint32_t MIN_LOOKAHEAD = 5;
+constexpr uint32_t MAX_LOOKAHEAD = 30;
+constexpr uint32_t LOOKAHEAD_BLOCK = 4;
+constexpr uint32_t LOOKAHEAD_BINS = 64;
+
+enum class AnalysisKernel { Auto, Scalar, Sse2, Avx2, Neon };
+
+inline const char* analysisKernelName(AnalysisKernel kernel)
+{
+    switch (kernel)
+    {
+    case AnalysisKernel::Scalar: return "scalar";
+    case AnalysisKernel::Sse2: return "sse2";
+    case AnalysisKernel::Avx2: return "avx2";
+    case AnalysisKernel::Neon: return "neon";
+    default: return "auto";
+    }
+}
+
+inline bool analysisKernelSupported(AnalysisKernel kernel)
+{
+    switch (kernel)
+    {
+    case AnalysisKernel::Scalar: return true;
+    case AnalysisKernel::Sse2: return cpuFeatures().sse2;
+    case AnalysisKernel::Avx2: return cpuFeatures().avx2;
+    case AnalysisKernel::Neon: return cpuFeatures().neon;
+    default: return false;
+    }
+}
+
+inline AnalysisKernel bestAnalysisKernel()
+{
+    if (analysisKernelSupported(AnalysisKernel::Avx2))
+        return AnalysisKernel::Avx2;
+    if (analysisKernelSupported(AnalysisKernel::Neon))
+        return AnalysisKernel::Neon;
+    if (analysisKernelSupported(AnalysisKernel::Sse2))
+        return AnalysisKernel::Sse2;
+    return AnalysisKernel::Scalar;
+}
+
+// ----------------------------------------------------------------------------
+// Kernels
+//
+// decimateRow: the 4x4 block means of four rows, (sum + 8) >> 4
+// sad: sum of absolute differences
+// sums: sum and sum of squares
+// sad and sums take at most LOOKAHEAD_CHUNK bytes, so no lane overflows.
+// ----------------------------------------------------------------------------
+
+constexpr size_t LOOKAHEAD_CHUNK = 65536;
+
+typedef void (*DecimateRowFn)(const uint8_t* src, size_t pitch, uint32_t blocks, uint8_t* dst);
+typedef uint64_t (*SadFn)(const uint8_t* a, const uint8_t* b, size_t count);
+typedef void (*SumsFn)(const uint8_t* data, size_t count, uint64_t& sum, uint64_t& squares);
+
+inline void decimateRowScalar(const uint8_t* src, size_t pitch, uint32_t blocks, uint8_t* dst)
+{
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        uint32_t sum = 0;
+        for (uint32_t y = 0; y < LOOKAHEAD_BLOCK; y++)
+        {
+            const uint8_t* p = src + pitch * y + b * LOOKAHEAD_BLOCK;
+            sum += p[0] + p[1] + p[2] + p[3];
+        }
+        dst[b] = (uint8_t)((sum + 8) >> 4);
+    }
+}
+
+inline uint64_t sadScalar(const uint8_t* a, const uint8_t* b, size_t count)
+{
+    uint64_t sad = 0;
+    for (size_t i = 0; i < count; i++)
+        sad += (uint64_t)std::abs((int)a[i] - (int)b[i]);
+    return sad;
+}
+
+inline void sumsScalar(const uint8_t* data, size_t count, uint64_t& sum, uint64_t& squares)
+{
+    uint64_t s = 0, q = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        s += data[i];
+        q += (uint32_t)data[i] * data[i];
+    }
+    sum = s;
+    squares = q;
+}
+
+#if defined(ARCH_X86)
+
+// Four 4x4 blocks from 16 columns of four rows
+TARGET_SSE2 inline __m128i decimateSse2(__m128i r0, __m128i r1, __m128i r2, __m128i r3)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero)),
+                               _mm_add_epi16(_mm_unpacklo_epi8(r2, zero), _mm_unpacklo_epi8(r3, zero)));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero)),
+                               _mm_add_epi16(_mm_unpackhi_epi8(r2, zero), _mm_unpackhi_epi8(r3, zero)));
+    // Column pairs, then pairs of pairs, at most 16 * 255 so the packs are exact
+    __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+    __m128i sums = _mm_madd_epi16(pairs, ones);
+    return _mm_srli_epi32(_mm_add_epi32(sums, _mm_set1_epi32(8)), 4);
+}
+
+TARGET_SSE2 inline void decimateRowSse2(const uint8_t* src, size_t pitch, uint32_t blocks, uint8_t* dst)
+{
+    uint32_t b = 0;
+    for (; b + 4 <= blocks; b += 4)
+    {
+        const uint8_t* p = src + b * LOOKAHEAD_BLOCK;
+        __m128i means = decimateSse2(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + pitch)),
+                                     _mm_loadu_si128((const __m128i*)(p + pitch * 2)), _mm_loadu_si128((const __m128i*)(p + pitch * 3)));
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(means, means), means);
+        int32_t packed = _mm_cvtsi128_si32(bytes);
+        memcpy(dst + b, &packed, 4);
+    }
+    decimateRowScalar(src + b * LOOKAHEAD_BLOCK, pitch, blocks - b, dst + b);
+}
+
+TARGET_SSE2 inline uint64_t sadSse2(const uint8_t* a, const uint8_t* b, size_t count)
+{
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, total);
+    return lanes[0] + lanes[1] + sadScalar(a + i, b + i, count - i);
+}
+
+TARGET_SSE2 inline void sumsSse2(const uint8_t* data, size_t count, uint64_t& sum, uint64_t& squares)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = zero, squareSums = zero;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        squareSums = _mm_add_epi32(squareSums, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint64_t sumLanes[2];
+    uint32_t squareLanes[4];
+    _mm_storeu_si128((__m128i*)sumLanes, sums);
+    _mm_storeu_si128((__m128i*)squareLanes, squareSums);
+    uint64_t tailSum, tailSquares;
+    sumsScalar(data + i, count - i, tailSum, tailSquares);
+    sum = sumLanes[0] + sumLanes[1] + tailSum;
+    squares = (uint64_t)squareLanes[0] + squareLanes[1] + squareLanes[2] + squareLanes[3] + tailSquares;
+}
+
+TARGET_AVX2 inline void decimateRowAvx2(const uint8_t* src, size_t pitch, uint32_t blocks, uint8_t* dst)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    uint32_t b = 0;
+    for (; b + 8 <= blocks; b += 8)
+    {
+        const uint8_t* p = src + b * LOOKAHEAD_BLOCK;
+        __m256i r0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i r1 = _mm256_loadu_si256((const __m256i*)(p + pitch));
+        __m256i r2 = _mm256_loadu_si256((const __m256i*)(p + pitch * 2));
+        __m256i r3 = _mm256_loadu_si256((const __m256i*)(p + pitch * 3));
+        // Within each 128 bit lane, as in the SSE2 kernel, so the blocks stay in order
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(r0, zero), _mm256_unpacklo_epi8(r1, zero)),
+                                      _mm256_add_epi16(_mm256_unpacklo_epi8(r2, zero), _mm256_unpacklo_epi8(r3, zero)));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(r0, zero), _mm256_unpackhi_epi8(r1, zero)),
+                                      _mm256_add_epi16(_mm256_unpackhi_epi8(r2, zero), _mm256_unpackhi_epi8(r3, zero)));
+        __m256i pairs = _mm256_packs_epi32(_mm256_madd_epi16(lo, ones), _mm256_madd_epi16(hi, ones));
+        __m256i sums = _mm256_madd_epi16(pairs, ones);
+        __m256i means = _mm256_srli_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(8)), 4);
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(means), _mm256_extracti128_si256(means, 1));
+        _mm_storel_epi64((__m128i*)(dst + b), _mm_packus_epi16(words, words));
+    }
+    decimateRowSse2(src + b * LOOKAHEAD_BLOCK, pitch, blocks - b, dst + b);
+}
+
+TARGET_AVX2 inline uint64_t sadAvx2(const uint8_t* a, const uint8_t* b, size_t count)
+{
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sadSse2(a + i, b + i, count - i);
+}
+
+TARGET_AVX2 inline void sumsAvx2(const uint8_t* data, size_t count, uint64_t& sum, uint64_t& squares)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sums = zero, squareSums = zero;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero);
+        __m256i hi = _mm256_unpackhi_epi8(v, zero);
+        squareSums = _mm256_add_epi32(squareSums, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+    }
+    uint64_t sumLanes[4];
+    uint32_t squareLanes[8];
+    _mm256_storeu_si256((__m256i*)sumLanes, sums);
+    _mm256_storeu_si256((__m256i*)squareLanes, squareSums);
+    uint64_t tailSum, tailSquares;
+    sumsSse2(data + i, count - i, tailSum, tailSquares);
+    sum = sumLanes[0] + sumLanes[1] + sumLanes[2] + sumLanes[3] + tailSum;
+    squares = tailSquares;
+    for (uint32_t lane : squareLanes)
+        squares += lane;
+}
+
+#endif
+
+#if defined(ARCH_ARM64)
+
+inline void decimateRowNeon(const uint8_t* src, size_t pitch, uint32_t blocks, uint8_t* dst)
+{
+    uint32_t b = 0;
+    for (; b + 4 <= blocks; b += 4)
+    {
+        const uint8_t* p = src + b * LOOKAHEAD_BLOCK;
+        uint16x8_t pairs = vpaddlq_u8(vld1q_u8(p));
+        pairs = vpadalq_u8(pairs, vld1q_u8(p + pitch));
+        pairs = vpadalq_u8(pairs, vld1q_u8(p + pitch * 2));
+        pairs = vpadalq_u8(pairs, vld1q_u8(p + pitch * 3));
+        uint32x4_t sums = vpaddlq_u16(pairs);
+        uint16x4_t means = vmovn_u32(vshrq_n_u32(vaddq_u32(sums, vdupq_n_u32(8)), 4));
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(means, means));
+        vst1_lane_u32((uint32_t*)(void*)(dst + b), vreinterpret_u32_u8(bytes), 0);
+    }
+    decimateRowScalar(src + b * LOOKAHEAD_BLOCK, pitch, blocks - b, dst + b);
+}
+
+inline uint64_t sadNeon(const uint8_t* a, const uint8_t* b, size_t count)
+{
+    uint32x4_t total = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        total = vpadalq_u16(total, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    return vaddlvq_u32(total) + sadScalar(a + i, b + i, count - i);
+}
+
+inline void sumsNeon(const uint8_t* data, size_t count, uint64_t& sum, uint64_t& squares)
+{
+    uint32x4_t sums = vdupq_n_u32(0), squareSums = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(data + i);
+        sums = vpadalq_u16(sums, vpaddlq_u8(v));
+        squareSums = vpadalq_u16(squareSums, vmull_u8(vget_low_u8(v), vget_low_u8(v)));
+        squareSums = vpadalq_u16(squareSums, vmull_u8(vget_high_u8(v), vget_high_u8(v)));
+    }
+    uint64_t tailSum, tailSquares;
+    sumsScalar(data + i, count - i, tailSum, tailSquares);
+    sum = vaddlvq_u32(sums) + tailSum;
+    squares = vaddlvq_u32(squareSums) + tailSquares;
+}
+
+#endif
+
+struct AnalysisKernels
+{
+    DecimateRowFn decimateRow;
+    SadFn sad;
+    SumsFn sums;
+};
+
+inline AnalysisKernels analysisKernels(AnalysisKernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(ARCH_X86)
+    case AnalysisKernel::Sse2: return { decimateRowSse2, sadSse2, sumsSse2 };
+    case AnalysisKernel::Avx2: return { decimateRowAvx2, sadAvx2, sumsAvx2 };
+#endif
+#if defined(ARCH_ARM64)
+    case AnalysisKernel::Neon: return { decimateRowNeon, sadNeon, sumsNeon };
+#endif
+    default: return { decimateRowScalar, sadScalar, sumsScalar };
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Scene analysis
+// ----------------------------------------------------------------------------
+
+struct LookaheadOptions
+{
+    uint32_t depth = 10;                // frames seen before one is decided, MIN_LOOKAHEAD to MAX_LOOKAHEAD
+    double histogramThreshold = 0.35;   // half the L1 distance of the histograms, 0 to 1
+    double sadThreshold = 12;           // mean absolute difference of the block means
+    double sadRatio = 2.5;              // over the mean SAD of the frames before
+    uint32_t minCutInterval = 6;        // frames from one cut to the next
+    double qpStrength = 2;              // QP per doubling of complexity
+    int32_t maxQpOffset = 4;
+    int32_t cutQpOffset = -2;
+};
+
+// One frame against the one before it
+struct FrameAnalysis
+{
+    double sad = 0;                     // mean absolute difference per block
+    double deviation = 0;               // standard deviation of the block means
+    double histogramDistance = 0;
+};
+
+struct LookaheadDecision
+{
+    uint64_t frame = 0;
+    bool sceneCut = false;
+    int32_t qpOffset = 0;
+    double complexity = 0;
+    FrameAnalysis analysis;
+};
+
+struct LookaheadStats
+{
+    uint64_t frames = 0;                // analyzed
+    uint64_t decided = 0;
+    uint64_t sceneCuts = 0;
+    uint64_t flashes = 0;               // cuts the picture came back from
+    double analysisUs = 0;              // per frame, on average
+};
+
+class Lookahead
+{
+public:
+    Lookahead(const LookaheadOptions& options, uint32_t width, uint32_t height, AnalysisKernel kernel = AnalysisKernel::Auto)
+        : options(options), blocksX(width / LOOKAHEAD_BLOCK), blocksY(height / LOOKAHEAD_BLOCK)
+    {
+        CHECK(options.depth >= MIN_LOOKAHEAD && options.depth <= MAX_LOOKAHEAD);
+        CHECK(blocksX != 0 && blocksY != 0);
+        if (kernel == AnalysisKernel::Auto)
+            kernel = bestAnalysisKernel();
+        CHECK(analysisKernelSupported(kernel));
+        this->kernel = kernel;
+        kernels = analysisKernels(kernel);
+
+        // The frame before the oldest undecided one, and depth after it
+        entries.resize(options.depth + 2);
+        for (Entry& entry : entries)
+            entry.plane.resize((size_t)blocksX * blocksY);
+    }
+
+    // The next frame's luma. Room for it comes from pop(), see ready().
+    void push(const uint8_t* luma, size_t pitch)
+    {
+        CHECK(!flushing && pushed - decided < options.depth + 1);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        Entry& entry = at(pushed);
+        for (uint32_t y = 0; y < blocksY; y++)
+            kernels.decimateRow(luma + pitch * y * LOOKAHEAD_BLOCK, pitch, blocksX, entry.plane.data() + (size_t)blocksX * y);
+        analyze(entry, start);
+    }
+
+    // The next frame as its 4x4 block means, blocksX by blocksY of them, from
+    // a pass that made them while it had the luma in cache anyway
+    void pushBlocks(const uint8_t* blocks)
+    {
+        CHECK(!flushing && pushed - decided < options.depth + 1);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        Entry& entry = at(pushed);
+        memcpy(entry.plane.data(), blocks, entry.plane.size());
+        analyze(entry, start);
+    }
+
+    // No more frames, every frame pushed can be decided
+    void flush() { flushing = true; }
+
+    bool ready() const { return decided < pushed && (flushing || pushed - decided > options.depth); }
+
+    // The oldest undecided frame, when depth frames after it are in
+    bool pop(LookaheadDecision& decision)
+    {
+        if (!ready())
+            return false;
+        uint64_t frame = decided;
+        Entry& entry = at(frame);
+
+        decision = LookaheadDecision();
+        decision.frame = frame;
+        decision.analysis = entry.analysis;
+        decision.sceneCut = frame != 0 && isSceneCut(frame);
+        bool intra = frame == 0 || decision.sceneCut;
+        if (intra)
+        {
+            // Coded on its own, and what follows is coded against it
+            entry.complexity = entry.analysis.deviation;
+            lastCut = frame;
+            decision.qpOffset = options.cutQpOffset;
+        }
+        else
+        {
+            decision.qpOffset = qpOffsetFor(frame);
+        }
+        decision.complexity = entry.complexity;
+        if (frame != 0 && !decision.sceneCut)
+            sadHistory = sadHistory == 0 ? entry.analysis.sad : sadHistory * 0.75 + entry.analysis.sad * 0.25;
+
+        decided++;
+        statCuts += decision.sceneCut ? 1 : 0;
+        return true;
+    }
+
+    // Frames pushed and not decided yet
+    uint64_t pending() const { return pushed - decided; }
+
+    const LookaheadOptions& settings() const { return options; }
+    AnalysisKernel activeKernel() const { return kernel; }
+
+    LookaheadStats stats() const
+    {
+        LookaheadStats result;
+        result.frames = statFrames;
+        result.decided = decided;
+        result.sceneCuts = statCuts;
+        result.flashes = statFlashes;
+        result.analysisUs = statFrames ? analysisNs / 1000.0 / statFrames : 0;
+        return result;
+    }
+
+private:
+    struct Entry
+    {
+        std::vector<uint8_t> plane;
+        uint32_t histogram[LOOKAHEAD_BINS];
+        FrameAnalysis analysis;
+        double complexity = 0;
+    };
+
+    Entry& at(uint64_t frame) { return entries[frame % entries.size()]; }
+
+    // The pushed frame's statistics, from its block means
+    void analyze(Entry& entry, std::chrono::steady_clock::time_point start)
+    {
+        std::fill(entry.histogram, entry.histogram + LOOKAHEAD_BINS, 0u);
+        for (uint8_t value : entry.plane)
+            entry.histogram[value * LOOKAHEAD_BINS / 256]++;
+
+        uint64_t sum = 0, squares = 0;
+        forChunks(entry.plane.data(), nullptr, [&](const uint8_t* a, const uint8_t*, size_t count)
+        {
+            uint64_t chunkSum, chunkSquares;
+            kernels.sums(a, count, chunkSum, chunkSquares);
+            sum += chunkSum;
+            squares += chunkSquares;
+        });
+        double count = (double)entry.plane.size();
+        double mean = sum / count;
+        entry.analysis = FrameAnalysis();
+        entry.analysis.deviation = std::sqrt(std::max(0.0, squares / count - mean * mean));
+        if (pushed != 0)
+        {
+            const Entry& previous = at(pushed - 1);
+            entry.analysis.sad = meanSad(entry, previous);
+            entry.analysis.histogramDistance = histogramDistance(entry, previous);
+        }
+        entry.complexity = 0.25 * entry.analysis.deviation + entry.analysis.sad;
+        pushed++;
+
+        statFrames++;
+        analysisNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    template <typename Fn>
+    void forChunks(const uint8_t* a, const uint8_t* b, Fn fn) const
+    {
+        size_t size = (size_t)blocksX * blocksY;
+        for (size_t offset = 0; offset < size; offset += LOOKAHEAD_CHUNK)
+            fn(a + offset, b ? b + offset : nullptr, std::min(LOOKAHEAD_CHUNK, size - offset));
+    }
+
+    double meanSad(const Entry& a, const Entry& b) const
+    {
+        uint64_t sad = 0;
+        forChunks(a.plane.data(), b.plane.data(), [&](const uint8_t* x, const uint8_t* y, size_t count) { sad += kernels.sad(x, y, count); });
+        return (double)sad / a.plane.size();
+    }
+
+    double histogramDistance(const Entry& a, const Entry& b) const
+    {
+        uint64_t distance = 0;
+        for (uint32_t bin = 0; bin < LOOKAHEAD_BINS; bin++)
+            distance += a.histogram[bin] > b.histogram[bin] ? a.histogram[bin] - b.histogram[bin] : b.histogram[bin] - a.histogram[bin];
+        return (double)distance / (2.0 * a.plane.size());
+    }
+
+    bool isSceneCut(uint64_t frame)
+    {
+        const FrameAnalysis& analysis = at(frame).analysis;
+        if (analysis.histogramDistance < options.histogramThreshold || analysis.sad < options.sadThreshold)
+            return false;
+        if (sadHistory != 0 && analysis.sad < options.sadRatio * sadHistory)
+            return false;
+        if (lastCut != NO_CUT && frame - lastCut < options.minCutInterval)
+            return false;
+        if (flashEnd != NO_CUT && frame <= flashEnd)
+            return false;
+
+        // A flash: one of the next two pictures is the one before again
+        const Entry& before = at(frame - 1);
+        for (uint64_t next = frame + 1; next <= frame + 2 && next < pushed; next++)
+        {
+            const Entry& after = at(next);
+            if (meanSad(after, before) < options.sadThreshold && histogramDistance(after, before) < options.histogramThreshold)
+            {
+                // Nor is the way back from it
+                flashEnd = next;
+                statFlashes++;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Against the frames still in the window, this one included, up to the
+    // next frame that looks like a cut: what comes after it is another shot
+    int32_t qpOffsetFor(uint64_t frame)
+    {
+        double total = 0;
+        uint64_t end = std::min(pushed, frame + options.depth + 1);
+        for (uint64_t other = frame; other < end; other++)
+        {
+            const FrameAnalysis& analysis = at(other).analysis;
+            if (other != frame && analysis.histogramDistance >= options.histogramThreshold && analysis.sad >= options.sadThreshold)
+            {
+                end = other;
+                break;
+            }
+            total += std::max(1.0, at(other).complexity);
+        }
+        double mean = total / (double)(end - frame);
+        double ratio = std::max(1.0, at(frame).complexity) / mean;
+        int32_t offset = (int32_t)std::lround(options.qpStrength * std::log2(ratio));
+        return std::max(-options.maxQpOffset, std::min(options.maxQpOffset, offset));
+    }
+
+    static constexpr uint64_t NO_CUT = UINT64_MAX;
+
+    LookaheadOptions options;
+    uint32_t blocksX;
+    uint32_t blocksY;
+    AnalysisKernel kernel;
+    AnalysisKernels kernels;
+
+    std::vector<Entry> entries;
+    uint64_t pushed = 0;
+    uint64_t decided = 0;
+    bool flushing = false;
+    uint64_t lastCut = NO_CUT;
+    uint64_t flashEnd = NO_CUT;         // last frame of the flash found last
+    double sadHistory = 0;              // SAD of the decided frames, smoothed
+
+    uint64_t statFrames = 0;
+    uint64_t statCuts = 0;
+    uint64_t statFlashes = 0;
+    uint64_t analysisNs = 0;
+};
@@ -0,0 +1,491 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+// winsock.h, which windows.h brings in, has everything used here
+#if !defined(_WINSOCKAPI_)
+#include <winsock2.h>
+#endif
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Project
+#include "common.h"
+#include "metrics_registry.h"
+
+// ----------------------------------------------------------------------------
+// Metrics export
+//
+// Two ways out of the process for what a MetricsRegistry collects, both on
+// the loopback interface only:
+// - a Prometheus endpoint: GET /metrics on 127.0.0.1:port answers with the
+//   text exposition format, collected when asked
+// - StatsD: every interval, counter increments since the last push, gauges,
+//   and per histogram the increment of its count and the interval's mean and
+//   p99 (bucket upper bound), as UDP datagrams to 127.0.0.1:port. Labels go
+//   out as DogStatsD tags, which the StatsD exporters and Telegraf read.
+// One thread does both and is idle in between; nothing on the encode path
+// waits for it.
+// ----------------------------------------------------------------------------
+
+// Text exposition format, version 0.0.4
+inline std::string prometheusText(const std::vector<MetricValue>& values)
+{
+    auto escape = [](const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+            if (c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    };
+    auto labelText = [&escape](const MetricLabels& labels, const char* le)
+    {
+        std::string text;
+        for (const auto& label : labels)
+            text += (text.empty() ? "" : ",") + label.first + "=\"" + escape(label.second) + "\"";
+        if (le)
+            text += (text.empty() ? "" : ",") + std::string("le=\"") + le + "\"";
+        return text.empty() ? text : "{" + text + "}";
+    };
+    auto number = [](double value)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.17g", value);
+        return std::string(text);
+    };
+
+    static const char* typeNames[] = { "counter", "gauge", "histogram" };
+    std::string text;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        const MetricValue& value = values[i];
+        if (i == 0 || values[i - 1].name != value.name)
+            text += "# HELP " + value.name + " " + value.help + "\n# TYPE " + value.name + " " + typeNames[(int)value.type] + "\n";
+        if (value.type != MetricType::Histogram)
+        {
+            text += value.name + labelText(value.labels, nullptr) + " " + number(value.value) + "\n";
+            continue;
+        }
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < value.buckets.size(); b++)
+        {
+            cumulative += value.buckets[b];
+            std::string le = b < value.bounds.size() ? number(value.bounds[b]) : "+Inf";
+            text += value.name + "_bucket" + labelText(value.labels, le.c_str()) + " " + std::to_string(cumulative) + "\n";
+        }
+        text += value.name + "_sum" + labelText(value.labels, nullptr) + " " + number(value.sum) + "\n";
+        text += value.name + "_count" + labelText(value.labels, nullptr) + " " + std::to_string(value.count) + "\n";
+    }
+    return text;
+}
+
+// StatsD lines since the previous values, which it then replaces. Counters
+// and histogram counts that did not move are left out.
+inline std::vector<std::string> statsdLines(const std::vector<MetricValue>& values, std::map<std::string, MetricValue>& previous)
+{
+    std::vector<std::string> lines;
+    for (const MetricValue& value : values)
+    {
+        std::string key = value.name, tags;
+        for (const auto& label : value.labels)
+        {
+            key += "," + label.first + "=" + label.second;
+            tags += (tags.empty() ? "|#" : ",") + label.first + ":" + label.second;
+        }
+        auto last = previous.find(key);
+        const MetricValue* before = last != previous.end() ? &last->second : nullptr;
+
+        char line[256];
+        if (value.type == MetricType::Gauge)
+        {
+            snprintf(line, sizeof(line), "%s:%.6g|g", value.name.c_str(), value.value);
+            lines.push_back(line + tags);
+        }
+        else if (value.type == MetricType::Counter)
+        {
+            // A counter that went back is a new series, all of it is new
+            double delta = before && value.value >= before->value ? value.value - before->value : value.value;
+            if (delta != 0)
+            {
+                snprintf(line, sizeof(line), "%s:%.0f|c", value.name.c_str(), delta);
+                lines.push_back(line + tags);
+            }
+        }
+        else
+        {
+            std::vector<uint64_t> buckets = value.buckets;
+            double sum = value.sum;
+            if (before && before->count <= value.count && before->buckets.size() == buckets.size())
+            {
+                for (size_t b = 0; b < buckets.size(); b++)
+                    buckets[b] -= std::min(buckets[b], before->buckets[b]);
+                sum -= before->sum;
+            }
+            uint64_t count = 0;
+            for (uint64_t bucket : buckets)
+                count += bucket;
+            if (count != 0)
+            {
+                uint64_t rank = (uint64_t)std::ceil(count * 0.99), seen = 0;
+                size_t b = 0;
+                while (b + 1 < buckets.size() && (seen += buckets[b]) < rank)
+                    b++;
+                double p99 = b < value.bounds.size() ? value.bounds[b] : value.bounds.back();
+                snprintf(line, sizeof(line), "%s.count:%llu|c", value.name.c_str(), (unsigned long long)count);
+                lines.push_back(line + tags);
+                snprintf(line, sizeof(line), "%s.avg:%.6g|g", value.name.c_str(), sum / count);
+                lines.push_back(line + tags);
+                snprintf(line, sizeof(line), "%s.p99:%.6g|g", value.name.c_str(), p99);
+                lines.push_back(line + tags);
+            }
+        }
+        previous[key] = value;
+    }
+    return lines;
+}
+
+// ----------------------------------------------------------------------------
+// Loopback sockets
+// ----------------------------------------------------------------------------
+
+class LoopbackSocket
+{
+public:
+#ifdef _WIN32
+    typedef SOCKET Handle;
+    static constexpr Handle INVALID = INVALID_SOCKET;
+#else
+    typedef int Handle;
+    static constexpr Handle INVALID = -1;
+#endif
+
+    LoopbackSocket() {}
+    LoopbackSocket(const LoopbackSocket&) = delete;
+    LoopbackSocket& operator=(const LoopbackSocket&) = delete;
+    LoopbackSocket(LoopbackSocket&& other) : handle(other.handle) { other.handle = INVALID; }
+
+    ~LoopbackSocket() { close(); }
+
+    // Port 0 takes any free port, see port()
+    bool listenTcp(uint16_t port)
+    {
+        return open(SOCK_STREAM) && bindTo(port) && ::listen(handle, 8) == 0;
+    }
+
+    bool bindUdp(uint16_t port)
+    {
+        return open(SOCK_DGRAM) && bindTo(port);
+    }
+
+    bool openUdp()
+    {
+        return open(SOCK_DGRAM);
+    }
+
+    bool connectTcp(uint16_t port)
+    {
+        sockaddr_in address = loopback(port);
+        return open(SOCK_STREAM) && ::connect(handle, (const sockaddr*)&address, sizeof(address)) == 0;
+    }
+
+    uint16_t port() const
+    {
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        if (getsockname(handle, (sockaddr*)&address, &length) != 0)
+            return 0;
+        return ntohs(address.sin_port);
+    }
+
+    // Waits up to the timeout for something to read, or a connection to accept
+    bool readable(std::chrono::milliseconds timeout) const
+    {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(handle, &set);
+        timeval wait;
+        wait.tv_sec = (long)(timeout.count() / 1000);
+        wait.tv_usec = (long)(timeout.count() % 1000 * 1000);
+        return select((int)handle + 1, &set, nullptr, nullptr, &wait) > 0;
+    }
+
+    LoopbackSocket accept()
+    {
+        LoopbackSocket client;
+        client.handle = ::accept(handle, nullptr, nullptr);
+        return client;
+    }
+
+    // Bytes read, 0 at the end and on errors
+    size_t receive(char* data, size_t size)
+    {
+        int received = (int)::recv(handle, data, (int)size, 0);
+        return received > 0 ? (size_t)received : 0;
+    }
+
+    bool sendAll(const std::string& data)
+    {
+        for (size_t sent = 0; sent < data.size();)
+        {
+            int count = (int)::send(handle, data.data() + sent, (int)(data.size() - sent), 0);
+            if (count <= 0)
+                return false;
+            sent += (size_t)count;
+        }
+        return true;
+    }
+
+    bool sendTo(uint16_t port, const std::string& datagram)
+    {
+        sockaddr_in address = loopback(port);
+        return ::sendto(handle, datagram.data(), (int)datagram.size(), 0, (const sockaddr*)&address, sizeof(address)) == (int)datagram.size();
+    }
+
+    bool valid() const { return handle != INVALID; }
+
+    void close()
+    {
+        if (handle == INVALID)
+            return;
+#ifdef _WIN32
+        closesocket(handle);
+#else
+        ::close(handle);
+#endif
+        handle = INVALID;
+    }
+
+private:
+#ifdef _WIN32
+    typedef int socklen_t;
+#endif
+
+    static sockaddr_in loopback(uint16_t port)
+    {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        return address;
+    }
+
+    bool open(int type)
+    {
+        close();
+#ifdef _WIN32
+        static bool started = []()
+        {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        if (!started)
+            return false;
+#endif
+        handle = ::socket(AF_INET, type, 0);
+        if (handle == INVALID)
+            return false;
+        int reuse = 1;
+        setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+        return true;
+    }
+
+    bool bindTo(uint16_t port)
+    {
+        sockaddr_in address = loopback(port);
+        return ::bind(handle, (const sockaddr*)&address, sizeof(address)) == 0;
+    }
+
+    Handle handle = INVALID;
+};
+
+// ----------------------------------------------------------------------------
+// Exporter
+// ----------------------------------------------------------------------------
+
+struct MetricsExporterOptions
+{
+    uint16_t prometheusPort = 0;        // 0 = no endpoint
+    bool prometheus = false;            // with port 0, any free port
+    uint16_t statsdPort = 0;            // 0 = no StatsD
+    std::chrono::milliseconds statsdInterval{1000};
+    size_t statsdDatagramBytes = 1400;  // lines per datagram up to this, below the usual MTU
+};
+
+struct MetricsExporterStats
+{
+    uint64_t scrapes = 0;
+    uint64_t datagrams = 0;
+    uint64_t sendFailures = 0;
+};
+
+class MetricsExporter
+{
+public:
+    MetricsExporter(const MetricsRegistry& registry, const MetricsExporterOptions& options)
+        : registry(registry), options(options)
+    {
+    }
+
+    ~MetricsExporter()
+    {
+        stop();
+    }
+
+    // False with the reason when the port cannot be had
+    bool start(std::string& error)
+    {
+        if (options.prometheus || options.prometheusPort != 0)
+        {
+            if (!listener.listenTcp(options.prometheusPort))
+            {
+                error = "cannot listen on 127.0.0.1:" + std::to_string(options.prometheusPort);
+                return false;
+            }
+        }
+        if (options.statsdPort != 0 && !statsd.openUdp())
+        {
+            error = "cannot open a UDP socket for StatsD";
+            return false;
+        }
+        running = true;
+        thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    // Pushes to StatsD one last time
+    void stop()
+    {
+        if (!running.exchange(false))
+            return;
+        thread.join();
+        if (statsd.valid())
+            push();
+        listener.close();
+    }
+
+    // The endpoint's port, the one picked when it was 0
+    uint16_t prometheusPort() const { return listener.valid() ? listener.port() : 0; }
+
+    MetricsExporterStats stats() const
+    {
+        MetricsExporterStats result;
+        result.scrapes = scrapes.load();
+        result.datagrams = datagrams.load();
+        result.sendFailures = sendFailures.load();
+        return result;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void run()
+    {
+        Clock::time_point nextPush = Clock::now() + options.statsdInterval;
+        while (running)
+        {
+            std::chrono::milliseconds wait(100);
+            if (statsd.valid())
+            {
+                Clock::time_point now = Clock::now();
+                if (now >= nextPush)
+                {
+                    push();
+                    nextPush = now + options.statsdInterval;
+                }
+                wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(nextPush - now) + std::chrono::milliseconds(1));
+            }
+            if (!listener.valid())
+            {
+                std::this_thread::sleep_for(wait);
+                continue;
+            }
+            if (listener.readable(wait))
+                serve(listener.accept());
+        }
+    }
+
+    // One request per connection, which is what scrapers do
+    void serve(LoopbackSocket client)
+    {
+        if (!client.valid())
+            return;
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 && client.readable(std::chrono::milliseconds(1000)))
+        {
+            size_t received = client.receive(buffer, sizeof(buffer));
+            if (received == 0)
+                break;
+            request.append(buffer, received);
+        }
+
+        bool metrics = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0 || request.compare(0, 6, "GET / ") == 0;
+        std::string body = metrics ? prometheusText(registry.collect()) : "not found\n";
+        std::string response = std::string(metrics ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n") +
+            "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        client.sendAll(response);
+        if (metrics)
+            scrapes++;
+    }
+
+    void push()
+    {
+        std::vector<std::string> lines = statsdLines(registry.collect(), previous);
+        std::string datagram;
+        for (const std::string& line : lines)
+        {
+            if (!datagram.empty() && datagram.size() + 1 + line.size() > options.statsdDatagramBytes)
+                send(datagram);
+            datagram += (datagram.empty() ? "" : "\n") + line;
+        }
+        if (!datagram.empty())
+            send(datagram);
+    }
+
+    void send(std::string& datagram)
+    {
+        if (statsd.sendTo(options.statsdPort, datagram))
+            datagrams++;
+        else
+            sendFailures++;
+        datagram.clear();
+    }
+
+    const MetricsRegistry& registry;
+    MetricsExporterOptions options;
+    LoopbackSocket listener;
+    LoopbackSocket statsd;
+    std::map<std::string, MetricValue> previous;    // exporter thread, then stop()
+    std::atomic<bool> running{false};
+    std::thread thread;
+    std::atomic<uint64_t> scrapes{0};
+    std::atomic<uint64_t> datagrams{0};
+    std::atomic<uint64_t> sendFailures{0};
+};
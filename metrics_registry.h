@@ -0,0 +1,518 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Project
+#include "common.h"
+#include "encoded_packet.h"
+
+// ----------------------------------------------------------------------------
+// Metrics
+//
+// Counters, gauges and histograms for monitoring, cheap enough to update on
+// every frame. Every thread that records gets a shard of its own, so a
+// counter update is a relaxed load and store on a cache line no other thread
+// writes, with no lock and no atomic read-modify-write. collect() adds the
+// shards up; it only takes the lock that guards the list of series.
+//
+// Gauges hold one value for everyone and are set with a relaxed store.
+// Histograms count into fixed buckets, upper bounds in the unit recorded
+// (seconds for latencies), and keep the sum, as Prometheus has them.
+// metrics_exporter.h serves what collect() returns.
+// ----------------------------------------------------------------------------
+
+enum class MetricType { Counter, Gauge, Histogram };
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+// Upper bounds in seconds for frame latencies, 0.5 ms to 1 s
+inline const std::vector<double>& latencyBuckets()
+{
+    static const std::vector<double> bounds = { 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1 };
+    return bounds;
+}
+
+// Handle for recording, valid as long as the registry and the series are
+struct MetricId
+{
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    uint32_t series = NONE;
+    uint32_t cell = 0;                  // first of its cells
+    const double* bounds = nullptr;     // histograms only
+    uint32_t boundCount = 0;
+
+    bool valid() const { return series != NONE; }
+};
+
+// One series summed over every shard
+struct MetricValue
+{
+    std::string name;
+    std::string help;
+    MetricType type = MetricType::Counter;
+    MetricLabels labels;
+    double value = 0;                   // counters and gauges
+    std::vector<double> bounds;         // histograms: upper bounds, +Inf implied
+    std::vector<uint64_t> buckets;      // per bucket, not cumulative, one more than bounds
+    double sum = 0;
+    uint64_t count = 0;
+};
+
+class MetricsRegistry
+{
+public:
+    MetricsRegistry()
+        : serial(nextSerial().fetch_add(1) + 1)
+    {
+    }
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    MetricId counter(const std::string& name, const std::string& help, const MetricLabels& labels = MetricLabels())
+    {
+        return add(name, help, MetricType::Counter, labels, std::vector<double>());
+    }
+
+    MetricId gauge(const std::string& name, const std::string& help, const MetricLabels& labels = MetricLabels())
+    {
+        return add(name, help, MetricType::Gauge, labels, std::vector<double>());
+    }
+
+    MetricId histogram(const std::string& name, const std::string& help, const MetricLabels& labels, const std::vector<double>& bounds)
+    {
+        CHECK(!bounds.empty() && std::is_sorted(bounds.begin(), bounds.end()));
+        return add(name, help, MetricType::Histogram, labels, bounds);
+    }
+
+    // The series is no longer collected and its cells go to the next one.
+    // Nothing may record into it any more.
+    void remove(MetricId& id)
+    {
+        if (!id.valid())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        Series& series = allSeries[id.series];
+        if (!series.removed)
+        {
+            series.removed = true;
+            for (uint32_t i = 0; i < series.cells; i++)
+            {
+                for (const std::unique_ptr<Shard>& shard : shards)
+                    shard->reset(series.cell + i);
+                gauges.reset(series.cell + i);
+            }
+            freeCells.insert(std::make_pair(series.cells, series.cell));
+        }
+        id = MetricId();
+    }
+
+    // Any thread
+    void add(const MetricId& id, uint64_t count = 1)
+    {
+        if (id.valid())
+            localShard().add(id.cell, count);
+    }
+
+    void set(const MetricId& id, double value)
+    {
+        if (id.valid())
+            gauges.store(id.cell, toBits(value));
+    }
+
+    void observe(const MetricId& id, double value)
+    {
+        if (!id.valid())
+            return;
+        uint32_t bucket = 0;
+        while (bucket < id.boundCount && value > id.bounds[bucket])
+            bucket++;
+        Shard& shard = localShard();
+        shard.add(id.cell + bucket, 1);
+        uint32_t sumCell = id.cell + id.boundCount + 1;
+        shard.store(sumCell, toBits(fromBits(shard.load(sumCell)) + value));
+    }
+
+    // Every live series, sorted by name, in the order they were added within one
+    std::vector<MetricValue> collect() const
+    {
+        std::vector<MetricValue> values;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const Series& series : allSeries)
+        {
+            if (series.removed)
+                continue;
+            MetricValue value;
+            value.name = series.name;
+            value.help = series.help;
+            value.type = series.type;
+            value.labels = series.labels;
+            if (series.type == MetricType::Gauge)
+            {
+                value.value = fromBits(gauges.load(series.cell));
+            }
+            else if (series.type == MetricType::Counter)
+            {
+                value.value = (double)sumShards(series.cell);
+            }
+            else
+            {
+                value.bounds = *series.bounds;
+                for (uint32_t i = 0; i <= series.bounds->size(); i++)
+                {
+                    value.buckets.push_back(sumShards(series.cell + i));
+                    value.count += value.buckets.back();
+                }
+                for (const std::unique_ptr<Shard>& shard : shards)
+                    value.sum += fromBits(shard->load(series.cell + (uint32_t)series.bounds->size() + 1));
+            }
+            values.push_back(std::move(value));
+        }
+        std::stable_sort(values.begin(), values.end(), [](const MetricValue& a, const MetricValue& b) { return a.name < b.name; });
+        return values;
+    }
+
+    // Threads that have recorded so far
+    size_t shardCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shards.size();
+    }
+
+private:
+    static constexpr uint32_t BLOCK_CELLS = 256;
+    static constexpr uint32_t MAX_BLOCKS = 256;
+
+    // Cells in blocks that are allocated when first written, so a shard
+    // costs nothing for series it never records and blocks never move
+    class CellBlocks
+    {
+    public:
+        CellBlocks()
+        {
+            for (std::atomic<std::atomic<uint64_t>*>& block : blocks)
+                block.store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~CellBlocks()
+        {
+            for (std::atomic<std::atomic<uint64_t>*>& block : blocks)
+                delete[] block.load(std::memory_order_relaxed);
+        }
+
+        uint64_t load(uint32_t cell) const
+        {
+            std::atomic<uint64_t>* block = blocks[cell / BLOCK_CELLS].load(std::memory_order_acquire);
+            return block ? block[cell % BLOCK_CELLS].load(std::memory_order_relaxed) : 0;
+        }
+
+        void store(uint32_t cell, uint64_t value)
+        {
+            cellFor(cell).store(value, std::memory_order_relaxed);
+        }
+
+        // Only the owning thread adds, so no read-modify-write is needed
+        void add(uint32_t cell, uint64_t count)
+        {
+            std::atomic<uint64_t>& value = cellFor(cell);
+            value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        }
+
+        void reset(uint32_t cell)
+        {
+            std::atomic<uint64_t>* block = blocks[cell / BLOCK_CELLS].load(std::memory_order_acquire);
+            if (block)
+                block[cell % BLOCK_CELLS].store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint64_t>& cellFor(uint32_t cell)
+        {
+            std::atomic<std::atomic<uint64_t>*>& slot = blocks[cell / BLOCK_CELLS];
+            std::atomic<uint64_t>* block = slot.load(std::memory_order_acquire);
+            if (!block)
+            {
+                // Gauges are shared, so two threads can get here at once
+                std::atomic<uint64_t>* created = new std::atomic<uint64_t>[BLOCK_CELLS];
+                for (uint32_t i = 0; i < BLOCK_CELLS; i++)
+                    created[i].store(0, std::memory_order_relaxed);
+                if (slot.compare_exchange_strong(block, created, std::memory_order_acq_rel))
+                    block = created;
+                else
+                    delete[] created;
+            }
+            return block[cell % BLOCK_CELLS];
+        }
+
+        std::atomic<std::atomic<uint64_t>*> blocks[MAX_BLOCKS];
+    };
+
+    // One thread's cells, on cache lines of their own
+    struct alignas(64) Shard : CellBlocks
+    {
+    };
+
+    struct Series
+    {
+        std::string name;
+        std::string help;
+        MetricType type;
+        MetricLabels labels;
+        std::shared_ptr<const std::vector<double>> bounds;
+        uint32_t cell;
+        uint32_t cells;
+        bool removed = false;
+    };
+
+    static std::atomic<uint64_t>& nextSerial()
+    {
+        static std::atomic<uint64_t> serials{0};
+        return serials;
+    }
+
+    static uint64_t toBits(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static double fromBits(uint64_t bits)
+    {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    MetricId add(const std::string& name, const std::string& help, MetricType type, const MetricLabels& labels, const std::vector<double>& bounds)
+    {
+        // Buckets, the +Inf bucket and the sum
+        uint32_t cells = type == MetricType::Histogram ? (uint32_t)bounds.size() + 2 : 1;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Series series;
+        series.name = name;
+        series.help = help;
+        series.type = type;
+        series.labels = labels;
+        series.cells = cells;
+        auto reused = freeCells.find(cells);
+        if (reused != freeCells.end())
+        {
+            series.cell = reused->second;
+            freeCells.erase(reused);
+        }
+        else
+        {
+            CHECK(usedCells + cells <= BLOCK_CELLS * MAX_BLOCKS);
+            series.cell = usedCells;
+            usedCells += cells;
+        }
+        if (type == MetricType::Histogram)
+            series.bounds = std::make_shared<const std::vector<double>>(bounds);
+        allSeries.push_back(series);
+
+        MetricId id;
+        id.series = (uint32_t)allSeries.size() - 1;
+        id.cell = series.cell;
+        if (series.bounds)
+        {
+            id.bounds = series.bounds->data();
+            id.boundCount = (uint32_t)series.bounds->size();
+        }
+        return id;
+    }
+
+    uint64_t sumShards(uint32_t cell) const
+    {
+        uint64_t total = 0;
+        for (const std::unique_ptr<Shard>& shard : shards)
+            total += shard->load(cell);
+        return total;
+    }
+
+    // The calling thread's shard. The last registry a thread recorded into
+    // is remembered, so this is a compare in the common case; registries
+    // have serials that are never reused, so a stale entry never matches.
+    Shard& localShard()
+    {
+        struct Cached
+        {
+            uint64_t serial = 0;
+            Shard* shard = nullptr;
+        };
+        thread_local Cached cached;
+        if (cached.serial == serial)
+            return *cached.shard;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::thread::id self = std::this_thread::get_id();
+        auto found = shardOf.find(self);
+        Shard* shard;
+        if (found != shardOf.end())
+        {
+            shard = found->second;
+        }
+        else
+        {
+            shards.emplace_back(new Shard());
+            shard = shards.back().get();
+            shardOf[self] = shard;
+        }
+        cached.serial = serial;
+        cached.shard = shard;
+        return *shard;
+    }
+
+    const uint64_t serial;
+    mutable std::mutex mutex;
+    std::deque<Series> allSeries;
+    std::multimap<uint32_t, uint32_t> freeCells;    // cell count to first cell
+    uint32_t usedCells = 0;
+    std::vector<std::unique_ptr<Shard>> shards;     // kept after their threads end, their counts still count
+    std::map<std::thread::id, Shard*> shardOf;
+    CellBlocks gauges;
+};
+
+// ----------------------------------------------------------------------------
+// Encoder series
+//
+// What one encode session reports, under its own labels: frames in and out,
+// bytes out, target and actual bitrate, the time from a frame going in on
+// NeedInput to its access unit coming out on HaveOutput, queue depths,
+// dropped frames and stream changes. The series go away with it.
+// ----------------------------------------------------------------------------
+
+class EncoderMetrics
+{
+public:
+    EncoderMetrics(MetricsRegistry& registry, const MetricLabels& labels)
+        : registry(registry)
+    {
+        framesIn = registry.counter("encoder_frames_in_total", "Frames submitted to the encoder", labels);
+        framesOut = registry.counter("encoder_frames_out_total", "Access units out of the encoder", labels);
+        bytesOut = registry.counter("encoder_bytes_out_total", "Bytes of access units out of the encoder", labels);
+        keyframes = registry.counter("encoder_keyframes_total", "Keyframes out of the encoder", labels);
+        dropped = registry.counter("encoder_frames_dropped_total", "Captured frames the encoder had no request or queue room for", labels);
+        skipped = registry.counter("encoder_frames_skipped_total", "Frame slots a late capture clock skipped", labels);
+        streamChanges = registry.counter("encoder_stream_changes_total", "Output format changes", labels);
+        targetBitrate = registry.gauge("encoder_target_bitrate_bps", "Bitrate the encoder is set to", labels);
+        actualBitrate = registry.gauge("encoder_output_bitrate_bps", "Bitrate of the last second of output, in stream time", labels);
+        inEncoder = registry.gauge("encoder_frames_in_encoder", "Frames submitted and not out yet", labels);
+        captureQueue = registry.gauge("encoder_capture_queue_frames", "Captured frames waiting for a request", labels);
+        writerQueue = registry.gauge("encoder_writer_queue_bytes", "Bytes the file writer has not written yet", labels);
+        latency = registry.histogram("encoder_latency_seconds", "Frame submitted on NeedInput to its access unit on HaveOutput", labels,
+            latencyBuckets());
+        for (InFlight& entry : inFlight)
+            entry.time.store(NO_TIME, std::memory_order_relaxed);
+    }
+
+    ~EncoderMetrics()
+    {
+        for (MetricId* id : { &framesIn, &framesOut, &bytesOut, &keyframes, &dropped, &skipped, &streamChanges, &targetBitrate, &actualBitrate,
+                              &inEncoder, &captureQueue, &writerQueue, &latency })
+            registry.remove(*id);
+    }
+
+    // Input side
+    void submitted(int64_t time)
+    {
+        // Stamped before the count, so the output side finds it
+        InFlight& entry = inFlight[submittedFrames.load(std::memory_order_relaxed) % IN_FLIGHT];
+        entry.submitted.store(nowNs(), std::memory_order_relaxed);
+        entry.time.store(time, std::memory_order_release);
+        uint64_t submittedNow = submittedFrames.load(std::memory_order_relaxed) + 1;
+        submittedFrames.store(submittedNow, std::memory_order_relaxed);
+        registry.add(framesIn);
+        registry.set(inEncoder, (double)(submittedNow - std::min(submittedNow, outputFrames.load(std::memory_order_relaxed))));
+    }
+
+    void droppedFrame() { registry.add(dropped); }
+    void skippedSlot() { registry.add(skipped); }
+    void setCaptureQueue(size_t frames) { registry.set(captureQueue, (double)frames); }
+    void setTargetBitrate(uint32_t bitrate) { registry.set(targetBitrate, bitrate); }
+
+    // Output side
+    void output(const EncodedPacket& packet, size_t writerQueueBytes)
+    {
+        registry.add(framesOut);
+        registry.add(bytesOut, packet.size());
+        if (packet.keyframe())
+            registry.add(keyframes);
+        registry.set(writerQueue, (double)writerQueueBytes);
+
+        // Frames come out in the order they went in, so the search starts
+        // at the oldest one not out yet
+        for (uint32_t i = 0; i < IN_FLIGHT; i++)
+        {
+            InFlight& entry = inFlight[(searchFrom + i) % IN_FLIGHT];
+            if (entry.time.load(std::memory_order_acquire) != packet.time())
+                continue;
+            int64_t submittedNs = entry.submitted.load(std::memory_order_relaxed);
+            entry.time.store(NO_TIME, std::memory_order_relaxed);
+            registry.observe(latency, std::max<int64_t>(0, nowNs() - submittedNs) / 1e9);
+            break;
+        }
+        uint64_t submittedNow = submittedFrames.load(std::memory_order_relaxed);
+        while (searchFrom < submittedNow && inFlight[searchFrom % IN_FLIGHT].time.load(std::memory_order_relaxed) == NO_TIME)
+            searchFrom++;
+        uint64_t out = outputFrames.fetch_add(1, std::memory_order_relaxed) + 1;
+        registry.set(inEncoder, (double)(std::max(submittedNow, out) - out));
+
+        // Bits over at least a second of sample times
+        if (windowBytes == 0)
+            windowStart = packet.time();
+        windowBytes += packet.size();
+        int64_t span = packet.time() + packet.duration() - windowStart;
+        if (span >= 10000000)
+        {
+            registry.set(actualBitrate, windowBytes * 8.0 * 1e7 / span);
+            windowBytes = 0;
+        }
+    }
+
+    void streamChanged() { registry.add(streamChanges); }
+
+private:
+    static constexpr uint32_t IN_FLIGHT = 64;
+    static constexpr int64_t NO_TIME = INT64_MIN;
+
+    struct InFlight
+    {
+        std::atomic<int64_t> time;
+        std::atomic<int64_t> submitted;
+    };
+
+    static int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    MetricsRegistry& registry;
+    MetricId framesIn, framesOut, bytesOut, keyframes, dropped, skipped, streamChanges;
+    MetricId targetBitrate, actualBitrate, inEncoder, captureQueue, writerQueue;
+    MetricId latency;
+
+    InFlight inFlight[IN_FLIGHT];
+    std::atomic<uint64_t> submittedFrames{0};   // input side writes
+    std::atomic<uint64_t> outputFrames{0};      // output side writes
+
+    // Output side only
+    uint64_t searchFrom = 0;
+    int64_t windowStart = 0;
+    uint64_t windowBytes = 0;
+};
@@ -0,0 +1,543 @@
+#pragma once
+
+// std
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "nal_parser.h"
+
+// ----------------------------------------------------------------------------
+// MP4 boxes
+//
+// Big-endian writer for ISO BMFF boxes. begin() leaves room for the size,
+// end() patches it once the contents are known.
+// ----------------------------------------------------------------------------
+
+class Mp4BoxWriter
+{
+public:
+    explicit Mp4BoxWriter(std::vector<uint8_t>& out)
+        : out(out)
+    {
+    }
+
+    void u8(uint32_t value) { out.push_back((uint8_t)value); }
+    void u16(uint32_t value) { u8(value >> 8); u8(value); }
+    void u24(uint32_t value) { u8(value >> 16); u16(value); }
+    void u32(uint32_t value) { u16(value >> 16); u16(value); }
+    void u64(uint64_t value) { u32((uint32_t)(value >> 32)); u32((uint32_t)value); }
+    void zeros(size_t count) { out.insert(out.end(), count, 0); }
+    void bytes(const uint8_t* data, size_t size) { out.insert(out.end(), data, data + size); }
+
+    void fourcc(const char* code)
+    {
+        bytes((const uint8_t*)code, 4);
+    }
+
+    size_t begin(const char* type)
+    {
+        size_t start = out.size();
+        u32(0);
+        fourcc(type);
+        return start;
+    }
+
+    size_t beginFull(const char* type, uint8_t version, uint32_t flags)
+    {
+        size_t start = begin(type);
+        u8(version);
+        u24(flags);
+        return start;
+    }
+
+    void end(size_t start)
+    {
+        patch32(start, (uint32_t)(out.size() - start));
+    }
+
+    void patch32(size_t offset, uint32_t value)
+    {
+        out[offset] = (uint8_t)(value >> 24);
+        out[offset + 1] = (uint8_t)(value >> 16);
+        out[offset + 2] = (uint8_t)(value >> 8);
+        out[offset + 3] = (uint8_t)value;
+    }
+
+    size_t size() const { return out.size(); }
+
+private:
+    std::vector<uint8_t>& out;
+};
+
+// ----------------------------------------------------------------------------
+// Fragment builder
+//
+// The boxes of a fragmented H.264 track, without deciding where they go: the
+// muxer below writes them into one file, the live segmenter into segments.
+// The avcC is built from the first SPS/PPS; Annex-B start codes become
+// 4-byte lengths and the sample times are the ones the encoder reported.
+// A stream change can bring new SPS/PPS mid-stream, so the sample entry is
+// avc3 and the parameter sets stay in the samples as well: a player that
+// starts at any keyframe gets the ones in use there.
+// ----------------------------------------------------------------------------
+
+struct Mp4Sample
+{
+    int64_t time;
+    int64_t duration;
+    uint32_t size;
+    bool keyframe;
+};
+
+class Mp4FragmentBuilder
+{
+public:
+    Mp4FragmentBuilder(uint32_t width, uint32_t height, uint32_t timescale)
+        : width(width), height(height), timescale(timescale)
+    {
+    }
+
+    // Takes SPS and PPS from a keyframe. false when it carries none.
+    bool readParameterSets(const EncodedPacket& keyframe)
+    {
+        const uint8_t* data = keyframe.data();
+        parser.forEachNalUnit(data, keyframe.size(), [&](size_t offset, size_t size)
+        {
+            uint8_t type = data[offset] & 0x1F;
+            if (type == NAL_SPS && sps.empty())
+                sps.assign(data + offset, data + offset + size);
+            if (type == NAL_PPS && pps.empty())
+                pps.assign(data + offset, data + offset + size);
+        });
+        if (sps.size() < 4 || pps.empty())
+        {
+            sps.clear();
+            pps.clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool hasParameterSets() const { return !sps.empty(); }
+
+    // RFC 6381 codecs value for playlists, e.g. avc3.64001f
+    std::string codecString() const
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "avc3.%02x%02x%02x", sps[1], sps[2], sps[3]);
+        return text;
+    }
+
+    // ftyp + moov, after readParameterSets()
+    void writeInitSegment(std::vector<uint8_t>& out) const
+    {
+        Mp4BoxWriter box(out);
+
+        size_t ftyp = box.begin("ftyp");
+        box.fourcc("iso6");
+        box.u32(0);
+        box.fourcc("iso6");
+        box.fourcc("cmfc");
+        box.fourcc("avc1");
+        box.fourcc("mp41");
+        box.end(ftyp);
+
+        size_t moov = box.begin("moov");
+        writeMvhd(box);
+        writeTrak(box);
+
+        size_t mvex = box.begin("mvex");
+        size_t trex = box.beginFull("trex", 0, 0);
+        box.u32(1);                                 // track_ID
+        box.u32(1);                                 // default_sample_description_index
+        box.u32(0);                                 // default_sample_duration
+        box.u32(0);                                 // default_sample_size
+        box.u32(0);                                 // default_sample_flags
+        box.end(trex);
+        box.end(mvex);
+        box.end(moov);
+    }
+
+    // Appends the access unit as length-prefixed NAL units and returns its size.
+    // Access unit delimiters are dropped, parameter sets kept.
+    uint32_t appendSample(std::vector<uint8_t>& out, const EncodedPacket& packet)
+    {
+        size_t start = out.size();
+        const uint8_t* data = packet.data();
+
+        parser.forEachNalUnit(data, packet.size(), [&](size_t offset, size_t size)
+        {
+            uint8_t type = data[offset] & 0x1F;
+            if (type == NAL_AUD)
+                return;
+            if (type == NAL_SPS || type == NAL_PPS)
+            {
+                const std::vector<uint8_t>& known = type == NAL_SPS ? sps : pps;
+                if (known.size() != size || memcmp(known.data(), data + offset, size) != 0)
+                    changes++;
+            }
+
+            Mp4BoxWriter box(out);
+            box.u32((uint32_t)size);
+            box.bytes(data + offset, size);
+        });
+        return (uint32_t)(out.size() - start);
+    }
+
+    // moof with one trun for samples whose mdat follows it directly. baseTime
+    // is the first sample's decode time, in the timescale.
+    void writeMoof(std::vector<uint8_t>& out, const std::vector<Mp4Sample>& samples, uint64_t baseTime, uint32_t sequence) const
+    {
+        Mp4BoxWriter box(out);
+
+        size_t moof = box.begin("moof");
+        size_t mfhd = box.beginFull("mfhd", 0, 0);
+        box.u32(sequence);
+        box.end(mfhd);
+
+        size_t traf = box.begin("traf");
+        size_t tfhd = box.beginFull("tfhd", 0, 0x020000); // default-base-is-moof
+        box.u32(1);
+        box.end(tfhd);
+
+        size_t tfdt = box.beginFull("tfdt", 1, 0);
+        box.u64(baseTime);
+        box.end(tfdt);
+
+        // data offset, then duration, size and flags per sample
+        size_t trun = box.beginFull("trun", 0, 0x000701);
+        box.u32((uint32_t)samples.size());
+        size_t dataOffset = box.size();
+        box.u32(0);
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            // Next sample's time where known, so gaps in the input stay in the timeline
+            int64_t duration = samples[i].duration;
+            if (i + 1 < samples.size() && samples[i + 1].time > samples[i].time)
+                duration = samples[i + 1].time - samples[i].time;
+
+            box.u32((uint32_t)toTimescale(duration));
+            box.u32(samples[i].size);
+            box.u32(samples[i].keyframe ? 0x02000000 : 0x01010000);
+        }
+        box.end(trun);
+        box.end(traf);
+        box.end(moof);
+        box.patch32(dataOffset, (uint32_t)(box.size() - moof + 8));
+    }
+
+    uint64_t toTimescale(int64_t ticks) const
+    {
+        if (ticks < 0)
+            ticks = 0;
+        if (timescale == 10000000)
+            return (uint64_t)ticks;
+        return (uint64_t)ticks * timescale / 10000000;
+    }
+
+    uint32_t timescaleHz() const { return timescale; }
+
+    // SPS/PPS seen that differ from the avcC
+    uint64_t parameterSetChanges() const { return changes; }
+
+private:
+    void writeMvhd(Mp4BoxWriter& box) const
+    {
+        size_t mvhd = box.beginFull("mvhd", 1, 0);
+        box.u64(0);                                 // creation_time
+        box.u64(0);                                 // modification_time
+        box.u32(timescale);
+        box.u64(0);                                 // duration, unknown up front
+        box.u32(0x00010000);                        // rate 1.0
+        box.u16(0x0100);                            // volume 1.0
+        box.zeros(10);
+        writeMatrix(box);
+        box.zeros(24);                              // pre_defined
+        box.u32(2);                                 // next_track_ID
+        box.end(mvhd);
+    }
+
+    void writeTrak(Mp4BoxWriter& box) const
+    {
+        size_t trak = box.begin("trak");
+
+        size_t tkhd = box.beginFull("tkhd", 1, 3);  // enabled, in movie
+        box.u64(0);
+        box.u64(0);
+        box.u32(1);                                 // track_ID
+        box.u32(0);
+        box.u64(0);                                 // duration
+        box.zeros(8);
+        box.u16(0);                                 // layer
+        box.u16(0);                                 // alternate_group
+        box.u16(0);                                 // volume, video
+        box.u16(0);
+        writeMatrix(box);
+        box.u32(width << 16);
+        box.u32(height << 16);
+        box.end(tkhd);
+
+        size_t mdia = box.begin("mdia");
+        size_t mdhd = box.beginFull("mdhd", 1, 0);
+        box.u64(0);
+        box.u64(0);
+        box.u32(timescale);
+        box.u64(0);
+        box.u16(0x55C4);                            // language und
+        box.u16(0);
+        box.end(mdhd);
+
+        size_t hdlr = box.beginFull("hdlr", 0, 0);
+        box.u32(0);
+        box.fourcc("vide");
+        box.zeros(12);
+        box.bytes((const uint8_t*)"VideoHandler", 13);
+        box.end(hdlr);
+
+        size_t minf = box.begin("minf");
+        size_t vmhd = box.beginFull("vmhd", 0, 1);
+        box.zeros(8);                               // graphicsmode, opcolor
+        box.end(vmhd);
+
+        size_t dinf = box.begin("dinf");
+        size_t dref = box.beginFull("dref", 0, 0);
+        box.u32(1);
+        size_t url = box.beginFull("url ", 0, 1);   // media in this file
+        box.end(url);
+        box.end(dref);
+        box.end(dinf);
+
+        size_t stbl = box.begin("stbl");
+        writeStsd(box);
+
+        // Samples live in the fragments, the tables stay empty
+        const char* empty[] = { "stts", "stsc", "stsz", "stco" };
+        for (const char* type : empty)
+        {
+            size_t table = box.beginFull(type, 0, 0);
+            if (strcmp(type, "stsz") == 0)
+                box.u32(0);                         // sample_size
+            box.u32(0);                             // entry_count
+            box.end(table);
+        }
+        box.end(stbl);
+        box.end(minf);
+        box.end(mdia);
+        box.end(trak);
+    }
+
+    void writeStsd(Mp4BoxWriter& box) const
+    {
+        size_t stsd = box.beginFull("stsd", 0, 0);
+        box.u32(1);
+
+        size_t avc3 = box.begin("avc3");
+        box.zeros(6);
+        box.u16(1);                                 // data_reference_index
+        box.zeros(16);
+        box.u16(width);
+        box.u16(height);
+        box.u32(0x00480000);                        // 72 dpi
+        box.u32(0x00480000);
+        box.u32(0);
+        box.u16(1);                                 // frame_count
+        box.zeros(32);                              // compressorname
+        box.u16(0x0018);                            // depth
+        box.u16(0xFFFF);                            // pre_defined
+
+        size_t avcC = box.begin("avcC");
+        box.u8(1);                                  // configurationVersion
+        box.u8(sps[1]);                             // AVCProfileIndication
+        box.u8(sps[2]);                             // profile_compatibility
+        box.u8(sps[3]);                             // AVCLevelIndication
+        box.u8(0xFF);                               // 4-byte NAL lengths
+        box.u8(0xE1);                               // one SPS
+        box.u16((uint32_t)sps.size());
+        box.bytes(sps.data(), sps.size());
+        box.u8(1);                                  // one PPS
+        box.u16((uint32_t)pps.size());
+        box.bytes(pps.data(), pps.size());
+
+        // High profiles carry the chroma format and bit depths
+        uint8_t profile = sps[1];
+        if (profile == 100 || profile == 110 || profile == 122 || profile == 144)
+        {
+            box.u8(0xFC | 1);                       // chroma_format 4:2:0
+            box.u8(0xF8 | 0);                       // bit_depth_luma_minus8
+            box.u8(0xF8 | 0);                       // bit_depth_chroma_minus8
+            box.u8(0);                              // numOfSequenceParameterSetExt
+        }
+        box.end(avcC);
+        box.end(avc3);
+        box.end(stsd);
+    }
+
+    static void writeMatrix(Mp4BoxWriter& box)
+    {
+        const uint32_t matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+        for (uint32_t value : matrix)
+            box.u32(value);
+    }
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t timescale;
+    NalParser parser;
+    std::vector<uint8_t> sps;
+    std::vector<uint8_t> pps;
+    uint64_t changes = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Fragmented MP4 muxer
+//
+// Writes CMAF-style fragmented MP4 straight from the encoder output: an init
+// segment (ftyp + moov), then one moof + mdat per GOP. Only the GOP being
+// built is held in memory, however long the recording runs.
+// ----------------------------------------------------------------------------
+
+struct Mp4MuxerOptions
+{
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t timescale = 10000000;     // sample times are in 100ns units
+    size_t maxFragmentBytes = 8 << 20; // cut a fragment early rather than grow past this
+    BitstreamWriterOptions writer;
+};
+
+struct Mp4MuxerStats
+{
+    uint64_t samples = 0;
+    uint64_t fragments = 0;
+    uint64_t droppedBeforeKeyframe = 0; // nothing to decode them from
+    uint64_t parameterSetChanges = 0;   // SPS/PPS different from the avcC
+    size_t fragmentHighWaterBytes = 0;
+};
+
+class Mp4Muxer : public IPacketConsumer
+{
+public:
+    Mp4Muxer(const char* path, const Mp4MuxerOptions& options = Mp4MuxerOptions())
+        : options(options), writer(path, options.writer), builder(options.width, options.height, options.timescale)
+    {
+    }
+
+    ~Mp4Muxer()
+    {
+        finish();
+    }
+
+    // Called from the encoder's event thread, one packet at a time
+    void onPacket(const EncodedPacket& packet) override
+    {
+        if (finished)
+            return;
+
+        if (!initWritten)
+        {
+            if (!packet.keyframe() || !builder.readParameterSets(packet))
+            {
+                stats.droppedBeforeKeyframe++;
+                return;
+            }
+            writeInitSegment();
+            initWritten = true;
+            firstTime = packet.time();
+        }
+
+        // New GOP, or the current fragment is getting too big
+        if (!samples.empty() && (packet.keyframe() || payload->storage.size() >= options.maxFragmentBytes))
+            writeFragment();
+
+        if (samples.empty())
+        {
+            mdat = pool.acquire(payload);
+            payload->storage.resize(8); // mdat header, filled in when the fragment is written
+        }
+
+        Mp4Sample sample;
+        sample.time = packet.time();
+        sample.duration = packet.duration();
+        sample.keyframe = packet.keyframe();
+        sample.size = builder.appendSample(payload->storage, packet);
+        samples.push_back(sample);
+        stats.samples++;
+        if (payload->storage.size() > stats.fragmentHighWaterBytes)
+            stats.fragmentHighWaterBytes = payload->storage.size();
+    }
+
+    // Writes the last fragment and closes the file, false when writing failed
+    bool finish()
+    {
+        if (finished)
+            return writer.close();
+        finished = true;
+        if (!samples.empty())
+            writeFragment();
+        return writer.close();
+    }
+
+    Mp4MuxerStats muxerStats() const
+    {
+        Mp4MuxerStats result = stats;
+        result.parameterSetChanges = builder.parameterSetChanges();
+        return result;
+    }
+
+    BitstreamWriterStats writerStats() const { return writer.stats(); }
+
+private:
+    void writeInitSegment()
+    {
+        PacketPool::Buffer* buffer;
+        EncodedPacket init = pool.acquire(buffer);
+        builder.writeInitSegment(buffer->storage);
+        buffer->commit();
+        writer.write(init);
+    }
+
+    // moof, then the mdat collected for it
+    void writeFragment()
+    {
+        PacketPool::Buffer* buffer;
+        EncodedPacket header = pool.acquire(buffer);
+        builder.writeMoof(buffer->storage, samples, builder.toTimescale(samples.front().time - firstTime), ++sequence);
+        buffer->commit();
+
+        // mdat header at the front of the payload
+        Mp4BoxWriter mdatBox(payload->storage);
+        mdatBox.patch32(0, (uint32_t)payload->storage.size());
+        memcpy(&payload->storage[4], "mdat", 4);
+        payload->commit();
+
+        writer.write(header);
+        writer.write(mdat);
+        mdat.reset();
+        payload = nullptr;
+        samples.clear();
+        stats.fragments++;
+    }
+
+    Mp4MuxerOptions options;
+    BitstreamWriter writer;
+    PacketPool pool;
+    Mp4MuxerStats stats;
+    Mp4FragmentBuilder builder;
+
+    bool initWritten = false;
+    bool finished = false;
+    int64_t firstTime = 0;
+    uint32_t sequence = 0;
+
+    // Fragment being built
+    std::vector<Mp4Sample> samples;
+    EncodedPacket mdat;
+    PacketPool::Buffer* payload = nullptr;
+};
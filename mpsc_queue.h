@@ -0,0 +1,96 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// ----------------------------------------------------------------------------
+// Lock-free multiple producer / single consumer queue
+//
+// A bounded ring where every slot carries a sequence number: producers claim
+// a position by advancing tail, write the item and then publish the slot by
+// bumping its sequence, so the consumer never sees a half-written item and no
+// producer waits for another. Positions only ever grow. Neither side
+// allocates after construction.
+// ----------------------------------------------------------------------------
+
+template <typename T>
+class MpscQueue
+{
+public:
+    explicit MpscQueue(size_t capacity)
+    {
+        size_t rounded = 1;
+        while (rounded < capacity)
+            rounded <<= 1;
+        slots.reset(new Slot[rounded]);
+        size = rounded;
+        mask = rounded - 1;
+        for (size_t i = 0; i < rounded; i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread. Fails without waiting when the queue is full.
+    bool push(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots[t & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)t;
+            if (difference == 0)
+            {
+                // Free at this position, claim it
+                if (tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed))
+                {
+                    slot.item = item;
+                    slot.sequence.store(t + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                // Still holds the item from one lap ago
+                return false;
+            }
+            else
+            {
+                t = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // The consumer only. An item whose producer is still writing it counts as
+    // not there yet, and so does everything behind it.
+    bool pop(T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        Slot& slot = slots[h & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != h + 1)
+            return false;
+        // Moved out, so the slot does not keep a reference alive
+        item = std::move(slot.item);
+        slot.sequence.store(h + size, std::memory_order_release);
+        head.store(h + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t capacity() const { return size; }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t size;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
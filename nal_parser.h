@@ -0,0 +1,301 @@
+#pragma once
+
+// std
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Project
+#include "common.h"
+#include "cpu_features.h"
+
+// ----------------------------------------------------------------------------
+// Start code scanning
+//
+// Finds the next 00 00 01 in an Annex-B stream. The SIMD kernels compare three
+// shifted loads at once, so every position in a block is tested in one go;
+// anything too short for a full block goes through the scalar loop, which
+// skips three bytes whenever the third one cannot end a start code.
+// ----------------------------------------------------------------------------
+
+enum class ScanKernel { Auto, Scalar, Sse2, Avx2, Neon };
+
+inline const char* scanKernelName(ScanKernel kernel)
+{
+    switch (kernel)
+    {
+    case ScanKernel::Auto: return "auto";
+    case ScanKernel::Scalar: return "scalar";
+    case ScanKernel::Sse2: return "sse2";
+    case ScanKernel::Avx2: return "avx2";
+    case ScanKernel::Neon: return "neon";
+    }
+    return "?";
+}
+
+inline bool scanKernelSupported(ScanKernel kernel)
+{
+    switch (kernel)
+    {
+    case ScanKernel::Scalar: return true;
+    case ScanKernel::Sse2: return cpuFeatures().sse2;
+    case ScanKernel::Avx2: return cpuFeatures().avx2;
+    case ScanKernel::Neon: return cpuFeatures().neon;
+    default: return false;
+    }
+}
+
+inline ScanKernel bestScanKernel()
+{
+    if (scanKernelSupported(ScanKernel::Avx2))
+        return ScanKernel::Avx2;
+    if (scanKernelSupported(ScanKernel::Neon))
+        return ScanKernel::Neon;
+    if (scanKernelSupported(ScanKernel::Sse2))
+        return ScanKernel::Sse2;
+    return ScanKernel::Scalar;
+}
+
+inline uint32_t lowestSetBit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+// Position of the first start code at or after from, or size when there is none
+inline size_t findStartCodeScalar(const uint8_t* data, size_t size, size_t from)
+{
+    size_t i = from;
+    while (i + 3 <= size)
+    {
+        if (data[i + 2] > 1)
+        {
+            i += 3;
+            continue;
+        }
+        if (data[i + 2] == 1 && data[i + 1] == 0 && data[i] == 0)
+            return i;
+        i++;
+    }
+    return size;
+}
+
+#if defined(ARCH_X86)
+
+TARGET_SSE2 inline size_t findStartCodeSse2(const uint8_t* data, size_t size, size_t from)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    size_t i = from;
+    for (; i + 18 <= size; i += 16)
+    {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(data + i + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask != 0)
+            return i + lowestSetBit(mask);
+    }
+    return findStartCodeScalar(data, size, i);
+}
+
+TARGET_AVX2 inline size_t findStartCodeAvx2(const uint8_t* data, size_t size, size_t from)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    size_t i = from;
+    for (; i + 34 <= size; i += 32)
+    {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(data + i + 2));
+        __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return i + lowestSetBit(mask);
+    }
+    return findStartCodeScalar(data, size, i);
+}
+
+#endif
+
+#if defined(ARCH_ARM64)
+
+inline size_t findStartCodeNeon(const uint8_t* data, size_t size, size_t from)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    size_t i = from;
+    for (; i + 18 <= size; i += 16)
+    {
+        uint8x16_t b0 = vld1q_u8(data + i);
+        uint8x16_t b1 = vld1q_u8(data + i + 1);
+        uint8x16_t b2 = vld1q_u8(data + i + 2);
+        uint8x16_t hit = vandq_u8(vandq_u8(vceqq_u8(b0, zero), vceqq_u8(b1, zero)), vceqq_u8(b2, one));
+
+        // No movemask on NEON, the block is rare enough to rescan
+        if (vmaxvq_u8(hit) != 0)
+            return findStartCodeScalar(data, i + 18, i);
+    }
+    return findStartCodeScalar(data, size, i);
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+// NAL unit parser
+//
+// Splits encoder output into NAL units and describes each access unit: NAL
+// types and offsets, IDR or not, and whether its SPS/PPS differ from the last
+// ones seen. Offsets are relative to the start of the access unit and point
+// at the NAL header, after the start code.
+// ----------------------------------------------------------------------------
+
+enum NalType : uint8_t
+{
+    NAL_SLICE = 1,
+    NAL_IDR = 5,
+    NAL_SEI = 6,
+    NAL_SPS = 7,
+    NAL_PPS = 8,
+    NAL_AUD = 9,
+};
+
+struct NalUnit
+{
+    size_t offset;
+    size_t size;
+    uint8_t type;
+    uint8_t refIdc;
+};
+
+struct AccessUnitInfo
+{
+    std::vector<NalUnit> nals;
+    size_t size = 0;
+    bool idr = false;
+    bool hasSps = false;
+    bool hasPps = false;
+    bool spsChanged = false;  // first SPS, or different from the previous one
+    bool ppsChanged = false;
+};
+
+class NalParser
+{
+public:
+    explicit NalParser(ScanKernel kernel = ScanKernel::Auto)
+        : kernel(kernel)
+    {
+        if (kernel == ScanKernel::Auto)
+            this->kernel = bestScanKernel();
+        CHECK(scanKernelSupported(this->kernel));
+
+        switch (this->kernel)
+        {
+#if defined(ARCH_X86)
+        case ScanKernel::Sse2: find = findStartCodeSse2; break;
+        case ScanKernel::Avx2: find = findStartCodeAvx2; break;
+#endif
+#if defined(ARCH_ARM64)
+        case ScanKernel::Neon: find = findStartCodeNeon; break;
+#endif
+        default: find = findStartCodeScalar; break;
+        }
+    }
+
+    size_t findStartCode(const uint8_t* data, size_t size, size_t from) const
+    {
+        return find(data, size, from);
+    }
+
+    // Calls found(offset, size) for every NAL unit, start codes and the zero
+    // bytes in front of them excluded
+    template <typename Found>
+    void forEachNalUnit(const uint8_t* data, size_t size, Found found) const
+    {
+        size_t start = find(data, size, 0);
+        while (start < size)
+        {
+            size_t nal = start + 3;
+            size_t next = find(data, size, nal);
+
+            // A 4-byte start code leaves its leading zero behind the previous NAL
+            size_t end = next;
+            while (end > nal && data[end - 1] == 0)
+                end--;
+            if (end > nal)
+                found(nal, end - nal);
+            start = next;
+        }
+    }
+
+    // One access unit. The result stays valid until the next call.
+    const AccessUnitInfo& parse(const uint8_t* data, size_t size)
+    {
+        info.nals.clear();
+        info.size = size;
+        info.idr = false;
+        info.hasSps = false;
+        info.hasPps = false;
+        info.spsChanged = false;
+        info.ppsChanged = false;
+
+        forEachNalUnit(data, size, [&](size_t offset, size_t nalSize)
+        {
+            NalUnit nal;
+            nal.offset = offset;
+            nal.size = nalSize;
+            nal.type = data[offset] & 0x1F;
+            nal.refIdc = (data[offset] >> 5) & 3;
+            info.nals.push_back(nal);
+
+            if (nal.type == NAL_IDR)
+                info.idr = true;
+            if (nal.type == NAL_SPS)
+            {
+                info.hasSps = true;
+                info.spsChanged |= remember(lastSps, data + offset, nalSize);
+            }
+            if (nal.type == NAL_PPS)
+            {
+                info.hasPps = true;
+                info.ppsChanged |= remember(lastPps, data + offset, nalSize);
+            }
+        });
+        return info;
+    }
+
+    ScanKernel activeKernel() const { return kernel; }
+
+private:
+    // Stores the parameter set and reports whether it differs from the stored one
+    static bool remember(std::vector<uint8_t>& last, const uint8_t* data, size_t size)
+    {
+        if (last.size() == size && memcmp(last.data(), data, size) == 0)
+            return false;
+        last.assign(data, data + size);
+        return true;
+    }
+
+    ScanKernel kernel;
+    size_t (*find)(const uint8_t*, size_t, size_t);
+    AccessUnitInfo info;
+    std::vector<uint8_t> lastSps;
+    std::vector<uint8_t> lastPps;
+};
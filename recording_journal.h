@@ -0,0 +1,470 @@
+#pragma once
+
+// std
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Project
+#include "bitstream_writer.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "mp4_muxer.h"
+#include "seek_index.h"
+
+// ----------------------------------------------------------------------------
+// Recording journal
+//
+// Write-ahead journal next to a durable recording's raw .h264 file. The
+// writer syncs the file at every GOP boundary (see BitstreamWriter::
+// setJournal), then appends the access units written since the last commit
+// and a commit record for the boundary to the journal, and syncs the
+// journal. A commit therefore never names bytes that are not on the disk,
+// and one costs two syncs per GOP. Everything is little-endian:
+//
+//     header   "H264WAL\0", u32 version, u32 record size, u32 width, u32 height
+//     unit     u16 type 1, u16 flags, u32 size, u64 offset, i64 time, i64 duration, u32 index, u32 checksum
+//     commit   u16 type 2, u16 flags, u32 0, u64 end, u64 units, u64 0, u32 0, u32 checksum
+//
+// The checksum is FNV-1a over the rest of the record, so a record torn by a
+// crash ends the journal instead of being read as garbage. After a crash,
+// recoverRecording() cuts the file back to the last commit and writes its
+// seek index and MP4 again from the journal.
+// ----------------------------------------------------------------------------
+
+constexpr char RECORDING_JOURNAL_MAGIC[8] = { 'H', '2', '6', '4', 'W', 'A', 'L', 0 };
+constexpr uint32_t RECORDING_JOURNAL_VERSION = 1;
+constexpr uint32_t RECORDING_JOURNAL_HEADER_SIZE = 24;
+constexpr uint32_t RECORDING_JOURNAL_RECORD_SIZE = 40;
+
+enum JournalRecordType : uint16_t
+{
+    JOURNAL_UNIT = 1,
+    JOURNAL_COMMIT = 2,
+};
+
+enum JournalRecordFlags : uint16_t
+{
+    JOURNAL_KEYFRAME = 1,      // units
+    JOURNAL_FINAL = 1,         // commits: the writer closed normally
+};
+
+struct RecordingJournalStats
+{
+    uint64_t units = 0;
+    uint64_t commits = 0;
+    uint64_t bytes = 0;        // journal file size
+    double commitAvgUs = 0;    // one append and sync
+    double commitMaxUs = 0;
+};
+
+inline uint32_t journalChecksum(const uint8_t* data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+class RecordingJournal : public IWriteJournal
+{
+public:
+    // The picture size is kept for rebuilding the MP4
+    RecordingJournal(const char* path, uint32_t width, uint32_t height)
+    {
+        CHECK(file.open(path, false));
+        std::vector<uint8_t> header(RECORDING_JOURNAL_MAGIC, RECORDING_JOURNAL_MAGIC + 8);
+        putLe(header, RECORDING_JOURNAL_VERSION, 4);
+        putLe(header, RECORDING_JOURNAL_RECORD_SIZE, 4);
+        putLe(header, width, 4);
+        putLe(header, height, 4);
+        ByteSpan span = { header.data(), header.size() };
+        CHECK(file.write(&span, 1));
+        bytes += header.size();
+    }
+
+    // Writer thread
+    void unitWritten(const WrittenUnit& unit) override
+    {
+        appendRecord(JOURNAL_UNIT, unit.keyframe ? JOURNAL_KEYFRAME : 0, unit.size, unit.offset, (uint64_t)unit.time, (uint64_t)unit.duration,
+            (uint32_t)unitCount);
+        unitCount++;
+    }
+
+    // Writer thread, after the file was synced up to end
+    void synced(uint64_t end, uint64_t units, bool final) override
+    {
+        Clock::time_point start = Clock::now();
+        appendRecord(JOURNAL_COMMIT, final ? JOURNAL_FINAL : 0, 0, end, units, 0, 0);
+        ByteSpan span = { records.data(), records.size() };
+        CHECK(file.write(&span, 1));
+        CHECK(file.sync());
+        uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+        bytes += records.size();
+        records.clear();
+        commits++;
+        commitTotalNs += ns;
+        if (ns > commitMaxNs.load(std::memory_order_relaxed))
+            commitMaxNs.store(ns, std::memory_order_relaxed);
+    }
+
+    RecordingJournalStats stats() const
+    {
+        RecordingJournalStats stats;
+        stats.units = unitCount.load();
+        stats.commits = commits.load();
+        stats.bytes = bytes.load();
+        if (stats.commits != 0)
+            stats.commitAvgUs = commitTotalNs.load() / 1000.0 / stats.commits;
+        stats.commitMaxUs = commitMaxNs.load() / 1000.0;
+        return stats;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static void putLe(std::vector<uint8_t>& out, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+            out.push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    void appendRecord(uint16_t type, uint16_t flags, uint32_t size, uint64_t offset, uint64_t time, uint64_t duration, uint32_t index)
+    {
+        size_t start = records.size();
+        putLe(records, type, 2);
+        putLe(records, flags, 2);
+        putLe(records, size, 4);
+        putLe(records, offset, 8);
+        putLe(records, time, 8);
+        putLe(records, duration, 8);
+        putLe(records, index, 4);
+        putLe(records, journalChecksum(&records[start], RECORDING_JOURNAL_RECORD_SIZE - 4), 4);
+    }
+
+    OutputFile file;
+    std::vector<uint8_t> records;  // not in the journal yet
+
+    std::atomic<uint64_t> unitCount{0};
+    std::atomic<uint64_t> commits{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> commitTotalNs{0};
+    std::atomic<uint64_t> commitMaxNs{0};
+};
+
+// ----------------------------------------------------------------------------
+// Reading and recovery
+// ----------------------------------------------------------------------------
+
+struct JournalCommit
+{
+    uint64_t end;              // file bytes on disk
+    uint64_t units;            // access units in them
+    bool final;
+};
+
+struct RecordingJournalContents
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<WrittenUnit> units;        // as logged, including past the last commit
+    std::vector<JournalCommit> commits;
+    uint64_t tornBytes = 0;                // after the last whole record
+};
+
+// False when the file is not a journal. Reading stops at the first torn
+// record, records of unknown types are skipped.
+inline bool loadRecordingJournal(const char* path, RecordingJournalContents& contents)
+{
+    contents = RecordingJournalContents();
+    std::ifstream fin(path, std::ios::binary);
+    uint8_t header[RECORDING_JOURNAL_HEADER_SIZE];
+    if (!fin.read((char*)header, sizeof(header)) || memcmp(header, RECORDING_JOURNAL_MAGIC, 8) != 0)
+        return false;
+
+    auto getLe = [](const uint8_t* p, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value |= (uint64_t)p[i] << (8 * i);
+        return value;
+    };
+    if (getLe(header + 8, 4) != RECORDING_JOURNAL_VERSION || getLe(header + 12, 4) != RECORDING_JOURNAL_RECORD_SIZE)
+        return false;
+    contents.width = (uint32_t)getLe(header + 16, 4);
+    contents.height = (uint32_t)getLe(header + 20, 4);
+
+    fin.seekg(0, std::ios::end);
+    uint64_t size = (uint64_t)fin.tellg();
+    fin.seekg(RECORDING_JOURNAL_HEADER_SIZE);
+    uint64_t end = RECORDING_JOURNAL_HEADER_SIZE;
+
+    uint8_t record[RECORDING_JOURNAL_RECORD_SIZE];
+    while (fin.read((char*)record, sizeof(record)) && getLe(record + 36, 4) == journalChecksum(record, RECORDING_JOURNAL_RECORD_SIZE - 4))
+    {
+        end += RECORDING_JOURNAL_RECORD_SIZE;
+
+        uint16_t type = (uint16_t)getLe(record, 2);
+        uint16_t flags = (uint16_t)getLe(record + 2, 2);
+        if (type == JOURNAL_UNIT)
+        {
+            WrittenUnit unit;
+            unit.size = (uint32_t)getLe(record + 4, 4);
+            unit.offset = getLe(record + 8, 8);
+            unit.time = (int64_t)getLe(record + 16, 8);
+            unit.duration = (int64_t)getLe(record + 24, 8);
+            unit.keyframe = (flags & JOURNAL_KEYFRAME) != 0;
+            contents.units.push_back(unit);
+        }
+        else if (type == JOURNAL_COMMIT)
+        {
+            contents.commits.push_back({ getLe(record + 8, 8), getLe(record + 16, 8), (flags & JOURNAL_FINAL) != 0 });
+        }
+    }
+    contents.tornBytes = size - end;
+    return true;
+}
+
+inline bool truncateFile(const char* path, uint64_t size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)size;
+    bool ok = SetFilePointerEx(file, position, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+    CloseHandle(file);
+    return ok;
+#else
+    return ::truncate(path, (off_t)size) == 0;
+#endif
+}
+
+inline bool replaceFile(const char* temporary, const char* target)
+{
+#ifdef _WIN32
+    return MoveFileExA(temporary, target, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(temporary, target) == 0;
+#endif
+}
+
+struct RecoveryOptions
+{
+    std::string path;          // the raw .h264 recording
+    std::string journalPath;   // its journal
+    std::string indexPath;     // seek index to write again, empty for none
+    std::string mp4Path;       // MP4 to write again, empty for none
+    uint32_t width = 0;        // MP4 picture size, 0 for the journal's
+    uint32_t height = 0;
+};
+
+// vid.h264 with vid.h264.wal, vid.h264.idx and vid.mp4, like encode.exe writes them
+inline RecoveryOptions recoveryOptionsFor(const std::string& path)
+{
+    RecoveryOptions options;
+    options.path = path;
+    options.journalPath = path + ".wal";
+    options.indexPath = path + ".idx";
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    options.mp4Path = (dot != std::string::npos && (slash == std::string::npos || dot > slash) ? path.substr(0, dot) : path) + ".mp4";
+    return options;
+}
+
+struct RecoveryResult
+{
+    uint64_t fileBytes = 0;    // before recovery
+    uint64_t keptBytes = 0;
+    uint64_t keptUnits = 0;
+    uint64_t keyframes = 0;
+    uint64_t loggedUnits = 0;  // in the journal, some maybe past the last commit
+    bool clean = false;        // the writer closed normally, nothing was cut
+};
+
+// Cuts the recording back to the last commit, the end of its last complete
+// GOP, and writes the seek index and MP4 again from what is left. Leaves
+// every file alone when the journal and the recording do not agree or the
+// recording cannot be read: the index and MP4 are written next to the old
+// ones from the committed units first, then renamed over them, and the
+// recording is cut last.
+inline bool recoverRecording(const RecoveryOptions& options, RecoveryResult& result, std::string& error)
+{
+    result = RecoveryResult();
+    RecordingJournalContents journal;
+    if (!loadRecordingJournal(options.journalPath.c_str(), journal))
+    {
+        error = options.journalPath + " is not a recording journal";
+        return false;
+    }
+    result.loggedUnits = journal.units.size();
+    if (journal.commits.empty())
+    {
+        error = "no complete GOP was committed to " + options.journalPath;
+        return false;
+    }
+    const JournalCommit& commit = journal.commits.back();
+
+    // The committed units have to tile the committed bytes, start with a
+    // keyframe and go forward in time
+    uint64_t end = 0;
+    bool tiled = commit.units <= journal.units.size() && (commit.units == 0 || journal.units[0].keyframe);
+    for (uint64_t i = 0; tiled && i < commit.units; i++)
+    {
+        tiled = journal.units[i].offset == end && (i == 0 || journal.units[i].time > journal.units[i - 1].time);
+        end += journal.units[i].size;
+    }
+    if (!tiled || end != commit.end)
+    {
+        error = options.journalPath + " does not describe its own commits";
+        return false;
+    }
+
+    {
+        std::ifstream probe(options.path, std::ios::binary | std::ios::ate);
+        if (!probe)
+        {
+            error = "cannot open " + options.path;
+            return false;
+        }
+        result.fileBytes = (uint64_t)probe.tellg();
+    }
+    if (result.fileBytes < commit.end)
+    {
+        error = options.path + " is shorter than its journal's last commit";
+        return false;
+    }
+
+    // Everything downstream of the raw stream, from the committed units, into
+    // files of their own; the bytes up to the commit are the same before the cut
+    const std::string indexTemporary = options.indexPath + ".tmp";
+    const std::string mp4Temporary = options.mp4Path + ".tmp";
+    auto removeTemporaries = [&]()
+    {
+        if (!options.indexPath.empty())
+            std::remove(indexTemporary.c_str());
+        if (!options.mp4Path.empty())
+            std::remove(mp4Temporary.c_str());
+    };
+    {
+        std::unique_ptr<SeekIndexWriter> index;
+        if (!options.indexPath.empty())
+            index.reset(new SeekIndexWriter(indexTemporary.c_str()));
+        std::unique_ptr<Mp4Muxer> muxer;
+        if (!options.mp4Path.empty())
+        {
+            Mp4MuxerOptions muxerOptions;
+            muxerOptions.width = options.width ? options.width : journal.width;
+            muxerOptions.height = options.height ? options.height : journal.height;
+            muxer.reset(new Mp4Muxer(mp4Temporary.c_str(), muxerOptions));
+        }
+
+        std::ifstream fin(options.path, std::ios::binary);
+        PacketPool pool;
+        for (uint64_t i = 0; i < commit.units; i++)
+        {
+            const WrittenUnit& unit = journal.units[i];
+            PacketPool::Buffer* buffer;
+            EncodedPacket packet = pool.acquire(buffer);
+            buffer->storage.resize(unit.size);
+            if (!fin.read((char*)buffer->storage.data(), unit.size))
+            {
+                index.reset();
+                muxer.reset();
+                removeTemporaries();
+                error = "cannot read " + options.path;
+                return false;
+            }
+            buffer->commit();
+            buffer->time = unit.time;
+            buffer->duration = unit.duration;
+            buffer->keyframe = unit.keyframe;
+            result.keyframes += unit.keyframe ? 1 : 0;
+
+            if (index)
+                index->onPacket(packet);
+            if (muxer)
+                muxer->onPacket(packet);
+        }
+        bool written = (!index || index->finish()) && (!muxer || muxer->finish());
+        index.reset();
+        muxer.reset();
+        if (!written)
+        {
+            removeTemporaries();
+            error = "cannot write the seek index or MP4 of " + options.path;
+            return false;
+        }
+    }
+
+    // Only now are the old files replaced. The recording goes last: cut or
+    // not, it still has every byte the new index and MP4 describe.
+    if ((!options.indexPath.empty() && !replaceFile(indexTemporary.c_str(), options.indexPath.c_str())) ||
+        (!options.mp4Path.empty() && !replaceFile(mp4Temporary.c_str(), options.mp4Path.c_str())))
+    {
+        removeTemporaries();
+        error = "cannot replace the seek index or MP4 of " + options.path;
+        return false;
+    }
+    if (result.fileBytes > commit.end && !truncateFile(options.path.c_str(), commit.end))
+    {
+        error = "cannot truncate " + options.path;
+        return false;
+    }
+    result.keptBytes = commit.end;
+    result.keptUnits = commit.units;
+    result.clean = commit.final && result.fileBytes == commit.end;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Process I/O
+//
+// What this process wrote, from /proc/self/io: bytes handed to write calls
+// and bytes that went to storage because of them. Their ratio to the payload
+// is the recording's write amplification. Linux only, false elsewhere.
+// ----------------------------------------------------------------------------
+
+struct ProcessIo
+{
+    uint64_t writeCallBytes = 0;  // wchar
+    uint64_t storageBytes = 0;    // write_bytes, 0 on tmpfs
+};
+
+inline bool readProcessIo(ProcessIo& io)
+{
+#ifdef __linux__
+    std::ifstream fin("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    bool found = false;
+    while (fin >> key >> value)
+    {
+        if (key == "wchar:")
+            io.writeCallBytes = value;
+        else if (key == "write_bytes:")
+        {
+            io.storageBytes = value;
+            found = true;
+        }
+    }
+    return found;
+#else
+    (void)io;
+    return false;
+#endif
+}
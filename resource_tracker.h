@@ -0,0 +1,272 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Project
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// Resource accounting
+//
+// Live counts and bytes of everything the encode loop creates per frame or
+// per session, by kind, with high-water marks. Creating and destroying one
+// costs a few relaxed atomics, so it is always on. The leak mode also keeps
+// every live object with the file and line that created it, so shutdown can
+// name what is still alive; ENCODER_TRACK_LEAKS=1 in the environment turns it
+// on from the start.
+//
+// Kinds:
+// - Sample: an input frame handed out by a frame pool and not yet back
+// - Buffer: memory behind frames, a CPU pool's or an IMFMediaBuffer
+// - Texture: a D3D11 texture
+// - Packet: an encoded packet's buffer, pooled or the MFT's
+// ----------------------------------------------------------------------------
+
+enum class ResourceKind { Sample, Buffer, Texture, Packet };
+
+constexpr size_t RESOURCE_KINDS = 4;
+
+inline const char* resourceKindName(ResourceKind kind)
+{
+    switch (kind)
+    {
+    case ResourceKind::Sample: return "sample";
+    case ResourceKind::Buffer: return "buffer";
+    case ResourceKind::Texture: return "texture";
+    default: return "packet";
+    }
+}
+
+struct ResourceCounts
+{
+    int64_t live = 0;
+    int64_t liveBytes = 0;
+    uint64_t created = 0;
+    uint64_t destroyed = 0;
+    int64_t peakLive = 0;
+    int64_t peakBytes = 0;
+};
+
+struct ResourceSnapshot
+{
+    ResourceCounts kinds[RESOURCE_KINDS];
+
+    const ResourceCounts& operator[](ResourceKind kind) const { return kinds[(size_t)kind]; }
+
+    int64_t live() const
+    {
+        int64_t total = 0;
+        for (const ResourceCounts& counts : kinds)
+            total += counts.live;
+        return total;
+    }
+
+    int64_t liveBytes() const
+    {
+        int64_t total = 0;
+        for (const ResourceCounts& counts : kinds)
+            total += counts.liveBytes;
+        return total;
+    }
+};
+
+// Creations of one kind per frame between two snapshots
+inline double createdPerFrame(const ResourceSnapshot& before, const ResourceSnapshot& after, ResourceKind kind, uint64_t frames)
+{
+    return frames ? (double)(after[kind].created - before[kind].created) / frames : 0.0;
+}
+
+// One object that was still alive, and where it came from
+struct LeakedResource
+{
+    ResourceKind kind;
+    const char* file;
+    int line;
+    size_t bytes;
+    uint64_t sequence;      // creation order, over every kind
+};
+
+class ResourceTracker
+{
+public:
+    ResourceTracker()
+    {
+        const char* value = getenv("ENCODER_TRACK_LEAKS");
+        leakMode = value && value[0] != '\0' && value[0] != '0';
+    }
+
+    void created(ResourceKind kind, const void* object, size_t bytes, const char* file, int line)
+    {
+        Counters& counters = kinds[(size_t)kind];
+        counters.created.fetch_add(1, std::memory_order_relaxed);
+        raise(counters.peakLive, counters.live.fetch_add(1, std::memory_order_relaxed) + 1);
+        raise(counters.peakBytes, counters.liveBytes.fetch_add((int64_t)bytes, std::memory_order_relaxed) + (int64_t)bytes);
+        if (!leakMode.load(std::memory_order_relaxed))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        objects[Key(kind, object)] = { kind, file, line, bytes, sequence++ };
+    }
+
+    void destroyed(ResourceKind kind, const void* object, size_t bytes)
+    {
+        Counters& counters = kinds[(size_t)kind];
+        counters.destroyed.fetch_add(1, std::memory_order_relaxed);
+        counters.live.fetch_sub(1, std::memory_order_relaxed);
+        counters.liveBytes.fetch_sub((int64_t)bytes, std::memory_order_relaxed);
+        if (!leakMode.load(std::memory_order_relaxed))
+            return;
+
+        // Objects from before the leak mode was turned on are not listed
+        std::lock_guard<std::mutex> lock(mutex);
+        objects.erase(Key(kind, object));
+    }
+
+    // A live object grew or shrank, such as a recycled packet buffer
+    void resized(ResourceKind kind, const void* object, size_t oldBytes, size_t newBytes)
+    {
+        Counters& counters = kinds[(size_t)kind];
+        int64_t delta = (int64_t)newBytes - (int64_t)oldBytes;
+        raise(counters.peakBytes, counters.liveBytes.fetch_add(delta, std::memory_order_relaxed) + delta);
+        if (!leakMode.load(std::memory_order_relaxed))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = objects.find(Key(kind, object));
+        if (found != objects.end())
+            found->second.bytes = newBytes;
+    }
+
+    ResourceSnapshot snapshot() const
+    {
+        ResourceSnapshot result;
+        for (size_t i = 0; i < RESOURCE_KINDS; i++)
+        {
+            const Counters& counters = kinds[i];
+            ResourceCounts& counts = result.kinds[i];
+            counts.live = counters.live.load(std::memory_order_relaxed);
+            counts.liveBytes = counters.liveBytes.load(std::memory_order_relaxed);
+            counts.created = counters.created.load(std::memory_order_relaxed);
+            counts.destroyed = counters.destroyed.load(std::memory_order_relaxed);
+            counts.peakLive = counters.peakLive.load(std::memory_order_relaxed);
+            counts.peakBytes = counters.peakBytes.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    // High-water marks start over from what is live now
+    void resetPeaks()
+    {
+        for (Counters& counters : kinds)
+        {
+            counters.peakLive.store(counters.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            counters.peakBytes.store(counters.liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    // Only objects created while it is on are listed
+    void setLeakTracking(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        leakMode.store(enabled, std::memory_order_relaxed);
+        if (!enabled)
+            objects.clear();
+    }
+
+    bool leakTracking() const { return leakMode.load(std::memory_order_relaxed); }
+
+    // What is alive now, oldest first
+    std::vector<LeakedResource> live() const
+    {
+        std::vector<LeakedResource> result;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entry : objects)
+                result.push_back(entry.second);
+        }
+        std::sort(result.begin(), result.end(), [](const LeakedResource& a, const LeakedResource& b) { return a.sequence < b.sequence; });
+        return result;
+    }
+
+    // One line per kind and creation site with how many are left. Returns
+    // the number of objects.
+    size_t reportLeaks(FILE* out) const
+    {
+        std::vector<LeakedResource> leaks = live();
+        std::map<std::tuple<int, std::string, int>, std::pair<size_t, size_t>> sites;
+        for (const LeakedResource& leak : leaks)
+        {
+            std::pair<size_t, size_t>& site = sites[std::make_tuple((int)leak.kind, std::string(leak.file), leak.line)];
+            site.first++;
+            site.second += leak.bytes;
+        }
+        for (const auto& site : sites)
+        {
+            fprintf(out, "leak: %zu %s (%zu bytes) created at %s:%d\n", site.second.first, resourceKindName((ResourceKind)std::get<0>(site.first)),
+                site.second.second, std::get<1>(site.first).c_str(), std::get<2>(site.first));
+        }
+        return leaks.size();
+    }
+
+private:
+    struct Counters
+    {
+        std::atomic<int64_t> live{0};
+        std::atomic<int64_t> liveBytes{0};
+        std::atomic<uint64_t> created{0};
+        std::atomic<uint64_t> destroyed{0};
+        std::atomic<int64_t> peakLive{0};
+        std::atomic<int64_t> peakBytes{0};
+    };
+
+    struct Key
+    {
+        Key(ResourceKind kind, const void* object) : kind(kind), object(object) {}
+        bool operator==(const Key& other) const { return kind == other.kind && object == other.object; }
+
+        ResourceKind kind;
+        const void* object;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const { return std::hash<const void*>()(key.object) ^ (size_t)key.kind; }
+    };
+
+    static void raise(std::atomic<int64_t>& peak, int64_t value)
+    {
+        int64_t current = peak.load(std::memory_order_relaxed);
+        while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    Counters kinds[RESOURCE_KINDS];
+    std::atomic<bool> leakMode{false};
+    mutable std::mutex mutex;
+    std::unordered_map<Key, LeakedResource, KeyHash> objects;
+    uint64_t sequence = 0;
+};
+
+// One for the process, never destroyed, so objects freed during static
+// destruction still find it
+inline ResourceTracker& resourceTracker()
+{
+    static ResourceTracker* tracker = new ResourceTracker();
+    return *tracker;
+}
+
+#define TRACK_CREATED(kind, object, bytes) resourceTracker().created(kind, object, bytes, __FILE__, __LINE__)
+#define TRACK_DESTROYED(kind, object, bytes) resourceTracker().destroyed(kind, object, bytes)
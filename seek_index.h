@@ -0,0 +1,243 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+// Project
+#include "bitstream_writer.h"
+#include "common.h"
+#include "encoded_packet.h"
+#include "nal_parser.h"
+
+// ----------------------------------------------------------------------------
+// Seek index
+//
+// Side-car file next to the raw .h264 stream with one fixed-size entry per
+// access unit, so tools can seek and cut a recording without scanning it.
+// Everything is little-endian:
+//
+//     header   "H264IDX\0", u32 version, u32 entry size
+//     entry    u64 file offset, i64 time, u32 size, u32 frame, u32 flags, u32 reserved
+//
+// Offsets assume the index sees the same packets, in the same order, as the
+// writer of the .h264 file.
+// ----------------------------------------------------------------------------
+
+enum SeekIndexFlags : uint32_t
+{
+    SEEK_KEYFRAME = 1,        // decoding can start here
+    SEEK_IDR = 2,
+    SEEK_SPS = 4,
+    SEEK_PPS = 8,
+    SEEK_PARAMETERS_CHANGED = 16,
+};
+
+struct SeekIndexEntry
+{
+    uint64_t offset;
+    int64_t time;
+    uint32_t size;
+    uint32_t frame;
+    uint32_t flags;
+};
+
+constexpr char SEEK_INDEX_MAGIC[8] = { 'H', '2', '6', '4', 'I', 'D', 'X', 0 };
+constexpr uint32_t SEEK_INDEX_VERSION = 1;
+constexpr uint32_t SEEK_INDEX_ENTRY_SIZE = 32;
+
+struct SeekIndexStats
+{
+    uint64_t entries = 0;
+    uint64_t keyframes = 0;
+    uint64_t parameterChanges = 0;
+    uint64_t nalUnits = 0;
+};
+
+class SeekIndexWriter : public IPacketConsumer
+{
+public:
+    // Entries are handed to the writer thread once per GOP, or every batchEntries
+    SeekIndexWriter(const char* path, size_t batchEntries = 1024, const BitstreamWriterOptions& options = BitstreamWriterOptions())
+        : writer(path, options), batchEntries(batchEntries)
+    {
+        PacketPool::Buffer* header;
+        EncodedPacket packet = pool.acquire(header);
+        header->storage.assign(SEEK_INDEX_MAGIC, SEEK_INDEX_MAGIC + 8);
+        putLe(header->storage, SEEK_INDEX_VERSION, 4);
+        putLe(header->storage, SEEK_INDEX_ENTRY_SIZE, 4);
+        header->commit();
+        writer.write(packet);
+    }
+
+    ~SeekIndexWriter()
+    {
+        finish();
+    }
+
+    void onPacket(const EncodedPacket& packet) override
+    {
+        if (finished)
+            return;
+
+        const AccessUnitInfo& info = parser.parse(packet.data(), packet.size());
+
+        uint32_t flags = 0;
+        if (packet.keyframe() || info.idr)
+            flags |= SEEK_KEYFRAME;
+        if (info.idr)
+            flags |= SEEK_IDR;
+        if (info.hasSps)
+            flags |= SEEK_SPS;
+        if (info.hasPps)
+            flags |= SEEK_PPS;
+        if ((info.spsChanged || info.ppsChanged) && stats.entries != 0)
+        {
+            flags |= SEEK_PARAMETERS_CHANGED;
+            stats.parameterChanges++;
+        }
+
+        // A new GOP flushes the entries of the previous one
+        if ((flags & SEEK_KEYFRAME) && pendingEntries != 0)
+            submit();
+
+        if (!batch)
+            batch = pool.acquire(buffer);
+        std::vector<uint8_t>& out = buffer->storage;
+        putLe(out, position, 8);
+        putLe(out, (uint64_t)packet.time(), 8);
+        putLe(out, (uint64_t)packet.size(), 4);
+        putLe(out, stats.entries, 4);
+        putLe(out, flags, 4);
+        putLe(out, 0, 4);
+        pendingEntries++;
+
+        position += packet.size();
+        stats.entries++;
+        stats.keyframes += (flags & SEEK_KEYFRAME) ? 1 : 0;
+        stats.nalUnits += info.nals.size();
+
+        if (pendingEntries >= batchEntries)
+            submit();
+    }
+
+    // false when the index could not be written
+    bool finish()
+    {
+        if (finished)
+            return writer.close();
+        finished = true;
+        if (pendingEntries != 0)
+            submit();
+        return writer.close();
+    }
+
+    SeekIndexStats indexStats() const { return stats; }
+
+private:
+    static void putLe(std::vector<uint8_t>& out, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+            out.push_back((uint8_t)(value >> (8 * i)));
+    }
+
+    void submit()
+    {
+        buffer->commit();
+        writer.write(batch);
+        batch.reset();
+        buffer = nullptr;
+        pendingEntries = 0;
+    }
+
+    BitstreamWriter writer;
+    PacketPool pool;
+    NalParser parser;
+    SeekIndexStats stats;
+    size_t batchEntries;
+    bool finished = false;
+
+    uint64_t position = 0;
+    EncodedPacket batch;
+    PacketPool::Buffer* buffer = nullptr;
+    size_t pendingEntries = 0;
+};
+
+// Reader side, for tools
+class SeekIndex
+{
+public:
+    bool load(const char* path)
+    {
+        entries.clear();
+
+        std::ifstream fin(path, std::ios::binary);
+        uint8_t header[16];
+        if (!fin.read((char*)header, sizeof(header)) || memcmp(header, SEEK_INDEX_MAGIC, 8) != 0)
+            return false;
+        if (getLe(header + 8, 4) != SEEK_INDEX_VERSION || getLe(header + 12, 4) != SEEK_INDEX_ENTRY_SIZE)
+            return false;
+
+        uint8_t record[SEEK_INDEX_ENTRY_SIZE];
+        while (fin.read((char*)record, sizeof(record)))
+        {
+            SeekIndexEntry entry;
+            entry.offset = getLe(record, 8);
+            entry.time = (int64_t)getLe(record + 8, 8);
+            entry.size = (uint32_t)getLe(record + 16, 4);
+            entry.frame = (uint32_t)getLe(record + 20, 4);
+            entry.flags = (uint32_t)getLe(record + 24, 4);
+            entries.push_back(entry);
+        }
+
+        // A torn last entry from a crash is ignored
+        return true;
+    }
+
+    // Last keyframe at or before frame, where decoding has to start to show it
+    const SeekIndexEntry* keyframeBefore(uint32_t frame) const
+    {
+        // Entries are numbered from zero without gaps
+        if (entries.empty())
+            return nullptr;
+        size_t i = frame < entries.size() ? frame : entries.size() - 1;
+        return keyframeAtOrBefore(i);
+    }
+
+    // Last keyframe at or before a sample time
+    const SeekIndexEntry* keyframeBeforeTime(int64_t time) const
+    {
+        auto after = std::upper_bound(entries.begin(), entries.end(), time,
+            [](int64_t t, const SeekIndexEntry& entry) { return t < entry.time; });
+        if (after == entries.begin())
+            return nullptr;
+        return keyframeAtOrBefore((size_t)(after - entries.begin()) - 1);
+    }
+
+    const std::vector<SeekIndexEntry>& all() const { return entries; }
+
+private:
+    const SeekIndexEntry* keyframeAtOrBefore(size_t i) const
+    {
+        while (!(entries[i].flags & SEEK_KEYFRAME))
+        {
+            if (i == 0)
+                return nullptr;
+            i--;
+        }
+        return &entries[i];
+    }
+
+    static uint64_t getLe(const uint8_t* p, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+            value |= (uint64_t)p[i] << (8 * i);
+        return value;
+    }
+
+    std::vector<SeekIndexEntry> entries;
+};
@@ -0,0 +1,633 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// Project
+#include "common.h"
+#include "encoded_packet.h"
+#include "encoder_backend.h"
+#include "encoder_caps.h"
+#include "event_pump.h"
+#include "frame_pool.h"
+#include "upload_pipeline.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Software stand-in backend
+//
+// Behaves like an async hardware MFT without touching a GPU: it asks for input
+// while it has room, holds a few frames back like a rate control lookahead
+// (none in low-latency mode), emits each frame as an Annex-B H.264 access unit
+// after a configurable latency, and can periodically report a stream change. The
+// bitstream has real SPS/PPS and slice headers around deterministic filler,
+// which is enough for parsers and muxers but not for a decoder.
+//
+// Events run on a serial queue, on a shared worker pool when one is given and
+// on a private thread otherwise, so hundreds of sessions need no thread each.
+// They reach the pipeline through an event pump, like the MFT's. Staged
+// uploads go through a CpuStagingDevice.
+// ----------------------------------------------------------------------------
+
+// The HRESULTs an MFT would return, MF_E_NOTACCEPTING and E_FAIL
+constexpr int32_t SOFTWARE_E_NOTACCEPTING = (int32_t)0xC00D36B5;
+constexpr int32_t SOFTWARE_E_FAIL = (int32_t)0x80004005;
+
+struct SoftwareBackendOptions
+{
+    EncoderConfig config;
+    uint32_t poolSize = 8;                              // input frames, plus one per frame of the config's lookahead
+
+    uint32_t depth = 3;                                 // frames the encoder holds at most
+    uint32_t lookahead = 2;                             // frames held back before the oldest comes out
+    std::chrono::microseconds latency{2000};            // input to output
+    size_t idrBytes = 40000;
+    size_t frameBytes = 8000;
+    uint32_t sizeJitterPercent = 25;
+    uint32_t streamChangeInterval = 0;                  // report a stream change every N outputs, 0 = never
+    uint64_t failAtFrame = 0;                           // input frame N fails to submit, from 1, 0 = never
+    uint32_t seed = 1;
+    std::chrono::microseconds copyLatency{300};         // staging copy to its fence, see upload_pipeline.h
+};
+
+// Writes RBSP bits and adds emulation prevention when converted to a NAL unit
+class H264BitWriter
+{
+public:
+    void bits(uint32_t value, int count)
+    {
+        for (int i = count - 1; i >= 0; i--)
+            bit((value >> i) & 1);
+    }
+
+    void bit(uint32_t value)
+    {
+        current = (uint8_t)((current << 1) | (value & 1));
+        if (++used == 8)
+        {
+            rbsp.push_back(current);
+            current = 0;
+            used = 0;
+        }
+    }
+
+    // Exp-Golomb
+    void ue(uint32_t value)
+    {
+        uint32_t coded = value + 1;
+        int length = 0;
+        while ((coded >> length) > 1)
+            length++;
+        bits(0, length);
+        bits(coded, length + 1);
+    }
+
+    void se(int32_t value)
+    {
+        ue(value > 0 ? (uint32_t)(2 * value - 1) : (uint32_t)(-2 * value));
+    }
+
+    void trailingBits()
+    {
+        bit(1);
+        while (used != 0)
+            bit(0);
+    }
+
+    void appendNal(std::vector<uint8_t>& out, uint8_t nalRefIdc, uint8_t nalType) const
+    {
+        static const uint8_t startCode[] = { 0, 0, 0, 1 };
+        out.insert(out.end(), startCode, startCode + 4);
+        out.push_back((uint8_t)((nalRefIdc << 5) | nalType));
+
+        int zeros = 0;
+        for (uint8_t b : rbsp)
+        {
+            if (zeros == 2 && b <= 3)
+            {
+                out.push_back(3);
+                zeros = 0;
+            }
+            out.push_back(b);
+            zeros = b == 0 ? zeros + 1 : 0;
+        }
+    }
+
+    std::vector<uint8_t> rbsp;
+
+private:
+    uint8_t current = 0;
+    int used = 0;
+};
+
+class SoftwareEncoderBackend : public IEncoderBackend
+{
+public:
+    explicit SoftwareEncoderBackend(const SoftwareBackendOptions& options, WorkerPool* workers = nullptr)
+        : options(options),
+          pool(options.poolSize + options.config.lookahead, frameBytes(options.config)),
+          ownWorkers(workers ? nullptr : new WorkerPool(1)),
+          events(workers ? *workers : *ownWorkers),
+          eventPump(workers ? *workers : *ownWorkers)
+    {
+        std::string error;
+        CHECK(validateConfig(options.config, error) && options.lookahead < options.depth);
+
+        // Like a low-latency MFT: one frame in, its output out, nothing held back
+        depth = options.config.lowLatency ? 1 : options.depth;
+        lookahead = options.config.lowLatency ? 0 : options.lookahead;
+        bitrate = options.config.bitrate;
+        frameRate = options.config.frameRate;
+        qp = options.config.qp;
+        pool.setReleaseCallback([this](uint32_t) { eventPump.releaseInput(); });
+    }
+
+    ~SoftwareEncoderBackend()
+    {
+        shutdown();
+    }
+
+    void start(IEncoderEventSink* sink) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            eventPump.start(sink);
+            started = true;
+        }
+        schedulePump();
+    }
+
+    bool acquireInput(InputFrame& frame) override
+    {
+        uint32_t slot;
+        if (!pool.acquire(slot))
+            return false;
+
+        frame.slot = slot;
+        frame.data = pool.data(slot);
+        frame.pitch = options.config.format == FrameFormat::NV12 ? options.config.width : (size_t)options.config.width * 4;
+        return true;
+    }
+
+    void releaseInput(const InputFrame& frame) override
+    {
+        pool.release(frame.slot);
+    }
+
+    void submitInput(const InputFrame& frame, int64_t time, int64_t duration) override
+    {
+        EncoderStatus failure;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (failed)
+                failure = { SOFTWARE_E_FAIL, "submitInput after a failure" };
+            else if (requested == 0)
+                failure = { SOFTWARE_E_NOTACCEPTING, "submitInput without NeedInput" };
+            else if (++submitted == options.failAtFrame)
+                failure = { SOFTWARE_E_FAIL, "submitInput" };
+
+            if (failure.ok())
+            {
+                requested--;
+
+                QueuedFrame queued;
+                queued.slot = frame.slot;
+                queued.time = time;
+                queued.duration = duration;
+                queued.readyAt = Clock::now() + options.latency;
+                queued.sizeScale = sizeScale;
+                queued.forceKeyframe = keyframeRequested;
+                keyframeRequested = false;
+                queue.push_back(queued);
+            }
+            else
+            {
+                // Like a failed ProcessInput, the encoder stops asking for
+                // frames and this one goes straight back
+                failed = true;
+            }
+        }
+
+        if (!failure.ok())
+        {
+            pool.release(frame.slot);
+            eventPump.fail(failure);
+            return;
+        }
+        schedulePump();
+    }
+
+    void setInputReleaseCallback(std::function<void()> callback) override
+    {
+        eventPump.setInputReleaseCallback(std::move(callback));
+    }
+
+    OutputStatus processOutput(EncodedPacket& packet) override
+    {
+        QueuedFrame frame;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (signaledOutputs != 0)
+                signaledOutputs--;
+            if (queue.empty())
+                return OutputStatus::NoOutput;
+
+            if (needsRenegotiation)
+                return OutputStatus::StreamChange;
+            if (options.streamChangeInterval != 0 && outputCount != 0 && outputCount % options.streamChangeInterval == 0 && !streamChangeReported)
+            {
+                needsRenegotiation = true;
+                streamChangeReported = true;
+                return OutputStatus::StreamChange;
+            }
+
+            frame = queue.front();
+            queue.pop_front();
+            streamChangeReported = false;
+        }
+
+        // Built straight into a pooled buffer the consumers share
+        PacketPool::Buffer* buffer;
+        packet = packets.acquire(buffer);
+
+        // Like the hardware encoders, a GOP length of 0 means a keyframe every
+        // two seconds, and a forced keyframe starts a new GOP
+        uint64_t gopLength = options.config.gopLength != 0 ? options.config.gopLength : std::max<uint64_t>(1, 2ull * options.config.frameRate.num / options.config.frameRate.den);
+        bool keyframe = frame.forceKeyframe || outputCount == 0 || sinceKeyframe >= gopLength;
+        sinceKeyframe = keyframe ? 1 : sinceKeyframe + 1;
+        buildAccessUnit(buffer->storage, keyframe, frame.sizeScale);
+
+        buffer->commit();
+        buffer->time = frame.time;
+        buffer->duration = frame.duration;
+        buffer->keyframe = keyframe;
+        outputCount++;
+
+        // The encoder is done with the input frame
+        pool.release(frame.slot);
+        schedulePump();
+        return OutputStatus::Ok;
+    }
+
+    void renegotiateOutput() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            needsRenegotiation = false;
+        }
+        schedulePump();
+    }
+
+    void drain() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            draining = true;
+        }
+        schedulePump();
+    }
+
+    void shutdown() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        events.close();
+        eventPump.close();
+    }
+
+    // Frames keep their size in bits per second: the bitrate scales them, a
+    // higher frame rate spreads the same bits over more frames, and in
+    // quality mode every 6 QP halve them
+    bool applyControl(const EncoderControl& control) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (control.bitrate != 0)
+            bitrate = control.bitrate;
+        if (control.frameRate.num != 0)
+            frameRate = control.frameRate;
+        if (control.qp != 0)
+            qp = control.qp;
+        keyframeRequested = keyframeRequested || control.forceKeyframe;
+        sizeScale = (double)bitrate / options.config.bitrate *
+            ((double)options.config.frameRate.num * frameRate.den) / ((double)options.config.frameRate.den * frameRate.num) *
+            std::pow(2.0, ((double)options.config.qp - qp) / 6);
+        return true;
+    }
+
+    const EncoderConfig& config() const override { return options.config; }
+    EncoderStatus status() const override { return eventPump.status(); }
+
+    // Input frames keep their memory, the copies write it
+    IStagingDevice* enableStaging(uint32_t buffers) override
+    {
+        size_t pitch = options.config.format == FrameFormat::NV12 ? options.config.width : (size_t)options.config.width * 4;
+        staging.reset(new CpuStagingDevice(buffers, frameBytes(options.config), pitch, options.copyLatency));
+        return staging.get();
+    }
+
+    CpuStagingStats stagingStats() const { return staging ? staging->stats() : CpuStagingStats(); }
+
+    FramePoolStats inputPoolStats() const { return pool.stats(); }
+    EventPumpStats eventStats() const { return eventPump.stats(); }
+    PacketPoolStats outputPoolStats() const { return packets.stats(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    static constexpr uint32_t PUMP_BATCH = 16;
+
+    static size_t frameBytes(const EncoderConfig& config)
+    {
+        size_t pixels = (size_t)config.width * config.height;
+        return config.format == FrameFormat::NV12 ? pixels * 3 / 2 : pixels * 4;
+    }
+
+    struct QueuedFrame
+    {
+        uint32_t slot;
+        int64_t time;
+        int64_t duration;
+        Clock::time_point readyAt;
+        double sizeScale;
+        bool forceKeyframe;
+    };
+
+    void schedulePump()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!started || stopping || pumpScheduled)
+                return;
+            pumpScheduled = true;
+        }
+        events.post([this]() { pump(); });
+    }
+
+    // Encoder model, emits one event at a time, a HaveOutput for every frame
+    // that is ready. Returns when there is nothing to do; whatever changes
+    // that schedules it again, and a frame still in its latency gets a timer.
+    // A busy pump requeues itself after a few events so other sessions on the
+    // same workers get their turn.
+    void pump()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (uint32_t emitted = 0; !stopping && !failed; emitted++)
+        {
+            if (emitted == PUMP_BATCH)
+            {
+                lock.unlock();
+                events.post([this]() { pump(); });
+                return;
+            }
+
+            if (!draining && requested + queue.size() < depth)
+            {
+                requested++;
+                eventPump.post(EncoderEvent::NeedInput);
+                continue;
+            }
+
+            if (queue.size() > (draining ? 0 : lookahead) + signaledOutputs && !needsRenegotiation)
+            {
+                // Draining flushes without waiting out the latency
+                Clock::time_point readyAt = queue[signaledOutputs].readyAt;
+                if (draining || Clock::now() >= readyAt)
+                {
+                    signaledOutputs++;
+                    eventPump.post(EncoderEvent::HaveOutput);
+                    continue;
+                }
+                if (!timerPending || readyAt < timerAt)
+                {
+                    timerPending = true;
+                    timerAt = readyAt;
+                    events.postAt(readyAt, [this]() { onTimer(); });
+                }
+                break;
+            }
+
+            if (draining && queue.empty() && !drainSignaled)
+            {
+                drainSignaled = true;
+                eventPump.post(EncoderEvent::DrainComplete);
+                continue;
+            }
+
+            break;
+        }
+        pumpScheduled = false;
+    }
+
+    void onTimer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            timerPending = false;
+        }
+        pump();
+    }
+
+    // Deterministic per frame: SPS and PPS in front of every IDR, then one
+    // slice whose size varies around the configured average.
+    void buildAccessUnit(std::vector<uint8_t>& accessUnit, bool keyframe, double sizeScale)
+    {
+        if (keyframe)
+        {
+            writeSps(accessUnit);
+            writePps(accessUnit);
+        }
+
+        if (keyframe)
+            frameNum = 0;
+
+        H264BitWriter slice;
+        slice.ue(0);                                // first_mb_in_slice
+        slice.ue(keyframe ? 7 : 5);                 // slice_type, I or P (all slices same type)
+        slice.ue(0);                                // pic_parameter_set_id
+        slice.bits(frameNum, 4);                    // frame_num, log2_max_frame_num = 4
+        if (keyframe)
+            slice.ue(idrPicId++ & 0xFFFF);          // idr_pic_id
+        slice.trailingBits();                       // byte align before the filler
+
+        std::mt19937 rng(options.seed + (uint32_t)outputCount);
+        size_t target = (size_t)((keyframe ? options.idrBytes : options.frameBytes) * sizeScale);
+        if (options.sizeJitterPercent != 0)
+        {
+            size_t jitter = target * options.sizeJitterPercent / 100;
+            target = target - jitter + rng() % (2 * jitter + 1);
+        }
+
+        // Filler has no zero bytes, so it can never look like a start code
+        for (size_t i = slice.rbsp.size(); i < target; i++)
+            slice.rbsp.push_back((uint8_t)(1 + rng() % 255));
+        slice.appendNal(accessUnit, 3, keyframe ? 5 : 1);
+
+        frameNum = (frameNum + 1) & 0xF;
+    }
+
+    void writeSps(std::vector<uint8_t>& accessUnit)
+    {
+        const EncoderConfig& config = options.config;
+        uint32_t mbWidth = (config.width + 15) / 16;
+        uint32_t mbHeight = (config.height + 15) / 16;
+        bool high = config.profile == H264Profile::High;
+
+        H264BitWriter sps;
+        sps.bits((uint32_t)config.profile, 8);      // profile_idc
+        sps.bits(0, 8);                             // constraint flags
+        sps.bits(config.level != 0 ? config.level : 42, 8); // level_idc, 4.2 when left to the encoder
+        sps.ue(0);                                  // seq_parameter_set_id
+        if (high)
+        {
+            sps.ue(1);                              // chroma_format_idc 4:2:0
+            sps.ue(0);                              // bit_depth_luma_minus8
+            sps.ue(0);                              // bit_depth_chroma_minus8
+            sps.bit(0);                             // qpprime_y_zero_transform_bypass_flag
+            sps.bit(0);                             // seq_scaling_matrix_present_flag
+        }
+        sps.ue(0);                                  // log2_max_frame_num_minus4
+        sps.ue(2);                                  // pic_order_cnt_type
+        sps.ue(1);                                  // max_num_ref_frames
+        sps.bit(0);                                 // gaps_in_frame_num_value_allowed_flag
+        sps.ue(mbWidth - 1);                        // pic_width_in_mbs_minus1
+        sps.ue(mbHeight - 1);                       // pic_height_in_map_units_minus1
+        sps.bit(1);                                 // frame_mbs_only_flag
+        sps.bit(1);                                 // direct_8x8_inference_flag
+
+        bool crop = mbWidth * 16 != config.width || mbHeight * 16 != config.height;
+        sps.bit(crop);                              // frame_cropping_flag
+        if (crop)
+        {
+            sps.ue(0);
+            sps.ue((mbWidth * 16 - config.width) / 2);
+            sps.ue(0);
+            sps.ue((mbHeight * 16 - config.height) / 2);
+        }
+        sps.bit(0);                                 // vui_parameters_present_flag
+        sps.trailingBits();
+        sps.appendNal(accessUnit, 3, 7);
+    }
+
+    void writePps(std::vector<uint8_t>& accessUnit)
+    {
+        H264BitWriter pps;
+        pps.ue(0);                                  // pic_parameter_set_id
+        pps.ue(0);                                  // seq_parameter_set_id
+        pps.bit(options.config.profile != H264Profile::Baseline); // entropy_coding_mode_flag, CABAC above Baseline
+        pps.bit(0);                                 // bottom_field_pic_order_in_frame_present_flag
+        pps.ue(0);                                  // num_slice_groups_minus1
+        pps.ue(0);                                  // num_ref_idx_l0_default_active_minus1
+        pps.ue(0);                                  // num_ref_idx_l1_default_active_minus1
+        pps.bit(0);                                 // weighted_pred_flag
+        pps.bits(0, 2);                             // weighted_bipred_idc
+        pps.se(0);                                  // pic_init_qp_minus26
+        pps.se(0);                                  // pic_init_qs_minus26
+        pps.se(0);                                  // chroma_qp_index_offset
+        pps.bit(1);                                 // deblocking_filter_control_present_flag
+        pps.bit(0);                                 // constrained_intra_pred_flag
+        pps.bit(0);                                 // redundant_pic_cnt_present_flag
+        pps.trailingBits();
+        pps.appendNal(accessUnit, 3, 8);
+    }
+
+    SoftwareBackendOptions options;
+    uint32_t depth;
+    uint32_t lookahead;
+    CpuFramePool pool;
+    std::unique_ptr<CpuStagingDevice> staging;
+    std::unique_ptr<WorkerPool> ownWorkers;
+    SerialQueue events;
+    EventPump eventPump;
+
+    std::mutex mutex;
+    std::deque<QueuedFrame> queue;
+    uint32_t requested = 0;
+    size_t signaledOutputs = 0;                         // HaveOutput not yet taken by processOutput
+    bool needsRenegotiation = false;
+    bool streamChangeReported = false;
+    bool draining = false;
+    bool drainSignaled = false;
+    bool started = false;
+    bool stopping = false;
+    bool failed = false;
+    uint64_t submitted = 0;
+    bool pumpScheduled = false;
+    bool timerPending = false;
+    Clock::time_point timerAt;
+
+    // Runtime changes, taken by the next frame submitted
+    uint32_t bitrate;
+    Rational frameRate;
+    uint32_t qp;
+    double sizeScale = 1.0;
+    bool keyframeRequested = false;
+
+    PacketPool packets;
+
+    // Only touched from processOutput, which the event pump serializes
+    uint64_t outputCount = 0;
+    uint64_t sinceKeyframe = 0;
+    uint32_t frameNum = 0;
+    uint32_t idrPicId = 0;
+};
+
+// Stand-in for a machine with some adapters, each with a session limit, or
+// with the adapters and encoders a capability probe reported
+class SoftwareBackendFactory : public IEncoderBackendFactory
+{
+public:
+    SoftwareBackendFactory(const SoftwareBackendOptions& options, std::vector<uint32_t> adapterLimits = { 0 })
+        : options(options), limits(std::move(adapterLimits))
+    {
+    }
+
+    // Adapters without a hardware encoder are left out, like the MF factory does
+    SoftwareBackendFactory(const SoftwareBackendOptions& options, const std::vector<AdapterCaps>& adapters)
+        : options(options)
+    {
+        for (const AdapterCaps& adapter : adapters)
+        {
+            if (!hasHardwareEncoder(adapter))
+                continue;
+            caps.push_back(adapter);
+            limits.push_back(adapterSessionLimit(adapter));
+        }
+    }
+
+    uint32_t adapterCount() const override { return (uint32_t)limits.size(); }
+    uint32_t sessionLimit(uint32_t adapter) const override { return limits[adapter]; }
+
+    bool supports(uint32_t adapter, const EncoderConfig& config) const override
+    {
+        return caps.empty() || bestEncoder(caps[adapter], config) >= 0;
+    }
+
+    std::unique_ptr<IEncoderBackend> createBackend(uint32_t adapter, const EncoderConfig& config, WorkerPool& workers) override
+    {
+        CHECK(adapter < limits.size() && supports(adapter, config));
+        SoftwareBackendOptions session = options;
+        session.config = config;
+        session.seed = options.seed + created++;
+        return std::unique_ptr<IEncoderBackend>(new SoftwareEncoderBackend(session, &workers));
+    }
+
+    // Probed adapters in factory order, empty without a probe
+    const std::vector<AdapterCaps>& adapters() const { return caps; }
+
+private:
+    SoftwareBackendOptions options;
+    std::vector<uint32_t> limits;
+    std::vector<AdapterCaps> caps;
+    std::atomic<uint32_t> created{0};
+};
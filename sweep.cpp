@@ -0,0 +1,76 @@
+// Benchmark sweep of the encode pipeline against the software stand-in, plus
+// the CPU kernels. On Windows, encode.exe --benchmark runs the same sweep on
+// the hardware encoder.
+//
+// Builds without any Windows SDK:
+//     g++ -O2 -std=c++17 -pthread sweep.cpp -o sweep    (Linux)
+//     cl /O2 /EHsc sweep.cpp                            (Windows)
+// Usage: ./sweep [stream settings] [--quick] [--frames N] [--filter text]
+//     [--no-kernels] [--json out.json] [--csv out.csv] [--baseline base.csv]
+//     [--tolerance 0.2]
+// Stream settings are the ones encode.exe takes; the sweep sets size, frame
+// rate and format. Exits 1 when a metric regressed against the baseline.
+
+// std
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+// Project
+#include "benchmark_suite.h"
+#include "encoder_config.h"
+#include "software_backend.h"
+
+// ----------------------------------------------------------------------------
+// Heap allocation counting
+//
+// Every new in the process goes through here, so the sweep can report heap
+// allocations per frame.
+// ----------------------------------------------------------------------------
+
+static std::atomic<uint64_t> heapAllocationCount{0};
+
+void* operator new(size_t size)
+{
+    heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* block = malloc(size ? size : 1);
+    if (!block)
+        throw std::bad_alloc();
+    return block;
+}
+
+// GCC sees new and free meet once these are inlined into the library's
+// deletes, and takes the pair for a mismatch
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkCommand command;
+    std::vector<std::string> rest;
+    std::string error;
+    if (!parseConfigArguments(argc, argv, command.suite.base, rest, error) || !validateConfig(command.suite.base, error) ||
+        !parseBenchmarkArguments(rest, command, error))
+    {
+        fprintf(stderr, "sweep: %s\n", error.c_str());
+        return 2;
+    }
+    command.suite.heapAllocations = []() { return heapAllocationCount.load(std::memory_order_relaxed); };
+
+    SoftwareBackendFactory factory((SoftwareBackendOptions()));
+    return runBenchmarkCommand(factory, command);
+}
@@ -0,0 +1,486 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Project
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// CPU topology
+//
+// The CPUs this process may run on, the NUMA node of each, and the size of
+// the L2 cache, which is what tiles are sized for. Linux reads sysfs, Windows
+// asks GetLogicalProcessorInformation; whatever is not found is one node and
+// TILE_CACHE_FALLBACK of L2.
+// ----------------------------------------------------------------------------
+
+constexpr size_t TILE_CACHE_FALLBACK = 1 << 20;
+
+struct CpuTopology
+{
+    std::vector<uint32_t> cpus;         // logical CPUs the process may use
+    std::vector<uint32_t> nodes;        // NUMA node of each of them
+    uint32_t nodeCount = 1;
+    size_t l2Bytes = TILE_CACHE_FALLBACK;
+};
+
+#if defined(__linux__)
+// "0-3,8,10-11" into 0 1 2 3 8 10 11
+inline std::vector<uint32_t> parseCpuList(const std::string& text)
+{
+    std::vector<uint32_t> cpus;
+    const char* p = text.c_str();
+    while (*p >= '0' && *p <= '9')
+    {
+        char* end;
+        uint32_t first = (uint32_t)strtoul(p, &end, 10);
+        uint32_t last = first;
+        if (*end == '-')
+            last = (uint32_t)strtoul(end + 1, &end, 10);
+        for (uint32_t cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+inline bool readLine(const std::string& path, std::string& line)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char buffer[4096];
+    bool ok = fgets(buffer, sizeof(buffer), file) != nullptr;
+    fclose(file);
+    if (ok)
+        line.assign(buffer, strcspn(buffer, "\n"));
+    return ok;
+}
+#endif
+
+inline CpuTopology detectCpuTopology()
+{
+    CpuTopology topology;
+#ifdef _WIN32
+    DWORD_PTR processMask = 0, systemMask = 0;
+    GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+    for (uint32_t cpu = 0; cpu < sizeof(DWORD_PTR) * 8; cpu++)
+    {
+        if (processMask & ((DWORD_PTR)1 << cpu))
+            topology.cpus.push_back(cpu);
+    }
+    topology.nodes.assign(topology.cpus.size(), 0);
+
+    DWORD bytes = 0;
+    GetLogicalProcessorInformation(nullptr, &bytes);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> entries(bytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (!entries.empty() && GetLogicalProcessorInformation(entries.data(), &bytes))
+    {
+        for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& entry : entries)
+        {
+            if (entry.Relationship == RelationCache && entry.Cache.Level == 2 && entry.Cache.Type != CacheInstruction)
+                topology.l2Bytes = entry.Cache.Size;
+            if (entry.Relationship != RelationNumaNode)
+                continue;
+            topology.nodeCount = std::max(topology.nodeCount, (uint32_t)entry.NumaNode.NodeNumber + 1);
+            for (size_t i = 0; i < topology.cpus.size(); i++)
+            {
+                if (entry.ProcessorMask & ((ULONG_PTR)1 << topology.cpus[i]))
+                    topology.nodes[i] = entry.NumaNode.NodeNumber;
+            }
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                topology.cpus.push_back(cpu);
+        }
+    }
+    topology.nodes.assign(topology.cpus.size(), 0);
+
+    std::string line;
+    for (uint32_t node = 0; node < 1024 && readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", line); node++)
+    {
+        topology.nodeCount = node + 1;
+        for (uint32_t cpu : parseCpuList(line))
+        {
+            for (size_t i = 0; i < topology.cpus.size(); i++)
+            {
+                if (topology.cpus[i] == cpu)
+                    topology.nodes[i] = node;
+            }
+        }
+    }
+
+    if (!topology.cpus.empty())
+    {
+        std::string cache = "/sys/devices/system/cpu/cpu" + std::to_string(topology.cpus[0]) + "/cache/index";
+        for (uint32_t index = 0; index < 8 && readLine(cache + std::to_string(index) + "/level", line); index++)
+        {
+            std::string type, size;
+            if (line != "2" || !readLine(cache + std::to_string(index) + "/type", type) || type == "Instruction" ||
+                !readLine(cache + std::to_string(index) + "/size", size))
+                continue;
+            char* unit;
+            size_t bytes = strtoul(size.c_str(), &unit, 10);
+            bytes <<= *unit == 'K' ? 10 : *unit == 'M' ? 20 : 0;
+            if (bytes != 0)
+                topology.l2Bytes = bytes;
+        }
+    }
+#endif
+    if (topology.cpus.empty())
+    {
+        uint32_t count = std::max(std::thread::hardware_concurrency(), 1u);
+        for (uint32_t cpu = 0; cpu < count; cpu++)
+            topology.cpus.push_back(cpu);
+        topology.nodes.assign(count, 0);
+    }
+    return topology;
+}
+
+inline const CpuTopology& cpuTopology()
+{
+    static const CpuTopology topology = detectCpuTopology();
+    return topology;
+}
+
+// ----------------------------------------------------------------------------
+// Tile scheduler
+//
+// Runs the tiles of one frame, numbered top to bottom, on a fixed set of
+// threads and returns when all of them have run. The calling thread is
+// thread 0 and takes tiles too.
+//
+// Tiles are dealt out in order as one contiguous range per thread, and the
+// threads are ordered by NUMA node for that, so each node works on one part
+// of the frame. Buffers used again from frame to frame then keep the pages
+// each node writes on that node after the first touch. A thread takes tiles
+// from the front of its range; one whose range ran out steals the back half
+// of another's, trying the threads dealt next to it first, which are on its
+// node and work on rows next to its own. A stolen range is the thief's, and
+// can be stolen from in turn, so one slow tile or one thread the OS put
+// aside costs only its own share.
+//
+// With pin set every worker stays on one CPU, spread round robin over the
+// nodes so each node's memory controller gets used. The calling thread is
+// not pinned and counts as being on the first worker CPU's node.
+// ----------------------------------------------------------------------------
+
+// Rows of a tile are as many as fit in half of L2 together, but at most a
+// TILES_PER_THREAD-th of a thread's share, so stealing has something to take
+constexpr uint32_t TILES_PER_THREAD = 4;
+constexpr uint32_t MAX_TILE_THREADS = 256;
+
+struct TileSchedulerOptions
+{
+    uint32_t threads = 0;               // the calling thread included, 0 for one per CPU
+    bool pin = false;
+};
+
+struct TileSchedulerStats
+{
+    uint64_t jobs = 0;
+    uint64_t tiles = 0;
+    uint64_t steals = 0;                // ranges taken from another thread
+    uint64_t stolenTiles = 0;           // tiles run by a thread they were not dealt to
+    uint32_t threads = 0;
+    uint32_t nodes = 0;                 // NUMA nodes the threads are on
+};
+
+// Tile, and the thread running it: 0 for the caller, else 1 to threads - 1
+typedef std::function<void(uint32_t tile, uint32_t thread)> TileFn;
+
+class TileScheduler
+{
+public:
+    explicit TileScheduler(const TileSchedulerOptions& options = TileSchedulerOptions())
+    {
+        const CpuTopology& topology = cpuTopology();
+        uint32_t count = options.threads != 0 ? options.threads : (uint32_t)topology.cpus.size();
+        CHECK(count <= MAX_TILE_THREADS);
+        count = std::max(count, 1u);
+
+        // CPUs round robin over the nodes
+        std::vector<std::vector<uint32_t>> byNode(topology.nodeCount);
+        for (size_t i = 0; i < topology.cpus.size(); i++)
+            byNode[topology.nodes[i]].push_back((uint32_t)i);
+        std::vector<uint32_t> spread;
+        for (size_t round = 0; spread.size() < topology.cpus.size(); round++)
+        {
+            for (const std::vector<uint32_t>& node : byNode)
+            {
+                if (round < node.size())
+                    spread.push_back(node[round]);
+            }
+        }
+
+        // Worker i goes on CPU spread[i - 1], wrapping when there are more
+        // threads than CPUs, and the caller counts as being on worker 1's node
+        cpuOf.resize(count);
+        nodeOf.resize(count);
+        std::vector<bool> seenNode(topology.nodeCount, false);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t index = spread[(i != 0 ? i - 1 : 0) % spread.size()];
+            cpuOf[i] = topology.cpus[index];
+            nodeOf[i] = topology.nodes[index];
+            if (!seenNode[nodeOf[i]])
+                nodesUsed++;
+            seenNode[nodeOf[i]] = true;
+        }
+
+        // Dealt by node, and in thread order within one
+        for (uint32_t i = 0; i < count; i++)
+            dealOrder.push_back(i);
+        std::stable_sort(dealOrder.begin(), dealOrder.end(), [this](uint32_t a, uint32_t b) { return nodeOf[a] < nodeOf[b]; });
+        std::vector<uint32_t> position(count);
+        for (uint32_t k = 0; k < count; k++)
+            position[dealOrder[k]] = k;
+
+        // Victims: the same node first, then by distance in the deal
+        victims.resize(count);
+        for (uint32_t self = 0; self < count; self++)
+        {
+            for (uint32_t other = 0; other < count; other++)
+            {
+                if (other != self)
+                    victims[self].push_back(other);
+            }
+            std::stable_sort(victims[self].begin(), victims[self].end(), [&](uint32_t a, uint32_t b)
+            {
+                bool aLocal = nodeOf[a] == nodeOf[self], bLocal = nodeOf[b] == nodeOf[self];
+                if (aLocal != bLocal)
+                    return aLocal;
+                return std::abs((int)position[a] - (int)position[self]) < std::abs((int)position[b] - (int)position[self]);
+            });
+        }
+
+        queues.reset(new Queue[count]);
+        for (uint32_t i = 1; i < count; i++)
+            workers.emplace_back([this, i, options]() { runWorker(i, options.pin); });
+    }
+
+    ~TileScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    // Runs fn on every tile in [0, count) and returns once all have run. Jobs
+    // of several callers take turns; fn must not start another job.
+    void run(uint32_t count, const TileFn& fn)
+    {
+        if (count == 0)
+            return;
+        std::lock_guard<std::mutex> turn(jobMutex);
+        jobs++;
+        if (workers.empty() || count == 1)
+        {
+            for (uint32_t tile = 0; tile < count; tile++)
+                fn(tile, 0);
+            tilesRun += count;
+            return;
+        }
+
+        const uint32_t threads = threadCount();
+        for (uint32_t k = 0; k < threads; k++)
+        {
+            Queue& queue = queues[dealOrder[k]];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.begin = (uint32_t)((uint64_t)count * k / threads);
+            queue.end = (uint32_t)((uint64_t)count * (k + 1) / threads);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            busy = (uint32_t)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        work(0, fn);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return busy == 0; });
+        job = nullptr;
+    }
+
+    uint32_t threadCount() const { return (uint32_t)workers.size() + 1; }
+
+    // The node a thread works for, see above
+    uint32_t nodeOfThread(uint32_t thread) const { return nodeOf[thread]; }
+
+    TileSchedulerStats stats() const
+    {
+        TileSchedulerStats result;
+        result.jobs = jobs.load();
+        result.tiles = tilesRun.load();
+        result.steals = steals.load();
+        result.stolenTiles = stolenTiles.load();
+        result.threads = threadCount();
+        result.nodes = nodesUsed;
+        return result;
+    }
+
+private:
+    // The tiles a thread has left, [begin, end)
+    struct alignas(64) Queue
+    {
+        std::mutex mutex;
+        uint32_t begin = 0;
+        uint32_t end = 0;
+    };
+
+    void runWorker(uint32_t self, bool pin)
+    {
+        if (pin)
+        {
+#ifdef _WIN32
+            if (cpuOf[self] < sizeof(DWORD_PTR) * 8)
+                SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpuOf[self]);
+#elif defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpuOf[self], &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+        }
+
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            const TileFn* fn = job;
+            lock.unlock();
+            work(self, *fn);
+            lock.lock();
+            if (--busy == 0)
+                idle.notify_all();
+        }
+    }
+
+    // Own tiles first, then stolen ones, until no thread has any left
+    void work(uint32_t self, const TileFn& fn)
+    {
+        Queue& own = queues[self];
+        uint64_t ran = 0, stolen = 0, thefts = 0;
+        bool stealing = false;
+        for (;;)
+        {
+            uint32_t tile;
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                tile = own.begin < own.end ? own.begin++ : UINT32_MAX;
+            }
+            if (tile != UINT32_MAX)
+            {
+                fn(tile, self);
+                ran++;
+                if (stealing)
+                    stolen++;
+                continue;
+            }
+            if (!steal(self))
+                break;
+            stealing = true;
+            thefts++;
+        }
+        tilesRun += ran;
+        stolenTiles += stolen;
+        steals += thefts;
+    }
+
+    bool steal(uint32_t self)
+    {
+        for (uint32_t victim : victims[self])
+        {
+            uint32_t begin, end;
+            {
+                Queue& queue = queues[victim];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                uint32_t left = queue.end - queue.begin;
+                if (left == 0)
+                    continue;
+                end = queue.end;
+                begin = end - (left + 1) / 2;
+                queue.end = begin;
+            }
+            Queue& own = queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin;
+            own.end = end;
+            return true;
+        }
+        return false;
+    }
+
+    std::vector<uint32_t> cpuOf;
+    std::vector<uint32_t> nodeOf;
+    std::vector<uint32_t> dealOrder;
+    std::vector<std::vector<uint32_t>> victims;
+    uint32_t nodesUsed = 0;
+    std::unique_ptr<Queue[]> queues;
+
+    std::mutex jobMutex;                // one job at a time
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> tilesRun{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> stolenTiles{0};
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    const TileFn* job = nullptr;
+    uint64_t generation = 0;
+    uint32_t busy = 0;                  // workers still in the job
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+// Rows per tile for a pass that reads and writes rowBytes per output row,
+// a multiple of multiple, see TILES_PER_THREAD
+inline uint32_t tileRowsFor(uint32_t height, size_t rowBytes, uint32_t threads, uint32_t multiple, size_t cacheBytes)
+{
+    uint32_t rows = (uint32_t)std::min<size_t>(cacheBytes / 2 / std::max<size_t>(rowBytes, 1), height);
+    rows = std::min(rows, height / (threads * TILES_PER_THREAD));
+    return std::max(rows / multiple * multiple, multiple);
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Project
+#include "common.h"
+#include "encoder_backend.h"
+#include "frame_source.h"
+#include "worker_pool.h"
+
+// ----------------------------------------------------------------------------
+// Pipelined upload
+//
+// Without it a frame is captured, converted and written into a mapped input
+// frame on the thread that answers NeedInput, so getting frame N+1 ready never
+// overlaps encoding frame N. With it frames move through three stages:
+//
+// 1. Fill: a serial task on the workers captures the next picture and
+//    converts it into the next staging buffer. Pictures are captured in order
+//    and only valid until the next one, so frames are filled one after the
+//    other; the conversion itself runs in bands on the workers when the
+//    uploader has them.
+// 2. Copy: a NeedInput request takes the oldest filled buffer, and the device
+//    copies it into the input frame and puts a fence behind the copy
+//    (CopyResource into a texture the encoder binds, and an event query).
+// 3. Encode: the frame goes in right behind its copy.
+//
+// Buffers are used in ring order, frame n goes through buffer n % depth, so
+// up to depth frames are filled ahead of the encoder. A buffer is filled again
+// only once the fence behind its last copy has passed: the fill polls it on a
+// timer instead of blocking a worker.
+// ----------------------------------------------------------------------------
+
+constexpr uint32_t MIN_UPLOAD_DEPTH = 2;
+constexpr uint32_t MAX_UPLOAD_DEPTH = 16;
+
+struct UploadPipelineOptions
+{
+    uint32_t depth = 3;                                     // staging buffers, frames filled ahead at most
+    std::chrono::microseconds fencePoll{100};               // between looks at a fence that has not passed
+};
+
+struct UploadPipelineStats
+{
+    uint64_t filled = 0;
+    uint64_t copied = 0;
+    uint64_t fenceWaits = 0;            // fills that found their buffer's copy still running
+    uint64_t starved = 0;               // requests that found nothing filled
+    uint32_t maxAhead = 0;              // most frames filled and not copied yet
+    double fillUs = 0;                  // per frame, on average
+};
+
+// Writes the next picture into staging memory, on the fill task; End writes nothing
+typedef std::function<SourceRead(uint8_t* data, size_t pitch)> UploadFillFn;
+
+class UploadPipeline
+{
+public:
+    // onFilled runs on the fill task after every frame, without any lock of the pipeline held
+    UploadPipeline(const UploadPipelineOptions& options, IStagingDevice& device, WorkerPool& workers, UploadFillFn fill,
+                   std::function<void()> onFilled)
+        : options(options), device(device), fills(workers), fill(std::move(fill)), onFilled(std::move(onFilled)),
+          reads(options.depth, SourceRead::Same)
+    {
+        CHECK(options.depth >= MIN_UPLOAD_DEPTH && options.depth <= MAX_UPLOAD_DEPTH);
+        CHECK(device.stagingCount() == options.depth);
+    }
+
+    ~UploadPipeline()
+    {
+        close();
+    }
+
+    void start()
+    {
+        scheduleFill();
+    }
+
+    // What the oldest filled frame read, false when none is filled yet. After
+    // End nothing follows and nothing is copied.
+    bool peek(SourceRead& read)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (taken == filled)
+        {
+            counters.starved++;
+            return false;
+        }
+        read = reads[taken % options.depth];
+        return true;
+    }
+
+    // The oldest filled frame into the input frame; its buffer is filled
+    // again once the copy's fence has passed
+    void copyInto(const InputFrame& input)
+    {
+        uint32_t buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            CHECK(taken < filled && reads[taken % options.depth] != SourceRead::End);
+            buffer = (uint32_t)(taken % options.depth);
+        }
+        device.copyToInput(buffer, input);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            taken++;
+            counters.copied++;
+        }
+        scheduleFill();
+    }
+
+    // No more fills after the one that is running, if any. Any thread, any lock held.
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+
+    // Stops and waits for a running fill unless called from it. Not while
+    // holding a lock onFilled takes.
+    void close()
+    {
+        stop();
+        fills.close();
+    }
+
+    const UploadPipelineOptions& settings() const { return options; }
+
+    UploadPipelineStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        UploadPipelineStats result = counters;
+        result.fillUs = counters.filled ? fillNs / 1000.0 / counters.filled : 0;
+        return result;
+    }
+
+private:
+    void scheduleFill()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fillScheduled || !canFill())
+                return;
+            fillScheduled = true;
+        }
+        fills.post([this]() { runFills(); });
+    }
+
+    // Holding the mutex
+    bool canFill() const { return !closed && !ended && filled - taken < options.depth; }
+
+    // Fills until the ring is full or the source ended. A buffer whose copy
+    // is still running is looked at again after fencePoll.
+    void runFills()
+    {
+        for (;;)
+        {
+            uint32_t buffer;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!canFill())
+                {
+                    fillScheduled = false;
+                    return;
+                }
+                buffer = (uint32_t)(filled % options.depth);
+            }
+
+            if (!device.copyDone(buffer))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    counters.fenceWaits++;
+                }
+                fills.postAt(WorkerPool::Clock::now() + options.fencePoll, [this]() { runFills(); });
+                return;
+            }
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            uint8_t* data;
+            size_t pitch;
+            SourceRead read = SourceRead::End;
+            if (device.mapStaging(buffer, data, pitch))
+            {
+                read = fill(data, pitch);
+                device.unmapStaging(buffer);
+            }
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reads[buffer] = read;
+                filled++;
+                ended = read == SourceRead::End;
+                if (!ended)
+                {
+                    counters.filled++;
+                    fillNs += ns;
+                }
+                counters.maxAhead = std::max(counters.maxAhead, (uint32_t)(filled - taken));
+            }
+            onFilled();
+        }
+    }
+
+    UploadPipelineOptions options;
+    IStagingDevice& device;
+    SerialQueue fills;
+    UploadFillFn fill;
+    std::function<void()> onFilled;
+
+    mutable std::mutex mutex;
+    std::vector<SourceRead> reads;      // per buffer, what its last fill read
+    uint64_t filled = 0;                // frames, an End included
+    uint64_t taken = 0;
+    bool fillScheduled = false;
+    bool ended = false;
+    bool closed = false;
+    UploadPipelineStats counters;
+    uint64_t fillNs = 0;
+};
+
+// ----------------------------------------------------------------------------
+// CPU staging device
+//
+// The stand-in for a GPU: staging buffers in one allocation, copies done at
+// once with memcpy, and a fence that passes copyLatency after its copy, like
+// a GPU that has the data in time but reports it late. It counts every
+// write into a buffer whose fence had not passed, which must never happen.
+// ----------------------------------------------------------------------------
+
+struct CpuStagingStats
+{
+    uint64_t copies = 0;
+    uint64_t earlyWrites = 0;           // buffers mapped before their fence passed
+    uint64_t mappedCopies = 0;          // buffers copied while mapped
+};
+
+class CpuStagingDevice : public IStagingDevice
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    CpuStagingDevice(uint32_t buffers, size_t frameBytes, size_t pitch, std::chrono::microseconds copyLatency)
+        : frameBytes(frameBytes), pitch(pitch), copyLatency(copyLatency), storage(frameBytes * buffers), buffers(buffers)
+    {
+        CHECK(buffers != 0);
+    }
+
+    uint32_t stagingCount() const override { return (uint32_t)buffers.size(); }
+
+    bool mapStaging(uint32_t buffer, uint8_t*& data, size_t& rowPitch) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer& staging = buffers[buffer];
+        if (staging.copied && Clock::now() < staging.fenceAt)
+            counters.earlyWrites++;
+        staging.mapped = true;
+        data = storage.data() + frameBytes * buffer;
+        rowPitch = pitch;
+        return true;
+    }
+
+    void unmapStaging(uint32_t buffer) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers[buffer].mapped = false;
+    }
+
+    void copyToInput(uint32_t buffer, const InputFrame& input) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer& staging = buffers[buffer];
+        if (staging.mapped)
+            counters.mappedCopies++;
+        memcpy(input.data, storage.data() + frameBytes * buffer, frameBytes);
+        staging.copied = true;
+        staging.fenceAt = Clock::now() + copyLatency;
+        counters.copies++;
+    }
+
+    bool copyDone(uint32_t buffer) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Buffer& staging = buffers[buffer];
+        return !staging.copied || Clock::now() >= staging.fenceAt;
+    }
+
+    CpuStagingStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+private:
+    struct Buffer
+    {
+        bool mapped = false;
+        bool copied = false;
+        Clock::time_point fenceAt;
+    };
+
+    size_t frameBytes;
+    size_t pitch;
+    std::chrono::microseconds copyLatency;
+    std::vector<uint8_t> storage;
+
+    mutable std::mutex mutex;
+    std::vector<Buffer> buffers;
+    CpuStagingStats counters;
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+// std
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Project
+#include "common.h"
+
+// ----------------------------------------------------------------------------
+// Worker pool
+//
+// A fixed set of threads running short tasks, shared by every encode session
+// instead of one event thread per encoder. Tasks can also be posted for a
+// point in time, which is how backends wait out encode latency without
+// blocking a thread.
+// ----------------------------------------------------------------------------
+
+struct WorkerPoolStats
+{
+    uint64_t tasks = 0;   // run so far
+    uint64_t timers = 0;  // of those, posted with postAt()
+    size_t queued = 0;
+    uint32_t threads = 0;
+};
+
+class WorkerPool
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit WorkerPool(uint32_t threads = 0)
+    {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency() != 0 ? std::thread::hardware_concurrency() : 4;
+        for (uint32_t i = 0; i < threads; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    // Tasks still queued are dropped, running ones finish first
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    void postAt(Clock::time_point when, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            timers.push(Timer{ when, timerSequence++, std::move(task) });
+        }
+        wake.notify_one();
+    }
+
+    uint32_t threadCount() const { return (uint32_t)workers.size(); }
+
+    WorkerPoolStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        WorkerPoolStats stats;
+        stats.tasks = tasksRun;
+        stats.timers = timersRun;
+        stats.queued = ready.size() + timers.size();
+        stats.threads = (uint32_t)workers.size();
+        return stats;
+    }
+
+private:
+    struct Timer
+    {
+        Clock::time_point when;
+        uint64_t sequence;
+        std::function<void()> task;
+
+        // Earliest first, in posting order for equal times
+        bool operator<(const Timer& other) const
+        {
+            return when != other.when ? when > other.when : sequence > other.sequence;
+        }
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping)
+        {
+            // Due timers join the ready queue
+            Clock::time_point now = Clock::now();
+            while (!timers.empty() && timers.top().when <= now)
+            {
+                ready.push_back(std::move(const_cast<Timer&>(timers.top()).task));
+                timers.pop();
+                timersRun++;
+            }
+
+            if (ready.empty())
+            {
+                if (timers.empty())
+                    wake.wait(lock);
+                else
+                {
+                    // A copy, since postAt() can move the heap while this waits
+                    Clock::time_point due = timers.top().when;
+                    wake.wait_until(lock, due);
+                }
+                continue;
+            }
+
+            std::function<void()> task = std::move(ready.front());
+            ready.pop_front();
+            tasksRun++;
+
+            lock.unlock();
+            task();
+            task = nullptr;
+            lock.lock();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> ready;
+    std::priority_queue<Timer> timers;
+    uint64_t timerSequence = 0;
+    uint64_t tasksRun = 0;
+    uint64_t timersRun = 0;
+    bool stopping = false;
+};
+
+// ----------------------------------------------------------------------------
+// Serial queue
+//
+// Runs its tasks on a worker pool one at a time and in order, so a session's
+// events never overlap even though any pool thread may run them. A busy queue
+// gives its thread back after a few tasks to keep sessions fair.
+// ----------------------------------------------------------------------------
+
+class SerialQueue
+{
+public:
+    static constexpr int BATCH = 16;
+
+    explicit SerialQueue(WorkerPool& pool)
+        : pool(pool), state(std::make_shared<State>())
+    {
+    }
+
+    ~SerialQueue()
+    {
+        close();
+    }
+
+    void post(std::function<void()> task)
+    {
+        post(pool, state, std::move(task));
+    }
+
+    void postAt(WorkerPool::Clock::time_point when, std::function<void()> task)
+    {
+        WorkerPool& target = pool;
+        std::shared_ptr<State> queue = state;
+        pool.postAt(when, [&target, queue, task]() { post(target, queue, task); });
+    }
+
+    // Drops whatever is queued and waits for a running task, unless called from it
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->closed = true;
+        state->tasks.clear();
+        if (state->runner != std::this_thread::get_id())
+            state->idle.wait(lock, [this]() { return !state->running; });
+    }
+
+    bool isCurrent() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->runner == std::this_thread::get_id();
+    }
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable idle;
+        std::deque<std::function<void()>> tasks;
+        bool scheduled = false;
+        bool running = false;
+        bool closed = false;
+        std::thread::id runner;
+    };
+
+    static void post(WorkerPool& pool, const std::shared_ptr<State>& state, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (state->closed)
+                return;
+            state->tasks.push_back(std::move(task));
+            if (state->scheduled)
+                return;
+            state->scheduled = true;
+        }
+        pool.post([&pool, state]() { drain(pool, state); });
+    }
+
+    static void drain(WorkerPool& pool, const std::shared_ptr<State>& state)
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->running = true;
+        state->runner = std::this_thread::get_id();
+
+        // Tasks posted meanwhile wait for the next turn, so a task that keeps
+        // requeueing itself cannot hold on to the thread
+        size_t count = std::min(state->tasks.size(), (size_t)BATCH);
+        for (size_t i = 0; i < count && !state->tasks.empty(); i++)
+        {
+            std::function<void()> task = std::move(state->tasks.front());
+            state->tasks.pop_front();
+            lock.unlock();
+            task();
+            task = nullptr;
+            lock.lock();
+        }
+
+        state->running = false;
+        state->runner = std::thread::id();
+        bool more = !state->tasks.empty();
+        state->scheduled = more;
+        state->idle.notify_all();
+        lock.unlock();
+
+        if (more)
+            pool.post([&pool, state]() { drain(pool, state); });
+    }
+
+    WorkerPool& pool;
+    std::shared_ptr<State> state;
+};